@@ -1,15 +1,53 @@
 #version 150
 
 uniform sampler2D texture0;
-uniform vec4 fog_color;
+
+//The same block as the vertex shaders, fog_table_transform is only read by FOG_PER_PIXEL
+layout(std140) uniform Fog {
+	vec4 fog_color;
+	vec2 fog_table_transform;
+	float fog_start;
+	float fog_end;
+	float fog_density;
+};
+
+//Sand, grass, rock and snow layers weighted by the channels of the splat map
+uniform bool splatting;
+uniform sampler2D splat_map;
+uniform sampler2DArray material_layers;
 
 in vec4 color;
 in vec2 texCoord0;
 in float blendFactor;
+in vec2 splatCoord;
+
+#ifdef FOG_PER_PIXEL
+//Fog factors by eye distance, the distance times the scale plus the offset of fog_table_transform is the texture coordinate
+uniform sampler1D fog_table;
+
+in vec3 eyePosition;
+#endif
 
 out vec4 outColor;
 
+vec4 sampleMaterials(vec2 texCoord)
+{
+	vec4 weights = texture(splat_map, splatCoord);
+	weights /= max(dot(weights, vec4(1.0)), 1.0 / 255.0);
+
+	return texture(material_layers, vec3(texCoord, 0.0)) * weights.r +
+	       texture(material_layers, vec3(texCoord, 1.0)) * weights.g +
+	       texture(material_layers, vec3(texCoord, 2.0)) * weights.b +
+	       texture(material_layers, vec3(texCoord, 3.0)) * weights.a;
+}
+
 void main(void) {
-	vec4 fragColor = color * texture(texture0, texCoord0.st);	
-	outColor = mix(fog_color, fragColor, blendFactor);
+	vec4 texel = splatting ? sampleMaterials(texCoord0.st) : texture(texture0, texCoord0.st);
+	vec4 fragColor = color * texel;
+#ifdef FOG_PER_PIXEL
+	float fogFactor = texture(fog_table, length(eyePosition) * fog_table_transform.x + fog_table_transform.y).r;
+#else
+	float fogFactor = blendFactor;
+#endif
+	outColor = mix(fog_color, fragColor, fogFactor);
 }
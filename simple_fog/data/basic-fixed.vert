@@ -1,20 +1,53 @@
 #version 150
 
-uniform mat4 projection_matrix;
-uniform mat4 modelview_matrix;
-uniform mat3 normal_matrix;
-
-uniform vec4 material_ambient;
-uniform vec4 material_diffuse;
-uniform vec4 material_specular;
-uniform vec4 material_emissive;
-uniform float material_shininess;
-
-uniform float fog_start;
-uniform float fog_end;
-uniform float fog_density;
-uniform vec4 fog_color;
-uniform int fog_type;
+//Per frame blocks from the shared uniform buffer, std140 so the application can lay them out
+layout(std140) uniform Frame {
+	mat4 modelview_matrix;
+	mat4 projection_matrix;
+	mat3 normal_matrix;
+};
+
+layout(std140) uniform Material {
+	vec4 material_ambient;
+	vec4 material_diffuse;
+	vec4 material_specular;
+	vec4 material_emissive;
+	float material_shininess;
+};
+
+layout(std140) uniform Fog {
+	vec4 fog_color;
+	vec2 fog_table_transform;
+	float fog_start;
+	float fog_end;
+	float fog_density;
+};
+
+uniform vec3 camera_position;
+uniform vec2 morph_range; //Distances at which the current LOD level starts and finishes morphing
+
+//Undo the quantization of packed vertices, a scale of one and no offset for float vertices
+uniform vec3 position_scale;
+uniform vec3 position_offset;
+uniform float texcoord_scale;
+uniform bool octahedral_normals;
+
+//Height texture layout: the vertices of a patch come from gl_VertexID and the heights from height_map
+uniform bool height_texture;
+uniform sampler2D height_map;
+uniform vec3 patch_origin; //First sample of the patch and the samples between its vertices
+uniform int patch_width;
+
+//Indirect draws of the height texture layout: the origin and morph range of every patch come from per instance attributes
+uniform bool indirect_draws;
+in vec3 a_PatchOrigin;
+in vec2 a_MorphRange;
+
+uniform vec4 splat_transform; //Scale and offset from world x and z to the splat and horizon maps
+
+//Sines of the horizon in 8 directions turning from +x towards +z, 4 to a layer
+uniform bool horizon_lighting;
+uniform sampler2DArray horizon_map;
 
 struct light {
 	vec4 position;
@@ -23,22 +56,131 @@ struct light {
 	vec4 ambient;
 };
 
-uniform light light0;
+layout(std140) uniform Light {
+	light light0;
+};
 
 in vec3 a_Vertex;
 in vec2 a_TexCoord0;
 in vec3 a_Normal;
+in float a_MorphHeight;
 
 out vec4 color;
 out vec2 texCoord0;
 out float blendFactor;
+#ifdef FOG_PER_PIXEL
+out vec3 eyePosition;
+#endif
+out vec2 splatCoord;
+
+//Unfolds a normal stored as a point on an octahedron
+vec3 decodeOctahedral(vec2 encoded)
+{
+	vec3 n = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+	if (n.z < 0.0)
+	{
+		vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+		n.xy = (1.0 - abs(n.yx)) * signs;
+	}
+	return normalize(n);
+}
+
+//Ambient occlusion from the mean horizon, and a soft shadow where the light is below the horizon towards it
+void sampleHorizons(vec2 mapCoord, vec3 lightDirection, out float occlusion, out float shadow)
+{
+	vec4 first = textureLod(horizon_map, vec3(mapCoord, 0.0), 0.0);
+	vec4 second = textureLod(horizon_map, vec3(mapCoord, 1.0), 0.0);
+	occlusion = 1.0 - dot(first + second, vec4(0.125));
+
+	float horizons[8] = float[8](first.x, first.y, first.z, first.w, second.x, second.y, second.z, second.w);
+	float slot = mod(atan(lightDirection.z, lightDirection.x) / radians(45.0), 8.0);
+	int index = min(int(slot), 7);
+	float horizon = mix(horizons[index], horizons[(index + 1) % 8], fract(slot));
+	shadow = smoothstep(horizon - 0.05, horizon + 0.05, lightDirection.y);
+}
+
+float fetchHeight(ivec2 texel)
+{
+	texel = clamp(texel, ivec2(0), textureSize(height_map, 0) - 1);
+	return texelFetch(height_map, texel, 0).r * position_scale.y + position_offset.y;
+}
+
+//Rebuilds what the streamed vertex buffers hold, the same way the patches are built on the CPU
+void sampleHeightMap(vec3 origin, out vec3 position, out float morphHeight, out vec3 normal, out vec2 texCoord)
+{
+	ivec2 grid = ivec2(gl_VertexID % patch_width, gl_VertexID / patch_width);
+	int step = int(origin.z);
+	ivec2 last = textureSize(height_map, 0) - 1;
+	ivec2 center = min(ivec2(origin.xy) + grid * step, last);
+	ivec2 dx = ivec2(step, 0);
+	ivec2 dz = ivec2(0, step);
+
+	float height = fetchHeight(center);
+	position = vec3(float(center.x) + position_offset.x, height, float(center.y) + position_offset.z);
+
+	//Vertices that aren't on the next coarser grid slide onto the edge or diagonal they split
+	morphHeight = height;
+	if ((grid.x & 1) == 1 && (grid.y & 1) == 1)
+	{
+		morphHeight = (fetchHeight(center - dx + dz) + fetchHeight(center + dx - dz)) * 0.5;
+	}
+	else if ((grid.x & 1) == 1)
+	{
+		morphHeight = (fetchHeight(center - dx) + fetchHeight(center + dx)) * 0.5;
+	}
+	else if ((grid.y & 1) == 1)
+	{
+		morphHeight = (fetchHeight(center - dz) + fetchHeight(center + dz)) * 0.5;
+	}
+
+	//Central differences, one sided along the border of the map
+	ivec2 low = max(center - ivec2(step), ivec2(0));
+	ivec2 high = min(center + ivec2(step), last);
+	float slopeX = (fetchHeight(ivec2(high.x, center.y)) - fetchHeight(ivec2(low.x, center.y))) / float(max(high.x - low.x, 1));
+	float slopeZ = (fetchHeight(ivec2(center.x, high.y)) - fetchHeight(ivec2(center.x, low.y))) / float(max(high.y - low.y, 1));
+	normal = normalize(vec3(-slopeX, 1.0, -slopeZ));
+
+	texCoord = vec2(center);
+}
 
 void main(void) 
 {
-	vec3 N = normalize(normal_matrix * a_Normal);	
+	vec3 position;
+	float morphHeight;
+	vec3 normal;
+	vec2 texCoord;
+	vec2 morphRange = indirect_draws ? a_MorphRange : morph_range;
+
+	if (height_texture)
+	{
+		sampleHeightMap(indirect_draws ? a_PatchOrigin : patch_origin, position, morphHeight, normal, texCoord);
+	}
+	else
+	{
+		position = a_Vertex * position_scale + position_offset;
+		morphHeight = a_MorphHeight * position_scale.y + position_offset.y;
+		normal = octahedral_normals ? decodeOctahedral(a_Normal.xy) : a_Normal;
+		texCoord = a_TexCoord0;
+	}
+
+	//Slide the vertex onto the next coarser LOD level as it gets further away
+	float morphK = clamp((distance(position, camera_position) - morphRange.x) / (morphRange.y - morphRange.x), 0.0, 1.0);
+	vec3 vertex = vec3(position.x, mix(position.y, morphHeight, morphK), position.z);
+
+	vec2 mapCoord = position.xz * splat_transform.xy + splat_transform.zw;
+
+	//The horizons are in world space, like the light before the modelview matrix
+	float occlusion = 1.0;
+	float shadow = 1.0;
+	if (horizon_lighting)
+	{
+		sampleHorizons(mapCoord, normalize(light0.position.xyz), occlusion, shadow);
+	}
+
+	vec3 N = normalize(normal_matrix * normal);	
 	vec3 L = normalize(modelview_matrix * light0.position).xyz;
 	float NdotL = max(dot(N, L.xyz), 0.0);
-	vec4 pos = modelview_matrix * vec4(a_Vertex, 1.0);
+	vec4 pos = modelview_matrix * vec4(vertex, 1.0);
 	
 	vec3 E = -pos.xyz;
 	vec4 finalColor = material_ambient * light0.ambient;
@@ -47,27 +189,32 @@ void main(void)
 	{
 		vec3 HV = normalize(L + E);
 		float NdotHV = max(dot(N, HV), 0.0);
-		finalColor += material_specular * light0.specular * pow(NdotHV, material_shininess);	
-		finalColor += material_diffuse * light0.diffuse * NdotL;
+		finalColor += material_specular * light0.specular * pow(NdotHV, material_shininess) * shadow;
+		finalColor += material_diffuse * light0.diffuse * NdotL * shadow;
 	}
 
-	//depending on the fog type we either use the linear, exp or exp2 calculations
-	//to calculate the fog blend factor
-	if (fog_type == 0) 
-	{
-		blendFactor = clamp((fog_end - length(pos)) / (fog_end - fog_start), 0.0, 1.0);
-	} 
-	else if (fog_type == 1) 
-	{
-		blendFactor = exp(-fog_density * length(pos));
-	} 
-	else 
-	{
-		blendFactor = exp2(-fog_density * length(pos));
-	}
+	//There is no other ambient light in the scene, so the occlusion darkens the diffuse light too
+	finalColor.rgb *= occlusion;
+
+	//The program is built once per fog mode, FOG_LINEAR, FOG_EXP or FOG_EXP2,
+	//and without fog when none of them is defined. FOG_PER_PIXEL leaves the
+	//fog to the fragment shader
+#if defined(FOG_PER_PIXEL)
+	eyePosition = pos.xyz; //The fragment shader looks the fog up at its own distance
+	blendFactor = 1.0;
+#elif defined(FOG_LINEAR)
+	blendFactor = clamp((fog_end - length(pos)) / (fog_end - fog_start), 0.0, 1.0);
+#elif defined(FOG_EXP)
+	blendFactor = exp(-fog_density * length(pos));
+#elif defined(FOG_EXP2)
+	blendFactor = exp2(-fog_density * length(pos));
+#else
+	blendFactor = 1.0;
+#endif
 	
 	color = material_emissive + finalColor;
-	texCoord0 = a_TexCoord0;
+	texCoord0 = texCoord * texcoord_scale;
+	splatCoord = mapCoord;
 	gl_Position = projection_matrix * pos;	
 }
 
@@ -0,0 +1,124 @@
+#version 150
+
+//Fog over the finished scene, once per pixel from the depth buffer. Built
+//once per fog mode like the scene shaders, FOG_LINEAR, FOG_EXP or FOG_EXP2,
+//and per stage: FOG_FACTORS works the fog out at reduced resolution and
+//FOG_UPSAMPLE applies those factors at full resolution. With neither the
+//fog is worked out for every pixel. FOG_FROXELS looks the light and the
+//transmittance of the volumetric fog up in the froxel grid instead.
+uniform sampler2D scene_color;
+uniform sampler2D scene_depth;
+uniform sampler2D fog_factors;     //Fog factor and eye distance of every reduced resolution texel
+uniform mat4 inverse_projection;
+
+//The scene's fog settings from the shared uniform buffer, the same block as the scene shaders
+layout(std140) uniform Fog {
+	vec4 fog_color;
+	vec2 fog_table_transform;
+	float fog_start;
+	float fog_end;
+	float fog_density;
+};
+
+#ifdef FOG_FROXELS
+uniform sampler3D froxel_volume;
+uniform vec3 froxel_depth;         //Near depth, log of far over near and slice count
+#endif
+
+in vec2 texCoord;
+
+out vec4 outColor;
+
+//Eye space position of the surface behind a depth buffer texel
+vec3 getPosition(float depth, vec2 coord)
+{
+	vec4 position = inverse_projection * vec4(vec3(coord, depth) * 2.0 - 1.0, 1.0);
+	return position.xyz / position.w;
+}
+
+float getDistance(float depth, vec2 coord)
+{
+	return length(getPosition(depth, coord));
+}
+
+float computeFog(float distance)
+{
+#if defined(FOG_LINEAR)
+	return clamp((fog_end - distance) / (fog_end - fog_start), 0.0, 1.0);
+#elif defined(FOG_EXP)
+	return exp(-fog_density * distance);
+#elif defined(FOG_EXP2)
+	return exp2(-fog_density * distance);
+#else
+	return 1.0;
+#endif
+}
+
+#ifdef FOG_UPSAMPLE
+//Bilinear between the four nearest reduced texels, but weighted down the
+//further their distance is from this pixel's, so the fog of one surface
+//doesn't bleed across the silhouette of another
+float upsampleFog(float distance, ivec2 pixel)
+{
+	vec2 position = vec2(pixel) * 0.5;
+	ivec2 base = ivec2(floor(position));
+	vec2 weights = position - vec2(base);
+	ivec2 last = textureSize(fog_factors, 0) - 1;
+
+	float fog = 0.0;
+	float total = 0.0;
+	for (int i = 0; i < 4; ++i)
+	{
+		ivec2 offset = ivec2(i & 1, i >> 1);
+		vec2 texel = texelFetch(fog_factors, min(base + offset, last), 0).rg;
+		float bilinear = mix(1.0 - weights.x, weights.x, float(offset.x)) * mix(1.0 - weights.y, weights.y, float(offset.y));
+		float weight = (bilinear + 1e-3) / (abs(texel.y - distance) + distance * 0.01 + 1e-3);
+
+		fog += texel.x * weight;
+		total += weight;
+	}
+
+	return fog / total;
+}
+#endif
+
+#ifdef FOG_FROXELS
+//Light in RGB and transmittance in A from the camera to the view depth, the
+//slices store the totals up to their far ends
+vec4 sampleFroxels(float viewDepth)
+{
+	float slice = log(max(viewDepth, froxel_depth.x) / froxel_depth.x) / froxel_depth.y;
+	return texture(froxel_volume, vec3(texCoord, slice - 0.5 / froxel_depth.z));
+}
+#endif
+
+void main(void)
+{
+#if defined(FOG_FROXELS)
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(scene_depth, pixel, 0).r;
+	vec4 color = texelFetch(scene_color, pixel, 0);
+	vec4 froxel = sampleFroxels(-getPosition(depth, texCoord).z);
+	outColor = (depth < 1.0) ? vec4(color.rgb * froxel.a + froxel.rgb, color.a) : color;
+#elif defined(FOG_FACTORS)
+	//Every reduced texel stands for the top left of the pixels it covers
+	ivec2 pixel = ivec2(gl_FragCoord.xy) * 2;
+	float depth = texelFetch(scene_depth, pixel, 0).r;
+	float distance = getDistance(depth, (vec2(pixel) + 0.5) / vec2(textureSize(scene_depth, 0)));
+	outColor = vec4(computeFog(distance), distance, 0.0, 0.0);
+#else
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depth = texelFetch(scene_depth, pixel, 0).r;
+	vec4 color = texelFetch(scene_color, pixel, 0);
+	float distance = getDistance(depth, texCoord);
+
+#ifdef FOG_UPSAMPLE
+	float fogFactor = upsampleFog(distance, pixel);
+#else
+	float fogFactor = computeFog(distance);
+#endif
+
+	//Where nothing was drawn the clear color stays, as it does with the fog in the scene shaders
+	outColor = (depth < 1.0) ? mix(fog_color, color, fogFactor) : color;
+#endif
+}
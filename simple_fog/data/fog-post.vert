@@ -0,0 +1,11 @@
+#version 150
+
+//A single triangle that covers the whole screen, made from gl_VertexID alone
+out vec2 texCoord;
+
+void main(void)
+{
+	vec2 corner = vec2(float((gl_VertexID & 1) << 2), float((gl_VertexID & 2) << 1));
+	texCoord = corner * 0.5;
+	gl_Position = vec4(corner - 1.0, 0.0, 1.0);
+}
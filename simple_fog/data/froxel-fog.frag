@@ -0,0 +1,97 @@
+#version 150
+
+//One slice of the froxel grid, drawn once per slice into a layer of a 3D
+//texture. Without defines it works out the in-scattered light and the
+//extinction of the fog in every froxel of the slice and blends them with
+//the last frame's. FROXEL_INTEGRATE adds the slice to the light and
+//transmittance accumulated from the camera up to it.
+uniform int froxel_slice;
+uniform vec3 froxel_depth;         //Near depth, log of far over near and slice count
+uniform vec2 tan_half_fov;
+
+in vec2 texCoord;
+
+out vec4 outColor;
+
+//View depth of the slice boundary at s, slice 0 starts at the camera
+float getSliceDepth(float s)
+{
+	return froxel_depth.x * exp(froxel_depth.y * s / froxel_depth.z);
+}
+
+#ifdef FROXEL_INTEGRATE
+uniform sampler3D scattering;
+uniform sampler2D accumulated;     //Light and transmittance up to the slice before
+
+out vec4 outAccumulated;
+
+void main(void)
+{
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	vec4 froxel = texelFetch(scattering, ivec3(pixel, froxel_slice), 0);
+	vec4 total = (froxel_slice > 0) ? texelFetch(accumulated, pixel, 0) : vec4(0.0, 0.0, 0.0, 1.0);
+
+	//Thickness along the ray rather than along the view axis
+	float rayScale = length(vec3((texCoord * 2.0 - 1.0) * tan_half_fov, 1.0));
+	float nearDepth = (froxel_slice > 0) ? getSliceDepth(float(froxel_slice)) : 0.0;
+	float thickness = (getSliceDepth(float(froxel_slice + 1)) - nearDepth) * rayScale;
+
+	//The light of a froxel of constant fog integrated over its thickness
+	float transmittance = exp(-froxel.a * thickness);
+	float integral = (froxel.a > 1e-5) ? (1.0 - transmittance) / froxel.a : thickness;
+
+	total.rgb += total.a * froxel.rgb * integral;
+	total.a *= transmittance;
+
+	outColor = total;
+	outAccumulated = total;
+}
+#else
+uniform mat4 inverse_view;
+uniform vec3 camera_position;
+uniform float froxel_jitter;       //Where in its slice the froxel is sampled this frame
+
+uniform float fog_density;         //Extinction per unit up to fog_base_height
+uniform float fog_base_height;
+uniform float fog_height_falloff;
+uniform vec3 sun_direction;        //Towards the sun
+uniform vec3 sun_color;
+uniform vec3 ambient_color;
+uniform float anisotropy;
+
+uniform sampler3D history;         //Last frame's scattering
+uniform mat4 previous_view_projection;
+uniform float history_weight;      //0 when there is no history
+
+const float PI = 3.14159265;
+
+void main(void)
+{
+	vec2 ndc = texCoord * 2.0 - 1.0;
+	float depth = getSliceDepth(float(froxel_slice) + froxel_jitter);
+	vec3 position = (inverse_view * vec4(ndc * tan_half_fov * depth, -depth, 1.0)).xyz;
+	vec3 viewDirection = normalize(position - camera_position);
+
+	float density = fog_density * exp(-fog_height_falloff * max(position.y - fog_base_height, 0.0));
+
+	//Henyey-Greenstein
+	float g2 = anisotropy * anisotropy;
+	float phase = (1.0 - g2) / (4.0 * PI * pow(1.0 + g2 - 2.0 * anisotropy * dot(viewDirection, sun_direction), 1.5));
+
+	vec4 froxel = vec4((ambient_color + sun_color * phase) * density, density);
+
+	//Where the same point was in last frame's grid, sampled at another depth
+	vec4 previous = previous_view_projection * vec4(position, 1.0);
+	if (history_weight > 0.0 && previous.w > 0.0)
+	{
+		vec3 coord = vec3(previous.xy / previous.w * 0.5 + 0.5,
+		                  log(previous.w / froxel_depth.x) / froxel_depth.y);
+		if (all(greaterThanEqual(coord, vec3(0.0))) && all(lessThanEqual(coord, vec3(1.0))))
+		{
+			froxel = mix(froxel, texture(history, coord), history_weight);
+		}
+	}
+
+	outColor = froxel;
+}
+#endif
@@ -1,14 +1,24 @@
 #version 150
 
-uniform mat4 projection_matrix;
-uniform mat4 modelview_matrix;
-uniform mat3 normal_matrix;
+//Per frame blocks from the shared uniform buffer, std140 so the application can lay them out
+layout(std140) uniform Frame {
+	mat4 modelview_matrix;
+	mat4 projection_matrix;
+	mat3 normal_matrix;
+};
 
-uniform float fog_start;
-uniform float fog_end;
-uniform float fog_density;
-uniform vec4 fog_color;
-uniform int fog_type;
+layout(std140) uniform Fog {
+	vec4 fog_color;
+	vec2 fog_table_transform;
+	float fog_start;
+	float fog_end;
+	float fog_density;
+};
+
+//Undo the quantization of packed vertices, a scale of one and no offset for float vertices
+uniform vec3 position_scale;
+uniform vec3 position_offset;
+uniform float texcoord_scale;
 
 in vec3 a_Vertex;
 in vec2 a_TexCoord0;
@@ -16,25 +26,30 @@ in vec2 a_TexCoord0;
 out vec4 color;
 out vec2 texCoord0;
 out float blendFactor;
+#ifdef FOG_PER_PIXEL
+out vec3 eyePosition;
+#endif
+out vec2 splatCoord;
 
 void main(void) 
 {
-	vec4 pos = modelview_matrix * vec4(a_Vertex, 1.0);
+	vec4 pos = modelview_matrix * vec4(a_Vertex * position_scale + position_offset, 1.0);
 	
-	if (fog_type == 0) 
-	{
-		blendFactor = clamp((fog_end - length(pos)) / (fog_end - fog_start), 0.0, 1.0);
-	} 
-	else if (fog_type == 1) 
-	{
-		blendFactor = exp(-fog_density * length(pos));
-	} 
-	else 
-	{
-		blendFactor = exp2(-fog_density * length(pos));
-	}
+#if defined(FOG_PER_PIXEL)
+	eyePosition = pos.xyz; //The fragment shader looks the fog up at its own distance
+	blendFactor = 1.0;
+#elif defined(FOG_LINEAR)
+	blendFactor = clamp((fog_end - length(pos)) / (fog_end - fog_start), 0.0, 1.0);
+#elif defined(FOG_EXP)
+	blendFactor = exp(-fog_density * length(pos));
+#elif defined(FOG_EXP2)
+	blendFactor = exp2(-fog_density * length(pos));
+#else
+	blendFactor = 1.0;
+#endif
 
 	color = vec4(1.0f, 1.0f, 1.0f, 0.3f);
-	texCoord0 = a_TexCoord0;
+	texCoord0 = a_TexCoord0 * texcoord_scale;
+	splatCoord = vec2(0.0); //The water has a single texture
 	gl_Position = projection_matrix * pos;	
 }
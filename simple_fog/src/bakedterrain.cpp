@@ -0,0 +1,264 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "bakedterrain.h"
+
+const char BAKED_FILE_MAGIC[4] = { 'S', 'F', 'B', 'K' };
+const unsigned int BAKED_FILE_VERSION = 3;
+
+//FNV-1a, 64 bit
+const unsigned long long KEY_OFFSET_BASIS = 14695981039346656037ULL;
+const unsigned long long KEY_PRIME = 1099511628211ULL;
+
+static void hashValue(unsigned long long& key, unsigned int value)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        key ^= (value >> (i * 8)) & 0xFF;
+        key *= KEY_PRIME;
+    }
+}
+
+static unsigned int alignOffset(size_t offset)
+{
+    return (unsigned int)((offset + 3) & ~size_t(3));
+}
+
+//Pads the file out to the next 4 byte boundary
+static void writePadding(std::ofstream& fileOut)
+{
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    size_t position = size_t(fileOut.tellp());
+    fileOut.write(zeros, alignOffset(position) - position);
+}
+
+BakedTerrain::BakedTerrain():
+m_header(NULL)
+{
+
+}
+
+BakedTerrain::~BakedTerrain()
+{
+    close();
+}
+
+unsigned long long BakedTerrain::computeKey(const RawHeightmap& source, const vector<unsigned int>& parameters)
+{
+    unsigned long long key = KEY_OFFSET_BASIS;
+
+    unsigned int size = 0, time = 0;
+    source.getFileStamp(size, time);
+    hashValue(key, size);
+    hashValue(key, time);
+    hashValue(key, (unsigned int)source.getSampleFormat());
+    hashValue(key, (unsigned int)source.getWidth());
+    hashValue(key, (unsigned int)source.getDepth());
+
+    //Layout changes of what gets stored as is
+    hashValue(key, sizeof(QuadtreeNode));
+    hashValue(key, sizeof(PackedTerrainVertex));
+
+    for (unsigned int i = 0; i < parameters.size(); ++i)
+    {
+        hashValue(key, parameters[i]);
+    }
+
+    return key;
+}
+
+/**
+The header is filled in as the blocks are laid out and written first, the
+blocks follow in the order of their offsets.
+*/
+bool BakedTerrain::write(const string& bakedFile, unsigned long long key, const TerrainQuadtree& quadtree,
+                         const IndexBuilder& patchIndices, const IndexBuilder& waterIndices, const vector<int>& pinnedNodes,
+                         const vector<PackedTerrainVertex>& pinnedVertices, const vector<float>& pinnedErrors,
+                         const vector<unsigned char>& horizons)
+{
+    vector<QuadtreeNode> nodes(quadtree.getNodeCount());
+    for (unsigned int i = 0; i < nodes.size(); ++i)
+    {
+        nodes[i] = quadtree.getNode(i);
+    }
+
+    const IndexBuilder* builders[2] = { &patchIndices, &waterIndices };
+    vector<unsigned int> sections[2];
+    vector<char> indices[2];
+
+    BakedFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BAKED_FILE_MAGIC, sizeof(header.magic));
+    header.version = BAKED_FILE_VERSION;
+    header.key = key;
+    header.nodeCount = nodes.size();
+    header.nodeOffset = alignOffset(sizeof(BakedFileHeader));
+
+    unsigned int offset = header.nodeOffset + sizeof(QuadtreeNode) * nodes.size();
+    for (int i = 0; i < 2; ++i)
+    {
+        BakedIndexStream& stream = (i == 0) ? header.patchIndices : header.waterIndices;
+
+        sections[i] = builders[i]->getSections();
+        sections[i].push_back(builders[i]->getIndexCount());
+        builders[i]->getIndexData(indices[i]);
+
+        stream.mode = builders[i]->getMode();
+        stream.type = builders[i]->getIndexType();
+        stream.restartIndex = builders[i]->getRestartIndex();
+        stream.order = builders[i]->getOrder();
+        stream.sectionCount = sections[i].size() - 1;
+        stream.sectionOffset = alignOffset(offset);
+        stream.dataSize = indices[i].size();
+        stream.dataOffset = stream.sectionOffset + sizeof(unsigned int) * sections[i].size();
+        offset = stream.dataOffset + stream.dataSize;
+    }
+
+    header.pinnedCount = pinnedNodes.size();
+    header.patchVertexCount = pinnedNodes.empty() ? 0 : pinnedVertices.size() / pinnedNodes.size();
+    header.patchErrorCount = pinnedNodes.empty() ? 0 : pinnedErrors.size() / pinnedNodes.size();
+    header.pinnedNodeOffset = alignOffset(offset);
+    header.pinnedVertexOffset = header.pinnedNodeOffset + sizeof(int) * pinnedNodes.size();
+    header.pinnedErrorOffset = header.pinnedVertexOffset + sizeof(PackedTerrainVertex) * pinnedVertices.size();
+    header.horizonSize = horizons.size();
+    header.horizonOffset = alignOffset(header.pinnedErrorOffset + sizeof(float) * pinnedErrors.size());
+
+    std::ofstream fileOut(bakedFile.c_str(), std::ios::binary);
+    if (!fileOut.good())
+    {
+        std::cerr << "Could not create the baked terrain " << bakedFile << std::endl;
+        return false;
+    }
+
+    fileOut.write(reinterpret_cast<const char*>(&header), sizeof(BakedFileHeader));
+    writePadding(fileOut);
+    fileOut.write(reinterpret_cast<const char*>(&nodes[0]), sizeof(QuadtreeNode) * nodes.size());
+
+    for (int i = 0; i < 2; ++i)
+    {
+        writePadding(fileOut);
+        fileOut.write(reinterpret_cast<const char*>(&sections[i][0]), sizeof(unsigned int) * sections[i].size());
+        if (!indices[i].empty())
+        {
+            fileOut.write(&indices[i][0], indices[i].size());
+        }
+    }
+
+    writePadding(fileOut);
+    if (!pinnedNodes.empty())
+    {
+        fileOut.write(reinterpret_cast<const char*>(&pinnedNodes[0]), sizeof(int) * pinnedNodes.size());
+        fileOut.write(reinterpret_cast<const char*>(&pinnedVertices[0]), sizeof(PackedTerrainVertex) * pinnedVertices.size());
+        fileOut.write(reinterpret_cast<const char*>(&pinnedErrors[0]), sizeof(float) * pinnedErrors.size());
+    }
+
+    writePadding(fileOut);
+    if (!horizons.empty())
+    {
+        fileOut.write(reinterpret_cast<const char*>(&horizons[0]), horizons.size());
+    }
+
+    return fileOut.good();
+}
+
+bool BakedTerrain::open(const string& bakedFile, unsigned long long key)
+{
+    close();
+
+    if (!m_file.open(bakedFile) || m_file.getSize() < sizeof(BakedFileHeader))
+    {
+        close();
+        return false;
+    }
+
+    m_header = reinterpret_cast<const BakedFileHeader*>(m_file.getData());
+
+    //A stale file is expected whenever the heightmap or the settings change, only a broken one is worth a message
+    if (memcmp(m_header->magic, BAKED_FILE_MAGIC, sizeof(m_header->magic)) != 0 ||
+        m_header->version != BAKED_FILE_VERSION || m_header->key != key)
+    {
+        close();
+        return false;
+    }
+
+    const BakedIndexStream* streams[2] = { &m_header->patchIndices, &m_header->waterIndices };
+    bool complete = isInside(m_header->nodeOffset, sizeof(QuadtreeNode) * m_header->nodeCount) &&
+                    isInside(m_header->pinnedNodeOffset, sizeof(int) * m_header->pinnedCount) &&
+                    isInside(m_header->pinnedVertexOffset, sizeof(PackedTerrainVertex) * m_header->patchVertexCount * m_header->pinnedCount) &&
+                    isInside(m_header->pinnedErrorOffset, sizeof(float) * m_header->patchErrorCount * m_header->pinnedCount) &&
+                    isInside(m_header->horizonOffset, m_header->horizonSize);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        complete = complete && isInside(streams[i]->sectionOffset, sizeof(unsigned int) * (streams[i]->sectionCount + 1)) &&
+                   isInside(streams[i]->dataOffset, streams[i]->dataSize);
+    }
+
+    if (!complete)
+    {
+        std::cerr << "Truncated baked terrain: " << bakedFile << std::endl;
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void BakedTerrain::close()
+{
+    m_file.close();
+    m_header = NULL;
+}
+
+bool BakedTerrain::isInside(unsigned int offset, size_t size) const
+{
+    return offset <= m_file.getSize() && size <= m_file.getSize() - offset;
+}
+
+const QuadtreeNode* BakedTerrain::getNodes() const
+{
+    return reinterpret_cast<const QuadtreeNode*>(m_file.getData() + m_header->nodeOffset);
+}
+
+int BakedTerrain::getPinnedNode(int index) const
+{
+    return reinterpret_cast<const int*>(m_file.getData() + m_header->pinnedNodeOffset)[index];
+}
+
+const PackedTerrainVertex* BakedTerrain::getPinnedVertices(int index) const
+{
+    return reinterpret_cast<const PackedTerrainVertex*>(m_file.getData() + m_header->pinnedVertexOffset) +
+           size_t(index) * m_header->patchVertexCount;
+}
+
+const float* BakedTerrain::getPinnedErrors(int index) const
+{
+    return reinterpret_cast<const float*>(m_file.getData() + m_header->pinnedErrorOffset) +
+           size_t(index) * m_header->patchErrorCount;
+}
+
+const unsigned char* BakedTerrain::getHorizons() const
+{
+    return (m_header->horizonSize > 0) ? reinterpret_cast<const unsigned char*>(m_file.getData() + m_header->horizonOffset) : NULL;
+}
+
+//Straight from the mapping into the buffer, like IndexBuilder::upload without building anything
+void BakedTerrain::uploadIndices(const BakedIndexStream& stream, IndexBuffer& indexBuffer) const
+{
+    const unsigned int* sections = reinterpret_cast<const unsigned int*>(m_file.getData() + stream.sectionOffset);
+
+    indexBuffer.mode = stream.mode;
+    indexBuffer.type = stream.type;
+    indexBuffer.restartIndex = stream.restartIndex;
+    indexBuffer.indexSize = (stream.type == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+    indexBuffer.sections.assign(sections, sections + stream.sectionCount + 1);
+
+    if (indexBuffer.buffer == 0)
+    {
+        glGenBuffers(1, &indexBuffer.buffer);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, indexBuffer.buffer);
+    glBufferData(GL_ARRAY_BUFFER, stream.dataSize, (stream.dataSize > 0) ? m_file.getData() + stream.dataOffset : NULL, GL_STATIC_DRAW);
+}
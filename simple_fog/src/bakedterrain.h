@@ -0,0 +1,117 @@
+#ifndef BOGLGP_BAKEDTERRAIN_H
+#define BOGLGP_BAKEDTERRAIN_H
+
+#include <string>
+#include <vector>
+#include "mappedfile.h"
+#include "rawheightmap.h"
+#include "indexbuilder.h"
+#include "quadtree.h"
+#include "vertexformat.h"
+
+using std::string;
+using std::vector;
+
+/*
+    On-disk layout of a baked terrain:
+
+    BakedFileHeader
+    quadtree nodes                      (QuadtreeNode, bounds included)
+    patch sections, patch indices       (sections + 1 unsigned ints, then the indices as uploaded)
+    water sections, water indices
+    pinned nodes                        (ints)
+    pinned vertices                     (PackedTerrainVertex, one patch after the other)
+    pinned errors                       (floats, RTIN vertex errors of each patch)
+    horizons                            (HorizonMap bytes, both layers)
+
+    Everything is stored the way it goes to the GPU, so a warm start maps
+    the file and hands the streams to glBufferData. Every block starts on
+    a 4 byte boundary.
+*/
+struct BakedIndexStream
+{
+    unsigned int mode;              //GL_TRIANGLES or GL_TRIANGLE_STRIP
+    unsigned int type;              //GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    unsigned int restartIndex;
+    unsigned int order;             //IndexOrder the indices were built in
+    unsigned int sectionCount;
+    unsigned int sectionOffset;     //Byte offset of the first index of every section followed by the index count
+    unsigned int dataSize;          //Bytes of indices
+    unsigned int dataOffset;
+};
+
+struct BakedFileHeader
+{
+    char magic[4];
+    unsigned int version;
+    unsigned long long key;         //Hash of the source heightmap and the parameters the terrain was built with
+    unsigned int nodeCount;
+    unsigned int nodeOffset;
+    BakedIndexStream patchIndices;
+    BakedIndexStream waterIndices;
+    unsigned int patchVertexCount;  //Vertices of every pinned patch
+    unsigned int patchErrorCount;   //Errors of every pinned patch
+    unsigned int pinnedCount;       //Patches of the coarsest level, built up front
+    unsigned int pinnedNodeOffset;
+    unsigned int pinnedVertexOffset;
+    unsigned int pinnedErrorOffset;
+    unsigned int horizonSize;       //Bytes of horizons
+    unsigned int horizonOffset;
+};
+
+/*
+    Everything Terrain::loadHeightmap generates from the heightmap before
+    the first frame, saved after a cold start. The quadtree bounds, the
+    patch and water indices, the vertices of the coarsest patches and the
+    horizon map are what would otherwise be rebuilt on every run.
+
+    The key covers the source file stamp and every parameter that changes
+    the generated data, so a file that was built from anything else is
+    never used. Vertices are only baked in the packed layout.
+*/
+class BakedTerrain
+{
+public:
+    BakedTerrain();
+    ~BakedTerrain();
+
+    //parameters holds every generation setting, floats by their bits
+    static unsigned long long computeKey(const RawHeightmap& source, const vector<unsigned int>& parameters);
+
+    //pinnedVertices and pinnedErrors hold the patches of pinnedNodes one after the other
+    static bool write(const string& bakedFile, unsigned long long key, const TerrainQuadtree& quadtree,
+                      const IndexBuilder& patchIndices, const IndexBuilder& waterIndices, const vector<int>& pinnedNodes,
+                      const vector<PackedTerrainVertex>& pinnedVertices, const vector<float>& pinnedErrors,
+                      const vector<unsigned char>& horizons);
+
+    //False if the file is missing, broken or baked with another key
+    bool open(const string& bakedFile, unsigned long long key);
+    void close();
+
+    bool isOpen() const { return m_header != NULL; }
+
+    const QuadtreeNode* getNodes() const;
+    int getNodeCount() const { return int(m_header->nodeCount); }
+
+    IndexOrder getPatchIndexOrder() const { return IndexOrder(m_header->patchIndices.order); }
+    void uploadPatchIndices(IndexBuffer& indexBuffer) const { uploadIndices(m_header->patchIndices, indexBuffer); }
+    void uploadWaterIndices(IndexBuffer& indexBuffer) const { uploadIndices(m_header->waterIndices, indexBuffer); }
+
+    int getPinnedCount() const { return int(m_header->pinnedCount); }
+    int getPinnedNode(int index) const;
+    const PackedTerrainVertex* getPinnedVertices(int index) const;
+    const float* getPinnedErrors(int index) const;
+    int getPinnedErrorCount() const { return int(m_header->patchErrorCount); }
+
+    //NULL if the file holds no horizons
+    const unsigned char* getHorizons() const;
+
+private:
+    void uploadIndices(const BakedIndexStream& stream, IndexBuffer& indexBuffer) const;
+    bool isInside(unsigned int offset, size_t size) const;
+
+    MappedFile m_file;
+    const BakedFileHeader* m_header;
+};
+
+#endif
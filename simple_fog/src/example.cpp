@@ -5,6 +5,9 @@
 #include <sstream>
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
 
 //for matrix calculation
 #include <GL/glew.h>
@@ -19,12 +22,71 @@
 #include "example.h"
 #include "glslshader.h"
 
-#define LINEAR_FOG 0
-#define EXP_FOG 1
-#define EXP2_FOG 2
+const float FOG_START = 20.0f;
+const float FOG_END = 50.0f;
+const float FOG_DENSITY = 0.03f;
+
+//Texture unit of the fog table, the terrain has the ones below it
+const int FOG_TABLE_UNIT = 5;
+
+//Fog color of the scene shaders and the fog pass
+const float FOG_COLOR[4] = { 0.5f, 0.5f, 0.5f, 0.5f };
+
+static vector<string> getFogDefines(int fogMode, bool perPixel)
+{
+    vector<string> defines;
+    if (getFogDefine(FogMode(fogMode)) != NULL)
+    {
+        defines.push_back(getFogDefine(FogMode(fogMode)));
+        if (perPixel)
+        {
+            defines.push_back("FOG_PER_PIXEL");
+        }
+    }
+
+    return defines;
+}
+
+//The samplers render sends every frame by their handles in both programs, the rest is in the uniform blocks
+enum ExampleUniform
+{
+    UNIFORM_TEXTURE0,
+    UNIFORM_FOG_TABLE,
+    UNIFORM_COUNT
+};
+
+const char* UNIFORM_NAMES[UNIFORM_COUNT] = { "texture0", "fog_table" };
+
+//Bytes of uniform blocks a frame can write, the four blocks take well under 1KB even at 256 byte alignment
+const size_t UNIFORM_FRAME_SIZE = 4096;
+
+//A terrain material layer, made from the grass when its image isn't there
+struct MaterialLayer
+{
+    const char* file;
+    float tint[3];      //Scales the brightness of the grass
+    float lift;         //Added to every channel after the tint
+};
+
+//In the order of the splat map channels
+const MaterialLayer MATERIAL_LAYERS[] =
+{
+    { "data/sand.tga",  { 0.9f, 0.8f, 0.55f },  0.3f },
+    { "data/grass.tga", { 1.0f, 1.0f, 1.0f },   0.0f },
+    { "data/rock.tga",  { 0.8f, 0.78f, 0.75f }, 0.1f },
+    { "data/snow.tga",  { 0.4f, 0.4f, 0.45f },  0.6f }
+};
+
+const int MATERIAL_LAYER_COUNT = sizeof(MATERIAL_LAYERS) / sizeof(MATERIAL_LAYERS[0]);
 
 Example::Example():
-	m_angle(0.0f)
+    m_perPixelFog(true),
+    m_deferredFog(false),
+    m_volumetricFog(false),
+	m_angle(0.0f),
+    m_grassTexID(0),
+    m_waterTexID(0),
+    m_materialTexID(0)
 {
     glGenVertexArrays(1, &m_VAO);
     glBindVertexArray(m_VAO);
@@ -41,6 +103,13 @@ Example::~Example()
 
 bool Example::init()
 {
+    typedef std::chrono::high_resolution_clock Clock;
+    Clock::time_point start = Clock::now();
+
+    //The images are decoded by jobs while this thread sets up the shaders and the terrain
+    JobFuture<bool> grassLoaded = m_jobs.async<bool>([this]() { return m_grassTexture.load("data/grass.tga"); });
+    JobFuture<bool> waterLoaded = m_jobs.async<bool>([this]() { return m_waterTexture.load("data/water.tga"); });
+
     if (!m_GLSLProgram->initialize() || !m_waterProgram->initialize()) 
     {
         std::cerr << "Could not initialize the shaders" << std::endl;
@@ -50,7 +119,7 @@ bool Example::init()
     glEnable(GL_DEPTH_TEST);
     glClearColor(0.0f, 0.5f, 0.9f, 0.5f);
 
-    if (!m_terrain.loadHeightmap("data/heightmap.raw", 65)) 
+    if (!m_terrain.loadHeightmap("data/heightmap.raw", RawHeightmapFormat(65, 65), m_jobs)) 
     {
         std::cerr << "Could not load the terrain" << std::endl;
         return false;
@@ -58,11 +127,14 @@ bool Example::init()
 
     //Bind the attribute locations
 	m_GLSLProgram->bindAttrib(0, "a_Vertex");
-    m_GLSLProgram->bindAttrib(1, "a_TexCoord");
+    m_GLSLProgram->bindAttrib(1, "a_TexCoord0");
     m_GLSLProgram->bindAttrib(2, "a_Normal");
+    m_GLSLProgram->bindAttrib(3, "a_MorphHeight");
+    m_GLSLProgram->bindAttrib(4, "a_PatchOrigin");
+    m_GLSLProgram->bindAttrib(5, "a_MorphRange");
 	
     m_waterProgram->bindAttrib(0, "a_Vertex");
-    m_waterProgram->bindAttrib(1, "a_TexCoord");
+    m_waterProgram->bindAttrib(1, "a_TexCoord0");
 
 	//Re link the program
 	m_GLSLProgram->linkProgram();	
@@ -71,53 +143,170 @@ bool Example::init()
     m_waterProgram->linkProgram();
     m_waterProgram->bindShader();
 
-    if (!m_grassTexture.load("data/grass.tga"))
+    //Every fog mode is a program of its own, built now so switching modes never waits on the compiler
+    for (int variant = 0; variant <= NO_FOG * 2 + 1; ++variant)
+    {
+        vector<string> defines = getFogDefines(variant / 2, variant % 2 == 1);
+        if (!m_GLSLProgram->prepareVariant(defines) || !m_waterProgram->prepareVariant(defines))
+        {
+            std::cerr << "Could not build the shaders for every fog mode" << std::endl;
+            return false;
+        }
+    }
+
+    //The blocks are shared by every variant of both programs
+    UniformBlocks::bindProgram(*m_GLSLProgram);
+    UniformBlocks::bindProgram(*m_waterProgram);
+    if (!m_uniformBlocks.initialize(UNIFORM_FRAME_SIZE))
     {
-        std::cerr << "Could not load the grass texture" << std::endl;
         return false;
     }
 
-    if (!m_waterTexture.load("data/water.tga"))
+    //Names are only looked up here, render sends by handle
+    for (int i = 0; i < UNIFORM_COUNT; ++i)
     {
-        std::cerr << "Could not load the water texture" << std::endl;
+        m_sceneUniforms.push_back(m_GLSLProgram->getUniformHandle(UNIFORM_NAMES[i]));
+        m_waterUniforms.push_back(m_waterProgram->getUniformHandle(UNIFORM_NAMES[i]));
+    }
+
+    if (!m_fogPass.initialize())
+    {
+        std::cerr << "Could not build the fog pass" << std::endl;
         return false;
     }
 
-    glGenTextures(1, &m_grassTexID);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, m_grassTexID);
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    if (!m_froxelFog.initialize())
+    {
+        std::cerr << "Could not build the froxel fog" << std::endl;
+        return false;
+    }
 
-    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGB8, m_grassTexture.getWidth(), 
-                      m_grassTexture.getHeight(), GL_RGB, GL_UNSIGNED_BYTE, 
-                      m_grassTexture.getImageData());
+    //Thickest over the water, thinning out towards the hill tops
+    m_froxelSettings.density = 0.06f;
+    m_froxelSettings.baseHeight = 4.0f;
+    m_froxelSettings.heightFalloff = 0.5f;
+    m_froxelSettings.sunDirection = glm::normalize(glm::vec3(0.0f, 0.4f, 1.0f));
+    m_froxelSettings.sunColor = glm::vec3(0.6f, 0.55f, 0.45f);
+    m_froxelSettings.ambientColor = glm::vec3(FOG_COLOR[0], FOG_COLOR[1], FOG_COLOR[2]);
+    m_froxelSettings.anisotropy = 0.3f;
 
-    glGenTextures(1, &m_waterTexID);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, m_waterTexID);
-    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    if (!grassLoaded.get(m_jobs))
+    {
+        std::cerr << "Could not load the grass texture" << std::endl;
+        return false;
+    }
 
-    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGB8, m_waterTexture.getWidth(), 
-                      m_waterTexture.getHeight(), GL_RGB, GL_UNSIGNED_BYTE, 
-                      m_waterTexture.getImageData());
+    if (!waterLoaded.get(m_jobs))
+    {
+        std::cerr << "Could not load the water texture" << std::endl;
+        return false;
+    }
+
+    m_grassTexID = uploadTexture(m_grassTexture);
+    m_waterTexID = uploadTexture(m_waterTexture);
+    m_materialTexID = uploadMaterialLayers(m_grassTexture);
 
     glEnable(GL_DEPTH_TEST);
     
     this->m_terrain.SetTextureHandle(m_grassTexID);
-    this->m_terrain.m_GLSLProgram = m_GLSLProgram;
+    this->m_terrain.setMaterialLayers(m_materialTexID);
+    this->m_terrain.setPrograms(m_GLSLProgram, m_waterProgram);
     
     glEnable(GL_CULL_FACE);
     glDepthFunc(GL_LEQUAL);
 
     m_fogMode = LINEAR_FOG;
+    selectFogVariants();
+
+    reportVertexLayout(false);
+
+    std::cout << "Loaded in " << std::chrono::duration<double, std::milli>(Clock::now() - start).count()
+              << " ms with " << m_jobs.getThreadCount() << " threads" << std::endl;
 
     //Return success
     return true;
 }
 
+/**
+The mipmaps are built by the GL rather than by gluBuild2DMipmaps on the CPU,
+so all that is left on this thread is the copy of the decoded image.
+*/
+GLuint Example::uploadTexture(const TargaImage& image)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    //glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+    //Rows of RGB images don't have to be 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, image.getWidth(), image.getHeight(), 0,
+                 GL_RGB, GL_UNSIGNED_BYTE, image.getImageData());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glGenerateMipmap(GL_TEXTURE_2D);
+    return texture;
+}
+
+
+
+/**
+Every layer has to be the size of the grass. Layers without an image of
+their own, or with one of another size, take the brightness of the grass
+and tint it, so the terrain can blend its materials with nothing more
+than the grass on disk.
+*/
+GLuint Example::uploadMaterialLayers(const TargaImage& grass)
+{
+    const unsigned int width = grass.getWidth();
+    const unsigned int height = grass.getHeight();
+    const size_t layerSize = size_t(width) * height * 3;
+    vector<unsigned char> layers(layerSize * MATERIAL_LAYER_COUNT);
+
+    for (int i = 0; i < MATERIAL_LAYER_COUNT; ++i)
+    {
+        const MaterialLayer& material = MATERIAL_LAYERS[i];
+        unsigned char* layer = &layers[layerSize * i];
+
+        //TargaImage::load complains about missing files, most of these are expected to be
+        TargaImage image;
+        if (std::ifstream(material.file).good() && image.load(material.file) &&
+            image.getWidth() == width && image.getHeight() == height && image.getBitsPerPixel() == 24)
+        {
+            std::copy(image.getImageData(), image.getImageData() + layerSize, layer);
+            continue;
+        }
 
+        const unsigned char* source = grass.getImageData();
+        for (size_t texel = 0; texel < layerSize; texel += 3)
+        {
+            float brightness = (source[texel] * 0.299f + source[texel + 1] * 0.587f + source[texel + 2] * 0.114f) / 255.0f;
+            for (int channel = 0; channel < 3; ++channel)
+            {
+                float value = brightness * material.tint[channel] + material.lift;
+                layer[texel + channel] = (unsigned char)(std::min(value, 1.0f) * 255.0f);
+            }
+        }
+    }
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB8, width, height, MATERIAL_LAYER_COUNT, 0,
+                 GL_RGB, GL_UNSIGNED_BYTE, &layers[0]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    return texture;
+}
 
 void Example::prepare(float dt)
 {
@@ -127,17 +316,171 @@ void Example::prepare(float dt)
 std::string Example::toggleFogMode()
 {
 	m_fogMode++;
-        if (m_fogMode > EXP2_FOG) {
+        if (m_fogMode > NO_FOG) {
             m_fogMode = LINEAR_FOG;
         }
 
-    string fogType = (m_fogMode == EXP_FOG)? "EXP Fog" : (m_fogMode == EXP2_FOG)? "EXP2 Fog" : "Linear Fog";
+    selectFogVariants();
+
+    string fogType = (m_fogMode == EXP_FOG)? "EXP Fog" : (m_fogMode == EXP2_FOG)? "EXP2 Fog" : (m_fogMode == NO_FOG)? "No Fog" : "Linear Fog";
     std::stringstream ss;
     ss << "Chapter 8 - Simple Fog - " << fogType;
     std::cout << ss.str() << std::endl;
     return ss.str();
 }
 
+//The uniforms are sent every frame, so the programs of the new mode need nothing else
+void Example::selectFogVariants()
+{
+    //The fog pass fogs the scene afterwards, so the scene itself is drawn without
+    int sceneFogMode = (m_deferredFog || m_volumetricFog) ? NO_FOG : m_fogMode;
+    m_GLSLProgram->selectVariant(getFogDefines(sceneFogMode, m_perPixelFog));
+    m_waterProgram->selectVariant(getFogDefines(sceneFogMode, m_perPixelFog));
+}
+
+void Example::toggleFogEvaluation()
+{
+    m_perPixelFog = !m_perPixelFog;
+    selectFogVariants();
+
+    std::cout << "Fog " << (m_perPixelFog ? "looked up per fragment" : "computed per vertex") << std::endl;
+}
+
+/**
+Cycles from the fog in the scene shaders to the fog pass at full resolution
+and then at reduced resolution.
+*/
+void Example::toggleFogPass()
+{
+    if (!m_deferredFog)
+    {
+        m_deferredFog = true;
+        m_fogPass.setReducedResolution(false);
+    }
+    else if (!m_fogPass.isReducedResolution())
+    {
+        m_fogPass.setReducedResolution(true);
+    }
+    else
+    {
+        m_deferredFog = false;
+    }
+
+    selectFogVariants();
+
+    std::cout << "Fog " << (!m_deferredFog ? "in the scene shaders" :
+                            m_fogPass.isReducedResolution() ? "pass at reduced resolution" : "pass at full resolution") << std::endl;
+}
+
+//Takes over from the fog modes while it is on
+void Example::toggleVolumetricFog()
+{
+    m_volumetricFog = !m_volumetricFog;
+    m_froxelFog.resetHistory();
+    selectFogVariants();
+
+    std::cout << "Volumetric height fog " << (m_volumetricFog ? "on" : "off") << std::endl;
+}
+
+void Example::benchmarkUniforms()
+{
+    const int ITERATIONS = 100000;
+
+    m_GLSLProgram->bindShader();
+    m_GLSLProgram->benchmarkLookups(ITERATIONS);
+    m_waterProgram->bindShader();
+    m_waterProgram->benchmarkLookups(ITERATIONS);
+}
+
+void Example::toggleVertexLayout()
+{
+    //Report on the layout that is going away, the timings only make sense for one layout at a time
+    reportVertexLayout(true);
+
+    //Cycle through the layouts, skipping any the hardware can't manage
+    VertexLayout layout = m_terrain.getVertexLayout();
+    do
+    {
+        layout = VertexLayout((layout + 1) % (HEIGHT_TEXTURE_LAYOUT + 1));
+    }
+    while (!m_terrain.setVertexLayout(layout));
+
+    reportVertexLayout(false);
+}
+
+void Example::toggleMeshError()
+{
+    //Cycle through the bounds, starting over with the full grid
+    const float errors[] = { 0.0f, 0.01f, 0.05f, 0.2f };
+    const int count = sizeof(errors) / sizeof(errors[0]);
+
+    int next = 0;
+    while (next < count && errors[next] <= m_terrain.getMeshError())
+    {
+        ++next;
+    }
+
+    m_terrain.setMeshError(errors[next % count]);
+
+    std::cout << "Mesh error " << m_terrain.getMeshError() << ": " << m_terrain.getPatchTriangles()
+              << " triangles per whole patch on average" << std::endl;
+}
+
+void Example::toggleHorizonCulling()
+{
+    //What the last frame culled, before the switch
+    std::cout << "Horizon culling hid " << m_terrain.getHiddenQuadrants() << " patch quadrants last frame, now "
+              << (m_terrain.isHorizonCulling() ? "off" : "on") << std::endl;
+
+    m_terrain.setHorizonCulling(!m_terrain.isHorizonCulling());
+}
+
+void Example::toggleIndirectDraws()
+{
+    //Submission time of the mode that is going away
+    std::cout << (m_terrain.isIndirectDraws() ? "Indirect" : "Direct") << " draws: "
+              << m_terrain.getSubmitTime() << " ms average CPU submission" << std::endl;
+
+    if (m_terrain.setIndirectDraws(!m_terrain.isIndirectDraws()))
+    {
+        std::cout << "Switched to " << (m_terrain.isIndirectDraws() ? "indirect" : "direct") << " draws"
+                  << (m_terrain.getVertexLayout() == HEIGHT_TEXTURE_LAYOUT ? "" : ", used by the height texture layout only")
+                  << std::endl;
+    }
+}
+
+void Example::reportVertexLayout(bool withDrawTime)
+{
+    string name;
+    switch (m_terrain.getVertexLayout())
+    {
+    case INTERLEAVED_PACKED_LAYOUT:
+        name = "Interleaved packed";
+        break;
+    case HEIGHT_TEXTURE_LAYOUT:
+        name = "Height texture";
+        break;
+    default:
+        name = "Separate float";
+    }
+
+    std::cout << name << " vertex layout: " << m_terrain.getVertexSize() << " bytes per terrain vertex, "
+              << m_terrain.getVertexMemory() / 1024 << " KB of vertex buffers";
+
+    if (withDrawTime)
+    {
+        double drawTime = m_terrain.getDrawTime();
+        if (drawTime >= 0.0)
+        {
+            std::cout << ", " << drawTime << " ms average draw time";
+        }
+
+        std::cout << ", " << m_terrain.getSubmitTime() << " ms average CPU submission";
+    }
+
+    std::cout << std::endl;
+}
+
 /**
 Returns an array of 3x3 floats representing a suitable normal
 matrix. This returns the inverse transpose of the passed in matrix
@@ -198,6 +541,13 @@ void Example::render()
     float modelviewMatrix[16];
     float projectionMatrix[16];
 
+    //Without its targets the pass is off and the scene shaders go back to the fog
+    if ((m_deferredFog || m_volumetricFog) && !m_fogPass.begin())
+    {
+        m_deferredFog = m_volumetricFog = false;
+        selectFogVariants();
+    }
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     //Load the identity matrix (reset to the default position and orientation)
     //glLoadIdentity();
@@ -230,48 +580,90 @@ void Example::render()
     float project[16] = {1.53,0,0,0,0,2.05,0,0,0,0,-1.02,-1,0,0,-2.02,0};
     vector<float> normalMatrix = calculateNormalMatrix(model);
 
+    //The table only changes with the fog settings, the per vertex programs simply don't read it
+    m_fogTable.update(FogMode(m_fogMode), FOG_START, FOG_END, FOG_DENSITY);
+
+    //Written once for every program, the std140 mat3 has its columns padded to vec4s
+    FrameBlock frame;
+    memcpy(frame.modelview, dArray, sizeof(frame.modelview));
+    memcpy(frame.projection, project, sizeof(frame.projection));
+    for (int column = 0; column < 3; ++column)
+    {
+        memcpy(&frame.normalMatrix[column * 4], &normalMatrix[column * 3], 3 * sizeof(float));
+        frame.normalMatrix[column * 4 + 3] = 0.0f;
+    }
+
+    FogBlock fog = { { FOG_COLOR[0], FOG_COLOR[1], FOG_COLOR[2], FOG_COLOR[3] },
+                     { m_fogTable.getScale(), m_fogTable.getOffset() },
+                     FOG_START, FOG_END, FOG_DENSITY, { 0.0f, 0.0f, 0.0f } };
+
+    LightBlock light = { { 0.0f, 0.4f, 1.0f, 0.0f }, { 1.0f, 1.0f, 1.0f, 1.0f },
+                         { 0.3f, 0.3f, 0.3f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f } };
+
+    MaterialBlock material = { { 0.2f, 0.2f, 0.2f, 1.0f }, { 0.8f, 0.8f, 0.8f, 1.0f },
+                               { 0.6f, 0.6f, 0.6f, 1.0f }, { 0.0f, 0.0f, 0.0f, 1.0f },
+                               10.0f, { 0.0f, 0.0f, 0.0f } };
+
+    m_uniformBlocks.beginFrame();
+    m_uniformBlocks.write(FRAME_BLOCK, frame);
+    m_uniformBlocks.write(FOG_BLOCK, fog);
+    m_uniformBlocks.write(LIGHT_BLOCK, light);
+    m_uniformBlocks.write(MATERIAL_BLOCK, material);
+    m_uniformBlocks.endWrites();
+
     m_GLSLProgram->bindShader();
+    m_GLSLProgram->sendUniform(m_sceneUniforms[UNIFORM_TEXTURE0], 0);
+    m_GLSLProgram->sendUniform(m_sceneUniforms[UNIFORM_FOG_TABLE], FOG_TABLE_UNIT);
+
+    glActiveTexture(GL_TEXTURE0 + FOG_TABLE_UNIT);
+    glBindTexture(GL_TEXTURE_1D, m_fogTable.getTexture());
+    glActiveTexture(GL_TEXTURE0);
+
+    //The camera sits at the origin of eye space, the terrain has no model transform
+    glm::vec4 cameraPosition = glm::inverse(pMat4) * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+    //Only the chunks inside the view volume are drawn
+    Frustum frustum;
+    frustum.extract(glm::make_mat4(project), pMat4);
+    m_terrain.update(glm::vec3(cameraPosition), frustum);
 
-    //Send the modelview and projection matrices to the shaders
-    m_GLSLProgram->sendUniform4x4("modelview_matrix", dArray);
-    m_GLSLProgram->sendUniform4x4("projection_matrix", project);
-    m_GLSLProgram->sendUniform3x3("normal_matrix", &normalMatrix[0]);
-    m_GLSLProgram->sendUniform("texture0", 0);
-    m_GLSLProgram->sendUniform("material_ambient", 0.2f, 0.2f, 0.2f, 1.0f);
-    m_GLSLProgram->sendUniform("material_diffuse", 0.8f, 0.8f, 0.8f, 1.0f);
-    m_GLSLProgram->sendUniform("material_specular", 0.6f, 0.6f, 0.6f, 1.0f);
-    m_GLSLProgram->sendUniform("material_emissive", 0.0f, 0.0f, 0.0f, 1.0f);
-    m_GLSLProgram->sendUniform("material_shininess", 10.0f);
-    m_GLSLProgram->sendUniform("light0.ambient", 0.0f, 0.0f, 0.0f, 1.0f);
-    m_GLSLProgram->sendUniform("light0.diffuse", 1.0f, 1.0f, 1.0f, 1.0f);
-    m_GLSLProgram->sendUniform("light0.specular", 0.3f, 0.3f, 0.3f, 1.0f);
-    m_GLSLProgram->sendUniform("light0.position", 0.0f, 0.4f, 1.0f, 0.0f);
-    m_GLSLProgram->sendUniform("fog_color", 0.5f, 0.5f, 0.5f, 0.5f);
-    m_GLSLProgram->sendUniform("fog_start", 20.0f);
-    m_GLSLProgram->sendUniform("fog_end", 50.0f);
-    m_GLSLProgram->sendUniform("fog_density", 0.03f);
-    m_GLSLProgram->sendUniform("fog_type", m_fogMode);
     glBindTexture(GL_TEXTURE_2D, m_grassTexID);
     m_terrain.render();
 
     m_waterProgram->bindShader();
-    m_waterProgram->sendUniform4x4("modelview_matrix", dArray);
-    m_waterProgram->sendUniform4x4("projection_matrix", project);
-    m_waterProgram->sendUniform3x3("normal_matrix", &normalMatrix[0]);
-
-    m_waterProgram->sendUniform("fog_color", 0.5f, 0.5f, 0.5f, 0.5f);
-    m_waterProgram->sendUniform("fog_start", 20.0f);
-    m_waterProgram->sendUniform("fog_end", 50.0f);
-    m_waterProgram->sendUniform("fog_density", 0.03f);
-    m_waterProgram->sendUniform("fog_type", m_fogMode);
+    m_waterProgram->sendUniform(m_waterUniforms[UNIFORM_FOG_TABLE], FOG_TABLE_UNIT);
 
     glBindTexture(GL_TEXTURE_2D, m_waterTexID);
     m_terrain.renderWater();
+
+    if (m_volumetricFog)
+    {
+        m_froxelFog.update(pMat4, glm::make_mat4(project), m_froxelSettings);
+        m_fogPass.applyFroxels(m_froxelFog, glm::make_mat4(project));
+    }
+    else if (m_deferredFog)
+    {
+        m_fogPass.apply(FogMode(m_fogMode), glm::make_mat4(project));
+    }
+
+    m_uniformBlocks.endFrame();
 }
 
+/**
+    Frees the GL objects Example holds itself while the context is still
+    current. The members that hold GL objects of their own free them when
+    Example is destroyed, which also has to happen before the context goes.
+*/
 void Example::shutdown()
 {
-
+    glDeleteTextures(1, &m_grassTexID);
+    glDeleteTextures(1, &m_waterTexID);
+    glDeleteTextures(1, &m_materialTexID);
+    glDeleteVertexArrays(1, &m_VAO);
+    m_grassTexID = m_waterTexID = m_materialTexID = m_VAO = 0;
+
+    m_GLSLProgram->unload();
+    m_waterProgram->unload();
 }
 
 void Example::onResize(int width, int height)
@@ -10,6 +10,11 @@
 #include <iostream>
 #include "terrain.h"
 #include "targa.h"
+#include "fogtable.h"
+#include "fogpass.h"
+#include "froxelfog.h"
+#include "uniformblocks.h"
+#include "jobsystem.h"
 
 class GLSLProgram; 
 
@@ -32,21 +37,50 @@ public:
     vector<float> calculateNormalMatrix(const float* modelviewMatrix);
   
     std::string toggleFogMode();
+    void toggleFogEvaluation();
+    void toggleFogPass();
+    void toggleVolumetricFog();
+
+    //Times the uniform lookups of both programs by name and by handle
+    void benchmarkUniforms();
+
+    void toggleVertexLayout();
+    void toggleMeshError();
+    void toggleHorizonCulling();
+    void toggleIndirectDraws();
 private:
+    void reportVertexLayout(bool withDrawTime);
+    void selectFogVariants();
+    GLuint uploadTexture(const TargaImage& image);
+    GLuint uploadMaterialLayers(const TargaImage& grass);
+
     int m_fogMode;
+    bool m_perPixelFog;         //Fog from the table per fragment rather than computed per vertex
+    bool m_deferredFog;         //Fog applied over the finished scene by m_fogPass
+    FogTable m_fogTable;
+    FogPass m_fogPass;
+    bool m_volumetricFog;       //Height fog from m_froxelFog instead of the fog modes
+    FroxelFog m_froxelFog;
+    FroxelFogSettings m_froxelSettings;
     float m_angle;
 
     Terrain m_terrain;
     GLSLProgram* m_GLSLProgram;
     GLSLProgram* m_waterProgram;
+    vector<GLSLProgram::UniformHandle> m_sceneUniforms;    //By ExampleUniform
+    vector<GLSLProgram::UniformHandle> m_waterUniforms;
+    UniformBlocks m_uniformBlocks;      //Matrices, fog, light and material of the frame for both programs
 
     TargaImage m_grassTexture;
     TargaImage m_waterTexture;
 
     GLuint m_grassTexID;
     GLuint m_waterTexID;
+    GLuint m_materialTexID;     //Texture array of the terrain materials
     GLuint m_VAO;
-    
+
+    //Last, so the workers are joined before anything a job might touch is destroyed
+    JobSystem m_jobs;
 };
 
 #endif
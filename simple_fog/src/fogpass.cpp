@@ -0,0 +1,259 @@
+#include <iostream>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "fogpass.h"
+
+//The stages of the pass, full resolution has no define of its own
+const char* FOG_FACTOR_STAGE = "FOG_FACTORS";
+const char* FOG_UPSAMPLE_STAGE = "FOG_UPSAMPLE";
+const char* FOG_FROXEL_STAGE = "FOG_FROXELS";
+
+//Texture units of the pass, nothing of the scene is bound any more when it runs
+const int SCENE_COLOR_UNIT = 0;
+const int SCENE_DEPTH_UNIT = 1;
+const int FOG_FACTOR_UNIT = 2;
+const int FROXEL_UNIT = 3;
+
+//The uniforms the stages send every frame by their handles, the fog settings are in the Fog block
+enum FogPassUniform
+{
+    FOG_PASS_UNIFORM_SCENE_COLOR,
+    FOG_PASS_UNIFORM_SCENE_DEPTH,
+    FOG_PASS_UNIFORM_FOG_FACTORS,
+    FOG_PASS_UNIFORM_INVERSE_PROJECTION,
+    FOG_PASS_UNIFORM_FROXEL_VOLUME,
+    FOG_PASS_UNIFORM_FROXEL_DEPTH,
+    FOG_PASS_UNIFORM_COUNT
+};
+
+const char* FOG_PASS_UNIFORM_NAMES[FOG_PASS_UNIFORM_COUNT] =
+{
+    "scene_color", "scene_depth", "fog_factors", "inverse_projection", "froxel_volume", "froxel_depth"
+};
+
+static vector<string> getPassDefines(FogMode mode, const char* stage)
+{
+    vector<string> defines;
+    if (getFogDefine(mode) != NULL)
+    {
+        defines.push_back(getFogDefine(mode));
+    }
+
+    if (stage != NULL)
+    {
+        defines.push_back(stage);
+    }
+
+    return defines;
+}
+
+static GLuint createTarget(GLint internalFormat, GLsizei width, GLsizei height, GLenum format, GLenum type)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+    return texture;
+}
+
+FogPass::FogPass():
+m_program("data/fog-post.vert", "data/fog-post.frag"),
+m_vertexArray(0),
+m_sceneFramebuffer(0),
+m_colorTexture(0),
+m_depthTexture(0),
+m_factorFramebuffer(0),
+m_factorTexture(0),
+m_width(0),
+m_height(0),
+m_reduced(false)
+{
+    m_viewport[0] = m_viewport[1] = m_viewport[2] = m_viewport[3] = 0;
+}
+
+FogPass::~FogPass()
+{
+    releaseTargets();
+    glDeleteVertexArrays(1, &m_vertexArray);
+    m_program.unload();
+}
+
+bool FogPass::initialize()
+{
+    if (!m_program.initialize())
+    {
+        return false;
+    }
+
+    //Kept for the variants built below
+    UniformBlocks::bindProgram(m_program);
+
+    const char* stages[3] = { NULL, FOG_FACTOR_STAGE, FOG_UPSAMPLE_STAGE };
+    for (int mode = LINEAR_FOG; mode <= NO_FOG; ++mode)
+    {
+        for (int stage = 0; stage < 3; ++stage)
+        {
+            if (!m_program.prepareVariant(getPassDefines(FogMode(mode), stages[stage])))
+            {
+                return false;
+            }
+        }
+    }
+
+    //The froxels bring their own fog model
+    if (!m_program.prepareVariant(vector<string>(1, FOG_FROXEL_STAGE)))
+    {
+        return false;
+    }
+
+    m_uniforms.clear();
+    for (int i = 0; i < FOG_PASS_UNIFORM_COUNT; ++i)
+    {
+        m_uniforms.push_back(m_program.getUniformHandle(FOG_PASS_UNIFORM_NAMES[i]));
+    }
+
+    glGenVertexArrays(1, &m_vertexArray);
+    return true;
+}
+
+bool FogPass::createTargets(int width, int height)
+{
+    releaseTargets();
+
+    m_width = width;
+    m_height = height;
+
+    m_colorTexture = createTarget(GL_RGBA8, width, height, GL_RGBA, GL_UNSIGNED_BYTE);
+    m_depthTexture = createTarget(GL_DEPTH_COMPONENT24, width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+    m_factorTexture = createTarget(GL_RG16F, (width + 1) / 2, (height + 1) / 2, GL_RG, GL_FLOAT);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &m_sceneFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_sceneFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_colorTexture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_depthTexture, 0);
+    bool complete = (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    glGenFramebuffers(1, &m_factorFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_factorFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_factorTexture, 0);
+    complete = complete && (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (!complete)
+    {
+        std::cerr << "Could not create the fog pass targets" << std::endl;
+        releaseTargets();
+        return false;
+    }
+
+    return true;
+}
+
+void FogPass::releaseTargets()
+{
+    glDeleteFramebuffers(1, &m_sceneFramebuffer);
+    glDeleteFramebuffers(1, &m_factorFramebuffer);
+    glDeleteTextures(1, &m_colorTexture);
+    glDeleteTextures(1, &m_depthTexture);
+    glDeleteTextures(1, &m_factorTexture);
+
+    m_sceneFramebuffer = m_factorFramebuffer = 0;
+    m_colorTexture = m_depthTexture = m_factorTexture = 0;
+    m_width = m_height = 0;
+}
+
+bool FogPass::begin()
+{
+    glGetIntegerv(GL_VIEWPORT, m_viewport);
+
+    if ((m_viewport[2] != m_width || m_viewport[3] != m_height) && !createTargets(m_viewport[2], m_viewport[3]))
+    {
+        return false;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, m_sceneFramebuffer);
+    glViewport(0, 0, m_width, m_height);
+    return true;
+}
+
+//Uniform values belong to the variant, so every stage gets all of them, the fog settings come from the Fog block
+void FogPass::selectStage(FogMode mode, const char* stage, const glm::mat4& projection)
+{
+    m_program.selectVariant(getPassDefines(mode, stage));
+    m_program.bindShader();
+
+    m_program.sendUniform(m_uniforms[FOG_PASS_UNIFORM_SCENE_COLOR], SCENE_COLOR_UNIT);
+    m_program.sendUniform(m_uniforms[FOG_PASS_UNIFORM_SCENE_DEPTH], SCENE_DEPTH_UNIT);
+    m_program.sendUniform(m_uniforms[FOG_PASS_UNIFORM_FOG_FACTORS], FOG_FACTOR_UNIT);
+    m_program.sendUniform4x4(m_uniforms[FOG_PASS_UNIFORM_INVERSE_PROJECTION], glm::value_ptr(glm::inverse(projection)));
+}
+
+void FogPass::bindScene()
+{
+    glDisable(GL_DEPTH_TEST);
+    glBindVertexArray(m_vertexArray);
+
+    glActiveTexture(GL_TEXTURE0 + SCENE_COLOR_UNIT);
+    glBindTexture(GL_TEXTURE_2D, m_colorTexture);
+    glActiveTexture(GL_TEXTURE0 + SCENE_DEPTH_UNIT);
+    glBindTexture(GL_TEXTURE_2D, m_depthTexture);
+}
+
+void FogPass::drawComposite()
+{
+    //The triangle covers every pixel, so the default framebuffer needs no clear
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, m_width, m_height);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glViewport(m_viewport[0], m_viewport[1], m_viewport[2], m_viewport[3]);
+    glActiveTexture(GL_TEXTURE0);
+    glEnable(GL_DEPTH_TEST);
+}
+
+void FogPass::apply(FogMode mode, const glm::mat4& projection)
+{
+    bindScene();
+
+    //No fog has nothing worth working out at a lower resolution
+    bool reduced = m_reduced && mode != NO_FOG;
+    if (reduced)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, m_factorFramebuffer);
+        glViewport(0, 0, (m_width + 1) / 2, (m_height + 1) / 2);
+
+        selectStage(mode, FOG_FACTOR_STAGE, projection);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        glActiveTexture(GL_TEXTURE0 + FOG_FACTOR_UNIT);
+        glBindTexture(GL_TEXTURE_2D, m_factorTexture);
+    }
+
+    selectStage(mode, reduced ? FOG_UPSAMPLE_STAGE : NULL, projection);
+    drawComposite();
+}
+
+//The grid is already coarser than the screen, so it is always applied at full resolution
+void FogPass::applyFroxels(const FroxelFog& froxels, const glm::mat4& projection)
+{
+    bindScene();
+
+    m_program.selectVariant(vector<string>(1, FOG_FROXEL_STAGE));
+    m_program.bindShader();
+    m_program.sendUniform(m_uniforms[FOG_PASS_UNIFORM_SCENE_COLOR], SCENE_COLOR_UNIT);
+    m_program.sendUniform(m_uniforms[FOG_PASS_UNIFORM_SCENE_DEPTH], SCENE_DEPTH_UNIT);
+    m_program.sendUniform(m_uniforms[FOG_PASS_UNIFORM_FROXEL_VOLUME], FROXEL_UNIT);
+    m_program.sendUniform4x4(m_uniforms[FOG_PASS_UNIFORM_INVERSE_PROJECTION], glm::value_ptr(glm::inverse(projection)));
+    m_program.sendUniform(m_uniforms[FOG_PASS_UNIFORM_FROXEL_DEPTH], froxels.getNearDepth(), froxels.getLogDepthRatio(), float(FroxelFog::FROXEL_SLICES));
+
+    glActiveTexture(GL_TEXTURE0 + FROXEL_UNIT);
+    glBindTexture(GL_TEXTURE_3D, froxels.getVolume());
+
+    drawComposite();
+}
@@ -0,0 +1,72 @@
+#ifndef BOGLGP_FOGPASS_H
+#define BOGLGP_FOGPASS_H
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include "glslshader.h"
+#include "fogtable.h"
+#include "froxelfog.h"
+#include "uniformblocks.h"
+
+/*
+    Fog as a post process. The scene is drawn without fog into a color and
+    a depth texture, then a full screen triangle mixes in the fog color by
+    the eye distance it reconstructs from the depth. The fog is worked out
+    once per pixel, however much geometry was drawn over it.
+
+    At reduced resolution the fog factors are worked out for one pixel in
+    four and brought back up by weighting the nearest ones with how close
+    their distances are to the pixel's, so the edges of near objects keep
+    their own fog.
+
+    The targets follow the size of the viewport at begin.
+*/
+class FogPass
+{
+public:
+    FogPass();
+    ~FogPass();
+
+    //Builds the programs of every fog mode and stage, needs a GL context
+    bool initialize();
+
+    void setReducedResolution(bool reduced) { m_reduced = reduced; }
+    bool isReducedResolution() const { return m_reduced; }
+
+    //Sends the scene into the pass until apply, false if the targets can't be made
+    bool begin();
+
+    //Draws the scene with fog into the default framebuffer, with the settings of the bound Fog uniform block
+    void apply(FogMode mode, const glm::mat4& projection);
+
+    //Draws the scene with the volumetric fog of an updated froxel grid into the default framebuffer
+    void applyFroxels(const FroxelFog& froxels, const glm::mat4& projection);
+
+private:
+    void bindScene();
+    void drawComposite();
+    bool createTargets(int width, int height);
+    void releaseTargets();
+    void selectStage(FogMode mode, const char* stage, const glm::mat4& projection);
+
+    GLSLProgram m_program;
+    vector<GLSLProgram::UniformHandle> m_uniforms;     //By FogPassUniform
+    GLuint m_vertexArray;           //Empty, the triangle comes from gl_VertexID
+
+    GLuint m_sceneFramebuffer;
+    GLuint m_colorTexture;
+    GLuint m_depthTexture;
+    GLuint m_factorFramebuffer;     //Reduced resolution fog factors and distances
+    GLuint m_factorTexture;
+
+    int m_viewport[4];              //Of the default framebuffer when the pass began
+    int m_width;
+    int m_height;
+    bool m_reduced;
+};
+
+#endif
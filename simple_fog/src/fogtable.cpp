@@ -0,0 +1,108 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "fogtable.h"
+
+using std::vector;
+
+//Entries of the table, enough that the linear filtering between them is invisible
+const int FOG_TABLE_SIZE = 256;
+
+//The exponential fogs are cut off where this much of the scene is left
+const float FOG_CUTOFF = 1.0f / 1024.0f;
+
+//In the order of FogMode
+const char* FOG_DEFINES[] = { "FOG_LINEAR", "FOG_EXP", "FOG_EXP2", NULL };
+
+const char* getFogDefine(FogMode mode)
+{
+    return FOG_DEFINES[mode];
+}
+
+FogTable::FogTable():
+m_texture(0),
+m_built(false),
+m_mode(NO_FOG),
+m_start(0.0f),
+m_end(0.0f),
+m_density(0.0f),
+m_scale(0.0f),
+m_offset(0.5f / FOG_TABLE_SIZE)
+{
+
+}
+
+FogTable::~FogTable()
+{
+    glDeleteTextures(1, &m_texture);
+}
+
+float FogTable::computeFactor(FogMode mode, float start, float end, float density, float distance)
+{
+    switch (mode)
+    {
+    case LINEAR_FOG:
+        return std::min(std::max((end - distance) / (end - start), 0.0f), 1.0f);
+    case EXP_FOG:
+        return std::exp(-density * distance);
+    case EXP2_FOG:
+        return std::exp2(-density * distance);
+    default:
+        return 1.0f;
+    }
+}
+
+bool FogTable::update(FogMode mode, float start, float end, float density)
+{
+    if (m_built && mode == m_mode && start == m_start && end == m_end && density == m_density)
+    {
+        return false;
+    }
+
+    m_built = true;
+    m_mode = mode;
+    m_start = start;
+    m_end = end;
+    m_density = density;
+
+    //The distance of the last entry, where the factor reaches 0 or the cutoff
+    float range = 1.0f;
+    if (mode == LINEAR_FOG)
+    {
+        range = std::max(end, 0.0f);
+    }
+    else if (mode == EXP_FOG && density > 0.0f)
+    {
+        range = -std::log(FOG_CUTOFF) / density;
+    }
+    else if (mode == EXP2_FOG && density > 0.0f)
+    {
+        range = -std::log2(FOG_CUTOFF) / density;
+    }
+
+    range = std::max(range, 1e-3f);
+
+    vector<unsigned short> factors(FOG_TABLE_SIZE);
+    for (int i = 0; i < FOG_TABLE_SIZE; ++i)
+    {
+        float factor = computeFactor(mode, start, end, density, range * i / (FOG_TABLE_SIZE - 1));
+        factors[i] = (unsigned short)(factor * 65535.0f + 0.5f);
+    }
+
+    m_scale = float(FOG_TABLE_SIZE - 1) / (range * FOG_TABLE_SIZE);
+
+    if (m_texture == 0)
+    {
+        glGenTextures(1, &m_texture);
+    }
+
+    glBindTexture(GL_TEXTURE_1D, m_texture);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexImage1D(GL_TEXTURE_1D, 0, GL_R16, FOG_TABLE_SIZE, 0, GL_RED, GL_UNSIGNED_SHORT, &factors[0]);
+    glBindTexture(GL_TEXTURE_1D, 0);
+
+    return true;
+}
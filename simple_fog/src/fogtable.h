@@ -0,0 +1,58 @@
+#ifndef BOGLGP_FOGTABLE_H
+#define BOGLGP_FOGTABLE_H
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <GL/glew.h>
+
+enum FogMode
+{
+    LINEAR_FOG,
+    EXP_FOG,
+    EXP2_FOG,
+    NO_FOG
+};
+
+//The shader define of a fog mode, NULL for no fog
+const char* getFogDefine(FogMode mode);
+
+/*
+    The fog factor by eye distance in a 1D texture, for fog worked out per
+    fragment with one lookup instead of per vertex and interpolated. The
+    table covers the distances up to where the fog is all but complete,
+    further away the last texel is clamped. It is only rebuilt when a fog
+    setting changes.
+
+    The shaders turn a distance d into the texture coordinate
+    d * scale + offset, which lands on texel centers at both ends.
+*/
+class FogTable
+{
+public:
+    FogTable();
+    ~FogTable();
+
+    //Rebuilds the table if anything changed since the last call, true if it did
+    bool update(FogMode mode, float start, float end, float density);
+
+    GLuint getTexture() const { return m_texture; }
+    float getScale() const { return m_scale; }
+    float getOffset() const { return m_offset; }
+
+    //What the vertex shaders compute per vertex, 1 is no fog
+    static float computeFactor(FogMode mode, float start, float end, float density, float distance);
+
+private:
+    GLuint m_texture;
+    bool m_built;
+    FogMode m_mode;
+    float m_start;
+    float m_end;
+    float m_density;
+    float m_scale;
+    float m_offset;
+};
+
+#endif
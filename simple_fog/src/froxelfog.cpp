@@ -0,0 +1,418 @@
+#include <cmath>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "froxelfog.h"
+
+//How much of a froxel is last frame's, the rest is this frame's sample
+const float HISTORY_WEIGHT = 0.9f;
+
+//Fractional part of the golden ratio, the jitter sequence it steps through covers a slice evenly
+const float JITTER_STEP = 0.618034f;
+
+const float PI = 3.14159265f;
+
+//The uniforms update sends every frame, by their handles
+enum FroxelUniform
+{
+    FROXEL_UNIFORM_FROXEL_DEPTH,
+    FROXEL_UNIFORM_TAN_HALF_FOV,
+    FROXEL_UNIFORM_INVERSE_VIEW,
+    FROXEL_UNIFORM_CAMERA_POSITION,
+    FROXEL_UNIFORM_FROXEL_JITTER,
+    FROXEL_UNIFORM_FOG_DENSITY,
+    FROXEL_UNIFORM_FOG_BASE_HEIGHT,
+    FROXEL_UNIFORM_FOG_HEIGHT_FALLOFF,
+    FROXEL_UNIFORM_SUN_DIRECTION,
+    FROXEL_UNIFORM_SUN_COLOR,
+    FROXEL_UNIFORM_AMBIENT_COLOR,
+    FROXEL_UNIFORM_ANISOTROPY,
+    FROXEL_UNIFORM_HISTORY,
+    FROXEL_UNIFORM_PREVIOUS_VIEW_PROJECTION,
+    FROXEL_UNIFORM_HISTORY_WEIGHT,
+    FROXEL_UNIFORM_FROXEL_SLICE,
+    FROXEL_UNIFORM_SCATTERING,
+    FROXEL_UNIFORM_ACCUMULATED,
+    FROXEL_UNIFORM_COUNT
+};
+
+const char* FROXEL_UNIFORM_NAMES[FROXEL_UNIFORM_COUNT] =
+{
+    "froxel_depth", "tan_half_fov", "inverse_view", "camera_position", "froxel_jitter",
+    "fog_density", "fog_base_height", "fog_height_falloff", "sun_direction", "sun_color",
+    "ambient_color", "anisotropy", "history", "previous_view_projection", "history_weight",
+    "froxel_slice", "scattering", "accumulated"
+};
+
+static GLuint createVolume(GLsizei width, GLsizei height, GLsizei depth)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_3D, texture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, width, height, depth, 0, GL_RGBA, GL_FLOAT, NULL);
+    return texture;
+}
+
+FroxelFog::FroxelFog():
+m_program("data/fog-post.vert", "data/froxel-fog.frag"),
+m_vertexArray(0),
+m_scatterFramebuffer(0),
+m_integrateFramebuffer(0),
+m_integrated(0),
+m_current(0),
+m_historyValid(false),
+m_frame(0),
+m_nearDepth(1.0f),
+m_logDepthRatio(1.0f)
+{
+    m_scattering[0] = m_scattering[1] = 0;
+    m_accumulated[0] = m_accumulated[1] = 0;
+}
+
+FroxelFog::~FroxelFog()
+{
+    glDeleteFramebuffers(1, &m_scatterFramebuffer);
+    glDeleteFramebuffers(1, &m_integrateFramebuffer);
+    glDeleteTextures(2, m_scattering);
+    glDeleteTextures(2, m_accumulated);
+    glDeleteTextures(1, &m_integrated);
+    glDeleteVertexArrays(1, &m_vertexArray);
+    m_program.unload();
+}
+
+bool FroxelFog::initialize()
+{
+    if (!m_program.initialize())
+    {
+        return false;
+    }
+
+    //The integration writes the froxels and the running total at once
+    m_program.bindFragData(0, "outColor");
+    m_program.bindFragData(1, "outAccumulated");
+    m_program.linkProgram();
+
+    if (!m_program.prepareVariant(vector<string>(1, "FROXEL_INTEGRATE")))
+    {
+        return false;
+    }
+
+    //froxel_slice alone is sent twice for every slice, so no names are looked up after this
+    m_uniforms.clear();
+    for (int i = 0; i < FROXEL_UNIFORM_COUNT; ++i)
+    {
+        m_uniforms.push_back(m_program.getUniformHandle(FROXEL_UNIFORM_NAMES[i]));
+    }
+
+    glGenVertexArrays(1, &m_vertexArray);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        m_scattering[i] = createVolume(FROXEL_WIDTH, FROXEL_HEIGHT, FROXEL_SLICES);
+
+        glGenTextures(1, &m_accumulated[i]);
+        glBindTexture(GL_TEXTURE_2D, m_accumulated[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, FROXEL_WIDTH, FROXEL_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+    }
+
+    m_integrated = createVolume(FROXEL_WIDTH, FROXEL_HEIGHT, FROXEL_SLICES);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &m_scatterFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_scatterFramebuffer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_scattering[0], 0, 0);
+    bool complete = (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glGenFramebuffers(1, &m_integrateFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_integrateFramebuffer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_integrated, 0, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_accumulated[1], 0);
+    glDrawBuffers(2, drawBuffers);
+    complete = complete && (glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (!complete)
+    {
+        std::cerr << "Could not create the froxel targets" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+FroxelFog::GridShape FroxelFog::getGridShape(const glm::mat4& projection)
+{
+    float nearDepth = projection[3][2] / (projection[2][2] - 1.0f);
+    float farDepth = projection[3][2] / (projection[2][2] + 1.0f);
+
+    GridShape shape;
+    shape.nearDepth = nearDepth;
+    shape.logDepthRatio = std::log(farDepth / nearDepth);
+    shape.tanHalfFov = glm::vec2(1.0f / projection[0][0], 1.0f / projection[1][1]);
+    return shape;
+}
+
+float FroxelFog::getSliceDepth(const GridShape& shape, float slice)
+{
+    return shape.nearDepth * std::exp(shape.logDepthRatio * slice / FROXEL_SLICES);
+}
+
+//What the scattering shader works out, before the temporal blend
+glm::vec4 FroxelFog::computeFroxel(const glm::vec3& position, const glm::vec3& cameraPosition,
+                                   const FroxelFogSettings& settings)
+{
+    glm::vec3 viewDirection = glm::normalize(position - cameraPosition);
+    float density = settings.density * std::exp(-settings.heightFalloff * std::max(position.y - settings.baseHeight, 0.0f));
+
+    float g = settings.anisotropy;
+    float phase = (1.0f - g * g) /
+                  (4.0f * PI * std::pow(1.0f + g * g - 2.0f * g * glm::dot(viewDirection, settings.sunDirection), 1.5f));
+
+    return glm::vec4((settings.ambientColor + settings.sunColor * phase) * density, density);
+}
+
+/**
+The same front to back sum as the integration shader, with the froxels
+sampled in the middle of their slices.
+*/
+void FroxelFog::integrateColumn(const GridShape& shape, const glm::mat4& inverseView, const FroxelFogSettings& settings,
+                                int x, int y, glm::vec4* integrated)
+{
+    glm::vec2 ndc((x + 0.5f) / FROXEL_WIDTH * 2.0f - 1.0f, (y + 0.5f) / FROXEL_HEIGHT * 2.0f - 1.0f);
+    glm::vec3 cameraPosition(inverseView[3]);
+    float rayScale = glm::length(glm::vec3(ndc * shape.tanHalfFov, 1.0f));
+
+    glm::vec4 total(0.0f, 0.0f, 0.0f, 1.0f);
+    for (int slice = 0; slice < FROXEL_SLICES; ++slice)
+    {
+        float depth = getSliceDepth(shape, slice + 0.5f);
+        glm::vec3 position(inverseView * glm::vec4(ndc * shape.tanHalfFov * depth, -depth, 1.0f));
+        glm::vec4 froxel = computeFroxel(position, cameraPosition, settings);
+
+        float nearDepth = (slice > 0) ? getSliceDepth(shape, float(slice)) : 0.0f;
+        float thickness = (getSliceDepth(shape, slice + 1.0f) - nearDepth) * rayScale;
+
+        float transmittance = std::exp(-froxel.w * thickness);
+        float integral = (froxel.w > 1e-5f) ? (1.0f - transmittance) / froxel.w : thickness;
+
+        total += glm::vec4(glm::vec3(froxel) * (total.w * integral), 0.0f);
+        total.w *= transmittance;
+
+        integrated[(size_t(slice) * FROXEL_HEIGHT + y) * FROXEL_WIDTH + x] = total;
+    }
+}
+
+void FroxelFog::computeReference(const glm::mat4& view, const glm::mat4& projection, const FroxelFogSettings& settings,
+                                 JobSystem& jobs, vector<glm::vec4>& integrated)
+{
+    GridShape shape = getGridShape(projection);
+    glm::mat4 inverseView = glm::inverse(view);
+
+    integrated.resize(size_t(FROXEL_WIDTH) * FROXEL_HEIGHT * FROXEL_SLICES);
+    glm::vec4* output = &integrated[0];
+
+    //Every column is independent, the slices of one depend on each other
+    JobHandle columns = jobs.parallelFor(0, FROXEL_WIDTH * FROXEL_HEIGHT, 0,
+        [&shape, &inverseView, &settings, output](int first, int end)
+        {
+            for (int column = first; column < end; ++column)
+            {
+                integrateColumn(shape, inverseView, settings, column % FROXEL_WIDTH, column / FROXEL_WIDTH, output);
+            }
+        });
+
+    jobs.wait(columns);
+}
+
+/**
+With the same density everywhere the sum is exact: the transmittance to
+the far end of a slice is exp(-density * distance) and the light is the
+light of a froxel times one minus that. Height fog has no closed form, it
+is only checked for light that never fades and transmittance that never
+grows along a column.
+*/
+bool FroxelFog::validate(JobSystem& jobs)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    //The projection and the camera of the example
+    const float projectionValues[16] = { 1.53f, 0, 0, 0, 0, 2.05f, 0, 0, 0, 0, -1.02f, -1, 0, 0, -2.02f, 0 };
+    glm::mat4 projection = glm::make_mat4(projectionValues);
+    glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -20.0f, -50.0f));
+
+    FroxelFogSettings settings;
+    settings.density = 0.05f;
+    settings.baseHeight = 0.0f;
+    settings.heightFalloff = 0.0f;
+    settings.sunDirection = glm::vec3(0.0f, 1.0f, 0.0f);
+    settings.sunColor = glm::vec3(1.0f, 0.5f, 0.25f);
+    settings.ambientColor = glm::vec3(0.2f, 0.3f, 0.4f);
+    settings.anisotropy = 0.0f;
+
+    vector<glm::vec4> integrated;
+    Clock::time_point start = Clock::now();
+    computeReference(view, projection, settings, jobs, integrated);
+    double elapsed = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    GridShape shape = getGridShape(projection);
+    glm::vec3 light = settings.ambientColor + settings.sunColor / (4.0f * PI);
+
+    float largest = 0.0f;
+    for (int slice = 0; slice < FROXEL_SLICES; ++slice)
+    {
+        for (int y = 0; y < FROXEL_HEIGHT; ++y)
+        {
+            for (int x = 0; x < FROXEL_WIDTH; ++x)
+            {
+                glm::vec2 ndc((x + 0.5f) / FROXEL_WIDTH * 2.0f - 1.0f, (y + 0.5f) / FROXEL_HEIGHT * 2.0f - 1.0f);
+                float distance = getSliceDepth(shape, slice + 1.0f) * glm::length(glm::vec3(ndc * shape.tanHalfFov, 1.0f));
+                float transmittance = std::exp(-settings.density * distance);
+
+                glm::vec4 expected(light * (1.0f - transmittance), transmittance);
+                glm::vec4 error = glm::abs(integrated[(size_t(slice) * FROXEL_HEIGHT + y) * FROXEL_WIDTH + x] - expected);
+                largest = std::max(largest, std::max(std::max(error.x, error.y), std::max(error.z, error.w)));
+            }
+        }
+    }
+
+    settings.baseHeight = 4.0f;
+    settings.heightFalloff = 0.3f;
+    settings.anisotropy = 0.5f;
+    computeReference(view, projection, settings, jobs, integrated);
+
+    int broken = 0;
+    for (int column = 0; column < FROXEL_WIDTH * FROXEL_HEIGHT; ++column)
+    {
+        glm::vec4 last(0.0f, 0.0f, 0.0f, 1.0f);
+        for (int slice = 0; slice < FROXEL_SLICES; ++slice)
+        {
+            glm::vec4 froxel = integrated[size_t(slice) * FROXEL_WIDTH * FROXEL_HEIGHT + column];
+            if (froxel.w > last.w || froxel.w < 0.0f || froxel.x < last.x || froxel.y < last.y || froxel.z < last.z)
+            {
+                ++broken;
+                break;
+            }
+
+            last = froxel;
+        }
+    }
+
+    const float TOLERANCE = 1e-4f;
+    std::cout << "Froxel reference: " << FROXEL_WIDTH << "x" << FROXEL_HEIGHT << "x" << FROXEL_SLICES << " in "
+              << elapsed << " ms with " << jobs.getThreadCount() << " threads" << std::endl;
+    std::cout << "  Uniform fog, largest error " << largest << " (tolerance " << TOLERANCE << ")" << std::endl;
+    std::cout << "  Height fog, " << broken << " columns out of order" << std::endl;
+
+    return largest <= TOLERANCE && broken == 0;
+}
+
+void FroxelFog::sendGridUniforms(const GridShape& shape)
+{
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_FROXEL_DEPTH], shape.nearDepth, shape.logDepthRatio, float(FROXEL_SLICES));
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_TAN_HALF_FOV], shape.tanHalfFov.x, shape.tanHalfFov.y);
+}
+
+/**
+Both passes draw one slice at a time into a layer of a 3D texture. The
+scattering blends with the other scattering texture, last frame's, and
+the integration carries its running total from slice to slice in a pair
+of 2D textures, since a slice can't read the texture it is drawn into.
+*/
+void FroxelFog::update(const glm::mat4& view, const glm::mat4& projection, const FroxelFogSettings& settings)
+{
+    GridShape shape = getGridShape(projection);
+    m_nearDepth = shape.nearDepth;
+    m_logDepthRatio = shape.logDepthRatio;
+
+    glm::mat4 inverseView = glm::inverse(view);
+    glm::vec3 cameraPosition(inverseView[3]);
+
+    GLint viewport[4];
+    GLint framebuffer = 0;
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+
+    glDisable(GL_DEPTH_TEST);
+    glBindVertexArray(m_vertexArray);
+    glViewport(0, 0, FROXEL_WIDTH, FROXEL_HEIGHT);
+
+    int previous = m_current;
+    m_current = 1 - m_current;
+
+    m_program.selectVariant(vector<string>());
+    m_program.bindShader();
+    sendGridUniforms(shape);
+    m_program.sendUniform4x4(m_uniforms[FROXEL_UNIFORM_INVERSE_VIEW], glm::value_ptr(inverseView));
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_CAMERA_POSITION], cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_FROXEL_JITTER], std::fmod(0.5f + m_frame * JITTER_STEP, 1.0f));
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_FOG_DENSITY], settings.density);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_FOG_BASE_HEIGHT], settings.baseHeight);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_FOG_HEIGHT_FALLOFF], settings.heightFalloff);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_SUN_DIRECTION], settings.sunDirection.x, settings.sunDirection.y, settings.sunDirection.z);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_SUN_COLOR], settings.sunColor.x, settings.sunColor.y, settings.sunColor.z);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_AMBIENT_COLOR], settings.ambientColor.x, settings.ambientColor.y, settings.ambientColor.z);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_ANISOTROPY], settings.anisotropy);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_HISTORY], 0);
+    m_program.sendUniform4x4(m_uniforms[FROXEL_UNIFORM_PREVIOUS_VIEW_PROJECTION], glm::value_ptr(m_previousViewProjection));
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_HISTORY_WEIGHT], m_historyValid ? HISTORY_WEIGHT : 0.0f);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, m_scattering[previous]);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_scatterFramebuffer);
+
+    for (int slice = 0; slice < FROXEL_SLICES; ++slice)
+    {
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_scattering[m_current], 0, slice);
+        m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_FROXEL_SLICE], slice);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
+
+    m_program.selectVariant(vector<string>(1, "FROXEL_INTEGRATE"));
+    m_program.bindShader();
+    sendGridUniforms(shape);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_SCATTERING], 0);
+    m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_ACCUMULATED], 1);
+
+    glBindTexture(GL_TEXTURE_3D, m_scattering[m_current]);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_integrateFramebuffer);
+
+    for (int slice = 0; slice < FROXEL_SLICES; ++slice)
+    {
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_integrated, 0, slice);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_accumulated[(slice + 1) & 1], 0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, m_accumulated[slice & 1]);
+
+        m_program.sendUniform(m_uniforms[FROXEL_UNIFORM_FROXEL_SLICE], slice);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    m_previousViewProjection = projection * view;
+    m_historyValid = true;
+    ++m_frame;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    if (depthTest)
+    {
+        glEnable(GL_DEPTH_TEST);
+    }
+}
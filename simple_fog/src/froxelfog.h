@@ -0,0 +1,115 @@
+#ifndef BOGLGP_FROXELFOG_H
+#define BOGLGP_FROXELFOG_H
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <vector>
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include "glslshader.h"
+#include "jobsystem.h"
+
+using std::vector;
+
+//Height fog lit by an ambient term and the sun
+struct FroxelFogSettings
+{
+    float density;              //Extinction per world unit up to baseHeight
+    float baseHeight;
+    float heightFalloff;        //Per world unit above baseHeight
+    glm::vec3 sunDirection;     //Unit vector towards the sun, world space
+    glm::vec3 sunColor;
+    glm::vec3 ambientColor;
+    float anisotropy;           //Henyey-Greenstein g, 0 scatters evenly
+};
+
+/*
+    Volumetric fog in a grid of froxels, frustum aligned voxels: the grid
+    splits the screen in FROXEL_WIDTH x FROXEL_HEIGHT columns and the view
+    depth from the near plane to the far plane in FROXEL_SLICES slices
+    that grow exponentially, slice 0 reaching back to the camera.
+
+    Every frame the density and the in-scattered light of each froxel are
+    worked out at one depth of its slice and integrated front to back,
+    so the fog over a pixel is a single lookup of the integrated light and
+    transmittance at its depth. The depth is jittered from frame to frame
+    and blended with the last frame's froxels reprojected, which spreads
+    the sampling of every froxel over several frames.
+
+    GL 3.2 has no compute shaders, so update fills the 3D textures a slice
+    at a time with fragment shaders. computeReference does the same on the
+    CPU without the temporal blend, for validation without a GL context.
+    The projection has to be a symmetric perspective one.
+*/
+class FroxelFog
+{
+public:
+    static const int FROXEL_WIDTH = 160;
+    static const int FROXEL_HEIGHT = 90;
+    static const int FROXEL_SLICES = 64;
+
+    FroxelFog();
+    ~FroxelFog();
+
+    //Builds the programs and the textures, needs a GL context
+    bool initialize();
+
+    //Fills the grid for a frame, the viewport and framebuffer bindings are left as they were
+    void update(const glm::mat4& view, const glm::mat4& projection, const FroxelFogSettings& settings);
+
+    //Forgets the last frame, for when the view jumps
+    void resetHistory() { m_historyValid = false; }
+
+    //RGB in-scattered light and A transmittance from the camera to the far end of each froxel
+    GLuint getVolume() const { return m_integrated; }
+    float getNearDepth() const { return m_nearDepth; }
+    float getLogDepthRatio() const { return m_logDepthRatio; }
+
+    /*
+        The integrated grid worked out by jobs, x fastest and then y and
+        the slices. Froxels are sampled in the middle of their slices.
+    */
+    static void computeReference(const glm::mat4& view, const glm::mat4& projection, const FroxelFogSettings& settings,
+                                 JobSystem& jobs, vector<glm::vec4>& integrated);
+
+    //Checks computeReference against closed forms of uniform fog and prints the errors, needs no GL context
+    static bool validate(JobSystem& jobs);
+
+private:
+    //Everything about the grid the projection decides
+    struct GridShape
+    {
+        float nearDepth;
+        float logDepthRatio;    //Log of far over near
+        glm::vec2 tanHalfFov;
+    };
+
+    static GridShape getGridShape(const glm::mat4& projection);
+    static float getSliceDepth(const GridShape& shape, float slice);
+    static glm::vec4 computeFroxel(const glm::vec3& position, const glm::vec3& cameraPosition,
+                                   const FroxelFogSettings& settings);
+    static void integrateColumn(const GridShape& shape, const glm::mat4& inverseView, const FroxelFogSettings& settings,
+                                int x, int y, glm::vec4* integrated);
+
+    void sendGridUniforms(const GridShape& shape);
+
+    GLSLProgram m_program;
+    vector<GLSLProgram::UniformHandle> m_uniforms;     //By FroxelUniform
+    GLuint m_vertexArray;           //Empty, the triangle comes from gl_VertexID
+    GLuint m_scatterFramebuffer;
+    GLuint m_integrateFramebuffer;
+    GLuint m_scattering[2];         //This frame's and last frame's scattering, swapped every frame
+    GLuint m_accumulated[2];        //Light and transmittance up to a slice, swapped every slice
+    GLuint m_integrated;
+
+    int m_current;                  //Scattering texture of this frame
+    bool m_historyValid;
+    unsigned int m_frame;
+    glm::mat4 m_previousViewProjection;
+    float m_nearDepth;
+    float m_logDepthRatio;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include "frustum.h"
+
+Frustum::Frustum()
+{
+    //Until extract is called nothing is culled
+    for (int i = 0; i < 6; ++i)
+    {
+        m_planes[i] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    }
+}
+
+/**
+Gribb/Hartmann plane extraction. Each plane is a sum or difference of the
+fourth row of the clip matrix and one of the other rows. glm matrices are
+column major so m[column][row].
+*/
+void Frustum::extract(const glm::mat4& projection, const glm::mat4& modelview)
+{
+    glm::mat4 clip = projection * modelview;
+    glm::vec4 rows[4];
+
+    for (int i = 0; i < 4; ++i)
+    {
+        rows[i] = glm::vec4(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+    }
+
+    m_planes[0] = rows[3] + rows[0]; //Left
+    m_planes[1] = rows[3] - rows[0]; //Right
+    m_planes[2] = rows[3] + rows[1]; //Bottom
+    m_planes[3] = rows[3] - rows[1]; //Top
+    m_planes[4] = rows[3] + rows[2]; //Near
+    m_planes[5] = rows[3] - rows[2]; //Far
+
+    for (int i = 0; i < 6; ++i)
+    {
+        m_planes[i] /= glm::length(glm::vec3(m_planes[i]));
+    }
+}
+
+Frustum::Result Frustum::testBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+{
+    Result result = INSIDE;
+
+    for (int i = 0; i < 6; ++i)
+    {
+        const glm::vec4& plane = m_planes[i];
+
+        //The corners furthest along and against the plane normal
+        glm::vec3 positive(plane.x >= 0.0f ? boxMax.x : boxMin.x,
+                           plane.y >= 0.0f ? boxMax.y : boxMin.y,
+                           plane.z >= 0.0f ? boxMax.z : boxMin.z);
+        glm::vec3 negative(plane.x >= 0.0f ? boxMin.x : boxMax.x,
+                           plane.y >= 0.0f ? boxMin.y : boxMax.y,
+                           plane.z >= 0.0f ? boxMin.z : boxMax.z);
+
+        if (glm::dot(glm::vec3(plane), positive) + plane.w < 0.0f)
+        {
+            return OUTSIDE;
+        }
+
+        if (glm::dot(glm::vec3(plane), negative) + plane.w < 0.0f)
+        {
+            result = INTERSECTS;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,30 @@
+#ifndef BOGLGP_FRUSTUM_H
+#define BOGLGP_FRUSTUM_H
+
+#include <glm/glm.hpp>
+
+/*
+    The six clipping planes of a view volume, pulled straight out of the
+    combined projection * modelview matrix. The planes point inwards, so a
+    point is inside when it is in front of all of them.
+*/
+class Frustum
+{
+public:
+    enum Result
+    {
+        OUTSIDE,
+        INTERSECTS,
+        INSIDE
+    };
+
+    Frustum();
+
+    void extract(const glm::mat4& projection, const glm::mat4& modelview);
+    Result testBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const;
+
+private:
+    glm::vec4 m_planes[6];
+};
+
+#endif
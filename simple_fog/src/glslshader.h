@@ -6,7 +6,9 @@
 #endif
 
 #include <map>
+#include <chrono>
 #include <fstream>
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -18,6 +20,24 @@ using std::ifstream;
 using std::map;
 using std::vector;
 
+/*
+    A vertex and fragment shader pair built into one program per set of
+    #defines. The defines go in right after the #version line, so a shader
+    can leave out whole paths with #ifdef instead of branching on uniforms.
+
+    Every variant is compiled and linked the first time selectVariant asks
+    for it, or ahead of time by prepareVariant, and kept by its defines in
+    the order they were given. Attribute and fragment data bindings apply
+    to every variant. The uniforms and bindShader work on the selected
+    one, and uniform values belong to a program, so they have to be sent
+    again after switching.
+
+    Every variant lists its active uniforms when it is linked. A handle
+    from getUniformHandle stands for a name in all of them, and sending by
+    handle is an index into the locations of the selected variant, with
+    no string built or searched for. Names are fine for the uniforms that
+    are only sent once in a while.
+*/
 class GLSLProgram
 {
 public:
@@ -28,7 +48,14 @@ public:
         string source;
     };
 
-    GLSLProgram(const string& vertexShader, const string& fragmentShader)
+    //A uniform name of every variant, from getUniformHandle
+    struct UniformHandle
+    {
+        int index;
+    };
+
+    GLSLProgram(const string& vertexShader, const string& fragmentShader):
+    m_current(NULL)
     {
         m_vertexShader.filename = vertexShader;
         m_fragmentShader.filename = fragmentShader;
@@ -41,19 +68,23 @@ public:
 
     void unload()
     {
-        glDetachShader(m_programID, m_vertexShader.id);
-        glDetachShader(m_programID, m_fragmentShader.id);
-        glDeleteShader(m_vertexShader.id);
-        glDeleteShader(m_fragmentShader.id);
-        glDeleteShader(m_programID);
+        for (map<string, Variant>::iterator i = m_variants.begin(); i != m_variants.end(); ++i)
+        {
+            Variant& variant = i->second;
+            glDetachShader(variant.programID, variant.vertexID);
+            glDetachShader(variant.programID, variant.fragmentID);
+            glDeleteShader(variant.vertexID);
+            glDeleteShader(variant.fragmentID);
+            glDeleteProgram(variant.programID);
+        }
+
+        m_variants.clear();
+        m_current = NULL;
     }
 
+    //Reads the shaders and builds the variant without defines
     bool initialize()
     {
-        m_programID = glCreateProgram();
-        m_vertexShader.id = glCreateShader(GL_VERTEX_SHADER);
-        m_fragmentShader.id = glCreateShader(GL_FRAGMENT_SHADER);
-
         m_vertexShader.source = readFile(m_vertexShader.filename);
         m_fragmentShader.source = readFile(m_fragmentShader.filename);
 
@@ -62,37 +93,79 @@ public:
             return false;
         }
 
-        const GLchar* tmp = static_cast<const GLchar*>(m_vertexShader.source.c_str());
-        glShaderSource(m_vertexShader.id, 1, (const GLchar**)&tmp, NULL);
+        return selectVariant(vector<string>());
+    }
 
-        tmp = static_cast<const GLchar*>(m_fragmentShader.source.c_str());
-        glShaderSource(m_fragmentShader.id, 1, (const GLchar**)&tmp, NULL);
+    //Builds the variant if it isn't there yet without selecting it
+    bool prepareVariant(const vector<string>& defines)
+    {
+        return getVariant(defines) != NULL;
+    }
 
-        if (!compileShader(m_vertexShader) || !compileShader(m_fragmentShader))
+    bool selectVariant(const vector<string>& defines)
+    {
+        Variant* variant = getVariant(defines);
+        if (variant == NULL)
         {
-			std::cerr << "Could not compile the shaders, they are invalid" << std::endl;
             return false;
         }
 
-        glAttachShader(m_programID, m_vertexShader.id);
-        glAttachShader(m_programID, m_fragmentShader.id);
-
-        glLinkProgram(m_programID);
+        m_current = variant;
         return true;
     }
 
+    unsigned int getVariantCount() const { return m_variants.size(); }
+
+    //Relinks every variant, for the attribute bindings to take effect
 	void linkProgram()
 	{
-		glLinkProgram(m_programID);
+        for (map<string, Variant>::iterator i = m_variants.begin(); i != m_variants.end(); ++i)
+        {
+            glLinkProgram(i->second.programID);
+            i->second.uniformMap.clear();
+            i->second.attribMap.clear();
+            reflectUniforms(i->second);
+            bindUniformBlocks(i->second);
+        }
 	}
 
+    //The same handle for the same name, whichever variant is selected and whenever it is built
+    UniformHandle getUniformHandle(const string& name)
+    {
+        UniformHandle handle;
+        map<string, int>::iterator found = m_uniformHandles.find(name);
+        if (found != m_uniformHandles.end())
+        {
+            handle.index = found->second;
+            return handle;
+        }
+
+        handle.index = int(m_uniformNames.size());
+        m_uniformNames.push_back(name);
+        m_uniformHandles.insert(std::make_pair(name, handle.index));
+
+        for (map<string, Variant>::iterator i = m_variants.begin(); i != m_variants.end(); ++i)
+        {
+            i->second.locations.push_back(findUniform(i->second, name));
+        }
+
+        return handle;
+    }
+
+    //-1 if the selected variant doesn't use the uniform, which the glUniform calls ignore
+    GLint getUniformLocation(UniformHandle handle) const
+    {
+        return m_current->locations[handle.index];
+    }
+
     GLuint getUniformLocation(const string& name)
     {
-        map<string, GLuint>::iterator i = m_uniformMap.find(name);
-        if (i == m_uniformMap.end())
+        map<string, GLuint>& uniformMap = m_current->uniformMap;
+        map<string, GLuint>::iterator i = uniformMap.find(name);
+        if (i == uniformMap.end())
         {
-            GLuint location = glGetUniformLocation(m_programID, name.c_str());
-            m_uniformMap.insert(std::make_pair(name, location));
+            GLuint location = glGetUniformLocation(m_current->programID, name.c_str());
+            uniformMap.insert(std::make_pair(name, location));
             return location;
         }
 
@@ -101,11 +174,12 @@ public:
 
     GLuint getAttribLocation(const string& name)
     {
-        map<string, GLuint>::iterator i = m_attribMap.find(name);
-        if (i == m_attribMap.end())
+        map<string, GLuint>& attribMap = m_current->attribMap;
+        map<string, GLuint>::iterator i = attribMap.find(name);
+        if (i == attribMap.end())
         {
-            GLuint location = glGetAttribLocation(m_programID, name.c_str());
-            m_attribMap.insert(std::make_pair(name, location));
+            GLuint location = glGetAttribLocation(m_current->programID, name.c_str());
+            attribMap.insert(std::make_pair(name, location));
             return location;
         }
 
@@ -144,23 +218,303 @@ public:
         glUniform3f(location, x, y, z);
     }
 
+    void sendUniform(const string& name, const float x, const float y)
+    {
+        GLuint location = getUniformLocation(name);
+        glUniform2f(location, x, y);
+    }
+
     void sendUniform(const string& name, const float scalar)
     {
         GLuint location = getUniformLocation(name);
         glUniform1f(location, scalar);
     }
 
+    void sendUniform(UniformHandle handle, const int id)
+    {
+        glUniform1i(getUniformLocation(handle), id);
+    }
+
+    void sendUniform4x4(UniformHandle handle, const float* matrix, bool transpose=false)
+    {
+        glUniformMatrix4fv(getUniformLocation(handle), 1, transpose, matrix);
+    }
+
+    void sendUniform3x3(UniformHandle handle, const float* matrix, bool transpose=false)
+    {
+        glUniformMatrix3fv(getUniformLocation(handle), 1, transpose, matrix);
+    }
+
+    void sendUniform(UniformHandle handle, const float red, const float green,
+                     const float blue, const float alpha)
+    {
+        glUniform4f(getUniformLocation(handle), red, green, blue, alpha);
+    }
+
+    void sendUniform(UniformHandle handle, const float x, const float y,
+                     const float z)
+    {
+        glUniform3f(getUniformLocation(handle), x, y, z);
+    }
+
+    void sendUniform(UniformHandle handle, const float x, const float y)
+    {
+        glUniform2f(getUniformLocation(handle), x, y);
+    }
+
+    void sendUniform(UniformHandle handle, const float scalar)
+    {
+        glUniform1f(getUniformLocation(handle), scalar);
+    }
+
+    /*
+        Times finding the location of every active uniform outside a block
+        of the selected variant by name, the way the string overloads do,
+        against finding it by handle, and prints both. Only the lookups are
+        timed, the glUniform calls cost the same either way.
+    */
+    void benchmarkLookups(int iterations)
+    {
+        typedef std::chrono::high_resolution_clock Clock;
+
+        vector<const char*> names;
+        vector<UniformHandle> handles;
+        //Uniform block members have no location and are never sent with glUniform
+        for (unsigned int i = 0; i < m_current->uniforms.size(); ++i)
+        {
+            if (m_current->uniforms[i].location >= 0)
+            {
+                names.push_back(m_current->uniforms[i].name.c_str());
+                handles.push_back(getUniformHandle(m_current->uniforms[i].name));
+            }
+        }
+
+        //Sums the locations so the loops can't be left out
+        GLuint byName = 0, byHandle = 0;
+        Clock::time_point start = Clock::now();
+        for (int run = 0; run < iterations; ++run)
+        {
+            for (unsigned int i = 0; i < names.size(); ++i)
+            {
+                byName += getUniformLocation(names[i]);
+            }
+        }
+
+        Clock::time_point namesEnd = Clock::now();
+        for (int run = 0; run < iterations; ++run)
+        {
+            for (unsigned int i = 0; i < handles.size(); ++i)
+            {
+                byHandle += getUniformLocation(handles[i]);
+            }
+        }
+
+        Clock::time_point handlesEnd = Clock::now();
+        double lookups = double(iterations) * std::max(names.size(), size_t(1));
+        std::cout << m_vertexShader.filename << ": " << names.size() << " uniforms, "
+                  << std::chrono::duration<double, std::nano>(namesEnd - start).count() / lookups << " ns by name, "
+                  << std::chrono::duration<double, std::nano>(handlesEnd - namesEnd).count() / lookups << " ns by handle"
+                  << ((byName == byHandle) ? "" : " (the locations differ!)") << std::endl;
+    }
+
+    //Takes effect on the next link, variants built later get it straight away
     void bindAttrib(unsigned int index, const string& attribName)
     {
-        glBindAttribLocation(m_programID, index, attribName.c_str());
+        m_attribBindings.push_back(std::make_pair(index, attribName));
+
+        for (map<string, Variant>::iterator i = m_variants.begin(); i != m_variants.end(); ++i)
+        {
+            glBindAttribLocation(i->second.programID, index, attribName.c_str());
+        }
+    }
+
+    //Which draw buffer an out variable of the fragment shader goes to, like bindAttrib
+    void bindFragData(unsigned int colorNumber, const string& name)
+    {
+        m_fragDataBindings.push_back(std::make_pair(colorNumber, name));
+
+        for (map<string, Variant>::iterator i = m_variants.begin(); i != m_variants.end(); ++i)
+        {
+            glBindFragDataLocation(i->second.programID, colorNumber, name.c_str());
+        }
+    }
+
+    //Which binding point a uniform block reads its buffer from, like bindFragData but also kept over relinks
+    void bindUniformBlock(unsigned int binding, const string& blockName)
+    {
+        m_blockBindings.push_back(std::make_pair(binding, blockName));
+
+        for (map<string, Variant>::iterator i = m_variants.begin(); i != m_variants.end(); ++i)
+        {
+            bindUniformBlocks(i->second);
+        }
     }
 
     void bindShader()
     {
-        glUseProgram(m_programID);
+        glUseProgram(m_current->programID);
     }
 
 private:
+    //An active uniform as the linker lists it, arrays by their name without [0]
+    struct ReflectedUniform
+    {
+        string name;
+        GLint location;
+        GLenum type;
+        GLint size;
+
+        bool operator<(const ReflectedUniform& other) const { return name < other.name; }
+    };
+
+    struct Variant
+    {
+        GLuint programID;
+        GLuint vertexID;
+        GLuint fragmentID;
+        map<string, GLuint> uniformMap;
+        map<string, GLuint> attribMap;
+        vector<ReflectedUniform> uniforms;  //Sorted by name
+        vector<GLint> locations;            //By handle
+    };
+
+    void reflectUniforms(Variant& variant)
+    {
+        variant.uniforms.clear();
+
+        GLint count = 0;
+        GLint maxLength = 0;
+        glGetProgramiv(variant.programID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(variant.programID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        vector<GLchar> name(std::max(maxLength, 1));
+
+        for (GLint i = 0; i < count; ++i)
+        {
+            ReflectedUniform uniform;
+            GLsizei length = 0;
+            glGetActiveUniform(variant.programID, i, GLsizei(name.size()), &length, &uniform.size, &uniform.type, &name[0]);
+
+            uniform.name.assign(&name[0], length);
+            if (uniform.name.size() > 3 && uniform.name.compare(uniform.name.size() - 3, 3, "[0]") == 0)
+            {
+                uniform.name.erase(uniform.name.size() - 3);
+            }
+
+            //Members of uniform blocks are listed too, without a location
+            uniform.location = glGetUniformLocation(variant.programID, uniform.name.c_str());
+            variant.uniforms.push_back(uniform);
+        }
+
+        std::sort(variant.uniforms.begin(), variant.uniforms.end());
+
+        variant.locations.resize(m_uniformNames.size());
+        for (unsigned int i = 0; i < m_uniformNames.size(); ++i)
+        {
+            variant.locations[i] = findUniform(variant, m_uniformNames[i]);
+        }
+    }
+
+    //Variants that don't use a block simply don't have it
+    void bindUniformBlocks(const Variant& variant)
+    {
+        for (unsigned int i = 0; i < m_blockBindings.size(); ++i)
+        {
+            GLuint index = glGetUniformBlockIndex(variant.programID, m_blockBindings[i].second.c_str());
+            if (index != GL_INVALID_INDEX)
+            {
+                glUniformBlockBinding(variant.programID, index, m_blockBindings[i].first);
+            }
+        }
+    }
+
+    GLint findUniform(const Variant& variant, const string& name) const
+    {
+        ReflectedUniform key;
+        key.name = name;
+        vector<ReflectedUniform>::const_iterator found = std::lower_bound(variant.uniforms.begin(), variant.uniforms.end(), key);
+        return (found != variant.uniforms.end() && found->name == name) ? found->location : -1;
+    }
+
+    Variant* getVariant(const vector<string>& defines)
+    {
+        string key;
+        for (unsigned int i = 0; i < defines.size(); ++i)
+        {
+            key += (i > 0) ? " " + defines[i] : defines[i];
+        }
+
+        map<string, Variant>::iterator found = m_variants.find(key);
+        if (found != m_variants.end())
+        {
+            return &found->second;
+        }
+
+        Variant variant;
+        variant.programID = glCreateProgram();
+        variant.vertexID = glCreateShader(GL_VERTEX_SHADER);
+        variant.fragmentID = glCreateShader(GL_FRAGMENT_SHADER);
+
+        string vertexSource = addDefines(m_vertexShader.source, defines);
+        string fragmentSource = addDefines(m_fragmentShader.source, defines);
+
+        const GLchar* tmp = static_cast<const GLchar*>(vertexSource.c_str());
+        glShaderSource(variant.vertexID, 1, (const GLchar**)&tmp, NULL);
+
+        tmp = static_cast<const GLchar*>(fragmentSource.c_str());
+        glShaderSource(variant.fragmentID, 1, (const GLchar**)&tmp, NULL);
+
+        if (!compileShader(variant.vertexID) || !compileShader(variant.fragmentID))
+        {
+			std::cerr << "Could not compile the shaders, they are invalid (defines: " << key << ")" << std::endl;
+            glDeleteShader(variant.vertexID);
+            glDeleteShader(variant.fragmentID);
+            glDeleteProgram(variant.programID);
+            return NULL;
+        }
+
+        glAttachShader(variant.programID, variant.vertexID);
+        glAttachShader(variant.programID, variant.fragmentID);
+
+        for (unsigned int i = 0; i < m_attribBindings.size(); ++i)
+        {
+            glBindAttribLocation(variant.programID, m_attribBindings[i].first, m_attribBindings[i].second.c_str());
+        }
+
+        for (unsigned int i = 0; i < m_fragDataBindings.size(); ++i)
+        {
+            glBindFragDataLocation(variant.programID, m_fragDataBindings[i].first, m_fragDataBindings[i].second.c_str());
+        }
+
+        glLinkProgram(variant.programID);
+        reflectUniforms(variant);
+        bindUniformBlocks(variant);
+        return &m_variants.insert(std::make_pair(key, variant)).first->second;
+    }
+
+    //The #version line has to stay first
+    string addDefines(const string& source, const vector<string>& defines) const
+    {
+        string header;
+        for (unsigned int i = 0; i < defines.size(); ++i)
+        {
+            header += "#define " + defines[i] + "\n";
+        }
+
+        size_t version = source.find("#version");
+        if (version == string::npos)
+        {
+            return header + source;
+        }
+
+        size_t lineEnd = source.find('\n', version);
+        if (lineEnd == string::npos)
+        {
+            return source + "\n" + header;
+        }
+
+        return source.substr(0, lineEnd + 1) + header + source.substr(lineEnd + 1);
+    }
+
     string readFile(const string& filename)
     {
         ifstream fileIn(filename.c_str());
@@ -175,16 +529,16 @@ private:
         return stringBuffer;
     }
 
-    bool compileShader(const GLSLShader& shader)
+    bool compileShader(unsigned int shaderID)
     {
-        glCompileShader(shader.id);
+        glCompileShader(shaderID);
         GLint result = 0xDEADBEEF;
-        glGetShaderiv(shader.id, GL_COMPILE_STATUS, &result);
+        glGetShaderiv(shaderID, GL_COMPILE_STATUS, &result);
 
         if (!result)
         {
-            std::cout << "Could not compile shader: " << shader.id << std::endl;
-            outputShaderLog(shader.id);
+            std::cout << "Could not compile shader: " << shaderID << std::endl;
+            outputShaderLog(shaderID);
             return false;
         }
 
@@ -208,12 +562,16 @@ private:
 
     }
 
-    GLSLShader m_vertexShader;
+    GLSLShader m_vertexShader;     //Only the filenames and sources, every variant has its own shaders
     GLSLShader m_fragmentShader;
-    unsigned int m_programID;
 
-    map<string, GLuint> m_uniformMap;
-    map<string, GLuint> m_attribMap;
+    map<string, Variant> m_variants;    //Keyed by their defines joined with spaces
+    Variant* m_current;
+    vector<std::pair<unsigned int, string> > m_attribBindings;
+    vector<std::pair<unsigned int, string> > m_fragDataBindings;
+    vector<std::pair<unsigned int, string> > m_blockBindings;
+    map<string, int> m_uniformHandles;  //Only searched when a handle is asked for
+    vector<string> m_uniformNames;      //By handle
 };
 
 #endif // GLSL_SHADER_H_INCLUDED
@@ -0,0 +1,525 @@
+#include <cmath>
+#include <algorithm>
+
+#include "heightfield.h"
+#include "normalgenerator.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HEIGHTFIELD_USE_SSE
+#include <emmintrin.h>
+#endif
+
+//Normals are computed this many at a time from stack buffers
+const int NORMAL_BATCH = 64;
+
+//Deep enough for 3 pending siblings on each of 32 levels plus the node being visited
+const int MAX_RAY_STACK = 100;
+
+//Stands in for the reciprocal of a zero direction component
+const float HUGE_RECIPROCAL = 1e30f;
+
+//The boxes of the pyramid reach down this far, everything under the surface counts as solid
+const float SOLID_DEPTH = -1e30f;
+
+//Boxes overlap their neighbours by this much so that rays along their edges can't slip between them
+const float BOX_MARGIN = 1e-4f;
+
+//A node of the pyramid waiting to be visited by a ray, with the span of the ray inside its box
+struct RayNode
+{
+    int level;
+    int x, z;
+    float entry, exit;
+};
+
+/**
+Slab test of a ray against four boxes at once, each reaching from maxY
+down to SOLID_DEPTH. Returns a bit per box in valid that the ray crosses
+between 0 and maxDistance, entry and exit receive the span of each.
+*/
+static int intersectBoxes(const float* minX, const float* maxX, const float* maxY, const float* minZ, const float* maxZ,
+                          int valid, const glm::vec3& origin, const glm::vec3& inverse, float maxDistance,
+                          float* entry, float* exit)
+{
+#ifdef HEIGHTFIELD_USE_SSE
+    const __m128 originX = _mm_set1_ps(origin.x), originY = _mm_set1_ps(origin.y), originZ = _mm_set1_ps(origin.z);
+    const __m128 inverseX = _mm_set1_ps(inverse.x), inverseY = _mm_set1_ps(inverse.y), inverseZ = _mm_set1_ps(inverse.z);
+
+    __m128 x0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(minX), originX), inverseX);
+    __m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(maxX), originX), inverseX);
+    __m128 y0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(SOLID_DEPTH), originY), inverseY);
+    __m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(maxY), originY), inverseY);
+    __m128 z0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(minZ), originZ), inverseZ);
+    __m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(maxZ), originZ), inverseZ);
+
+    __m128 near4 = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+    __m128 far4 = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_min_ps(_mm_max_ps(z0, z1), _mm_set1_ps(maxDistance)));
+
+    _mm_storeu_ps(entry, near4);
+    _mm_storeu_ps(exit, far4);
+    return _mm_movemask_ps(_mm_cmple_ps(near4, far4)) & valid;
+#else
+    int hits = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        float x0 = (minX[i] - origin.x) * inverse.x, x1 = (maxX[i] - origin.x) * inverse.x;
+        float y0 = (SOLID_DEPTH - origin.y) * inverse.y, y1 = (maxY[i] - origin.y) * inverse.y;
+        float z0 = (minZ[i] - origin.z) * inverse.z, z1 = (maxZ[i] - origin.z) * inverse.z;
+
+        entry[i] = std::max(std::max(std::min(x0, x1), std::min(y0, y1)), std::max(std::min(z0, z1), 0.0f));
+        exit[i] = std::min(std::min(std::max(x0, x1), std::max(y0, y1)), std::min(std::max(z0, z1), maxDistance));
+
+        if ((valid & (1 << i)) && entry[i] <= exit[i])
+        {
+            hits |= 1 << i;
+        }
+    }
+    return hits;
+#endif
+}
+
+HeightField::HeightField():
+m_width(0),
+m_depth(0),
+m_originX(0.0f),
+m_originZ(0.0f)
+{
+
+}
+
+void HeightField::build(const float* heights, int width, int depth, float originX, float originZ)
+{
+    m_heights.assign(heights, heights + size_t(width) * depth);
+    m_width = width;
+    m_depth = depth;
+    m_originX = originX;
+    m_originZ = originZ;
+
+    //Level 0 has a node per cell, each level above halves both sides
+    int nodesX = width - 1;
+    int nodesZ = depth - 1;
+
+    m_pyramid.assign(1, vector<glm::vec2>(nodesX * nodesZ));
+    m_levelWidths.assign(1, nodesX);
+
+    while (nodesX > 1 || nodesZ > 1)
+    {
+        nodesX = (nodesX + 1) / 2;
+        nodesZ = (nodesZ + 1) / 2;
+        m_pyramid.push_back(vector<glm::vec2>(nodesX * nodesZ));
+        m_levelWidths.push_back(nodesX);
+    }
+
+    updatePyramid(0, 0, width - 1, depth - 1);
+}
+
+void HeightField::setHeights(int firstX, int firstZ, int width, int depth, const float* heights)
+{
+    for (int z = 0; z < depth; ++z)
+    {
+        std::copy(heights + z * width, heights + (z + 1) * width, &m_heights[(firstZ + z) * m_width + firstX]);
+    }
+
+    //The cells on both sides of a sample share it
+    updatePyramid(std::max(firstX - 1, 0), std::max(firstZ - 1, 0),
+                  std::min(firstX + width, m_width - 1), std::min(firstZ + depth, m_depth - 1));
+}
+
+/**
+Recomputes the nodes over the cells [firstX, endX) x [firstZ, endZ) and
+everything above them. The bilinear surface of a cell never leaves the
+range of its corners, so those are its bounds.
+*/
+void HeightField::updatePyramid(int firstX, int firstZ, int endX, int endZ)
+{
+    const int cellsX = m_width - 1;
+
+    for (int z = firstZ; z < endZ; ++z)
+    {
+        const float* top = &m_heights[z * m_width];
+        const float* bottom = top + m_width;
+
+        for (int x = firstX; x < endX; ++x)
+        {
+            m_pyramid[0][z * cellsX + x] = glm::vec2(std::min(std::min(top[x], top[x + 1]), std::min(bottom[x], bottom[x + 1])),
+                                                     std::max(std::max(top[x], top[x + 1]), std::max(bottom[x], bottom[x + 1])));
+        }
+    }
+
+    for (unsigned int level = 1; level < m_pyramid.size(); ++level)
+    {
+        const vector<glm::vec2>& below = m_pyramid[level - 1];
+        const int belowX = m_levelWidths[level - 1];
+        const int belowZ = int(below.size()) / belowX;
+        const int nodesX = m_levelWidths[level];
+
+        firstX /= 2;
+        firstZ /= 2;
+        endX = (endX + 1) / 2;
+        endZ = (endZ + 1) / 2;
+
+        for (int z = firstZ; z < endZ; ++z)
+        {
+            for (int x = firstX; x < endX; ++x)
+            {
+                glm::vec2 bounds = below[(z * 2) * belowX + x * 2];
+
+                for (int child = 1; child < 4; ++child)
+                {
+                    int childX = x * 2 + (child & 1);
+                    int childZ = z * 2 + (child >> 1);
+
+                    if (childX < belowX && childZ < belowZ)
+                    {
+                        const glm::vec2& childBounds = below[childZ * belowX + childX];
+                        bounds.x = std::min(bounds.x, childBounds.x);
+                        bounds.y = std::max(bounds.y, childBounds.y);
+                    }
+                }
+
+                m_pyramid[level][z * nodesX + x] = bounds;
+            }
+        }
+    }
+}
+
+void HeightField::clear()
+{
+    m_heights.clear();
+    m_pyramid.clear();
+    m_levelWidths.clear();
+    m_width = m_depth = 0;
+}
+
+glm::vec2 HeightField::getBounds() const
+{
+    return m_pyramid.empty() ? glm::vec2(0.0f) : m_pyramid.back()[0];
+}
+
+float HeightField::getHeight(float x, float z) const
+{
+    //Written so that NaN positions end up on the border rather than outside the map
+    float fx = std::max(0.0f, std::min(x - m_originX, float(m_width - 1)));
+    float fz = std::max(0.0f, std::min(z - m_originZ, float(m_depth - 1)));
+    int ix = std::min(int(fx), m_width - 2);
+    int iz = std::min(int(fz), m_depth - 2);
+    float u = fx - float(ix);
+    float v = fz - float(iz);
+
+    const float* top = &m_heights[iz * m_width + ix];
+    const float* bottom = top + m_width;
+
+    float upper = top[0] + (top[1] - top[0]) * u;
+    float lower = bottom[0] + (bottom[1] - bottom[0]) * u;
+    return upper + (lower - upper) * v;
+}
+
+void HeightField::getHeights(const float* x, const float* z, int count, float* heights) const
+{
+    int i = 0;
+
+#ifdef HEIGHTFIELD_USE_SSE
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 originX = _mm_set1_ps(m_originX), originZ = _mm_set1_ps(m_originZ);
+    const __m128 lastX = _mm_set1_ps(float(m_width - 1)), lastZ = _mm_set1_ps(float(m_depth - 1));
+    const __m128 lastCellX = _mm_set1_ps(float(m_width - 2)), lastCellZ = _mm_set1_ps(float(m_depth - 2));
+
+    for (; i + 4 <= count; i += 4)
+    {
+        //The positions are clamped to be positive first, so truncating floors them
+        __m128 fx = _mm_min_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(x + i), originX), zero), lastX);
+        __m128 fz = _mm_min_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(z + i), originZ), zero), lastZ);
+        __m128 cellX = _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(fx)), lastCellX);
+        __m128 cellZ = _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(fz)), lastCellZ);
+        __m128 u = _mm_sub_ps(fx, cellX);
+        __m128 v = _mm_sub_ps(fz, cellZ);
+
+        //SSE2 can't gather, so the corners are fetched one query at a time
+        int ix[4], iz[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(ix), _mm_cvttps_epi32(cellX));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(iz), _mm_cvttps_epi32(cellZ));
+
+        float h00[4], h10[4], h01[4], h11[4];
+        for (int j = 0; j < 4; ++j)
+        {
+            const float* top = &m_heights[size_t(iz[j]) * m_width + ix[j]];
+            h00[j] = top[0];
+            h10[j] = top[1];
+            h01[j] = top[m_width];
+            h11[j] = top[m_width + 1];
+        }
+
+        __m128 top = _mm_loadu_ps(h00);
+        __m128 bottom = _mm_loadu_ps(h01);
+        __m128 upper = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(h10), top), u));
+        __m128 lower = _mm_add_ps(bottom, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(h11), bottom), u));
+        _mm_storeu_ps(heights + i, _mm_add_ps(upper, _mm_mul_ps(_mm_sub_ps(lower, upper), v)));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        heights[i] = getHeight(x[i], z[i]);
+    }
+}
+
+glm::vec3 HeightField::getNormal(float x, float z) const
+{
+    float normal[3];
+    getNormals(&x, &z, 1, normal);
+    return glm::vec3(normal[0], normal[1], normal[2]);
+}
+
+/**
+The slopes are differences of the bilinear heights one unit either side of
+each position, which matches the central differences of NormalGenerator on
+the samples themselves. Near the border the pair is shifted inwards so that
+both ends stay on the map. The normals come out of the same kernel.
+*/
+void HeightField::getNormals(const float* x, const float* z, int count, float* normals) const
+{
+    const float spanX = float(std::min(m_width - 1, 2));
+    const float spanZ = float(std::min(m_depth - 1, 2));
+    const float firstX = m_originX, lastX = m_originX + float(m_width - 1) - spanX;
+    const float firstZ = m_originZ, lastZ = m_originZ + float(m_depth - 1) - spanZ;
+
+    float scaleX[NORMAL_BATCH];
+    std::fill(scaleX, scaleX + NORMAL_BATCH, 1.0f / spanX);
+
+    for (int first = 0; first < count; first += NORMAL_BATCH)
+    {
+        const int batch = std::min(count - first, NORMAL_BATCH);
+
+        float leftX[NORMAL_BATCH], rightX[NORMAL_BATCH], upZ[NORMAL_BATCH], downZ[NORMAL_BATCH];
+        for (int i = 0; i < batch; ++i)
+        {
+            leftX[i] = std::max(firstX, std::min(x[first + i] - 0.5f * spanX, lastX));
+            rightX[i] = leftX[i] + spanX;
+            upZ[i] = std::max(firstZ, std::min(z[first + i] - 0.5f * spanZ, lastZ));
+            downZ[i] = upZ[i] + spanZ;
+        }
+
+        float left[NORMAL_BATCH], right[NORMAL_BATCH], up[NORMAL_BATCH], down[NORMAL_BATCH];
+        getHeights(leftX, z + first, batch, left);
+        getHeights(rightX, z + first, batch, right);
+        getHeights(x + first, upZ, batch, up);
+        getHeights(x + first, downZ, batch, down);
+
+        NormalGenerator::computeRow(left, right, up, down, scaleX, 1.0f / spanZ, batch, normals + first * 3);
+    }
+}
+
+/**
+The height along the ray within a cell is quadratic in t, because the
+bilinear surface is. With h = h00 + a*u + b*v + c*u*v and u, v moving
+linearly with t, the first root of h(t) - y(t) in [entry, exit] is where
+the ray goes under. Returns -1 if it stays above the cell.
+*/
+float HeightField::intersectCell(int cellX, int cellZ, const glm::vec3& origin, const glm::vec3& direction,
+                                 float entry, float exit) const
+{
+    const float* top = &m_heights[cellZ * m_width + cellX];
+    const float h00 = top[0], h10 = top[1], h01 = top[m_width], h11 = top[m_width + 1];
+
+    const float slopeU = h10 - h00;
+    const float slopeV = h01 - h00;
+    const float twist = h00 - h10 - h01 + h11;
+    const float u0 = origin.x - float(cellX);
+    const float v0 = origin.z - float(cellZ);
+
+    const float a = twist * direction.x * direction.z;
+    const float b = slopeU * direction.x + slopeV * direction.z + twist * (u0 * direction.z + v0 * direction.x) - direction.y;
+    const float c = h00 + slopeU * u0 + slopeV * v0 + twist * u0 * v0 - origin.y;
+
+    //Already under where it comes into the cell
+    if ((a * entry + b) * entry + c >= 0.0f)
+    {
+        return entry;
+    }
+
+    float roots[2];
+    int rootCount = 0;
+
+    if (std::fabs(a) < 1e-12f)
+    {
+        if (b != 0.0f)
+        {
+            roots[rootCount++] = -c / b;
+        }
+    }
+    else
+    {
+        float discriminant = b * b - 4.0f * a * c;
+        if (discriminant >= 0.0f)
+        {
+            //The stable form, it avoids subtracting two nearly equal numbers
+            float q = -0.5f * (b + (b < 0.0f ? -std::sqrt(discriminant) : std::sqrt(discriminant)));
+            roots[rootCount++] = q / a;
+            if (q != 0.0f)
+            {
+                roots[rootCount++] = c / q;
+            }
+        }
+    }
+
+    float hit = -1.0f;
+    for (int i = 0; i < rootCount; ++i)
+    {
+        if (roots[i] >= entry && roots[i] <= exit && (hit < 0.0f || roots[i] < hit))
+        {
+            hit = roots[i];
+        }
+    }
+
+    return hit;
+}
+
+bool HeightField::intersectRay(const glm::vec3& worldOrigin, const glm::vec3& direction, float maxDistance, float& distance) const
+{
+    if (m_pyramid.empty())
+    {
+        return false;
+    }
+
+    //Everything below works in sample units with the first sample at 0
+    const glm::vec3 origin(worldOrigin.x - m_originX, worldOrigin.y, worldOrigin.z - m_originZ);
+    const int cellsX = m_width - 1;
+    const int cellsZ = m_depth - 1;
+
+    glm::vec3 inverse;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        inverse[axis] = (direction[axis] != 0.0f) ? 1.0f / direction[axis] :
+                        (std::signbit(direction[axis]) ? -HUGE_RECIPROCAL : HUGE_RECIPROCAL);
+    }
+
+    float best = maxDistance;
+    bool found = false;
+
+    RayNode stack[MAX_RAY_STACK];
+    int stackSize = 0;
+
+    //The root goes through the same test as everything else, as the first of four boxes
+    {
+        const int root = int(m_pyramid.size()) - 1;
+        const glm::vec2& bounds = m_pyramid[root][0];
+        float minX[4] = { -BOX_MARGIN, 0.0f, 0.0f, 0.0f }, maxX[4] = { float(cellsX) + BOX_MARGIN, 0.0f, 0.0f, 0.0f };
+        float maxY[4] = { bounds.y, 0.0f, 0.0f, 0.0f };
+        float minZ[4] = { -BOX_MARGIN, 0.0f, 0.0f, 0.0f }, maxZ[4] = { float(cellsZ) + BOX_MARGIN, 0.0f, 0.0f, 0.0f };
+        float entry[4], exit[4];
+
+        if (intersectBoxes(minX, maxX, maxY, minZ, maxZ, 1, origin, inverse, best, entry, exit))
+        {
+            RayNode node = { root, 0, 0, entry[0], exit[0] };
+            stack[stackSize++] = node;
+        }
+    }
+
+    while (stackSize > 0)
+    {
+        const RayNode node = stack[--stackSize];
+
+        if (node.entry > best)
+        {
+            continue;
+        }
+
+        //A ray that is under the lowest point of a node where it enters is inside the solid right there
+        const float lowest = m_pyramid[node.level][node.z * m_levelWidths[node.level] + node.x].x;
+        if (origin.y + direction.y * node.entry <= lowest)
+        {
+            best = node.entry;
+            found = true;
+            continue;
+        }
+
+        if (node.level == 0)
+        {
+            float hit = intersectCell(node.x, node.z, origin, direction, node.entry, std::min(node.exit, best));
+            if (hit >= 0.0f && hit <= best)
+            {
+                best = hit;
+                found = true;
+            }
+            continue;
+        }
+
+        //Test the four children together, the ones past the edge of the map are left empty
+        const int level = node.level - 1;
+        const int size = 1 << level;
+        const int levelWidth = m_levelWidths[level];
+        const int levelDepth = int(m_pyramid[level].size()) / levelWidth;
+
+        float minX[4], maxX[4], maxY[4], minZ[4], maxZ[4];
+        int valid = 0;
+        for (int child = 0; child < 4; ++child)
+        {
+            int x = node.x * 2 + (child & 1);
+            int z = node.z * 2 + (child >> 1);
+
+            minX[child] = float(x * size) - BOX_MARGIN;
+            maxX[child] = float(std::min((x + 1) * size, cellsX)) + BOX_MARGIN;
+            minZ[child] = float(z * size) - BOX_MARGIN;
+            maxZ[child] = float(std::min((z + 1) * size, cellsZ)) + BOX_MARGIN;
+
+            maxY[child] = 0.0f;
+            if (x < levelWidth && z < levelDepth)
+            {
+                maxY[child] = m_pyramid[level][z * levelWidth + x].y;
+                valid |= 1 << child;
+            }
+        }
+
+        float entry[4], exit[4];
+        int hits = intersectBoxes(minX, maxX, maxY, minZ, maxZ, valid, origin, inverse, best, entry, exit);
+
+        //Push the farthest first so that the nearest child is visited next
+        int order[4], orderCount = 0;
+        for (int child = 0; child < 4; ++child)
+        {
+            if (hits & (1 << child))
+            {
+                int i = orderCount++;
+                for (; i > 0 && entry[order[i - 1]] < entry[child]; --i)
+                {
+                    order[i] = order[i - 1];
+                }
+                order[i] = child;
+            }
+        }
+
+        for (int i = 0; i < orderCount; ++i)
+        {
+            int child = order[i];
+            RayNode next = { level, node.x * 2 + (child & 1), node.z * 2 + (child >> 1), entry[child], exit[child] };
+            stack[stackSize++] = next;
+        }
+    }
+
+    if (found)
+    {
+        distance = best;
+    }
+
+    return found;
+}
+
+int HeightField::intersectRays(const glm::vec3* origins, const glm::vec3* directions, int count, float maxDistance,
+                               float* distances) const
+{
+    int hits = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (intersectRay(origins[i], directions[i], maxDistance, distances[i]))
+        {
+            ++hits;
+        }
+        else
+        {
+            distances[i] = -1.0f;
+        }
+    }
+
+    return hits;
+}
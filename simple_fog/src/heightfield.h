@@ -0,0 +1,85 @@
+#ifndef BOGLGP_HEIGHTFIELD_H
+#define BOGLGP_HEIGHTFIELD_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+using std::vector;
+
+/*
+    Height, normal and ray queries against the full resolution heights of
+    the terrain, for gameplay code that shouldn't keep a copy of its own.
+    Samples are one unit apart in world space starting at the origin passed
+    to build, and the surface between them is bilinear. Positions outside
+    the map are clamped to its border.
+
+    Rays are marched through a min/max pyramid over the cells of the grid:
+    level 0 holds the height bounds of every cell, each level above halves
+    both sides until a single node covers the map. A ray only descends into
+    the nodes it passes under the top of, nearest first, stops as soon as it
+    is below the bottom of one, and solves the cells it reaches exactly.
+    Everything under the surface and inside the map counts as solid.
+
+    Every query is const and safe to call from several threads at once. The
+    batch heights and normals work on 4 queries at a time with SSE, and rays
+    test the 4 children of a node together. Callers with very large batches
+    can split them over JobSystem::parallelFor.
+*/
+class HeightField
+{
+public:
+    HeightField();
+
+    //width x depth heights, row by row with x growing along a row
+    void build(const float* heights, int width, int depth, float originX, float originZ);
+    void clear();
+
+    //Replaces the heights of the samples [firstX, firstX + width) x [firstZ, firstZ + depth)
+    void setHeights(int firstX, int firstZ, int width, int depth, const float* heights);
+
+    bool isEmpty() const { return m_heights.empty(); }
+    int getWidth() const { return m_width; }
+    int getDepth() const { return m_depth; }
+
+    //World position of the first sample
+    float getOriginX() const { return m_originX; }
+    float getOriginZ() const { return m_originZ; }
+
+    float getHeight(float x, float z) const;
+    glm::vec3 getNormal(float x, float z) const;
+
+    /*
+        Distance along direction to the first point of the surface, in units
+        of the length of direction. A ray that starts below the surface hits
+        it straight away, one that comes in under the edge of the map hits
+        the edge. False if nothing is hit within maxDistance.
+    */
+    bool intersectRay(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float& distance) const;
+
+    void getHeights(const float* x, const float* z, int count, float* heights) const;
+
+    //Normals are written as x, y, z triples
+    void getNormals(const float* x, const float* z, int count, float* normals) const;
+
+    //Distances of the misses are set to -1, returns the number of hits
+    int intersectRays(const glm::vec3* origins, const glm::vec3* directions, int count, float maxDistance,
+                      float* distances) const;
+
+    //Height bounds of the whole map
+    glm::vec2 getBounds() const;
+
+private:
+    void updatePyramid(int firstX, int firstZ, int endX, int endZ);
+    float intersectCell(int cellX, int cellZ, const glm::vec3& origin, const glm::vec3& direction,
+                        float entry, float exit) const;
+
+    vector<float> m_heights;
+    vector<vector<glm::vec2> > m_pyramid;   //Min/max height per node, level 0 is one node per cell
+    vector<int> m_levelWidths;              //Nodes along x on every level of the pyramid
+    int m_width;
+    int m_depth;
+    float m_originX;
+    float m_originZ;
+};
+
+#endif
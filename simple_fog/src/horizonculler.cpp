@@ -0,0 +1,179 @@
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#include "horizonculler.h"
+
+const float PI = 3.14159265358979f;
+
+HorizonCuller::HorizonCuller(int binCount):
+m_binCount(binCount),
+m_cameraPosition(0.0f),
+m_bins(binCount)
+{
+
+}
+
+void HorizonCuller::begin(const glm::vec3& cameraPosition)
+{
+    m_cameraPosition = cameraPosition;
+    m_queue.clear();
+
+    //Clearing keeps the memory of the steps for the next pass
+    for (int i = 0; i < m_binCount; ++i)
+    {
+        m_bins[i].clear();
+    }
+}
+
+float HorizonCuller::getNearDistance(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+{
+    float dx = std::max(std::max(boxMin.x - m_cameraPosition.x, m_cameraPosition.x - boxMax.x), 0.0f);
+    float dz = std::max(std::max(boxMin.z - m_cameraPosition.z, m_cameraPosition.z - boxMax.z), 0.0f);
+    return sqrtf(dx * dx + dz * dz);
+}
+
+/**
+False when the camera is above the footprint, a box all around the camera
+neither hides nor is hidden. Otherwise the footprint lies within half a
+turn around the camera, so the azimuths of its corners are measured from
+the direction of its centre and never wrap between them.
+*/
+bool HorizonCuller::getFootprint(const glm::vec3& boxMin, const glm::vec3& boxMax, Footprint& footprint) const
+{
+    const float x[2] = { boxMin.x - m_cameraPosition.x, boxMax.x - m_cameraPosition.x };
+    const float z[2] = { boxMin.z - m_cameraPosition.z, boxMax.z - m_cameraPosition.z };
+
+    if (x[0] <= 0.0f && x[1] >= 0.0f && z[0] <= 0.0f && z[1] >= 0.0f)
+    {
+        return false;
+    }
+
+    footprint.nearDistance = getNearDistance(boxMin, boxMax);
+    footprint.farDistance = sqrtf(std::max(x[0] * x[0], x[1] * x[1]) + std::max(z[0] * z[0], z[1] * z[1]));
+
+    const float center = atan2f(z[0] + z[1], x[0] + x[1]);
+    float lowest = 0.0f;
+    float highest = 0.0f;
+    for (int i = 0; i < 4; ++i)
+    {
+        float delta = atan2f(z[i >> 1], x[i & 1]) - center;
+        if (delta > PI)
+        {
+            delta -= 2.0f * PI;
+        }
+        else if (delta < -PI)
+        {
+            delta += 2.0f * PI;
+        }
+
+        lowest = std::min(lowest, delta);
+        highest = std::max(highest, delta);
+    }
+
+    const float binsPerRadian = float(m_binCount) / (2.0f * PI);
+    footprint.firstBin = (center + lowest + PI) * binsPerRadian;
+    footprint.endBin = (center + highest + PI) * binsPerRadian;
+    return true;
+}
+
+//Whether every bin the footprint touches is above the steepest slope of a box reaching up to maxY
+bool HorizonCuller::isHidden(const Footprint& footprint, float maxY) const
+{
+    const float height = maxY - m_cameraPosition.y;
+    const float slope = height / ((height > 0.0f) ? footprint.nearDistance : footprint.farDistance);
+
+    const int first = int(floorf(footprint.firstBin));
+    const int last = int(floorf(footprint.endBin));
+    for (int bin = first; bin <= last; ++bin)
+    {
+        if (getHorizon(((bin % m_binCount) + m_binCount) % m_binCount, footprint.nearDistance) <= slope)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool HorizonCuller::cull(const glm::vec3& boxMin, const glm::vec3& boxMax)
+{
+    Footprint footprint;
+    if (!getFootprint(boxMin, boxMax, footprint))
+    {
+        return false;
+    }
+
+    //Everything entirely nearer than this box can hide it
+    addOccluders(footprint.nearDistance);
+
+    if (isHidden(footprint, boxMax.y))
+    {
+        return true;
+    }
+
+    //The solid part of the box at its least steep point, over the bins it covers completely
+    const float height = boxMin.y - m_cameraPosition.y;
+
+    Occluder occluder;
+    occluder.farDistance = footprint.farDistance;
+    occluder.slope = height / ((height < 0.0f) ? footprint.nearDistance : footprint.farDistance);
+    occluder.firstBin = int(ceilf(footprint.firstBin));
+    occluder.binCount = int(floorf(footprint.endBin)) - occluder.firstBin;
+
+    if (occluder.binCount > 0)
+    {
+        m_queue.push_back(occluder);
+        std::push_heap(m_queue.begin(), m_queue.end());
+    }
+
+    return false;
+}
+
+void HorizonCuller::end()
+{
+    addOccluders(FLT_MAX);
+}
+
+bool HorizonCuller::isOccluded(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+{
+    Footprint footprint;
+    return getFootprint(boxMin, boxMax, footprint) && isHidden(footprint, boxMax.y);
+}
+
+//Moves the queued occluders that end within distance into the bins, nearest first so every bin's steps stay sorted
+void HorizonCuller::addOccluders(float distance)
+{
+    while (!m_queue.empty() && m_queue.front().farDistance <= distance)
+    {
+        std::pop_heap(m_queue.begin(), m_queue.end());
+        const Occluder occluder = m_queue.back();
+        m_queue.pop_back();
+
+        for (int i = 0; i < occluder.binCount; ++i)
+        {
+            vector<HorizonStep>& steps = m_bins[((occluder.firstBin + i) % m_binCount + m_binCount) % m_binCount];
+            if (!steps.empty() && steps.back().slope >= occluder.slope)
+            {
+                continue;
+            }
+
+            if (!steps.empty() && steps.back().distance == occluder.farDistance)
+            {
+                steps.back().slope = occluder.slope;
+            }
+            else
+            {
+                HorizonStep step = { occluder.farDistance, occluder.slope };
+                steps.push_back(step);
+            }
+        }
+    }
+}
+
+float HorizonCuller::getHorizon(int bin, float distance) const
+{
+    const vector<HorizonStep>& steps = m_bins[bin];
+    vector<HorizonStep>::const_iterator after = std::upper_bound(steps.begin(), steps.end(), distance, HorizonStep::before);
+    return (after == steps.begin()) ? -FLT_MAX : (after - 1)->slope;
+}
@@ -0,0 +1,89 @@
+#ifndef BOGLGP_HORIZONCULLER_H
+#define BOGLGP_HORIZONCULLER_H
+
+#include <vector>
+#include <glm/glm.hpp>
+
+using std::vector;
+
+/*
+    Occlusion culling against a horizon, for a heightfield seen from a
+    camera that can pitch. The horizon is one dimensional: a bin for every
+    slice of azimuth around the camera, holding the steepest slope, height
+    over horizontal distance, up to which the terrain nearer than a given
+    distance blocks the view. Slopes don't depend on the pitch of the
+    camera, so the horizon stays exact along each bin however far the
+    camera looks down.
+
+    The terrain is solid below its surface. A box that covers part of it is
+    solid at least up to its minimum height over its whole footprint, so it
+    hides whatever lies farther out in the same bins below the slope of that
+    height. Boxes are handed to cull nearest first; the ones that aren't
+    hidden are queued as occluders and only enter the horizon once the boxes
+    being tested are entirely farther away than they are. Each bin keeps the
+    distances its slope rose at, so isOccluded can test anything at any
+    distance once the pass is over.
+*/
+class HorizonCuller
+{
+public:
+    explicit HorizonCuller(int binCount = 2048);
+
+    //Starts a new pass from cameraPosition and forgets the last one
+    void begin(const glm::vec3& cameraPosition);
+
+    //Horizontal distance from the camera to the nearest point of a box, the order cull expects
+    float getNearDistance(const glm::vec3& boxMin, const glm::vec3& boxMax) const;
+
+    //True if the box is hidden, otherwise it becomes an occluder. Boxes must come by getNearDistance
+    bool cull(const glm::vec3& boxMin, const glm::vec3& boxMax);
+
+    //Adds the occluders still queued, after the last box of the pass
+    void end();
+
+    //Tests a box of any other object against the terrain of the last pass
+    bool isOccluded(const glm::vec3& boxMin, const glm::vec3& boxMax) const;
+
+private:
+    //The bins a footprint covers and its horizontal distances from the camera
+    struct Footprint
+    {
+        float nearDistance;
+        float farDistance;
+        float firstBin;     //Fractional bin of the lowest azimuth, not wrapped
+        float endBin;       //Fractional bin of the highest azimuth
+    };
+
+    //A slope that holds from distance onwards
+    struct HorizonStep
+    {
+        float distance;
+        float slope;
+
+        //Orders distances against steps for upper_bound
+        static bool before(float distance, const HorizonStep& step) { return distance < step.distance; }
+    };
+
+    struct Occluder
+    {
+        float farDistance;
+        int firstBin;
+        int binCount;
+        float slope;
+
+        //Orders the queue so that the nearest far distance is on top
+        bool operator<(const Occluder& other) const { return farDistance > other.farDistance; }
+    };
+
+    bool getFootprint(const glm::vec3& boxMin, const glm::vec3& boxMax, Footprint& footprint) const;
+    bool isHidden(const Footprint& footprint, float maxY) const;
+    void addOccluders(float distance);
+    float getHorizon(int bin, float distance) const;
+
+    int m_binCount;
+    glm::vec3 m_cameraPosition;
+    vector<vector<HorizonStep> > m_bins;
+    vector<Occluder> m_queue;               //Heap of the occluders that aren't in the bins yet
+};
+
+#endif
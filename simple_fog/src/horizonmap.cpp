@@ -0,0 +1,92 @@
+#include <cmath>
+#include <algorithm>
+#include "horizonmap.h"
+
+using std::max;
+using std::min;
+
+//Samples every direction steps along x and z
+static const int DIRECTION_STEPS[HorizonMap::DIRECTION_COUNT][2] =
+{
+    { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 }
+};
+
+void HorizonMap::bake(const HeightField& heightField, const SampleRegion& region, JobSystem& jobs,
+                      vector<unsigned char>& horizons)
+{
+    horizons.resize(size_t(region.endX - region.firstX) * (region.endZ - region.firstZ) * DIRECTION_COUNT);
+
+    jobs.wait(jobs.parallelFor(region.firstZ, region.endZ, 0, [&](int first, int end)
+    {
+        for (int z = first; z < end; ++z)
+        {
+            bakeRow(heightField, region, z, horizons);
+        }
+    }));
+}
+
+/**
+Marches every direction for the whole row at once, so each step is a
+single batch of height queries. Samples whose step leaves the map keep
+the horizon they have.
+*/
+void HorizonMap::bakeRow(const HeightField& heightField, const SampleRegion& region, int z,
+                         vector<unsigned char>& horizons)
+{
+    const int regionWidth = region.endX - region.firstX;
+    const size_t layerSize = size_t(regionWidth) * (region.endZ - region.firstZ) * 4;
+    const float originX = heightField.getOriginX();
+    const float originZ = heightField.getOriginZ();
+
+    vector<float> x(regionWidth), zs(regionWidth), heights(regionWidth), ground(regionWidth), slopes(regionWidth);
+    for (int i = 0; i < regionWidth; ++i)
+    {
+        x[i] = originX + float(region.firstX + i);
+        zs[i] = originZ + float(z);
+    }
+
+    heightField.getHeights(&x[0], &zs[0], regionWidth, &ground[0]);
+
+    for (int direction = 0; direction < DIRECTION_COUNT; ++direction)
+    {
+        const int stepX = DIRECTION_STEPS[direction][0];
+        const int stepZ = DIRECTION_STEPS[direction][1];
+        const float stepLength = std::sqrt(float(stepX * stepX + stepZ * stepZ));
+
+        std::fill(slopes.begin(), slopes.end(), 0.0f);
+
+        for (int distance = 1; distance <= SEARCH_RADIUS; distance += max(distance / 4, 1))
+        {
+            const int sampleZ = z + stepZ * distance;
+            const int first = max(region.firstX, -stepX * distance);
+            const int end = min(region.endX, heightField.getWidth() - stepX * distance);
+
+            if (sampleZ < 0 || sampleZ >= heightField.getDepth() || first >= end)
+            {
+                break;
+            }
+
+            for (int i = 0; i < end - first; ++i)
+            {
+                x[i] = originX + float(first + i + stepX * distance);
+                zs[i] = originZ + float(sampleZ);
+            }
+
+            heightField.getHeights(&x[0], &zs[0], end - first, &heights[0]);
+
+            const float scale = 1.0f / (float(distance) * stepLength);
+            for (int i = 0; i < end - first; ++i)
+            {
+                float& slope = slopes[first - region.firstX + i];
+                slope = max(slope, (heights[i] - ground[first - region.firstX + i]) * scale);
+            }
+        }
+
+        unsigned char* texels = &horizons[layerSize * (direction / 4) + size_t(z - region.firstZ) * regionWidth * 4];
+        for (int i = 0; i < regionWidth; ++i)
+        {
+            float sine = slopes[i] / std::sqrt(1.0f + slopes[i] * slopes[i]);
+            texels[i * 4 + direction % 4] = (unsigned char)(sine * 255.0f + 0.5f);
+        }
+    }
+}
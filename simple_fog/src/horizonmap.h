@@ -0,0 +1,39 @@
+#ifndef BOGLGP_HORIZONMAP_H
+#define BOGLGP_HORIZONMAP_H
+
+#include <vector>
+#include "heightfield.h"
+#include "tiledheightmap.h"
+#include "jobsystem.h"
+
+using std::vector;
+
+/*
+    The horizon around every sample of a height field, for ambient
+    occlusion and sun shadows without shadow maps. For each of 8 directions,
+    turning from +x towards +z in steps of 45 degrees, the horizon is the
+    steepest rise to any sample up to SEARCH_RADIUS samples away. The
+    diagonals step onto samples too, so nothing is interpolated. Steps grow
+    with the distance, the far terrain only matters when it is high.
+
+    Horizons are stored as the sine of their elevation in a byte, 0 for a
+    horizon at or below the sample. The bytes form 2 layers of RGBA texels,
+    directions 0 to 3 then 4 to 7, ready for a GL_TEXTURE_2D_ARRAY. Rows are
+    baked in parallel.
+*/
+class HorizonMap
+{
+public:
+    static const int DIRECTION_COUNT = 8;
+    static const int SEARCH_RADIUS = 64;
+
+    //Horizons of the samples of region, every layer row by row, the region a whole layer
+    static void bake(const HeightField& heightField, const SampleRegion& region, JobSystem& jobs,
+                     vector<unsigned char>& horizons);
+
+private:
+    static void bakeRow(const HeightField& heightField, const SampleRegion& region, int z,
+                        vector<unsigned char>& horizons);
+};
+
+#endif
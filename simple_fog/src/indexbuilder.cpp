@@ -0,0 +1,391 @@
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <algorithm>
+
+#include "indexbuilder.h"
+
+//Marks the end of a strip while building, replaced by the restart index of the final type on upload
+const GLuint STRIP_END = 0xFFFFFFFF;
+
+//Tuning values from Tom Forsyth's "Linear-Speed Vertex Cache Optimisation"
+const float CACHE_DECAY_POWER = 1.5f;
+const float LAST_TRIANGLE_SCORE = 0.75f;
+const float VALENCE_BOOST_SCALE = 2.0f;
+const float VALENCE_BOOST_POWER = 0.5f;
+
+IndexBuilder::IndexBuilder(int vertexCount, IndexOrder order):
+m_vertexCount(vertexCount),
+m_order(order),
+m_triangleCount(0)
+{
+
+}
+
+const char* IndexBuilder::getOrderName(IndexOrder order)
+{
+    switch (order)
+    {
+    case ZIGZAG_STRIP_ORDER:
+        return "zig-zag strips";
+    case FORSYTH_ORDER:
+        return "Forsyth lists";
+    default:
+        return "row-major lists";
+    }
+}
+
+GLenum IndexBuilder::getMode() const
+{
+    return (m_order == ZIGZAG_STRIP_ORDER) ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+}
+
+/**
+Bytes aren't considered even for tiny grids, most hardware widens them to
+shorts on the fly. The largest value of the type is kept free for the
+primitive restart index.
+*/
+GLenum IndexBuilder::getIndexType() const
+{
+    return (m_vertexCount <= 0xFFFF) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+GLuint IndexBuilder::getRestartIndex() const
+{
+    return (getIndexType() == GL_UNSIGNED_SHORT) ? 0xFFFF : 0xFFFFFFFF;
+}
+
+void IndexBuilder::addGridSection(int gridWidth, int startX, int startZ, int quadsX, int quadsZ, const unsigned char* cellMask)
+{
+    m_sections.push_back(m_indices.size());
+
+    if (m_order == ZIGZAG_STRIP_ORDER)
+    {
+        /*
+            Every row is a strip that alternates between the upper and the
+            lower edge of the row. Odd rows run from right to left and
+            start on the lower edge so that the triangles keep the same
+            winding and the row starts next to the vertices the previous
+            row just finished with. Masked out quads split a row into
+            several strips.
+        */
+        for (int j = 0; j < quadsZ; ++j)
+        {
+            int z = startZ + j;
+            bool reverse = (j & 1) != 0;
+
+            int i = 0;
+            while (i < quadsX)
+            {
+                int cell = reverse ? (quadsX - 1 - i) : i;
+                if (cellMask && !cellMask[j * quadsX + cell])
+                {
+                    ++i;
+                    continue;
+                }
+
+                //Find the run of quads that are kept
+                int first = i;
+                while (i < quadsX && (!cellMask || cellMask[j * quadsX + (reverse ? (quadsX - 1 - i) : i)]))
+                {
+                    ++i;
+                }
+
+                for (int k = first; k <= i; ++k)
+                {
+                    int x = reverse ? (startX + quadsX - k) : (startX + k);
+                    int top = (z * gridWidth) + x;
+                    int bottom = ((z + 1) * gridWidth) + x;
+
+                    m_indices.push_back(reverse ? bottom : top);
+                    m_indices.push_back(reverse ? top : bottom);
+                }
+
+                m_indices.push_back(STRIP_END);
+                m_triangleCount += (i - first) * 2;
+            }
+        }
+
+        return;
+    }
+
+    vector<GLuint> triangles;
+    for (int z = startZ; z < startZ + quadsZ; ++z)
+    {
+        for (int x = startX; x < startX + quadsX; ++x)
+        {
+            if (cellMask && !cellMask[(z - startZ) * quadsX + (x - startX)])
+            {
+                continue;
+            }
+
+            triangles.push_back((z * gridWidth) + x); //Current point
+            triangles.push_back(((z + 1) * gridWidth) + x); //Next row
+            triangles.push_back((z * gridWidth) + x + 1); //Same row, but next column
+
+            triangles.push_back(((z + 1) * gridWidth) + x); //Next row
+            triangles.push_back(((z + 1) * gridWidth) + x + 1); //Next row, next column
+            triangles.push_back((z * gridWidth) + x + 1); //Same row, but next column
+        }
+    }
+
+    m_triangleCount += triangles.size() / 3;
+
+    if (m_order == FORSYTH_ORDER && !triangles.empty())
+    {
+        optimizeForsyth(triangles);
+    }
+
+    m_indices.insert(m_indices.end(), triangles.begin(), triangles.end());
+}
+
+void IndexBuilder::addTriangleSection(const vector<GLuint>& triangles)
+{
+    assert(m_order != ZIGZAG_STRIP_ORDER);
+
+    m_sections.push_back(m_indices.size());
+    m_triangleCount += triangles.size() / 3;
+
+    if (m_order == FORSYTH_ORDER && !triangles.empty())
+    {
+        vector<GLuint> ordered(triangles);
+        optimizeForsyth(ordered);
+        m_indices.insert(m_indices.end(), ordered.begin(), ordered.end());
+    }
+    else
+    {
+        m_indices.insert(m_indices.end(), triangles.begin(), triangles.end());
+    }
+}
+
+static float scoreVertex(int cachePosition, int remainingTriangles, int cacheSize)
+{
+    //Nothing left to draw with this vertex
+    if (remainingTriangles == 0)
+    {
+        return -1.0f;
+    }
+
+    float score = 0.0f;
+    if (cachePosition >= 0)
+    {
+        //The vertices of the last triangle get a fixed score so the next triangle doesn't just reuse its edge
+        if (cachePosition < 3)
+        {
+            score = LAST_TRIANGLE_SCORE;
+        }
+        else
+        {
+            score = powf(1.0f - float(cachePosition - 3) / float(cacheSize - 3), CACHE_DECAY_POWER);
+        }
+    }
+
+    //Vertices with few triangles left are worth finishing off
+    score += VALENCE_BOOST_SCALE * powf(float(remainingTriangles), -VALENCE_BOOST_POWER);
+    return score;
+}
+
+/**
+Greedily emits the triangle with the best score, where the score of a
+vertex rises with how recently it entered a simulated LRU cache and with
+how few triangles still need it. Only the triangles of vertices in the
+cache are rescored after each step, so this runs in linear time.
+*/
+void IndexBuilder::optimizeForsyth(vector<GLuint>& triangles) const
+{
+    const int triangleCount = triangles.size() / 3;
+    const int cacheSize = VERTEX_CACHE_SIZE;
+
+    //Triangles that use each vertex
+    vector<int> remaining(m_vertexCount, 0);
+    for (unsigned int i = 0; i < triangles.size(); ++i)
+    {
+        ++remaining[triangles[i]];
+    }
+
+    vector<int> firstTriangle(m_vertexCount + 1, 0);
+    for (int i = 0; i < m_vertexCount; ++i)
+    {
+        firstTriangle[i + 1] = firstTriangle[i] + remaining[i];
+    }
+
+    vector<int> adjacency(triangles.size());
+    vector<int> filled(firstTriangle.begin(), firstTriangle.end() - 1);
+    for (unsigned int i = 0; i < triangles.size(); ++i)
+    {
+        adjacency[filled[triangles[i]]++] = i / 3;
+    }
+
+    vector<int> cachePosition(m_vertexCount, -1);
+    vector<float> vertexScore(m_vertexCount);
+    for (int i = 0; i < m_vertexCount; ++i)
+    {
+        vertexScore[i] = scoreVertex(-1, remaining[i], cacheSize);
+    }
+
+    vector<float> triangleScore(triangleCount);
+    vector<unsigned char> emitted(triangleCount, 0);
+    for (int i = 0; i < triangleCount; ++i)
+    {
+        triangleScore[i] = vertexScore[triangles[i * 3]] + vertexScore[triangles[i * 3 + 1]] + vertexScore[triangles[i * 3 + 2]];
+    }
+
+    vector<GLuint> ordered;
+    ordered.reserve(triangles.size());
+
+    vector<int> cache;
+    vector<int> newCache;
+    int best = int(std::max_element(triangleScore.begin(), triangleScore.end()) - triangleScore.begin());
+
+    for (int count = 0; count < triangleCount; ++count)
+    {
+        //The cache ran dry, fall back to the best triangle anywhere
+        if (best < 0)
+        {
+            float bestScore = -1.0e30f;
+            for (int i = 0; i < triangleCount; ++i)
+            {
+                if (!emitted[i] && triangleScore[i] > bestScore)
+                {
+                    bestScore = triangleScore[i];
+                    best = i;
+                }
+            }
+        }
+
+        emitted[best] = 1;
+
+        newCache.clear();
+        for (int corner = 0; corner < 3; ++corner)
+        {
+            int vertex = triangles[best * 3 + corner];
+            ordered.push_back(vertex);
+            newCache.push_back(vertex);
+
+            //Drop the triangle from the vertex's list of triangles to go
+            int* begin = &adjacency[firstTriangle[vertex]];
+            int* end = begin + remaining[vertex];
+            *std::find(begin, end, best) = *(end - 1);
+            --remaining[vertex];
+        }
+
+        for (unsigned int i = 0; i < cache.size(); ++i)
+        {
+            if (std::find(newCache.begin(), newCache.begin() + 3, cache[i]) == newCache.begin() + 3)
+            {
+                newCache.push_back(cache[i]);
+            }
+        }
+
+        //Rescore everything that was in the cache, including what just fell out of it
+        for (unsigned int i = 0; i < newCache.size(); ++i)
+        {
+            int vertex = newCache[i];
+            cachePosition[vertex] = (int(i) < cacheSize) ? int(i) : -1;
+            vertexScore[vertex] = scoreVertex(cachePosition[vertex], remaining[vertex], cacheSize);
+        }
+
+        best = -1;
+        float bestScore = -1.0e30f;
+        for (unsigned int i = 0; i < newCache.size(); ++i)
+        {
+            int vertex = newCache[i];
+            for (int j = 0; j < remaining[vertex]; ++j)
+            {
+                int triangle = adjacency[firstTriangle[vertex] + j];
+                float score = vertexScore[triangles[triangle * 3]] + vertexScore[triangles[triangle * 3 + 1]] +
+                              vertexScore[triangles[triangle * 3 + 2]];
+                triangleScore[triangle] = score;
+
+                if (score > bestScore)
+                {
+                    bestScore = score;
+                    best = triangle;
+                }
+            }
+        }
+
+        if (int(newCache.size()) > cacheSize)
+        {
+            newCache.resize(cacheSize);
+        }
+        cache.swap(newCache);
+    }
+
+    triangles.swap(ordered);
+}
+
+float IndexBuilder::computeACMR(int cacheSize) const
+{
+    if (m_triangleCount == 0)
+    {
+        return 0.0f;
+    }
+
+    std::deque<GLuint> cache;
+    unsigned int misses = 0;
+
+    for (unsigned int i = 0; i < m_indices.size(); ++i)
+    {
+        GLuint index = m_indices[i];
+        if (index == STRIP_END || std::find(cache.begin(), cache.end(), index) != cache.end())
+        {
+            continue;
+        }
+
+        ++misses;
+        cache.push_back(index);
+        if (int(cache.size()) > cacheSize)
+        {
+            cache.pop_front();
+        }
+    }
+
+    return float(misses) / float(m_triangleCount);
+}
+
+void IndexBuilder::upload(IndexBuffer& indexBuffer) const
+{
+    indexBuffer.mode = getMode();
+    indexBuffer.type = getIndexType();
+    indexBuffer.restartIndex = getRestartIndex();
+    indexBuffer.indexSize = (indexBuffer.type == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint);
+    indexBuffer.sections = m_sections;
+    indexBuffer.sections.push_back(m_indices.size());
+
+    if (indexBuffer.buffer == 0)
+    {
+        glGenBuffers(1, &indexBuffer.buffer);
+    }
+
+    vector<char> data;
+    getIndexData(data);
+
+    //The element binding belongs to whichever vertex array is bound, so upload through the array target
+    glBindBuffer(GL_ARRAY_BUFFER, indexBuffer.buffer);
+    glBufferData(GL_ARRAY_BUFFER, data.size(), data.empty() ? NULL : &data[0], GL_STATIC_DRAW);
+}
+
+void IndexBuilder::getIndexData(vector<char>& data) const
+{
+    if (getIndexType() == GL_UNSIGNED_SHORT)
+    {
+        const GLushort restartIndex = GLushort(getRestartIndex());
+
+        data.resize(sizeof(GLushort) * m_indices.size());
+        GLushort* indices = reinterpret_cast<GLushort*>(data.empty() ? NULL : &data[0]);
+        for (unsigned int i = 0; i < m_indices.size(); ++i)
+        {
+            indices[i] = (m_indices[i] == STRIP_END) ? restartIndex : GLushort(m_indices[i]);
+        }
+    }
+    else
+    {
+        data.resize(sizeof(GLuint) * m_indices.size());
+        if (!data.empty())
+        {
+            memcpy(&data[0], &m_indices[0], data.size());
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef BOGLGP_INDEXBUILDER_H
+#define BOGLGP_INDEXBUILDER_H
+
+#include <vector>
+#include <GL/Glew.h>
+
+using std::vector;
+
+enum IndexOrder
+{
+    ROW_MAJOR_ORDER,        //Triangle lists, one row of quads after the other
+    ZIGZAG_STRIP_ORDER,     //A triangle strip per row, alternating direction, joined by primitive restarts
+    FORSYTH_ORDER           //Triangle lists reordered with Forsyth's vertex cache optimization
+};
+
+//Post transform cache size assumed when ordering and measuring indices
+const int VERTEX_CACHE_SIZE = 16;
+
+//An uploaded index buffer and what it takes to draw it
+struct IndexBuffer
+{
+    GLuint buffer;
+    GLenum mode;                    //GL_TRIANGLES or GL_TRIANGLE_STRIP
+    GLenum type;                    //GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    GLuint restartIndex;            //Only used by strips
+    unsigned int indexSize;         //Bytes per index
+    vector<unsigned int> sections;  //First index of every section followed by the total index count
+
+    IndexBuffer():
+    buffer(0),
+    mode(GL_TRIANGLES),
+    type(GL_UNSIGNED_INT),
+    restartIndex(0),
+    indexSize(0)
+    {
+    }
+};
+
+/*
+    Builds the index buffer of a regular grid of vertices. The grid is
+    added in sections, each one a rectangle of quads that stays contiguous
+    in the buffer so that it can be drawn on its own, and any run of
+    neighbouring sections can be drawn with one call.
+
+    Indices are kept as 32 bit while building and stored with the narrowest
+    type that can address every vertex when uploaded.
+*/
+class IndexBuilder
+{
+public:
+    IndexBuilder(int vertexCount, IndexOrder order);
+
+    /*
+        Adds the quads from (startX, startZ) of a grid that is gridWidth
+        vertices wide as a new section. cellMask, if given, has a byte per
+        quad of the section, row by row, and only the quads with a nonzero
+        byte are kept.
+    */
+    void addGridSection(int gridWidth, int startX, int startZ, int quadsX, int quadsZ, const unsigned char* cellMask = NULL);
+
+    //Adds a triangle list as a new section, only for the list orders
+    void addTriangleSection(const vector<GLuint>& triangles);
+
+    IndexOrder getOrder() const { return m_order; }
+    GLenum getMode() const;
+    GLenum getIndexType() const;
+    GLuint getRestartIndex() const;
+    unsigned int getIndexCount() const { return m_indices.size(); }
+    unsigned int getTriangleCount() const { return m_triangleCount; }
+
+    //Average cache miss ratio: vertices transformed per triangle with a FIFO cache of cacheSize entries
+    float computeACMR(int cacheSize) const;
+
+    void upload(IndexBuffer& indexBuffer) const;
+
+    //The indices as upload stores them, in the index type with restart indices in place
+    void getIndexData(vector<char>& data) const;
+
+    //First index of every section, without the total
+    const vector<unsigned int>& getSections() const { return m_sections; }
+
+    static const char* getOrderName(IndexOrder order);
+
+private:
+    void optimizeForsyth(vector<GLuint>& triangles) const;
+
+    int m_vertexCount;
+    IndexOrder m_order;
+    unsigned int m_triangleCount;
+    vector<GLuint> m_indices;
+    vector<unsigned int> m_sections;
+};
+
+#endif
@@ -0,0 +1,248 @@
+#include <algorithm>
+
+#include "jobsystem.h"
+
+//The system the current thread works for and the index of its queue there, set by the workers
+static thread_local const JobSystem* t_queueOwner = NULL;
+static thread_local int t_queueIndex = -1;
+
+JobSystem::JobSystem(unsigned int threadCount):
+m_queued(0),
+m_stopping(false)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u) - 1;
+    }
+
+    for (unsigned int i = 0; i <= threadCount; ++i)
+    {
+        m_queues.push_back(new WorkQueue);
+    }
+
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        m_workers.push_back(std::thread(&JobSystem::run, this, i));
+    }
+}
+
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+
+    m_wakeUp.notify_all();
+
+    for (unsigned int i = 0; i < m_workers.size(); ++i)
+    {
+        m_workers[i].join();
+    }
+
+    for (unsigned int i = 0; i < m_queues.size(); ++i)
+    {
+        delete m_queues[i];
+    }
+}
+
+JobHandle JobSystem::schedule(const std::function<void()>& work, const vector<JobHandle>& dependencies)
+{
+    JobHandle job(new Job);
+    job->work = work;
+    job->unfinished = 1;
+    job->finished = false;
+
+    for (unsigned int i = 0; i < dependencies.size(); ++i)
+    {
+        Job& dependency = *dependencies[i];
+
+        std::lock_guard<std::mutex> lock(dependency.mutex);
+        if (!dependency.finished)
+        {
+            ++job->unfinished;
+            dependency.continuations.push_back(job);
+        }
+    }
+
+    //Drop the hold that kept the dependencies from submitting the job before they were all counted
+    if (--job->unfinished == 0)
+    {
+        submit(job);
+    }
+
+    return job;
+}
+
+/**
+The ranges become jobs of their own and the handle that comes back is an
+empty job that depends on all of them.
+*/
+JobHandle JobSystem::parallelFor(int first, int end, int grain, const std::function<void(int, int)>& work,
+                                 const vector<JobHandle>& dependencies)
+{
+    if (grain <= 0)
+    {
+        //A few ranges per thread leaves room to balance uneven ranges
+        grain = std::max((end - first) / int(getThreadCount() * 4), 1);
+    }
+
+    vector<JobHandle> ranges;
+    for (int rangeFirst = first; rangeFirst < end; rangeFirst += grain)
+    {
+        int rangeEnd = std::min(rangeFirst + grain, end);
+        ranges.push_back(schedule([work, rangeFirst, rangeEnd]() { work(rangeFirst, rangeEnd); }, dependencies));
+    }
+
+    if (ranges.empty())
+    {
+        ranges = dependencies;
+    }
+
+    return schedule(std::function<void()>(), ranges);
+}
+
+void JobSystem::wait(const JobHandle& job)
+{
+    while (!job->finished)
+    {
+        JobHandle next = findJob();
+        if (next)
+        {
+            execute(next);
+            continue;
+        }
+
+        //Nothing to help with, sleep until a job finishes or more work turns up
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!job->finished && m_queued == 0)
+        {
+            m_wakeUp.wait(lock);
+        }
+    }
+}
+
+void JobSystem::waitAll(const vector<JobHandle>& jobs)
+{
+    for (unsigned int i = 0; i < jobs.size(); ++i)
+    {
+        wait(jobs[i]);
+    }
+}
+
+void JobSystem::run(unsigned int index)
+{
+    t_queueOwner = this;
+    t_queueIndex = index;
+
+    while (true)
+    {
+        JobHandle job = findJob();
+        if (job)
+        {
+            execute(job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stopping && m_queued == 0)
+        {
+            m_wakeUp.wait(lock);
+        }
+
+        if (m_stopping)
+        {
+            return;
+        }
+    }
+}
+
+void JobSystem::submit(const JobHandle& job)
+{
+    WorkQueue& queue = *m_queues[getOwnQueue()];
+
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(job);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_queued;
+    }
+
+    m_wakeUp.notify_one();
+}
+
+void JobSystem::execute(const JobHandle& job)
+{
+    if (job->work)
+    {
+        job->work();
+    }
+
+    vector<JobHandle> continuations;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->finished = true;
+        continuations.swap(job->continuations);
+    }
+
+    for (unsigned int i = 0; i < continuations.size(); ++i)
+    {
+        if (--continuations[i]->unfinished == 0)
+        {
+            submit(continuations[i]);
+        }
+    }
+
+    //Threads waiting on this job sleep on the same condition as idle workers
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+    }
+
+    m_wakeUp.notify_all();
+}
+
+//Workers of another system share the last queue with every thread that isn't a worker of this one
+int JobSystem::getOwnQueue() const
+{
+    return (t_queueOwner == this) ? t_queueIndex : int(m_queues.size()) - 1;
+}
+
+/**
+Newest job of the thread's own queue first, then the oldest job of any
+other queue.
+*/
+JobHandle JobSystem::findJob()
+{
+    const int queueCount = m_queues.size();
+    const int own = getOwnQueue();
+
+    {
+        WorkQueue& queue = *m_queues[own];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.jobs.empty())
+        {
+            JobHandle job = queue.jobs.back();
+            queue.jobs.pop_back();
+            --m_queued;
+            return job;
+        }
+    }
+
+    for (int i = 1; i < queueCount; ++i)
+    {
+        WorkQueue& queue = *m_queues[(own + i) % queueCount];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.jobs.empty())
+        {
+            JobHandle job = queue.jobs.front();
+            queue.jobs.pop_front();
+            --m_queued;
+            return job;
+        }
+    }
+
+    return JobHandle();
+}
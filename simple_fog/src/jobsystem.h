@@ -0,0 +1,117 @@
+#ifndef BOGLGP_JOBSYSTEM_H
+#define BOGLGP_JOBSYSTEM_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+using std::vector;
+using std::deque;
+
+class JobSystem;
+
+//A unit of work, it runs once every job it depends on has finished
+struct Job
+{
+    std::function<void()> work;
+    std::atomic<int> unfinished;        //Dependencies still running, plus one until the job is submitted
+    std::atomic<bool> finished;
+
+    std::mutex mutex;                   //Guards continuations against the job finishing
+    vector<std::shared_ptr<Job> > continuations;
+};
+
+typedef std::shared_ptr<Job> JobHandle;
+
+//The result of a job, get waits for it
+template <class T>
+class JobFuture
+{
+public:
+    JobFuture() {}
+    JobFuture(const JobHandle& job, const std::shared_ptr<T>& value): m_job(job), m_value(value) {}
+
+    const JobHandle& getJob() const { return m_job; }
+    T& get(JobSystem& jobs);
+
+private:
+    JobHandle m_job;
+    std::shared_ptr<T> m_value;
+};
+
+/*
+    A fixed pool of worker threads with a queue each. Threads push the jobs
+    they create onto their own queue and take work from its back, which
+    keeps related jobs on one core. A thread that runs dry steals from the
+    front of the other queues, where the oldest and usually largest jobs
+    are.
+
+    Threads that are not workers, the GL thread above all, share one extra
+    queue. Waiting on a job from any thread runs other jobs in the meantime
+    rather than blocking, so jobs may wait on jobs they create.
+*/
+class JobSystem
+{
+public:
+    //0 threads uses one per core, less the calling thread
+    explicit JobSystem(unsigned int threadCount = 0);
+    ~JobSystem();
+
+    JobHandle schedule(const std::function<void()>& work, const vector<JobHandle>& dependencies = vector<JobHandle>());
+
+    //Splits [first, end) into ranges of about grain items and calls work(rangeFirst, rangeEnd) for each, 0 picks a grain
+    JobHandle parallelFor(int first, int end, int grain, const std::function<void(int, int)>& work,
+                          const vector<JobHandle>& dependencies = vector<JobHandle>());
+
+    template <class T>
+    JobFuture<T> async(const std::function<T()>& work, const vector<JobHandle>& dependencies = vector<JobHandle>());
+
+    void wait(const JobHandle& job);
+    void waitAll(const vector<JobHandle>& jobs);
+
+    //Workers plus the thread that waits
+    unsigned int getThreadCount() const { return m_workers.size() + 1; }
+
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        deque<JobHandle> jobs;
+    };
+
+    void run(unsigned int index);
+    void submit(const JobHandle& job);
+    void execute(const JobHandle& job);
+    int getOwnQueue() const;
+    JobHandle findJob();
+
+    vector<std::thread> m_workers;
+    vector<WorkQueue*> m_queues;        //One per worker, the last is shared by every other thread
+
+    std::mutex m_mutex;                 //Only held to sleep and to wake sleepers without losing a signal
+    std::condition_variable m_wakeUp;
+    std::atomic<int> m_queued;
+    bool m_stopping;
+};
+
+template <class T>
+T& JobFuture<T>::get(JobSystem& jobs)
+{
+    jobs.wait(m_job);
+    return *m_value;
+}
+
+template <class T>
+JobFuture<T> JobSystem::async(const std::function<T()>& work, const vector<JobHandle>& dependencies)
+{
+    std::shared_ptr<T> value(new T());
+    JobHandle job = schedule([work, value]() { *value = work(); }, dependencies);
+    return JobFuture<T>(job, value);
+}
+
+#endif
@@ -25,6 +25,103 @@ void OnError(int errorCode, const char* msg) {
 }
 
 
+//True on the frame a key goes down, wasDown carries its state from one frame to the next
+static bool keyPressed(GLFWwindow* window, int key, bool& wasDown)
+{
+    bool down = (glfwGetKey(window, key) == GLFW_PRESS);
+    bool pressed = down && !wasDown;
+    wasDown = down;
+    return pressed;
+}
+
+//Renders frames until the window is closed
+static void runMainLoop(Example& example)
+{
+    //This is the mainloop, we render frames until isRunning returns false
+    double lastTime = glfwGetTime();
+
+    //Whether each toggle key was down last frame, so holding it toggles once
+    bool layoutKeyDown = false;
+    bool meshErrorKeyDown = false;
+    bool horizonKeyDown = false;
+    bool indirectKeyDown = false;
+    bool fogKeyDown = false;
+    bool fogPassKeyDown = false;
+    bool volumetricKeyDown = false;
+    
+    // run while the window is open
+    while(!glfwWindowShouldClose(gWindow)){
+        // process pending events
+        glfwPollEvents();
+        
+        double thisTime = glfwGetTime();
+        //Update((float)(thisTime - lastTime));
+        example.prepare((float)(thisTime - lastTime));
+        lastTime = thisTime;
+        
+        if (glfwGetKey(gWindow, GLFW_KEY_SPACE))
+        {
+            example.toggleFogMode();
+        }
+
+        //Switch the vertex layout once per key press
+        if (keyPressed(gWindow, GLFW_KEY_L, layoutKeyDown))
+        {
+            example.toggleVertexLayout();
+        }
+
+        //Step through the patch mesh error bounds once per key press
+        if (keyPressed(gWindow, GLFW_KEY_E, meshErrorKeyDown))
+        {
+            example.toggleMeshError();
+        }
+
+        //Switch horizon culling once per key press
+        if (keyPressed(gWindow, GLFW_KEY_H, horizonKeyDown))
+        {
+            example.toggleHorizonCulling();
+        }
+
+        //Switch between direct and indirect draws once per key press
+        if (keyPressed(gWindow, GLFW_KEY_I, indirectKeyDown))
+        {
+            example.toggleIndirectDraws();
+        }
+
+        //Switch between per vertex and per fragment fog once per key press
+        if (keyPressed(gWindow, GLFW_KEY_P, fogKeyDown))
+        {
+            example.toggleFogEvaluation();
+        }
+
+        //Step through the fog pass resolutions once per key press
+        if (keyPressed(gWindow, GLFW_KEY_F, fogPassKeyDown))
+        {
+            example.toggleFogPass();
+        }
+
+        //Volumetric height fog on and off once per key press
+        if (keyPressed(gWindow, GLFW_KEY_V, volumetricKeyDown))
+        {
+            example.toggleVolumetricFog();
+        }
+        
+        
+        // draw one frame
+        example.render();
+        
+        GLenum error = glGetError();
+        if(error != GL_NO_ERROR)
+        std::cerr << "OpenGL Error " << error << std::endl;
+        
+        //exit program if escape key is pressed
+        if(glfwGetKey(gWindow, GLFW_KEY_ESCAPE))
+        glfwSetWindowShouldClose(gWindow, GL_TRUE);
+        
+        glfwSwapBuffers(gWindow);
+    }
+}
+
 int main(int argc, char** argv)
 {
     //Set our window settings
@@ -32,6 +129,25 @@ int main(int argc, char** argv)
     const int windowHeight = 768;
     const int windowBPP = 16;
     const int windowFullscreen = false;
+
+    //Time the terrain normal generation and quit without opening a window
+    if (argc > 1 && string(argv[1]) == "--benchmark-normals")
+    {
+        return Terrain::benchmarkNormals("data/heightmap.raw", RawHeightmapFormat(65, 65)) ? 0 : 1;
+    }
+
+    //Check the CPU version of the vertex lighting and fog against the shader port and quit
+    if (argc > 1 && string(argv[1]) == "--benchmark-shading")
+    {
+        return Terrain::benchmarkShading("data/heightmap.raw", RawHeightmapFormat(65, 65)) ? 0 : 1;
+    }
+
+    //Check the CPU reference of the froxel fog and quit without opening a window
+    if (argc > 1 && string(argv[1]) == "--validate-froxels")
+    {
+        JobSystem jobs;
+        return FroxelFog::validate(jobs) ? 0 : 1;
+    }
     
     glfwSetErrorCallback(OnError);
     if(!glfwInit())
@@ -67,41 +183,23 @@ int main(int argc, char** argv)
     if(!GLEW_VERSION_3_2)
     throw std::runtime_error("OpenGL 3.2 API is not available.");
     
-    Example example;
-    
-    example.init();
-    
-    //This is the mainloop, we render frames until isRunning returns false
-    double lastTime = glfwGetTime();
-    
-    // run while the window is open
-    while(!glfwWindowShouldClose(gWindow)){
-        // process pending events
-        glfwPollEvents();
-        
-        double thisTime = glfwGetTime();
-        //Update((float)(thisTime - lastTime));
-        example.prepare((float)(thisTime - lastTime));
-        lastTime = thisTime;
-        
-        if (glfwGetKey(gWindow, GLFW_KEY_SPACE))
+    //Example and its members hold GL objects, so they are freed before glfwTerminate takes the context
+    {
+        Example example;
+
+        example.init();
+
+        //Time the uniform lookups of the linked programs and quit
+        if (argc > 1 && string(argv[1]) == "--benchmark-uniforms")
         {
-            example.toggleFogMode();
+            example.benchmarkUniforms();
         }
-        
-        
-        // draw one frame
-        example.render();
-        
-        GLenum error = glGetError();
-        if(error != GL_NO_ERROR)
-        std::cerr << "OpenGL Error " << error << std::endl;
-        
-        //exit program if escape key is pressed
-        if(glfwGetKey(gWindow, GLFW_KEY_ESCAPE))
-        glfwSetWindowShouldClose(gWindow, GL_TRUE);
-        
-        glfwSwapBuffers(gWindow);
+        else
+        {
+            runMainLoop(example);
+        }
+
+        example.shutdown();
     }
     
     // clean up and exit
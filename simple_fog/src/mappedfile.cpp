@@ -0,0 +1,117 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "mappedfile.h"
+
+MappedFile::MappedFile():
+m_data(NULL),
+m_size(0),
+m_copyOnWrite(false)
+#ifdef _WIN32
+,
+m_fileHandle(NULL),
+m_mappingHandle(NULL)
+#endif
+{
+
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const string& fileName, bool copyOnWrite)
+{
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+
+    HANDLE mapping = CreateFileMapping(file, NULL, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    m_data = mapping ? MapViewOfFile(mapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0) : NULL;
+    m_size = size_t(size.QuadPart);
+    m_fileHandle = file;
+    m_mappingHandle = mapping;
+#else
+    int file = ::open(fileName.c_str(), O_RDONLY);
+    if (file == -1)
+    {
+        return false;
+    }
+
+    struct stat info;
+    fstat(file, &info);
+
+    m_size = size_t(info.st_size);
+    if (m_size > 0)
+    {
+        m_data = copyOnWrite ? mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0) :
+                               mmap(NULL, m_size, PROT_READ, MAP_SHARED, file, 0);
+    }
+    else
+    {
+        m_data = MAP_FAILED;
+    }
+    ::close(file);
+
+    if (m_data == MAP_FAILED)
+    {
+        m_data = NULL;
+    }
+#endif
+
+    if (!m_data)
+    {
+        close();
+        return false;
+    }
+
+    m_copyOnWrite = copyOnWrite;
+    return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if (m_data)
+    {
+        UnmapViewOfFile(m_data);
+    }
+
+    if (m_mappingHandle)
+    {
+        CloseHandle(m_mappingHandle);
+    }
+
+    if (m_fileHandle)
+    {
+        CloseHandle(m_fileHandle);
+    }
+
+    m_fileHandle = m_mappingHandle = NULL;
+#else
+    if (m_data)
+    {
+        munmap(m_data, m_size);
+    }
+#endif
+
+    m_data = NULL;
+    m_size = 0;
+    m_copyOnWrite = false;
+}
@@ -0,0 +1,47 @@
+#ifndef BOGLGP_MAPPEDFILE_H
+#define BOGLGP_MAPPEDFILE_H
+
+#include <string>
+
+using std::string;
+
+/*
+    A read only view of a whole file. Pages are only read from disk when
+    they are first touched and the OS can drop them again under memory
+    pressure, so large files cost address space rather than memory.
+
+    A copy on write view can also be changed in memory. The pages that are
+    written to get private copies, the file itself is never written.
+*/
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const string& fileName, bool copyOnWrite = false);
+    void close();
+
+    bool isOpen() const { return m_data != NULL; }
+    const char* getData() const { return static_cast<const char*>(m_data); }
+    size_t getSize() const { return m_size; }
+
+    //NULL unless the view is copy on write
+    char* getWritableData() { return m_copyOnWrite ? static_cast<char*>(m_data) : NULL; }
+
+private:
+    //Copying would unmap the view twice
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    void* m_data;
+    size_t m_size;
+    bool m_copyOnWrite;
+
+#ifdef _WIN32
+    void* m_fileHandle;
+    void* m_mappingHandle;
+#endif
+};
+
+#endif
@@ -0,0 +1,293 @@
+#include <cmath>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+#include "normalgenerator.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NORMALS_USE_SSE
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+/*
+    Largest average angle between the normals of the two approaches that
+    still counts as a match. The stencils differ, so single samples on
+    sharp ridges can be several degrees apart even when both are right.
+*/
+const float MATCH_TOLERANCE_DEGREES = 2.0f;
+
+//Below this many rows a thread costs more than it saves
+const int MIN_ROWS_PER_THREAD = 32;
+
+#ifdef NORMALS_USE_SSE
+/**
+Turns the x, y and z of four normals into x, y, z triples:
+
+    x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+*/
+static inline void storeInterleaved(float* out, __m128 x, __m128 y, __m128 z)
+{
+    __m128 xyLow = _mm_unpacklo_ps(x, y);                               //x0 y0 x1 y1
+    __m128 xyHigh = _mm_unpackhi_ps(x, y);                              //x2 y2 x3 y3
+    __m128 zx = _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0));          //z0 z0 x1 x1
+    __m128 yz = _mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1));          //y1 y1 z1 z1
+    __m128 zxy = _mm_shuffle_ps(z, xyHigh, _MM_SHUFFLE(3, 2, 3, 2));    //z2 z3 x3 y3
+
+    _mm_storeu_ps(out, _mm_shuffle_ps(xyLow, zx, _MM_SHUFFLE(2, 0, 1, 0)));
+    _mm_storeu_ps(out + 4, _mm_shuffle_ps(yz, xyHigh, _MM_SHUFFLE(1, 0, 2, 0)));
+    _mm_storeu_ps(out + 8, _mm_shuffle_ps(zxy, zxy, _MM_SHUFFLE(1, 3, 2, 0)));
+}
+#endif
+
+void NormalGenerator::computeRow(const float* left, const float* right, const float* up, const float* down,
+                                 const float* scaleX, float scaleZ, int count, float* normals)
+{
+    int i = 0;
+
+#ifdef __AVX__
+    const __m256 one8 = _mm256_set1_ps(1.0f);
+    const __m256 zero8 = _mm256_setzero_ps();
+    const __m256 scaleZ8 = _mm256_set1_ps(scaleZ);
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 dx = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(right + i), _mm256_loadu_ps(left + i)), _mm256_loadu_ps(scaleX + i));
+        __m256 dz = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(down + i), _mm256_loadu_ps(up + i)), scaleZ8);
+        __m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), one8), _mm256_mul_ps(dz, dz)));
+        __m256 inverse = _mm256_div_ps(one8, length);
+
+        __m256 x = _mm256_mul_ps(_mm256_sub_ps(zero8, dx), inverse);
+        __m256 z = _mm256_mul_ps(_mm256_sub_ps(zero8, dz), inverse);
+
+        storeInterleaved(normals + i * 3, _mm256_castps256_ps128(x), _mm256_castps256_ps128(inverse), _mm256_castps256_ps128(z));
+        storeInterleaved(normals + i * 3 + 12, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(inverse, 1), _mm256_extractf128_ps(z, 1));
+    }
+#endif
+
+#ifdef NORMALS_USE_SSE
+    const __m128 one4 = _mm_set1_ps(1.0f);
+    const __m128 zero4 = _mm_setzero_ps();
+    const __m128 scaleZ4 = _mm_set1_ps(scaleZ);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 dx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(right + i), _mm_loadu_ps(left + i)), _mm_loadu_ps(scaleX + i));
+        __m128 dz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(down + i), _mm_loadu_ps(up + i)), scaleZ4);
+        __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), one4), _mm_mul_ps(dz, dz)));
+        __m128 inverse = _mm_div_ps(one4, length);
+
+        storeInterleaved(normals + i * 3, _mm_mul_ps(_mm_sub_ps(zero4, dx), inverse), inverse,
+                         _mm_mul_ps(_mm_sub_ps(zero4, dz), inverse));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        float dx = (right[i] - left[i]) * scaleX[i];
+        float dz = (down[i] - up[i]) * scaleZ;
+        float inverse = 1.0f / sqrtf(dx * dx + 1.0f + dz * dz);
+
+        normals[i * 3 + 0] = -dx * inverse;
+        normals[i * 3 + 1] = inverse;
+        normals[i * 3 + 2] = -dz * inverse;
+    }
+}
+
+void NormalGenerator::generateRows(const float* heights, int width, int depth, float spacing, const float* scaleX,
+                                   int firstRow, int endRow, float* normals)
+{
+    for (int z = firstRow; z < endRow; ++z)
+    {
+        int above = std::max(z - 1, 0);
+        int below = std::min(z + 1, depth - 1);
+        float scaleZ = 1.0f / (float(std::max(below - above, 1)) * spacing);
+
+        const float* row = heights + z * width;
+        const float* up = heights + above * width;
+        const float* down = heights + below * width;
+        float* out = normals + z * width * 3;
+
+        if (width == 1)
+        {
+            computeRow(row, row, up, down, scaleX, scaleZ, 1, out);
+            continue;
+        }
+
+        //The border columns are their own missing neighbour
+        computeRow(row, row + 1, up, down, scaleX, scaleZ, 1, out);
+        computeRow(row, row + 2, up + 1, down + 1, scaleX + 1, scaleZ, width - 2, out + 3);
+        computeRow(row + width - 2, row + width - 1, up + width - 1, down + width - 1,
+                   scaleX + width - 1, scaleZ, 1, out + (width - 1) * 3);
+    }
+}
+
+void NormalGenerator::generate(const float* heights, int width, int depth, float spacing, float* normals, unsigned int threadCount)
+{
+    vector<float> scaleX(width);
+    for (int x = 0; x < width; ++x)
+    {
+        int left = std::max(x - 1, 0);
+        int right = std::min(x + 1, width - 1);
+        scaleX[x] = 1.0f / (float(std::max(right - left, 1)) * spacing);
+    }
+
+    if (threadCount == 0)
+    {
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    threadCount = std::min(threadCount, (unsigned int)std::max(depth / MIN_ROWS_PER_THREAD, 1));
+
+    //Every thread writes its own band of rows, the calling thread takes the last one
+    vector<std::thread> threads;
+    int rowsPerThread = (depth + threadCount - 1) / threadCount;
+
+    for (unsigned int i = 0; i + 1 < threadCount; ++i)
+    {
+        int firstRow = i * rowsPerThread;
+        int endRow = std::min(firstRow + rowsPerThread, depth);
+        threads.push_back(std::thread(&NormalGenerator::generateRows, heights, width, depth, spacing, &scaleX[0],
+                                      firstRow, endRow, normals));
+    }
+
+    generateRows(heights, width, depth, spacing, &scaleX[0], std::min(int(threadCount - 1) * rowsPerThread, depth), depth, normals);
+
+    for (unsigned int i = 0; i < threads.size(); ++i)
+    {
+        threads[i].join();
+    }
+}
+
+void NormalGenerator::generateFaceAveraged(const float* heights, int width, int depth, float spacing, float* normals)
+{
+    vector<float> vertices(width * depth * 3);
+    for (int z = 0; z < depth; ++z)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            int index = z * width + x;
+            vertices[index * 3 + 0] = float(x) * spacing;
+            vertices[index * 3 + 1] = heights[index];
+            vertices[index * 3 + 2] = float(z) * spacing;
+        }
+    }
+
+    vector<unsigned int> indices;
+    for (int z = 0; z < depth - 1; ++z)
+    {
+        for (int x = 0; x < width - 1; ++x)
+        {
+            indices.push_back((z * width) + x); //Current point
+            indices.push_back(((z + 1) * width) + x); //Next row
+            indices.push_back((z * width) + x + 1); //Same row, but next column
+
+            indices.push_back(((z + 1) * width) + x); //Next row
+            indices.push_back(((z + 1) * width) + x + 1); //Next row, next column
+            indices.push_back((z * width) + x + 1); //Same row, but next column
+        }
+    }
+
+    vector<int> shareCount(width * depth, 0);
+    std::fill(normals, normals + width * depth * 3, 0.0f);
+
+    for (unsigned int i = 0; i < indices.size(); i += 3)
+    {
+        const float* v1 = &vertices[indices[i] * 3];
+        const float* v2 = &vertices[indices[i + 1] * 3];
+        const float* v3 = &vertices[indices[i + 2] * 3];
+
+        float vec1[3] = { v2[0] - v1[0], v2[1] - v1[1], v2[2] - v1[2] };
+        float vec2[3] = { v3[0] - v1[0], v3[1] - v1[1], v3[2] - v1[2] };
+
+        //Calculate the normal
+        float normal[3];
+        normal[0] = vec1[1] * vec2[2] - vec1[2] * vec2[1];
+        normal[1] = vec1[2] * vec2[0] - vec1[0] * vec2[2];
+        normal[2] = vec1[0] * vec2[1] - vec1[1] * vec2[0];
+
+        float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+
+        for (int j = 0; j < 3; ++j)
+        {
+            unsigned int index = indices[i + j];
+            normals[index * 3 + 0] += normal[0] / length;
+            normals[index * 3 + 1] += normal[1] / length;
+            normals[index * 3 + 2] += normal[2] / length;
+            shareCount[index]++;
+        }
+    }
+
+    for (int i = 0; i < width * depth; ++i)
+    {
+        float* normal = normals + i * 3;
+        normal[0] /= shareCount[i];
+        normal[1] /= shareCount[i];
+        normal[2] /= shareCount[i];
+
+        float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        normal[0] /= length;
+        normal[1] /= length;
+        normal[2] /= length;
+    }
+}
+
+void NormalGenerator::benchmark(const float* heights, int width, int depth, float spacing)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    const int RUNS = 5;
+
+    vector<float> reference(width * depth * 3);
+    vector<float> normals(width * depth * 3);
+    unsigned int threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+    //Best of a few runs for each approach
+    double faceTime = 1.0e30, singleTime = 1.0e30, threadedTime = 1.0e30;
+    for (int run = 0; run < RUNS; ++run)
+    {
+        Clock::time_point start = Clock::now();
+        generateFaceAveraged(heights, width, depth, spacing, &reference[0]);
+        Clock::time_point faceEnd = Clock::now();
+        generate(heights, width, depth, spacing, &normals[0], 1);
+        Clock::time_point singleEnd = Clock::now();
+        generate(heights, width, depth, spacing, &normals[0], threadCount);
+        Clock::time_point threadedEnd = Clock::now();
+
+        faceTime = std::min(faceTime, std::chrono::duration<double, std::milli>(faceEnd - start).count());
+        singleTime = std::min(singleTime, std::chrono::duration<double, std::milli>(singleEnd - faceEnd).count());
+        threadedTime = std::min(threadedTime, std::chrono::duration<double, std::milli>(threadedEnd - singleEnd).count());
+    }
+
+    double largest = 0.0, total = 0.0;
+    for (int i = 0; i < width * depth; ++i)
+    {
+        const float* a = &reference[i * 3];
+        const float* b = &normals[i * 3];
+        double cosine = std::min(1.0, std::max(-1.0, double(a[0] * b[0] + a[1] * b[1] + a[2] * b[2])));
+        double angle = acos(cosine) * 180.0 / 3.14159265358979;
+
+        largest = std::max(largest, angle);
+        total += angle;
+    }
+
+#if defined(__AVX__)
+    const char* kernel = "AVX";
+#elif defined(NORMALS_USE_SSE)
+    const char* kernel = "SSE";
+#else
+    const char* kernel = "scalar";
+#endif
+
+    std::cout << "Normals of a " << width << "x" << depth << " grid" << std::endl;
+    std::cout << "  face averaging:     " << faceTime << " ms" << std::endl;
+    std::cout << "  finite differences: " << singleTime << " ms on 1 thread, " << threadedTime << " ms on "
+              << threadCount << " threads (" << kernel << ")" << std::endl;
+    double average = total / (width * depth);
+    std::cout << "  difference: " << average << " degrees on average (" << largest << " at most), "
+              << ((average <= MATCH_TOLERANCE_DEGREES) ? "within" : "outside") << " the tolerance of "
+              << MATCH_TOLERANCE_DEGREES << " degrees" << std::endl;
+}
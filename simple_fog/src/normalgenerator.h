@@ -0,0 +1,48 @@
+#ifndef BOGLGP_NORMALGENERATOR_H
+#define BOGLGP_NORMALGENERATOR_H
+
+#include <vector>
+
+using std::vector;
+
+/*
+    Vertex normals of a regular height grid from finite differences. The
+    normal at a sample is (-dh/dx, 1, -dh/dz) normalized, where the slopes
+    are central differences inside the grid and one sided along its border.
+    Samples are processed 8 at a time with AVX, 4 at a time with SSE, and
+    one at a time where neither is available.
+
+    Normals are written as x, y, z triples, one per height.
+*/
+class NormalGenerator
+{
+public:
+    //Normals of a width x depth grid spaced spacing apart. Rows are split over threadCount threads, 0 uses them all
+    static void generate(const float* heights, int width, int depth, float spacing, float* normals, unsigned int threadCount = 0);
+
+    /*
+        The core kernel: normals of count samples in a row. left, right, up
+        and down hold the neighbours of each sample, scaleX the reciprocal of
+        the distance between left and right for each sample and scaleZ the
+        same between up and down for the whole row.
+    */
+    static void computeRow(const float* left, const float* right, const float* up, const float* down,
+                           const float* scaleX, float scaleZ, int count, float* normals);
+
+    /*
+        The original approach of the terrain: every triangle of the grid
+        (triangulated like the index buffers) contributes its normalized face
+        normal to its corners, which are then averaged. Kept as the reference
+        the finite differences are checked against.
+    */
+    static void generateFaceAveraged(const float* heights, int width, int depth, float spacing, float* normals);
+
+    //Times both approaches on the grid and prints how far apart their normals are
+    static void benchmark(const float* heights, int width, int depth, float spacing);
+
+private:
+    static void generateRows(const float* heights, int width, int depth, float spacing, const float* scaleX,
+                             int firstRow, int endRow, float* normals);
+};
+
+#endif
@@ -0,0 +1,347 @@
+#include <algorithm>
+
+#include "quadtree.h"
+
+//Fraction of a LOD range after which vertices start morphing towards the next level
+const float MORPH_START_RATIO = 0.66f;
+
+//Morph range used for the coarsest level, it has nothing to morph into
+const float NO_MORPH_START = 1.0e30f;
+const float NO_MORPH_END = 2.0e30f;
+
+TerrainQuadtree::TerrainQuadtree():
+m_width(0),
+m_depth(0),
+m_leafSize(0),
+m_root(-1),
+m_offsetX(0.0f),
+m_offsetZ(0.0f)
+{
+
+}
+
+int TerrainQuadtree::computeLevelCount(int width, int leafSize)
+{
+    //Find the smallest power of two multiple of the leaf that covers the map
+    int rootSize = leafSize;
+    int levels = 1;
+    while (rootSize < width - 1)
+    {
+        rootSize *= 2;
+        ++levels;
+    }
+
+    return levels;
+}
+
+void TerrainQuadtree::build(int width, int depth, int leafSize, float leafRange, const glm::vec2* leafBounds, int leafCount)
+{
+    buildLevels(width, depth, leafSize, leafRange);
+
+    int levels = getLevelCount();
+    m_nodes.clear();
+    m_root = buildNode(leafBounds, leafCount, 0, 0, leafSize << (levels - 1), levels - 1);
+}
+
+void TerrainQuadtree::build(int width, int depth, int leafSize, float leafRange, const QuadtreeNode* nodes, int nodeCount)
+{
+    buildLevels(width, depth, leafSize, leafRange);
+
+    //buildNode adds the root last
+    m_nodes.assign(nodes, nodes + nodeCount);
+    m_root = nodeCount - 1;
+}
+
+void TerrainQuadtree::buildLevels(int width, int depth, int leafSize, float leafRange)
+{
+    m_width = width;
+    m_depth = depth;
+    m_leafSize = leafSize;
+    m_offsetX = float(-width / 2); //Matches the vertex positions of the original grid
+    m_offsetZ = float(-depth / 2);
+
+    int levels = computeLevelCount(std::max(width, depth), leafSize);
+
+    //Each level is visible twice as far as the one below it
+    m_ranges.resize(levels);
+    m_morphStart.resize(levels);
+    m_morphEnd.resize(levels);
+
+    float range = leafRange;
+    float previous = 0.0f;
+    for (int i = 0; i < levels; ++i)
+    {
+        m_ranges[i] = range;
+        m_morphEnd[i] = range;
+        m_morphStart[i] = previous + (range - previous) * MORPH_START_RATIO;
+
+        previous = range;
+        range *= 2.0f;
+    }
+
+    m_morphStart[levels - 1] = NO_MORPH_START;
+    m_morphEnd[levels - 1] = NO_MORPH_END;
+}
+
+int TerrainQuadtree::buildNode(const glm::vec2* leafBounds, int leafCount, int x, int z, int size, int level)
+{
+    //Nodes that start past the last quad of the map are never drawn
+    if (x >= m_width - 1 || z >= m_depth - 1)
+    {
+        return -1;
+    }
+
+    QuadtreeNode node;
+    node.x = x;
+    node.z = z;
+    node.size = size;
+    node.level = level;
+    for (int i = 0; i < 4; ++i)
+    {
+        node.children[i] = -1;
+    }
+
+    if (level == 0)
+    {
+        const glm::vec2& bounds = leafBounds[(z / m_leafSize) * leafCount + (x / m_leafSize)];
+        node.minY = bounds.x;
+        node.maxY = bounds.y;
+    }
+    else
+    {
+        node.minY = 1.0e30f;
+        node.maxY = -1.0e30f;
+
+        int half = size / 2;
+        for (int i = 0; i < 4; ++i)
+        {
+            int child = buildNode(leafBounds, leafCount, x + (i & 1) * half, z + (i >> 1) * half, half, level - 1);
+            node.children[i] = child;
+
+            if (child != -1)
+            {
+                node.minY = std::min(node.minY, m_nodes[child].minY);
+                node.maxY = std::max(node.maxY, m_nodes[child].maxY);
+            }
+        }
+    }
+
+    m_nodes.push_back(node);
+    return int(m_nodes.size()) - 1;
+}
+
+void TerrainQuadtree::updateBounds(const glm::vec2* leafBounds, int leafCount, const SampleRegion& region)
+{
+    if (m_root != -1)
+    {
+        updateNodeBounds(m_root, leafBounds, leafCount, region);
+    }
+}
+
+//Children are visited before their parent, like in buildNode
+void TerrainQuadtree::updateNodeBounds(int index, const glm::vec2* leafBounds, int leafCount, const SampleRegion& region)
+{
+    QuadtreeNode& node = m_nodes[index];
+
+    //The samples on the far edges belong to the node too
+    if (node.x >= region.endX || node.x + node.size < region.firstX ||
+        node.z >= region.endZ || node.z + node.size < region.firstZ)
+    {
+        return;
+    }
+
+    if (node.level == 0)
+    {
+        const glm::vec2& bounds = leafBounds[(node.z / m_leafSize) * leafCount + (node.x / m_leafSize)];
+        node.minY = bounds.x;
+        node.maxY = bounds.y;
+        return;
+    }
+
+    node.minY = 1.0e30f;
+    node.maxY = -1.0e30f;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        int child = node.children[i];
+        if (child != -1)
+        {
+            updateNodeBounds(child, leafBounds, leafCount, region);
+            node.minY = std::min(node.minY, m_nodes[child].minY);
+            node.maxY = std::max(node.maxY, m_nodes[child].maxY);
+        }
+    }
+}
+
+void TerrainQuadtree::select(const glm::vec3& cameraPosition, const Frustum& frustum, const vector<unsigned char>& ready,
+                             vector<NodeSelection>& selection, vector<int>& missing) const
+{
+    selection.clear();
+    missing.clear();
+
+    if (m_root != -1)
+    {
+        selectNode(m_root, cameraPosition, frustum, false, ready, selection, missing);
+    }
+}
+
+/**
+Returns false if the node is outside of its LOD range, in that case the parent
+draws the area with its own, coarser, patch. Because a node is only subdivided
+when the camera is within the range of the next finer level, neighbouring
+nodes never differ by more than one level and the morph has fully collapsed
+the finer patch onto the coarser one along the shared edge, so there are no
+cracks.
+
+Nodes outside of the frustum count as handled so nobody draws them. Once a
+node is entirely inside the frustum its children are too, fullyVisible
+skips the plane tests for the rest of that branch.
+
+A node whose patch is still being streamed in is treated as out of range,
+its parent keeps covering the area until the patch arrives.
+*/
+bool TerrainQuadtree::selectNode(int index, const glm::vec3& cameraPosition, const Frustum& frustum, bool fullyVisible,
+                                 const vector<unsigned char>& ready, vector<NodeSelection>& selection, vector<int>& missing) const
+{
+    const QuadtreeNode& node = m_nodes[index];
+    int topLevel = getLevelCount() - 1;
+
+    //The coarsest level always covers the rest of the map
+    if (node.level < topLevel && !intersectsSphere(node, cameraPosition, m_ranges[node.level]))
+    {
+        return false;
+    }
+
+    if (!fullyVisible)
+    {
+        glm::vec3 boxMin, boxMax;
+        getNodeBounds(node, boxMin, boxMax);
+
+        Frustum::Result result = frustum.testBox(boxMin, boxMax);
+        if (result == Frustum::OUTSIDE)
+        {
+            return true;
+        }
+
+        fullyVisible = (result == Frustum::INSIDE);
+    }
+
+    if (!ready[index])
+    {
+        missing.push_back(index);
+        return false;
+    }
+
+    NodeSelection entry;
+    entry.node = index;
+    entry.quadrants = ALL_QUADRANTS;
+
+    if (node.level == 0 || !intersectsSphere(node, cameraPosition, m_ranges[node.level - 1]))
+    {
+        if (!fullyVisible)
+        {
+            entry.quadrants = visibleQuadrants(node, frustum);
+        }
+
+        if (entry.quadrants != 0)
+        {
+            selection.push_back(entry);
+        }
+        return true;
+    }
+
+    //Let the children draw what they can, we fill in the rest
+    entry.quadrants = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (node.children[i] != -1 && !selectNode(node.children[i], cameraPosition, frustum, fullyVisible, ready, selection, missing))
+        {
+            entry.quadrants |= 1 << i;
+        }
+    }
+
+    if (entry.quadrants != 0)
+    {
+        selection.push_back(entry);
+    }
+
+    return true;
+}
+
+/**
+Drops the quadrants of a partially visible node whose child bounds are
+outside of the frustum, the child bounds are tighter than the node's.
+*/
+unsigned int TerrainQuadtree::visibleQuadrants(const QuadtreeNode& node, const Frustum& frustum) const
+{
+    if (node.level == 0)
+    {
+        return ALL_QUADRANTS;
+    }
+
+    unsigned int quadrants = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (node.children[i] == -1)
+        {
+            continue;
+        }
+
+        glm::vec3 boxMin, boxMax;
+        getNodeBounds(m_nodes[node.children[i]], boxMin, boxMax);
+
+        if (frustum.testBox(boxMin, boxMax) != Frustum::OUTSIDE)
+        {
+            quadrants |= 1 << i;
+        }
+    }
+
+    return quadrants;
+}
+
+void TerrainQuadtree::getNodeBounds(const QuadtreeNode& node, glm::vec3& boxMin, glm::vec3& boxMax) const
+{
+    boxMin = glm::vec3(sampleToWorldX(node.x), node.minY, sampleToWorldZ(node.z));
+    boxMax = glm::vec3(sampleToWorldX(std::min(node.x + node.size, m_width - 1)), node.maxY,
+                       sampleToWorldZ(std::min(node.z + node.size, m_depth - 1)));
+}
+
+/**
+The child holds the tighter bounds where there is one, the quadrants of
+the finest level share the bounds of their node.
+*/
+bool TerrainQuadtree::getQuadrantBounds(const QuadtreeNode& node, int quadrant, glm::vec3& boxMin, glm::vec3& boxMax) const
+{
+    if (node.level > 0)
+    {
+        if (node.children[quadrant] == -1)
+        {
+            return false;
+        }
+
+        getNodeBounds(m_nodes[node.children[quadrant]], boxMin, boxMax);
+        return true;
+    }
+
+    const int half = node.size / 2;
+    const int x = node.x + (quadrant & 1) * half;
+    const int z = node.z + (quadrant >> 1) * half;
+    if (x >= m_width - 1 || z >= m_depth - 1)
+    {
+        return false;
+    }
+
+    boxMin = glm::vec3(sampleToWorldX(x), node.minY, sampleToWorldZ(z));
+    boxMax = glm::vec3(sampleToWorldX(std::min(x + half, m_width - 1)), node.maxY, sampleToWorldZ(std::min(z + half, m_depth - 1)));
+    return true;
+}
+
+bool TerrainQuadtree::intersectsSphere(const QuadtreeNode& node, const glm::vec3& center, float radius) const
+{
+    glm::vec3 boxMin, boxMax;
+    getNodeBounds(node, boxMin, boxMax);
+
+    glm::vec3 closest = glm::clamp(center, boxMin, boxMax);
+    glm::vec3 delta = closest - center;
+    return glm::dot(delta, delta) <= radius * radius;
+}
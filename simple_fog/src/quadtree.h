@@ -0,0 +1,104 @@
+#ifndef BOGLGP_QUADTREE_H
+#define BOGLGP_QUADTREE_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "frustum.h"
+#include "tiledheightmap.h"
+
+using std::vector;
+
+/*
+    A node covers a square block of heightmap samples, the root a square
+    that covers the whole map however long its sides. Every node is drawn
+    with the same patch of leafSize x leafSize quads, so a node at level L
+    samples the heightmap every 2^L samples. Level 0 is the finest level.
+
+    Children and patch quadrants use the same ordering:
+
+        +---+---+
+        | 0 | 1 |    x grows to the right
+        +---+---+
+        | 2 | 3 |    z grows downwards
+        +---+---+
+*/
+struct QuadtreeNode
+{
+    int x, z;           //Origin of the node in heightmap samples
+    int size;           //Width of the node in heightmap samples
+    int level;          //LOD level, 0 is the finest
+    float minY, maxY;   //Height bounds of everything below this node
+    int children[4];    //Indices into the node pool, -1 if outside the map
+};
+
+struct NodeSelection
+{
+    int node;               //Index of the selected node
+    unsigned int quadrants; //Bit mask of the quadrants that should be drawn
+};
+
+class TerrainQuadtree
+{
+public:
+    static const unsigned int ALL_QUADRANTS = 0xF;
+
+    TerrainQuadtree();
+
+    static int computeLevelCount(int width, int leafSize);
+
+    //leafBounds holds the min/max height of every leafSize block of the map, leafCount per row
+    void build(int width, int depth, int leafSize, float leafRange, const glm::vec2* leafBounds, int leafCount);
+
+    //Takes the nodes, bounds included, from an earlier build instead of the leaf bounds
+    void build(int width, int depth, int leafSize, float leafRange, const QuadtreeNode* nodes, int nodeCount);
+
+    //Takes the height bounds of the nodes over region from the leaf bounds again, after the heights changed
+    void updateBounds(const glm::vec2* leafBounds, int leafCount, const SampleRegion& region);
+
+    /*
+        Fills selection with the visible nodes to draw from cameraPosition
+        (CDLOD selection). Nodes without a ready patch are left to their
+        parent and added to missing.
+    */
+    void select(const glm::vec3& cameraPosition, const Frustum& frustum, const vector<unsigned char>& ready,
+                vector<NodeSelection>& selection, vector<int>& missing) const;
+
+    const QuadtreeNode& getNode(int index) const { return m_nodes[index]; }
+    int getNodeCount() const { return int(m_nodes.size()); }
+    int getLevelCount() const { return int(m_ranges.size()); }
+
+    float getMorphStart(int level) const { return m_morphStart[level]; }
+    float getMorphEnd(int level) const { return m_morphEnd[level]; }
+
+    //Converts heightmap sample coordinates into world coordinates
+    float sampleToWorldX(int sample) const { return float(sample) + m_offsetX; }
+    float sampleToWorldZ(int sample) const { return float(sample) + m_offsetZ; }
+
+    void getNodeBounds(const QuadtreeNode& node, glm::vec3& boxMin, glm::vec3& boxMax) const;
+
+    //Bounds of the part of the map a quadrant of a node's patch covers, false if it is past the edge of the map
+    bool getQuadrantBounds(const QuadtreeNode& node, int quadrant, glm::vec3& boxMin, glm::vec3& boxMax) const;
+
+private:
+    void buildLevels(int width, int depth, int leafSize, float leafRange);
+    int buildNode(const glm::vec2* leafBounds, int leafCount, int x, int z, int size, int level);
+    void updateNodeBounds(int index, const glm::vec2* leafBounds, int leafCount, const SampleRegion& region);
+    bool selectNode(int index, const glm::vec3& cameraPosition, const Frustum& frustum, bool fullyVisible,
+                    const vector<unsigned char>& ready, vector<NodeSelection>& selection, vector<int>& missing) const;
+    unsigned int visibleQuadrants(const QuadtreeNode& node, const Frustum& frustum) const;
+    bool intersectsSphere(const QuadtreeNode& node, const glm::vec3& center, float radius) const;
+
+    vector<QuadtreeNode> m_nodes;
+    vector<float> m_ranges;
+    vector<float> m_morphStart;
+    vector<float> m_morphEnd;
+
+    int m_width;
+    int m_depth;
+    int m_leafSize;
+    int m_root;
+    float m_offsetX;
+    float m_offsetZ;
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include <sys/stat.h>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <iostream>
+
+#include "rawheightmap.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAW_USE_SSE
+#include <emmintrin.h>
+#endif
+
+static int getSampleSize(RawSampleFormat format)
+{
+    return (format == RAW_UNSIGNED_8) ? 1 : 2;
+}
+
+//The height the largest sample of a format converts to
+static unsigned int getFullHeight(RawSampleFormat format)
+{
+    return (format == RAW_UNSIGNED_8) ? 0xFF00 : 0xFFFF;
+}
+
+RawHeightmap::RawHeightmap():
+m_samples(NULL),
+m_width(0),
+m_depth(0),
+m_sampleFormat(RAW_UNSIGNED_8),
+m_maxHeight(0)
+{
+
+}
+
+bool RawHeightmap::open(const string& fileName, const RawHeightmapFormat& format)
+{
+    close();
+
+    if (!m_file.open(fileName))
+    {
+        std::cout << "File does not exist" << std::endl;
+        return false;
+    }
+
+    m_fileName = fileName;
+
+    unsigned int headerSize = format.headerSize;
+    m_width = format.width;
+    m_depth = format.depth;
+    m_sampleFormat = format.sampleFormat;
+    m_maxHeight = getFullHeight(m_sampleFormat);
+
+    bool hasHeader = m_file.getSize() >= 2 && memcmp(m_file.getData(), "P5", 2) == 0;
+    if (hasHeader)
+    {
+        int maxValue = 0;
+        if (!parsePGMHeader(headerSize, maxValue))
+        {
+            std::cout << "Could not read the PGM header of " << fileName << std::endl;
+            close();
+            return false;
+        }
+
+        m_sampleFormat = (maxValue > 255) ? RAW_UNSIGNED_16_BIG : RAW_UNSIGNED_8;
+        m_maxHeight = (m_sampleFormat == RAW_UNSIGNED_8) ? (unsigned int)(maxValue << 8) : (unsigned int)maxValue;
+    }
+
+    size_t dataSize = size_t(m_width) * m_depth * getSampleSize(m_sampleFormat);
+
+    //Without a header nothing may follow the samples, it would mean the size is wrong
+    if (m_width < 2 || m_depth < 2 || m_file.getSize() < headerSize + dataSize ||
+        (!hasHeader && m_file.getSize() != headerSize + dataSize))
+    {
+        std::cout << "Image size does not match passed width" << std::endl;
+        close();
+        return false;
+    }
+
+    m_samples = reinterpret_cast<const unsigned char*>(m_file.getData()) + headerSize;
+    return true;
+}
+
+void RawHeightmap::close()
+{
+    m_file.close();
+    m_samples = NULL;
+    m_width = m_depth = 0;
+}
+
+bool RawHeightmap::getFileStamp(unsigned int& size, unsigned int& time) const
+{
+    struct stat info;
+    if (stat(m_fileName.c_str(), &info) != 0)
+    {
+        return false;
+    }
+
+    size = (unsigned int)info.st_size;
+    time = (unsigned int)info.st_mtime;
+    return true;
+}
+
+/**
+P5, the width, the height and the maximum value as text separated by
+whitespace, with comments from # to the end of a line, then a single
+whitespace character before the samples.
+*/
+bool RawHeightmap::parsePGMHeader(unsigned int& headerSize, int& maxValue)
+{
+    const char* data = m_file.getData();
+    const size_t size = m_file.getSize();
+    size_t position = 2;
+
+    int values[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        while (position < size && (isspace((unsigned char)data[position]) || data[position] == '#'))
+        {
+            if (data[position] == '#')
+            {
+                while (position < size && data[position] != '\n')
+                {
+                    ++position;
+                }
+            }
+            else
+            {
+                ++position;
+            }
+        }
+
+        if (position >= size || !isdigit((unsigned char)data[position]))
+        {
+            return false;
+        }
+
+        values[i] = 0;
+        while (position < size && isdigit((unsigned char)data[position]) && values[i] < 0x1000000)
+        {
+            values[i] = values[i] * 10 + (data[position] - '0');
+            ++position;
+        }
+    }
+
+    if (position >= size || !isspace((unsigned char)data[position]) || values[2] < 1 || values[2] > 0xFFFF)
+    {
+        return false;
+    }
+
+    m_width = values[0];
+    m_depth = values[1];
+    maxValue = values[2];
+    headerSize = (unsigned int)(position + 1);
+    return true;
+}
+
+void RawHeightmap::readRows(int firstRow, int endRow, unsigned short* heights) const
+{
+    const size_t rowSize = size_t(m_width) * getSampleSize(m_sampleFormat);
+    const int count = m_width * (endRow - firstRow);
+    convertSamples(m_samples + rowSize * firstRow, m_sampleFormat, count, heights);
+
+    //A PGM maximum short of the format's range is stretched over all of it, samples above it are clamped
+    const unsigned int fullHeight = getFullHeight(m_sampleFormat);
+    if (m_maxHeight != fullHeight)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            heights[i] = (unsigned short)(std::min((unsigned int)heights[i], m_maxHeight) * fullHeight / m_maxHeight);
+        }
+    }
+}
+
+/**
+With SSE2, 8 bit samples are interleaved with zero bytes so that they land
+in the high byte, and big endian samples swap their bytes with two shifts,
+16 samples or 8 samples at a time. Little endian samples are already what
+x86 wants and are copied. The scalar loop assembles samples byte by byte,
+which works on a host of either endianness.
+*/
+void RawHeightmap::convertSamples(const unsigned char* source, RawSampleFormat format, int count, unsigned short* heights)
+{
+    int i = 0;
+
+#ifdef RAW_USE_SSE
+    const __m128i zero = _mm_setzero_si128();
+
+    if (format == RAW_UNSIGNED_8)
+    {
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(heights + i), _mm_unpacklo_epi8(zero, bytes));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(heights + i + 8), _mm_unpackhi_epi8(zero, bytes));
+        }
+    }
+    else if (format == RAW_UNSIGNED_16_LITTLE)
+    {
+        memcpy(heights, source, sizeof(unsigned short) * count);
+        return;
+    }
+    else
+    {
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i words = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 2));
+            words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(heights + i), words);
+        }
+    }
+#endif
+
+    switch (format)
+    {
+    case RAW_UNSIGNED_8:
+        for (; i < count; ++i)
+        {
+            heights[i] = (unsigned short)(source[i] << 8);
+        }
+        break;
+    case RAW_UNSIGNED_16_LITTLE:
+        for (; i < count; ++i)
+        {
+            heights[i] = (unsigned short)(source[i * 2] | (source[i * 2 + 1] << 8));
+        }
+        break;
+    default:
+        for (; i < count; ++i)
+        {
+            heights[i] = (unsigned short)((source[i * 2] << 8) | source[i * 2 + 1]);
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef BOGLGP_RAWHEIGHTMAP_H
+#define BOGLGP_RAWHEIGHTMAP_H
+
+#include <string>
+#include "mappedfile.h"
+
+using std::string;
+
+enum RawSampleFormat
+{
+    RAW_UNSIGNED_8,             //One byte per sample
+    RAW_UNSIGNED_16_LITTLE,     //Two bytes per sample, least significant first
+    RAW_UNSIGNED_16_BIG         //Two bytes per sample, most significant first
+};
+
+//How to read a heightmap without a header of its own
+struct RawHeightmapFormat
+{
+    int width;                  //Samples along x
+    int depth;                  //Samples along z, the number of rows
+    RawSampleFormat sampleFormat;
+    unsigned int headerSize;    //Bytes to skip before the first sample
+
+    RawHeightmapFormat(int width, int depth, RawSampleFormat sampleFormat = RAW_UNSIGNED_8, unsigned int headerSize = 0):
+    width(width),
+    depth(depth),
+    sampleFormat(sampleFormat),
+    headerSize(headerSize)
+    {
+    }
+};
+
+/*
+    A heightmap file mapped into memory, rows of samples with x growing
+    along a row and z from row to row. Files that start with a binary PGM
+    header (P5) describe their own size and depth, the format passed to
+    open only applies to headerless files. PGM samples are 16 bit big
+    endian when the maximum value is above 255, and are scaled so that the
+    maximum value is the top of the range, like a full range file.
+
+    Nothing is read up front, rows are converted straight from the mapping
+    into the caller's buffer as 16 bit heights. 8 bit samples become the
+    high byte so both depths share one scale.
+*/
+class RawHeightmap
+{
+public:
+    RawHeightmap();
+
+    bool open(const string& fileName, const RawHeightmapFormat& format);
+    void close();
+
+    const string& getFileName() const { return m_fileName; }
+    int getWidth() const { return m_width; }
+    int getDepth() const { return m_depth; }
+    RawSampleFormat getSampleFormat() const { return m_sampleFormat; }
+
+    //Size and modification time of the file, what derived files are checked against
+    bool getFileStamp(unsigned int& size, unsigned int& time) const;
+
+    //Converts the rows [firstRow, endRow) into heights, getWidth() per row
+    void readRows(int firstRow, int endRow, unsigned short* heights) const;
+
+    //The conversion kernel, count samples of format from source into heights
+    static void convertSamples(const unsigned char* source, RawSampleFormat format, int count, unsigned short* heights);
+
+private:
+    bool parsePGMHeader(unsigned int& headerSize, int& maxValue);
+
+    MappedFile m_file;
+    string m_fileName;
+    const unsigned char* m_samples;
+    int m_width;
+    int m_depth;
+    RawSampleFormat m_sampleFormat;
+    unsigned int m_maxHeight;       //What the PGM maximum value converts to, the top of the range without a header
+};
+
+#endif
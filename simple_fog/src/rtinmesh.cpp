@@ -0,0 +1,137 @@
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include "rtinmesh.h"
+
+using std::max;
+
+RtinMesh::RtinMesh(int gridSize):
+m_gridSize(gridSize)
+{
+    int size = gridSize - 1;
+    assert(size > 0 && (size & (size - 1)) == 0);
+
+    //Triangle i of the hierarchy has the id i + 2. The lowest bit of the id
+    //picks one of the two halves of the grid and every bit above it, from the
+    //top down, one of the two halves of the triangle before.
+    int triangles = size * size * 2 - 2;
+    m_hypotenuses.resize(triangles * 4);
+
+    for (int i = 0; i < triangles; ++i)
+    {
+        int id = i + 2;
+        int ax = 0, az = 0, bx = 0, bz = 0, cx = 0, cz = 0;
+        if (id & 1)
+        {
+            bx = bz = cx = size;
+        }
+        else
+        {
+            ax = az = cz = size;
+        }
+
+        while ((id >>= 1) > 1)
+        {
+            int mx = (ax + bx) >> 1;
+            int mz = (az + bz) >> 1;
+
+            if (id & 1)
+            {
+                bx = ax; bz = az;
+                ax = cx; az = cz;
+            }
+            else
+            {
+                ax = bx; az = bz;
+                bx = cx; bz = cz;
+            }
+
+            cx = mx;
+            cz = mz;
+        }
+
+        m_hypotenuses[i * 4 + 0] = (unsigned short)ax;
+        m_hypotenuses[i * 4 + 1] = (unsigned short)az;
+        m_hypotenuses[i * 4 + 2] = (unsigned short)bx;
+        m_hypotenuses[i * 4 + 3] = (unsigned short)bz;
+    }
+}
+
+void RtinMesh::computeErrors(const float* heights, int stride, const unsigned char* keep, float* errors) const
+{
+    int vertexCount = m_gridSize * m_gridSize;
+    for (int i = 0; i < vertexCount; ++i)
+    {
+        errors[i] = (keep && keep[i]) ? FLT_MAX : 0.0f;
+    }
+
+    //The finest triangles come last, so walking backwards every vertex has
+    //its own error complete before the triangle it splits is reached
+    int size = m_gridSize - 1;
+    int triangles = int(m_hypotenuses.size() / 4);
+    int parents = triangles - size * size;
+
+    for (int i = triangles - 1; i >= 0; --i)
+    {
+        int ax = m_hypotenuses[i * 4 + 0];
+        int az = m_hypotenuses[i * 4 + 1];
+        int bx = m_hypotenuses[i * 4 + 2];
+        int bz = m_hypotenuses[i * 4 + 3];
+
+        int mx = (ax + bx) >> 1;
+        int mz = (az + bz) >> 1;
+        int middle = mz * m_gridSize + mx;
+
+        float interpolated = (heights[(az * m_gridSize + ax) * stride] + heights[(bz * m_gridSize + bx) * stride]) * 0.5f;
+        float error = max(errors[middle], std::fabs(interpolated - heights[middle * stride]));
+
+        if (i < parents)
+        {
+            //The right angle corner, the children split the two legs
+            int cx = mx + mz - az;
+            int cz = mz + ax - mx;
+
+            error = max(error, errors[((az + cz) >> 1) * m_gridSize + ((ax + cx) >> 1)]);
+            error = max(error, errors[((bz + cz) >> 1) * m_gridSize + ((bx + cx) >> 1)]);
+        }
+
+        errors[middle] = error;
+    }
+}
+
+void RtinMesh::buildMesh(const float* errors, float maxError, vector<unsigned int>& indices) const
+{
+    int size = m_gridSize - 1;
+    addTriangle(errors, maxError, 0, 0, size, size, size, 0, indices);
+    addTriangle(errors, maxError, size, size, 0, 0, 0, size, indices);
+}
+
+void RtinMesh::addTriangle(const float* errors, float maxError, int ax, int az, int bx, int bz, int cx, int cz,
+                           vector<unsigned int>& indices) const
+{
+    int mx = (ax + bx) >> 1;
+    int mz = (az + bz) >> 1;
+
+    if (std::abs(ax - cx) + std::abs(az - cz) > 1 && errors[mz * m_gridSize + mx] > maxError)
+    {
+        addTriangle(errors, maxError, cx, cz, ax, az, mx, mz, indices);
+        addTriangle(errors, maxError, bx, bz, cx, cz, mx, mz, indices);
+        return;
+    }
+
+    unsigned int a = az * m_gridSize + ax;
+    unsigned int b = bz * m_gridSize + bx;
+    unsigned int c = cz * m_gridSize + cx;
+
+    //The grid rows turn from +z towards +x, triangles of the hierarchy alternate
+    if ((bx - ax) * (cz - az) - (bz - az) * (cx - ax) > 0)
+    {
+        std::swap(b, c);
+    }
+
+    indices.push_back(a);
+    indices.push_back(b);
+    indices.push_back(c);
+}
@@ -0,0 +1,48 @@
+#ifndef BOGLGP_RTINMESH_H
+#define BOGLGP_RTINMESH_H
+
+#include <vector>
+
+using std::vector;
+
+/*
+    Right triangulated irregular network over a square grid of 2^k + 1
+    vertices on a side, after Mapbox's Martini. The grid is split along its
+    diagonal into two right triangles and every triangle splits into two
+    more at the middle of its hypotenuse, down to the single cells.
+
+    The error of a vertex is how far the surface moves when the triangles
+    it splits are left whole, raised to the errors of the vertices that
+    depend on it. A mesh for an error bound then splits a triangle exactly
+    when the vertex in the middle of its hypotenuse has a larger error. The
+    two triangles that share a hypotenuse see the same vertex and make the
+    same choice, so the mesh never has cracks.
+
+    Vertex i of the grid is at x = i % gridSize, z = i / gridSize.
+*/
+class RtinMesh
+{
+public:
+    explicit RtinMesh(int gridSize);
+
+    int getGridSize() const { return m_gridSize; }
+
+    /*
+        Fills errors with one value per vertex. heights holds the height of
+        vertex i at heights[i * stride]. Vertices with a nonzero keep byte
+        are never dropped, keep may be NULL.
+    */
+    void computeErrors(const float* heights, int stride, const unsigned char* keep, float* errors) const;
+
+    //Appends the triangles of the coarsest mesh within maxError, wound like the rows of IndexBuilder
+    void buildMesh(const float* errors, float maxError, vector<unsigned int>& indices) const;
+
+private:
+    void addTriangle(const float* errors, float maxError, int ax, int az, int bx, int bz, int cx, int cz,
+                     vector<unsigned int>& indices) const;
+
+    int m_gridSize;
+    vector<unsigned short> m_hypotenuses;   //ax, az, bx, bz of every triangle of the hierarchy, finest last
+};
+
+#endif
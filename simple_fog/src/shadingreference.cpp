@@ -0,0 +1,469 @@
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include "shadingreference.h"
+#include "normalgenerator.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SHADING_USE_SSE
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+using std::vector;
+
+//Largest difference of any color channel or blend factor that still counts as a match
+const float MATCH_TOLERANCE = 1e-4f;
+
+const float LOG2_E = 1.44269504f;
+
+//Everything the shader works out once per draw rather than per vertex
+struct ShadingConstants
+{
+    float light[3];             //Eye space direction towards the light
+    float ambient[4];           //material_ambient * light0.ambient
+    float diffuse[4];           //material_diffuse * light0.diffuse
+    float specular[4];          //material_specular * light0.specular
+};
+
+static ShadingConstants getConstants(const ShadingParameters& parameters)
+{
+    ShadingConstants constants;
+
+    //normalize(modelview_matrix * light0.position).xyz, the w counts towards the length
+    const float* m = parameters.modelview;
+    const float* p = parameters.lightPosition;
+    float light[4];
+    float lengthSquared = 0.0f;
+    for (int i = 0; i < 4; ++i)
+    {
+        light[i] = m[i] * p[0] + m[4 + i] * p[1] + m[8 + i] * p[2] + m[12 + i] * p[3];
+        lengthSquared += light[i] * light[i];
+    }
+
+    for (int i = 0; i < 3; ++i)
+    {
+        constants.light[i] = light[i] / std::sqrt(lengthSquared);
+    }
+
+    for (int i = 0; i < 4; ++i)
+    {
+        constants.ambient[i] = parameters.materialAmbient[i] * parameters.lightAmbient[i];
+        constants.diffuse[i] = parameters.materialDiffuse[i] * parameters.lightDiffuse[i];
+        constants.specular[i] = parameters.materialSpecular[i] * parameters.lightSpecular[i];
+    }
+
+    return constants;
+}
+
+/*
+    One float per lane, so that the kernel below is written once for every
+    width. Comparisons give masks that select picks lanes by.
+*/
+struct Float1
+{
+    float v;
+
+    Float1(float value): v(value) {}
+    static Float1 load(const float* p) { return Float1(*p); }
+    void store(float* p) const { *p = v; }
+};
+
+static inline Float1 operator+(Float1 a, Float1 b) { return a.v + b.v; }
+static inline Float1 operator-(Float1 a, Float1 b) { return a.v - b.v; }
+static inline Float1 operator*(Float1 a, Float1 b) { return a.v * b.v; }
+static inline Float1 operator/(Float1 a, Float1 b) { return a.v / b.v; }
+static inline Float1 min(Float1 a, Float1 b) { return std::min(a.v, b.v); }
+static inline Float1 max(Float1 a, Float1 b) { return std::max(a.v, b.v); }
+static inline Float1 sqrt(Float1 a) { return std::sqrt(a.v); }
+static inline Float1 exp2(Float1 a) { return std::exp2(a.v); }
+static inline Float1 log2(Float1 a) { return std::log2(a.v); }
+static inline Float1 greaterThan(Float1 a, Float1 b) { return (a.v > b.v) ? 1.0f : 0.0f; }
+static inline Float1 select(Float1 mask, Float1 a, Float1 b) { return (mask.v != 0.0f) ? a : b; }
+
+#ifdef SHADING_USE_SSE
+struct Float4
+{
+    __m128 v;
+
+    Float4(__m128 value): v(value) {}
+    Float4(float value): v(_mm_set1_ps(value)) {}
+    static Float4 load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+static inline Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+static inline Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+static inline Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+static inline Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+static inline Float4 min(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+static inline Float4 max(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+static inline Float4 sqrt(Float4 a) { return _mm_sqrt_ps(a.v); }
+static inline Float4 greaterThan(Float4 a, Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+static inline Float4 select(Float4 mask, Float4 a, Float4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+
+/**
+2^x split into 2^floor(x), built straight in the exponent bits, and 2^fract(x)
+from a polynomial. Both polynomials here and in log2 are minimax fits, this
+one is good to 2e-7 relative and the one of log2 to 1e-5 absolute.
+*/
+static inline Float4 exp2(Float4 x)
+{
+    x = min(max(x, Float4(-126.0f)), Float4(127.0f));
+
+    //SSE2 has no floor, truncation rounds the negatives up
+    __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(x.v));
+    __m128 whole = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, x.v), _mm_set1_ps(1.0f)));
+    Float4 f = x - Float4(whole);
+
+    __m128 power = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(whole), _mm_set1_epi32(127)), 23));
+    Float4 p = ((((Float4(1.8775767e-3f) * f + Float4(8.9893397e-3f)) * f + Float4(5.5826318e-2f)) * f +
+                 Float4(2.4015361e-1f)) * f + Float4(6.9315308e-1f)) * f + Float4(9.9999994e-1f);
+    return Float4(power) * p;
+}
+
+//Only for x > 0, the exponent bits give the whole part and a polynomial the rest
+static inline Float4 log2(Float4 x)
+{
+    __m128i bits = _mm_castps_si128(x.v);
+    Float4 exponent = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    Float4 m = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF))), _mm_set1_ps(1.0f));
+
+    Float4 p = ((((Float4(-3.4436006e-2f) * m + Float4(3.1821337e-1f)) * m + Float4(-1.2315303f)) * m +
+                 Float4(2.5988452f)) * m + Float4(-3.3241990f)) * m + Float4(3.1157899f);
+    return p * (m - Float4(1.0f)) + exponent;
+}
+#endif
+
+#ifdef __AVX__
+struct Float8
+{
+    __m256 v;
+
+    Float8(__m256 value): v(value) {}
+    Float8(float value): v(_mm256_set1_ps(value)) {}
+    static Float8 load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+static inline Float8 operator+(Float8 a, Float8 b) { return _mm256_add_ps(a.v, b.v); }
+static inline Float8 operator-(Float8 a, Float8 b) { return _mm256_sub_ps(a.v, b.v); }
+static inline Float8 operator*(Float8 a, Float8 b) { return _mm256_mul_ps(a.v, b.v); }
+static inline Float8 operator/(Float8 a, Float8 b) { return _mm256_div_ps(a.v, b.v); }
+static inline Float8 min(Float8 a, Float8 b) { return _mm256_min_ps(a.v, b.v); }
+static inline Float8 max(Float8 a, Float8 b) { return _mm256_max_ps(a.v, b.v); }
+static inline Float8 sqrt(Float8 a) { return _mm256_sqrt_ps(a.v); }
+static inline Float8 greaterThan(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+static inline Float8 select(Float8 mask, Float8 a, Float8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+
+//AVX has no 256 bit integer instructions, so the bit tricks go through the SSE versions a half at a time
+static inline Float8 exp2(Float8 x)
+{
+    Float4 low = exp2(Float4(_mm256_castps256_ps128(x.v)));
+    Float4 high = exp2(Float4(_mm256_extractf128_ps(x.v, 1)));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(low.v), high.v, 1);
+}
+
+static inline Float8 log2(Float8 x)
+{
+    Float4 low = log2(Float4(_mm256_castps256_ps128(x.v)));
+    Float4 high = log2(Float4(_mm256_extractf128_ps(x.v, 1)));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(low.v), high.v, 1);
+}
+#endif
+
+/**
+The vertices [first, first + width of F), the same steps as the shader on
+every lane. Lanes the light doesn't reach pick no specular and no diffuse
+instead of branching.
+*/
+template <class F>
+static inline void shadeVertices(const ShadingParameters& parameters, const ShadingConstants& constants,
+                                 const ShadingInput& input, int first, const ShadingOutput& output)
+{
+    const float* m = parameters.modelview;
+    const float* n = parameters.normalMatrix;
+    const float* l = constants.light;
+
+    F x = F::load(input.x + first);
+    F y = F::load(input.y + first);
+    F z = F::load(input.z + first);
+    F normalX = F::load(input.normalX + first);
+    F normalY = F::load(input.normalY + first);
+    F normalZ = F::load(input.normalZ + first);
+    F occlusion = input.occlusion ? F::load(input.occlusion + first) : F(1.0f);
+    F shadow = input.shadow ? F::load(input.shadow + first) : F(1.0f);
+
+    //N = normalize(normal_matrix * normal)
+    F nx = F(n[0]) * normalX + F(n[3]) * normalY + F(n[6]) * normalZ;
+    F ny = F(n[1]) * normalX + F(n[4]) * normalY + F(n[7]) * normalZ;
+    F nz = F(n[2]) * normalX + F(n[5]) * normalY + F(n[8]) * normalZ;
+    F inverse = F(1.0f) / sqrt(nx * nx + ny * ny + nz * nz);
+    nx = nx * inverse;
+    ny = ny * inverse;
+    nz = nz * inverse;
+
+    F NdotL = max(nx * F(l[0]) + ny * F(l[1]) + nz * F(l[2]), F(0.0f));
+
+    //pos = modelview_matrix * vec4(vertex, 1.0)
+    F px = F(m[0]) * x + F(m[4]) * y + F(m[8]) * z + F(m[12]);
+    F py = F(m[1]) * x + F(m[5]) * y + F(m[9]) * z + F(m[13]);
+    F pz = F(m[2]) * x + F(m[6]) * y + F(m[10]) * z + F(m[14]);
+    F pw = F(m[3]) * x + F(m[7]) * y + F(m[11]) * z + F(m[15]);
+
+    //HV = normalize(L + E) with E = -pos.xyz
+    F hx = F(l[0]) - px;
+    F hy = F(l[1]) - py;
+    F hz = F(l[2]) - pz;
+    inverse = F(1.0f) / sqrt(hx * hx + hy * hy + hz * hz);
+    F NdotHV = max((nx * hx + ny * hy + nz * hz) * inverse, F(0.0f));
+
+    //pow(NdotHV, material_shininess), a zero base comes out as 2^-126
+    F lit = greaterThan(NdotL, F(0.0f));
+    F specular = select(lit, exp2(F(parameters.materialShininess) * log2(max(NdotHV, F(1e-30f)))) * shadow, F(0.0f));
+    F diffuse = select(lit, NdotL * shadow, F(0.0f));
+
+    const float* emissive = parameters.materialEmissive;
+    const float* a = constants.ambient;
+    const float* d = constants.diffuse;
+    const float* s = constants.specular;
+    (F(emissive[0]) + (F(a[0]) + F(s[0]) * specular + F(d[0]) * diffuse) * occlusion).store(output.red + first);
+    (F(emissive[1]) + (F(a[1]) + F(s[1]) * specular + F(d[1]) * diffuse) * occlusion).store(output.green + first);
+    (F(emissive[2]) + (F(a[2]) + F(s[2]) * specular + F(d[2]) * diffuse) * occlusion).store(output.blue + first);
+    (F(emissive[3]) + F(a[3]) + F(s[3]) * specular + F(d[3]) * diffuse).store(output.alpha + first);
+
+    //length(pos) takes the w in too
+    F distance = sqrt(px * px + py * py + pz * pz + pw * pw);
+    F blendFactor(1.0f);
+    switch (parameters.fogMode)
+    {
+    case LINEAR_FOG:
+        blendFactor = min(max((F(parameters.fogEnd) - distance) / F(parameters.fogEnd - parameters.fogStart), F(0.0f)), F(1.0f));
+        break;
+    case EXP_FOG:
+        blendFactor = exp2(F(-parameters.fogDensity * LOG2_E) * distance);
+        break;
+    case EXP2_FOG:
+        blendFactor = exp2(F(-parameters.fogDensity) * distance);
+        break;
+    default:
+        break;
+    }
+
+    blendFactor.store(output.blendFactor + first);
+}
+
+void ShadingReference::shade(const ShadingParameters& parameters, const ShadingInput& input, int count, const ShadingOutput& output)
+{
+    ShadingConstants constants = getConstants(parameters);
+    int i = 0;
+
+#ifdef __AVX__
+    for (; i + 8 <= count; i += 8)
+    {
+        shadeVertices<Float8>(parameters, constants, input, i, output);
+    }
+#endif
+
+#ifdef SHADING_USE_SSE
+    for (; i + 4 <= count; i += 4)
+    {
+        shadeVertices<Float4>(parameters, constants, input, i, output);
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        shadeVertices<Float1>(parameters, constants, input, i, output);
+    }
+}
+
+void ShadingReference::shadeScalar(const ShadingParameters& parameters, const ShadingInput& input, int count, const ShadingOutput& output)
+{
+    glm::mat4 modelview = glm::make_mat4(parameters.modelview);
+    glm::mat3 normalMatrix = glm::make_mat3(parameters.normalMatrix);
+    glm::vec4 materialAmbient = glm::make_vec4(parameters.materialAmbient);
+    glm::vec4 materialDiffuse = glm::make_vec4(parameters.materialDiffuse);
+    glm::vec4 materialSpecular = glm::make_vec4(parameters.materialSpecular);
+    glm::vec4 materialEmissive = glm::make_vec4(parameters.materialEmissive);
+    glm::vec4 lightAmbient = glm::make_vec4(parameters.lightAmbient);
+    glm::vec4 lightDiffuse = glm::make_vec4(parameters.lightDiffuse);
+    glm::vec4 lightSpecular = glm::make_vec4(parameters.lightSpecular);
+
+    for (int i = 0; i < count; ++i)
+    {
+        glm::vec3 vertex(input.x[i], input.y[i], input.z[i]);
+        glm::vec3 normal(input.normalX[i], input.normalY[i], input.normalZ[i]);
+        float occlusion = input.occlusion ? input.occlusion[i] : 1.0f;
+        float shadow = input.shadow ? input.shadow[i] : 1.0f;
+
+        glm::vec3 N = glm::normalize(normalMatrix * normal);
+        glm::vec3 L = glm::vec3(glm::normalize(modelview * glm::make_vec4(parameters.lightPosition)));
+        float NdotL = std::max(glm::dot(N, L), 0.0f);
+        glm::vec4 pos = modelview * glm::vec4(vertex, 1.0f);
+
+        glm::vec3 E = -glm::vec3(pos);
+        glm::vec4 finalColor = materialAmbient * lightAmbient;
+
+        if (NdotL > 0.0f)
+        {
+            glm::vec3 HV = glm::normalize(L + E);
+            float NdotHV = std::max(glm::dot(N, HV), 0.0f);
+            finalColor += materialSpecular * lightSpecular * std::pow(NdotHV, parameters.materialShininess) * shadow;
+            finalColor += materialDiffuse * lightDiffuse * NdotL * shadow;
+        }
+
+        finalColor = glm::vec4(glm::vec3(finalColor) * occlusion, finalColor.a);
+
+        glm::vec4 color = materialEmissive + finalColor;
+        output.red[i] = color.r;
+        output.green[i] = color.g;
+        output.blue[i] = color.b;
+        output.alpha[i] = color.a;
+        output.blendFactor[i] = FogTable::computeFactor(parameters.fogMode, parameters.fogStart, parameters.fogEnd,
+                                                        parameters.fogDensity, glm::length(pos));
+    }
+}
+
+static void setVector(float* target, float x, float y, float z, float w)
+{
+    target[0] = x;
+    target[1] = y;
+    target[2] = z;
+    target[3] = w;
+}
+
+bool ShadingReference::benchmark(const float* heights, int width, int depth, float spacing)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    const int RUNS = 20;
+    const int count = width * depth;
+
+    //The streams of the grid, with horizon terms that vary from vertex to vertex
+    vector<float> normals(size_t(count) * 3);
+    NormalGenerator::generate(heights, width, depth, spacing, &normals[0]);
+
+    vector<float> streams(size_t(count) * 8);
+    float* x = &streams[0];
+    float* y = x + count;
+    float* z = y + count;
+    float* normalX = z + count;
+    float* normalY = normalX + count;
+    float* normalZ = normalY + count;
+    float* occlusion = normalZ + count;
+    float* shadow = occlusion + count;
+
+    for (int i = 0; i < count; ++i)
+    {
+        x[i] = float(i % width) * spacing;
+        y[i] = heights[i];
+        z[i] = float(i / width) * spacing;
+        normalX[i] = normals[i * 3 + 0];
+        normalY[i] = normals[i * 3 + 1];
+        normalZ[i] = normals[i * 3 + 2];
+        occlusion[i] = 0.5f + 0.5f * normalY[i];
+        shadow[i] = float(i % 3) * 0.5f;
+    }
+
+    ShadingInput input = { x, y, z, normalX, normalY, normalZ, NULL, NULL };
+    ShadingInput horizonInput = input;
+    horizonInput.occlusion = occlusion;
+    horizonInput.shadow = shadow;
+
+    vector<float> results(size_t(count) * 10);
+    ShadingOutput scalar = { &results[0], &results[count], &results[count * 2], &results[count * 3], &results[count * 4] };
+    ShadingOutput simd = { &results[count * 5], &results[count * 6], &results[count * 7], &results[count * 8], &results[count * 9] };
+
+    //The material, light and camera of the example
+    ShadingParameters parameters;
+    glm::mat4 modelview = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -20.0f, 0.0f));
+    modelview = glm::rotate(modelview, 25.0f, glm::vec3(1.0f, 0.0f, 0.0f));
+    modelview = glm::translate(modelview, glm::vec3(0.0f, 0.0f, -50.0f));
+    glm::mat3 normalMatrix = glm::inverseTranspose(glm::mat3(modelview));
+    std::copy(glm::value_ptr(modelview), glm::value_ptr(modelview) + 16, parameters.modelview);
+    std::copy(glm::value_ptr(normalMatrix), glm::value_ptr(normalMatrix) + 9, parameters.normalMatrix);
+
+    setVector(parameters.materialAmbient, 0.2f, 0.2f, 0.2f, 1.0f);
+    setVector(parameters.materialDiffuse, 0.8f, 0.8f, 0.8f, 1.0f);
+    setVector(parameters.materialSpecular, 0.6f, 0.6f, 0.6f, 1.0f);
+    setVector(parameters.materialEmissive, 0.0f, 0.0f, 0.0f, 1.0f);
+    parameters.materialShininess = 10.0f;
+    setVector(parameters.lightPosition, 0.0f, 0.4f, 1.0f, 0.0f);
+    setVector(parameters.lightAmbient, 0.0f, 0.0f, 0.0f, 1.0f);
+    setVector(parameters.lightDiffuse, 1.0f, 1.0f, 1.0f, 1.0f);
+    setVector(parameters.lightSpecular, 0.3f, 0.3f, 0.3f, 1.0f);
+
+    //Every mode over near, middling and far fog
+    const float STARTS[] = { 0.0f, 20.0f, 45.0f };
+    const float ENDS[] = { 15.0f, 50.0f, 120.0f };
+    const float DENSITIES[] = { 0.005f, 0.03f, 0.2f };
+
+    double scalarTime = 1.0e30, simdTime = 1.0e30;
+    float largestColor = 0.0f, largestFog = 0.0f;
+
+    for (int mode = LINEAR_FOG; mode <= NO_FOG; ++mode)
+    {
+        for (int setting = 0; setting < 3; ++setting)
+        {
+            parameters.fogMode = FogMode(mode);
+            parameters.fogStart = STARTS[setting];
+            parameters.fogEnd = ENDS[setting];
+            parameters.fogDensity = DENSITIES[setting];
+
+            for (int horizons = 0; horizons < 2; ++horizons)
+            {
+                const ShadingInput& streamsIn = horizons ? horizonInput : input;
+
+                for (int run = 0; run < RUNS; ++run)
+                {
+                    Clock::time_point start = Clock::now();
+                    shadeScalar(parameters, streamsIn, count, scalar);
+                    Clock::time_point scalarEnd = Clock::now();
+                    shade(parameters, streamsIn, count, simd);
+                    Clock::time_point simdEnd = Clock::now();
+
+                    scalarTime = std::min(scalarTime, std::chrono::duration<double, std::milli>(scalarEnd - start).count());
+                    simdTime = std::min(simdTime, std::chrono::duration<double, std::milli>(simdEnd - scalarEnd).count());
+                }
+
+                //Red, green, blue and alpha follow each other
+                for (int i = 0; i < count * 4; ++i)
+                {
+                    largestColor = std::max(largestColor, std::fabs(scalar.red[i] - simd.red[i]));
+                }
+
+                for (int i = 0; i < count; ++i)
+                {
+                    largestFog = std::max(largestFog, std::fabs(scalar.blendFactor[i] - simd.blendFactor[i]));
+                }
+            }
+        }
+    }
+
+#if defined(__AVX__)
+    const char* kernel = "AVX, 8 wide";
+#elif defined(SHADING_USE_SSE)
+    const char* kernel = "SSE, 4 wide";
+#else
+    const char* kernel = "scalar";
+#endif
+
+    bool match = largestColor <= MATCH_TOLERANCE && largestFog <= MATCH_TOLERANCE;
+    std::cout << "Vertex lighting and fog of a " << width << "x" << depth << " grid over " << (NO_FOG + 1) * 3 * 2
+              << " fog and horizon settings" << std::endl;
+    std::cout << "  shader port: " << scalarTime << " ms, streams: " << simdTime << " ms (" << kernel << ")" << std::endl;
+    std::cout << "  difference: " << largestColor << " in color, " << largestFog << " in blend factor, "
+              << (match ? "within" : "outside") << " the tolerance of " << MATCH_TOLERANCE << std::endl;
+
+    return match;
+}
@@ -0,0 +1,76 @@
+#ifndef BOGLGP_SHADINGREFERENCE_H
+#define BOGLGP_SHADINGREFERENCE_H
+
+#include "fogtable.h"
+
+//The uniforms of basic-fixed.vert that the lighting and the fog read, matrices column major
+struct ShadingParameters
+{
+    float modelview[16];
+    float normalMatrix[9];
+
+    float materialAmbient[4];
+    float materialDiffuse[4];
+    float materialSpecular[4];
+    float materialEmissive[4];
+    float materialShininess;
+
+    float lightPosition[4];     //light0, before the modelview matrix
+    float lightAmbient[4];
+    float lightDiffuse[4];
+    float lightSpecular[4];
+
+    FogMode fogMode;            //Per vertex fog, the program without FOG_PER_PIXEL
+    float fogStart;
+    float fogEnd;
+    float fogDensity;
+};
+
+//Vertex streams, structure of arrays with one float per vertex in each
+struct ShadingInput
+{
+    const float* x;             //World position, after the morph
+    const float* y;
+    const float* z;
+    const float* normalX;       //World normal
+    const float* normalY;
+    const float* normalZ;
+    const float* occlusion;     //Horizon terms, both NULL like the shader without horizon lighting
+    const float* shadow;
+};
+
+struct ShadingOutput
+{
+    float* red;                 //The color output
+    float* green;
+    float* blue;
+    float* alpha;
+    float* blendFactor;
+};
+
+/*
+    The per vertex lighting and fog of basic-fixed.vert on the CPU, so
+    they can be checked and timed without a GL context.
+
+    shadeScalar is a line by line port of the shader, one vertex at a
+    time. shade works out the same on the streams 8 vertices at a time
+    with AVX, 4 at a time with SSE, and one at a time where neither is
+    available, with polynomial exp2 and log2 for the specular power and
+    the exponential fogs.
+*/
+class ShadingReference
+{
+public:
+    static void shade(const ShadingParameters& parameters, const ShadingInput& input, int count, const ShadingOutput& output);
+    static void shadeScalar(const ShadingParameters& parameters, const ShadingInput& input, int count, const ShadingOutput& output);
+
+    /*
+        Shades the grid with the material, light and camera of the example
+        over a sweep of fog settings of every mode, times both versions and
+        prints how far apart they are. False if they differ by more than
+        the tolerance anywhere.
+    */
+    static bool benchmark(const float* heights, int width, int depth, float spacing);
+};
+
+#endif
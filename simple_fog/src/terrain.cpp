@@ -1,332 +1,1981 @@
-#include <fstream>
 #include <cmath>
 #include <iostream>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <chrono>
 
 #include "terrain.h"
 #include "example.h"
+#include "normalgenerator.h"
+#include "shadingreference.h"
 
-Terrain::Terrain()
+//Number of quads along the side of every quadtree patch
+const int PATCH_SIZE = 16;
+
+//Distance up to which the finest LOD level is used, each coarser level doubles it
+const float LOD_LEAF_RANGE = 32.0f;
+
+//Upper bound on the number of patches that keep their vertex buffers around
+const unsigned int MAX_RESIDENT_PATCHES = 1024;
+
+//Patches handed over by the streamer that get uploaded in a single frame
+const unsigned int MAX_UPLOADS_PER_FRAME = 8;
+
+//World height error the simplified patch meshes may have on level 0
+const float DEFAULT_MESH_ERROR = 0.05f;
+
+//Quads along the side of a tile in the tiled heightmap, a multiple of PATCH_SIZE
+const int TILE_SIZE = 64;
+
+//Memory the streamer may use for decoded tiles
+const size_t DEFAULT_TILE_CACHE_BUDGET = 64 * 1024 * 1024;
+
+//World height of the brightest heightmap value
+const float HEIGHT_SCALE = 10.0f;
+
+const float WATER_HEIGHT = 4.0f;
+
+//Sand fades into grass between the water and this height, grass into snow between the snow heights
+const float SAND_HEIGHT = WATER_HEIGHT + 0.75f;
+const float SNOW_START_HEIGHT = 7.0f;
+const float SNOW_END_HEIGHT = 8.0f;
+
+//Rock takes over as the up component of the normal falls from the first value to the second
+const float ROCK_START_SLOPE = 0.85f;
+const float ROCK_END_SLOPE = 0.7f;
+
+//Floats of per draw data for every node drawn indirectly: origin x and z, step, morph start and end
+const int DRAW_DATA_SIZE = 5;
+
+//The uniforms render and renderWater send, by their handles in both programs
+enum TerrainUniform
+{
+    TERRAIN_UNIFORM_SPLATTING,
+    TERRAIN_UNIFORM_SPLAT_MAP,
+    TERRAIN_UNIFORM_MATERIAL_LAYERS,
+    TERRAIN_UNIFORM_POSITION_SCALE,
+    TERRAIN_UNIFORM_POSITION_OFFSET,
+    TERRAIN_UNIFORM_TEXCOORD_SCALE,
+    TERRAIN_UNIFORM_CAMERA_POSITION,
+    TERRAIN_UNIFORM_PATCH_WIDTH,
+    TERRAIN_UNIFORM_HEIGHT_MAP,
+    TERRAIN_UNIFORM_OCTAHEDRAL_NORMALS,
+    TERRAIN_UNIFORM_HEIGHT_TEXTURE,
+    TERRAIN_UNIFORM_HORIZON_LIGHTING,
+    TERRAIN_UNIFORM_HORIZON_MAP,
+    TERRAIN_UNIFORM_SPLAT_TRANSFORM,
+    TERRAIN_UNIFORM_INDIRECT_DRAWS,
+    TERRAIN_UNIFORM_PATCH_ORIGIN,
+    TERRAIN_UNIFORM_MORPH_RANGE,
+    TERRAIN_UNIFORM_COUNT
+};
+
+const char* TERRAIN_UNIFORM_NAMES[TERRAIN_UNIFORM_COUNT] =
+{
+    "splatting", "splat_map", "material_layers", "position_scale", "position_offset",
+    "texcoord_scale", "camera_position", "patch_width", "height_map", "octahedral_normals",
+    "height_texture", "horizon_lighting", "horizon_map", "splat_transform", "indirect_draws",
+    "patch_origin", "morph_range"
+};
+
+//The bits of a float, for hashing settings into the bake key
+static unsigned int floatBits(float value)
 {
-    m_vertexBuffer = m_indexBuffer = m_colorBuffer = 0;
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
 }
 
-void Terrain::SetTextureHandle(GLuint handle)
+//Finds the next run of neighbouring quadrants from end on, false once there is none left
+static bool nextQuadrantRun(unsigned int quadrants, int& first, int& end)
 {
-    this->m_grassTexID = handle;
+    first = end;
+    while (first < 4 && !(quadrants & (1 << first)))
+    {
+        ++first;
+    }
+
+    end = first;
+    while (end < 4 && (quadrants & (1 << end)))
+    {
+        ++end;
+    }
+
+    return first < 4;
 }
 
-void Terrain::generateVertices(const vector<float> heights, int width)
+Terrain::Terrain():
+m_GLSLProgram(NULL),
+m_waterProgram(NULL),
+m_indexOrder(ROW_MAJOR_ORDER),
+m_rtin(PATCH_SIZE + 1),
+m_meshError(DEFAULT_MESH_ERROR),
+m_grassTexID(0),
+m_materialLayers(0),
+m_splatTexture(0),
+m_horizonTexture(0),
+m_heightTexture(0),
+m_gridVertexArray(0),
+m_waterVertexArray(0),
+m_waterVertexBuffer(0),
+m_waterTexCoordsBuffer(0),
+m_vertexLayout(INTERLEAVED_PACKED_LAYOUT),
+m_submitTime(0.0),
+m_submitSamples(0),
+m_indirectDraws(false),
+m_drawCommandBuffer(0),
+m_drawDataBuffer(0),
+m_width(0),
+m_depth(0),
+m_jobs(NULL),
+m_horizonCulling(true),
+m_hiddenQuadrants(0),
+m_frame(0)
 {
-    //Generate the vertices
-    int i = 0;
-    for (float z = float(-width / 2); z <= (width/2); ++z) 
+    DrawTimer timer = { 0, false, false, 0, 0 };
+    m_terrainTimer = timer;
+    m_waterTimer = timer;
+
+    const int width = PATCH_SIZE + 1;
+    const int half = PATCH_SIZE / 2;
+    m_keepQuadrants.resize(width * width);
+    m_keepBorder.resize(width * width);
+
+    for (int z = 0; z < width; ++z)
     {
-        for (float x = float(-width / 2); x <= (width/2); ++x) 
+        for (int x = 0; x < width; ++x)
         {
-            m_vertices.push_back(Vertex(x, heights[i++], z));
+            bool border = (x == 0 || z == 0 || x == PATCH_SIZE || z == PATCH_SIZE);
+            m_keepBorder[z * width + x] = border ? 1 : 0;
+            m_keepQuadrants[z * width + x] = (border || x == half || z == half) ? 1 : 0;
         }
     }
+}
 
-    glGenBuffers(1, &m_vertexBuffer); //Generate a buffer for the vertices
-    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer); //Bind the vertex buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_vertices.size() * 3, &m_vertices[0], GL_STATIC_DRAW); //Send the data to OpenGL
-    
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), NULL);
+Terrain::~Terrain()
+{
+    m_streamer.stop();
+
+    releasePatches();
+    releaseWater();
+
+    glDeleteTextures(1, &m_heightTexture);
+    glDeleteTextures(1, &m_splatTexture);
+    glDeleteTextures(1, &m_horizonTexture);
+    glDeleteVertexArrays(1, &m_gridVertexArray);
+    glDeleteBuffers(1, &m_patchIndices.buffer);
+    glDeleteBuffers(1, &m_waterIndices.buffer);
+    glDeleteBuffers(1, &m_drawCommandBuffer);
+    glDeleteBuffers(1, &m_drawDataBuffer);
+    glDeleteQueries(1, &m_terrainTimer.query);
+    glDeleteQueries(1, &m_waterTimer.query);
+}
+
+void Terrain::SetTextureHandle(GLuint handle)
+{
+    this->m_grassTexID = handle;
+}
+
+void Terrain::setPrograms(GLSLProgram* terrainProgram, GLSLProgram* waterProgram)
+{
+    m_GLSLProgram = terrainProgram;
+    m_waterProgram = waterProgram;
+
+    //Names are only looked up here, render and renderWater send by handle
+    m_terrainUniforms.clear();
+    m_waterUniforms.clear();
+    for (int i = 0; i < TERRAIN_UNIFORM_COUNT; ++i)
+    {
+        m_terrainUniforms.push_back(m_GLSLProgram->getUniformHandle(TERRAIN_UNIFORM_NAMES[i]));
+        m_waterUniforms.push_back(m_waterProgram->getUniformHandle(TERRAIN_UNIFORM_NAMES[i]));
+    }
 }
 
-void Terrain::generateWaterVertices(int width) 
+void Terrain::generateWaterVertices() 
 {
-    int i = 0;
-    for (float z = float(-width / 2); z <= (width/2); z++) 
+    m_waterVertices.clear();
+    for (float z = m_quadtree.sampleToWorldZ(0); z <= m_quadtree.sampleToWorldZ(m_depth - 1); z++) 
     {
-        for (float x = float(-width / 2); x <= (width/2); x++) 
+        for (float x = m_quadtree.sampleToWorldX(0); x <= m_quadtree.sampleToWorldX(m_width - 1); x++) 
         {
-            m_waterVertices.push_back(Vertex(x, 4.0f, z));
+            m_waterVertices.push_back(Vertex(x, WATER_HEIGHT, z));
         }
     }
-
-    glGenBuffers(1, &m_waterVertexBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_waterVertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_waterVertices.size() * 3, &m_waterVertices[0], GL_STATIC_DRAW);
 }
 
-void Terrain::generateIndices(int width)
+JobHandle Terrain::generatePatchIndices(vector<IndexBuilder>& builders)
 {
     /*
-        We loop through building the triangles that
-        make up each grid square in the heightmap
+        Every patch shares this index buffer. The triangles are written
+        one quadrant at a time so that a parent node can draw just the
+        quadrants its children don't cover with a single range each.
 
         (z*w+x) *----* (z*w+x+1)
                 |   /| 
                 |  / | 
                 | /  |
      ((z+1)*w+x)*----* ((z+1)*w+x+1)
+
+        Each ordering is built by a job of its own and the one that
+        transforms the fewest vertices per triangle wins, the water uses
+        the same one. The returned job finishes once m_indexOrder is set.
     */
-    //Generate the triangle indices
-    for (int z = 0; z < width - 1; ++z) //Go through the rows - 1
+    const int width = PATCH_SIZE + 1;
+    const IndexOrder orders[] = { ROW_MAJOR_ORDER, ZIGZAG_STRIP_ORDER, FORSYTH_ORDER };
+
+    builders.clear();
+    for (int i = 0; i < 3; ++i)
+    {
+        builders.push_back(IndexBuilder(width * width, orders[i]));
+    }
+
+    JobHandle built = m_jobs->parallelFor(0, builders.size(), 1, [&builders, width](int first, int end)
+    {
+        const int half = PATCH_SIZE / 2;
+        for (int i = first; i < end; ++i)
+        {
+            for (int quadrant = 0; quadrant < 4; ++quadrant)
+            {
+                builders[i].addGridSection(width, (quadrant & 1) * half, (quadrant >> 1) * half, half, half);
+            }
+        }
+    });
+
+    return m_jobs->schedule([this, &builders]()
     {
-        for (int x = 0; x < width - 1; ++x) //And the columns - 1
+        float bestACMR = 1.0e30f;
+        for (unsigned int i = 0; i < builders.size(); ++i)
         {
-            m_indices.push_back((z * width) + x); //Current point        
-            m_indices.push_back(((z + 1) * width) + x); //Next row
-            m_indices.push_back((z * width) + x + 1); //Same row, but next column
+            float acmr = builders[i].computeACMR(VERTEX_CACHE_SIZE);
+            if (acmr < bestACMR)
+            {
+                bestACMR = acmr;
+                m_indexOrder = builders[i].getOrder();
+            }
+        }
+    }, vector<JobHandle>(1, built));
+}
 
-            m_indices.push_back(((z + 1) * width) + x); //Next row
-            m_indices.push_back(((z + 1) * width) + x + 1); //Next row, next column
-            m_indices.push_back((z * width) + x + 1); //Same row, but next column
+void Terrain::uploadPatchIndices(const vector<IndexBuilder>& builders)
+{
+    std::cout << "Patch index ACMR (" << VERTEX_CACHE_SIZE << " entry cache):";
+
+    const IndexBuilder* best = &builders[0];
+    for (unsigned int i = 0; i < builders.size(); ++i)
+    {
+        std::cout << " " << IndexBuilder::getOrderName(builders[i].getOrder()) << " " << builders[i].computeACMR(VERTEX_CACHE_SIZE);
+        if (builders[i].getOrder() == m_indexOrder)
+        {
+            best = &builders[i];
         }
     }
 
-    glGenBuffers(1, &m_indexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * m_indices.size(), &m_indices[0], GL_STATIC_DRAW);
+    best->upload(m_patchIndices);
+
+    std::cout << std::endl << "Using " << IndexBuilder::getOrderName(m_indexOrder) << " with "
+              << m_patchIndices.indexSize * 8 << " bit indices, about " << best->computeACMR(VERTEX_CACHE_SIZE) * best->getTriangleCount()
+              << " vertex shader runs per patch for " << best->getTriangleCount() << " triangles" << std::endl;
 }
 
-void Terrain::generateWaterIndices(int width)
+/**
+Only the cells of the water grid that can have the terrain below them are
+kept, everywhere else the water would just be blended and then hidden or
+depth rejected. The terrain over a cell is a plane through samples of the
+level it is drawn at, or a blend towards the next one while morphing, so
+a cell is kept if its enclosing cell on any of those levels has a corner
+under the water.
+*/
+void Terrain::generateWaterIndices(IndexBuilder& builder)
 {
-    //Generate the triangle indices
-    for (int z = 0; z < width - 1; ++z) //Go through the rows - 1
+    const int width = m_width;
+    const int cellsX = m_width - 1;
+    const int cellsZ = m_depth - 1;
+    const int levels = m_quadtree.getLevelCount() + 1; //The coarsest level still morphs towards the one above it
+
+    vector<unsigned short> heights;
+    readHeights(heights);
+
+    vector<unsigned char> mask(cellsX * cellsZ, 0);
+
+    for (int z = 0; z < cellsZ; ++z)
     {
-        for (int x = 0; x < width - 1; ++x) //And the columns - 1
+        for (int x = 0; x < cellsX; ++x)
         {
-            m_waterIndices.push_back((z * width) + x); //Current point        
-            m_waterIndices.push_back(((z + 1) * width) + x); //Next row
-            m_waterIndices.push_back((z * width) + x + 1); //Same row, but next column
+            for (int level = 0; level < levels && !mask[z * cellsX + x]; ++level)
+            {
+                int step = 1 << level;
+                int left = (x / step) * step;
+                int top = (z / step) * step;
+                int right = std::min(left + step, m_width - 1);
+                int bottom = std::min(top + step, m_depth - 1);
 
-            m_waterIndices.push_back(((z + 1) * width) + x); //Next row
-            m_waterIndices.push_back(((z + 1) * width) + x + 1); //Next row, next column
-            m_waterIndices.push_back((z * width) + x + 1); //Same row, but next column
+                if (m_heightmap.decode(heights[top * width + left]) < WATER_HEIGHT ||
+                    m_heightmap.decode(heights[top * width + right]) < WATER_HEIGHT ||
+                    m_heightmap.decode(heights[bottom * width + left]) < WATER_HEIGHT ||
+                    m_heightmap.decode(heights[bottom * width + right]) < WATER_HEIGHT)
+                {
+                    mask[z * cellsX + x] = 1;
+                }
+            }
         }
     }
 
-    glGenBuffers(1, &m_waterIndexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_waterIndexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * m_waterIndices.size(), &m_waterIndices[0], GL_STATIC_DRAW);
+    builder = IndexBuilder(m_width * m_depth, m_indexOrder);
+    builder.addGridSection(m_width, 0, 0, cellsX, cellsZ, &mask[0]);
 }
 
-Vertex* crossProduct(Vertex* out, Vertex* v1, Vertex* v2)
+void Terrain::uploadWaterIndices(const IndexBuilder& builder)
 {
-    Vertex v;
-    v.x = (v1->y * v2->z) - (v1->z * v2->y);
-	v.y = (v1->z * v2->x) - (v1->x * v2->z);
-	v.z = (v1->x * v2->y) - (v1->y * v2->x);
+    builder.upload(m_waterIndices);
 
-    out->x = v.x;
-    out->y = v.y;
-    out->z = v.z;
+    //The water is flat, so the blended fragments shrink with its area just like the triangles
+    const int cells = (m_width - 1) * (m_depth - 1);
+    const int wetCells = builder.getTriangleCount() / 2;
+    std::cout << "Water: " << wetCells << " of " << cells << " cells under the water level, "
+              << builder.getTriangleCount() << " triangles instead of " << cells * 2 << ", "
+              << 100.0f * (1.0f - float(wetCells) / float(cells)) << "% less blended area" << std::endl;
+    std::cout << "Water index ACMR: " << builder.computeACMR(VERTEX_CACHE_SIZE) << " with "
+              << m_waterIndices.indexSize * 8 << " bit indices" << std::endl;
+}
+
+/**
+Draws the sections [first, end) of an index buffer with the vertex array
+that is bound.
+*/
+void Terrain::drawSections(const IndexBuffer& indices, int first, int end)
+{
+    glDrawElements(indices.mode, indices.sections[end] - indices.sections[first], indices.type,
+                   (const GLvoid*)(size_t(indices.indexSize) * indices.sections[first]));
+}
+
+/**
+Writes a command for every run of quadrants of the selected nodes and
+draws them all at once. The base instance of a command is the node it
+belongs to, which steps the per instance attributes onto the data of that
+node without the shader needing gl_DrawID.
+*/
+void Terrain::drawIndirect()
+{
+    if (m_drawCommandBuffer == 0)
+    {
+        createIndirectBuffers();
+    }
+
+    m_drawCommands.clear();
+    m_drawData.clear();
+
+    for (unsigned int i = 0; i < m_selection.size(); ++i)
+    {
+        const NodeSelection& selection = m_selection[i];
+        const QuadtreeNode& node = m_quadtree.getNode(selection.node);
+
+        m_drawData.push_back(float(node.x));
+        m_drawData.push_back(float(node.z));
+        m_drawData.push_back(float(1 << node.level));
+        m_drawData.push_back(m_quadtree.getMorphStart(node.level));
+        m_drawData.push_back(m_quadtree.getMorphEnd(node.level));
+
+        int first = 0, end = 0;
+        while (nextQuadrantRun(selection.quadrants, first, end))
+        {
+            DrawElementsCommand command = { m_patchIndices.sections[end] - m_patchIndices.sections[first], 1,
+                                            m_patchIndices.sections[first], 0, i };
+            m_drawCommands.push_back(command);
+        }
+    }
+
+    if (m_drawCommands.empty())
+    {
+        return;
+    }
+
+    //Both buffers are respecified every frame, so the driver can hand out fresh storage instead of waiting on the last frame
+    glBindBuffer(GL_ARRAY_BUFFER, m_drawDataBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_drawData.size(), &m_drawData[0], GL_STREAM_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_drawCommandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsCommand) * m_drawCommands.size(), &m_drawCommands[0], GL_STREAM_DRAW);
+
+    glBindVertexArray(m_gridVertexArray);
+    glMultiDrawElementsIndirect(m_patchIndices.mode, m_patchIndices.type, NULL, GLsizei(m_drawCommands.size()), 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+//The per node data becomes attributes 4 and 5 of the grid vertex array, stepped once per instance
+void Terrain::createIndirectBuffers()
+{
+    glGenBuffers(1, &m_drawCommandBuffer);
+    glGenBuffers(1, &m_drawDataBuffer);
+
+    const GLsizei stride = sizeof(GLfloat) * DRAW_DATA_SIZE;
+
+    glBindVertexArray(m_gridVertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, m_drawDataBuffer);
+    //Direct draws of the grid still fetch the first node, so the buffer is never left without storage
+    glBufferData(GL_ARRAY_BUFFER, stride, NULL, GL_STREAM_DRAW);
+    glVertexAttribPointer((GLint)4, 3, GL_FLOAT, GL_FALSE, stride, 0);
+    glVertexAttribPointer((GLint)5, 2, GL_FLOAT, GL_FALSE, stride, (const GLvoid*)(sizeof(GLfloat) * 3));
+    glVertexAttribDivisor(4, 1);
+    glVertexAttribDivisor(5, 1);
+    glEnableVertexAttribArray(4);
+    glEnableVertexAttribArray(5);
+    glBindVertexArray(0);
+}
+
+bool Terrain::setIndirectDraws(bool enabled)
+{
+    //The base instance of the commands has to reach the attributes
+    if (enabled && !GLEW_VERSION_4_3 && !(GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance))
+    {
+        std::cerr << "Indirect draws need GL 4.3 or ARB_multi_draw_indirect and ARB_base_instance" << std::endl;
+        return false;
+    }
 
-    return out;
+    m_indirectDraws = enabled;
+    return true;
+}
+
+/**
+Creates the vertex buffers of a patch in the current layout and records
+the attribute setup in a vertex array, drawing the patch only needs to
+bind that.
+*/
+void Terrain::uploadPatch(const PatchData& data, TerrainPatch& patch)
+{
+    computePatchErrors(data, patch.errors);
+
+    if (m_vertexLayout == INTERLEAVED_PACKED_LAYOUT)
+    {
+        vector<PackedTerrainVertex> vertices;
+        packVertices(data, 0, int(data.morphHeights.size()), vertices);
+        uploadPackedPatch(data.node, &vertices[0], patch);
+        return;
+    }
+
+    glGenVertexArrays(1, &patch.vertexArray);
+    glBindVertexArray(patch.vertexArray);
+    glGenBuffers(4, patch.buffers);
+
+    glBindBuffer(GL_ARRAY_BUFFER, patch.buffers[0]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * data.vertices.size(), &data.vertices[0], GL_STATIC_DRAW);
+    glVertexAttribPointer((GLint)0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, patch.buffers[1]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * data.texCoords.size(), &data.texCoords[0], GL_STATIC_DRAW);
+    glVertexAttribPointer((GLint)1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, patch.buffers[2]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * data.normals.size(), &data.normals[0], GL_STATIC_DRAW);
+    glVertexAttribPointer((GLint)2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, patch.buffers[3]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * data.morphHeights.size(), &data.morphHeights[0], GL_STATIC_DRAW);
+    glVertexAttribPointer((GLint)3, 1, GL_FLOAT, GL_FALSE, 0, 0);
+
+    finishPatch(data.node, patch);
 }
 
-Vertex* normalize(Vertex* in) 
+//The packed layout only needs the vertices, they can come straight from the baked terrain
+void Terrain::uploadPackedPatch(int node, const PackedTerrainVertex* vertices, TerrainPatch& patch)
 {
-    float l = sqrtf(in->x * in->x + in->y * in->y + in->z * in->z);
-    in->x = in->x / l;
-    in->y = in->y / l;
-    in->z = in->z / l;
-    return in;
+    const int vertexCount = (PATCH_SIZE + 1) * (PATCH_SIZE + 1);
+
+    glGenVertexArrays(1, &patch.vertexArray);
+    glBindVertexArray(patch.vertexArray);
+
+    glGenBuffers(1, &patch.buffers[0]);
+    glBindBuffer(GL_ARRAY_BUFFER, patch.buffers[0]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(PackedTerrainVertex) * vertexCount, vertices, GL_STATIC_DRAW);
+
+    const GLsizei stride = sizeof(PackedTerrainVertex);
+    glVertexAttribPointer((GLint)0, 3, GL_UNSIGNED_SHORT, GL_FALSE, stride, (const GLvoid*)offsetof(PackedTerrainVertex, x));
+    glVertexAttribPointer((GLint)1, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, (const GLvoid*)offsetof(PackedTerrainVertex, texCoord));
+    glVertexAttribPointer((GLint)2, 2, GL_SHORT, GL_TRUE, stride, (const GLvoid*)offsetof(PackedTerrainVertex, normal));
+    glVertexAttribPointer((GLint)3, 1, GL_UNSIGNED_SHORT, GL_FALSE, stride, (const GLvoid*)offsetof(PackedTerrainVertex, morphHeight));
+
+    patch.buffers[1] = patch.buffers[2] = patch.buffers[3] = 0;
+
+    finishPatch(node, patch);
 }
 
-void Terrain::generateNormals() 
+//Enables the attributes of the bound patch vertex array, gives it its indices and marks it ready
+void Terrain::finishPatch(int node, TerrainPatch& patch)
 {
-    vector<Vertex> faceNormals; //Temporary array to store the face normals
-    vector<int> shareCount;
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glEnableVertexAttribArray(3);
 
-    m_normals.resize(m_vertices.size()); //We want a normal for each vertex
-    shareCount.resize(m_vertices.size());
+    glBindVertexArray(0);
 
-    for (unsigned int i = 0; i < shareCount.size(); ++i) 
+    if (m_meshError > 0.0f)
     {
-        shareCount[i] = 0;
+        IndexBuilder builder(0, FORSYTH_ORDER);
+        buildPatchIndices(m_quadtree.getNode(node).level, patch, builder);
+        builder.upload(patch.indices);
     }
 
-    unsigned int numTriangles = m_indices.size() / 3;
+    bindPatchIndices(patch);
+
+    patch.lastUsedFrame = m_frame;
+    m_patchReady[node] = 1;
+}
+
+//Packs the vertices [first, end) of a patch for INTERLEAVED_PACKED_LAYOUT
+void Terrain::packVertices(const PatchData& data, int first, int end, vector<PackedTerrainVertex>& vertices) const
+{
+    const float offsetX = m_quadtree.sampleToWorldX(0);
+    const float offsetZ = m_quadtree.sampleToWorldZ(0);
+
+    vertices.resize(end - first);
+    for (int i = first; i < end; ++i)
+    {
+        PackedTerrainVertex& vertex = vertices[i - first];
+        vertex.x = (unsigned short)(data.vertices[i * 3 + 0] - offsetX + 0.5f);
+        vertex.height = quantizeUnorm16(data.vertices[i * 3 + 1] / HEIGHT_SCALE);
+        vertex.z = (unsigned short)(data.vertices[i * 3 + 2] - offsetZ + 0.5f);
+        vertex.morphHeight = quantizeUnorm16(data.morphHeights[i] / HEIGHT_SCALE);
+        encodeOctahedral(data.normals[i * 3 + 0], data.normals[i * 3 + 1], data.normals[i * 3 + 2], vertex.normal);
+        vertex.texCoord[0] = quantizeUnorm16(data.texCoords[i * 2 + 0] / TEXCOORD_RANGE);
+        vertex.texCoord[1] = quantizeUnorm16(data.texCoords[i * 2 + 1] / TEXCOORD_RANGE);
+    }
+}
 
-    faceNormals.resize(numTriangles); //One normal per triangle
+/**
+Overwrites the rows [firstRow, endRow) of a resident patch in place. The
+buffers keep their size, so nothing is reallocated.
+*/
+void Terrain::updatePatchRows(const PatchData& data, TerrainPatch& patch, int firstRow, int endRow)
+{
+    const int first = firstRow * (PATCH_SIZE + 1);
+    const int end = endRow * (PATCH_SIZE + 1);
 
-    for (unsigned int i = 0; i < numTriangles; ++i)
+    if (m_vertexLayout == INTERLEAVED_PACKED_LAYOUT)
     {
-        Vertex* v1 = &m_vertices[m_indices[i*3]];
-        Vertex* v2 = &m_vertices[m_indices[(i*3)+1]];
-        Vertex* v3 = &m_vertices[m_indices[(i*3)+2]];
+        vector<PackedTerrainVertex> vertices;
+        packVertices(data, first, end, vertices);
 
-        Vertex vec1, vec2;
+        glBindBuffer(GL_ARRAY_BUFFER, patch.buffers[0]);
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(PackedTerrainVertex) * first, sizeof(PackedTerrainVertex) * vertices.size(), &vertices[0]);
+    }
+    else
+    {
+        //The texture coordinates don't depend on the heights
+        glBindBuffer(GL_ARRAY_BUFFER, patch.buffers[0]);
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * first, sizeof(GLfloat) * 3 * (end - first), &data.vertices[first * 3]);
 
-        vec1.x = v2->x - v1->x;
-        vec1.y = v2->y - v1->y;
-        vec1.z = v2->z - v1->z;
+        glBindBuffer(GL_ARRAY_BUFFER, patch.buffers[2]);
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * first, sizeof(GLfloat) * 3 * (end - first), &data.normals[first * 3]);
 
-        vec2.x = v3->x - v1->x;
-        vec2.y = v3->y - v1->y;
-        vec2.z = v3->z - v1->z;
+        glBindBuffer(GL_ARRAY_BUFFER, patch.buffers[3]);
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * first, sizeof(GLfloat) * (end - first), &data.morphHeights[first]);
+    }
+}
 
-        Vertex* normal = &faceNormals[i];
-        crossProduct(normal, &vec1, &vec2); //Calculate the normal
-        normalize(normal);
+/**
+Rebuilds the resident patches that read region, with jobs like the pinned
+patches, and uploads the rows of each that hold or neighbour a changed
+sample. Patches that aren't resident are built from the new heights when
+they are next needed.
+*/
+void Terrain::updatePatches(const SampleRegion& region)
+{
+    vector<PatchRequest> requests;
+    for (map<int, TerrainPatch>::iterator i = m_patches.begin(); i != m_patches.end(); ++i)
+    {
+        const QuadtreeNode& node = m_quadtree.getNode((*i).first);
+        PatchRequest request = { (*i).first, node.level, node.x, node.z };
 
-        for (int j = 0; j < 3; ++j) 
+        if (TileStreamer::readsRegion(PATCH_SIZE, request, region))
         {
-            int index = m_indices[(i*3)+j];
-            m_normals[index].x += normal->x;
-            m_normals[index].y += normal->y;
-            m_normals[index].z += normal->z;
-            shareCount[index]++;
+            requests.push_back(request);
         }
     }
 
-    for (unsigned int i = 0; i < m_vertices.size(); ++i)
+    vector<PatchData> data(requests.size());
+    m_jobs->wait(m_jobs->parallelFor(0, requests.size(), 1, [this, &requests, &data](int first, int end)
+    {
+        for (int i = first; i < end; ++i)
+        {
+            TileStreamer::buildPatch(m_heightmap, PATCH_SIZE, requests[i], data[i]);
+        }
+    }));
+
+    for (unsigned int i = 0; i < requests.size(); ++i)
     {
-        m_normals[i].x = m_normals[i].x / shareCount[i];
-        m_normals[i].y = m_normals[i].y / shareCount[i];
-        m_normals[i].z = m_normals[i].z / shareCount[i];
-        normalize(&m_normals[i]);
+        const int level = requests[i].level;
+        const int samplesZ = m_heightmap.getLevelSamplesZ(level);
+        const int originZ = requests[i].z >> level;
+
+        //A row also changes when the rows next to it do, through its normals and morph targets
+        int firstRow = PATCH_SIZE + 1;
+        int endRow = 0;
+        for (int j = 0; j <= PATCH_SIZE; ++j)
+        {
+            int sampleZ = std::min(originZ + j, samplesZ - 1);
+            int up = m_heightmap.levelToSampleZ(level, std::max(sampleZ - 1, 0));
+            int down = m_heightmap.levelToSampleZ(level, std::min(sampleZ + 1, samplesZ - 1));
+
+            if (up < region.endZ && down >= region.firstZ)
+            {
+                firstRow = std::min(firstRow, j);
+                endRow = j + 1;
+            }
+        }
+
+        if (firstRow < endRow)
+        {
+            TerrainPatch& patch = m_patches[requests[i].node];
+            updatePatchRows(data[i], patch, firstRow, endRow);
+
+            computePatchErrors(data[i], patch.errors);
+            if (m_meshError > 0.0f)
+            {
+                IndexBuilder builder(0, FORSYTH_ORDER);
+                buildPatchIndices(level, patch, builder);
+                builder.upload(patch.indices);
+            }
+        }
     }
+}
 
-    glGenBuffers(1, &m_normalBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer); //Bind the vertex buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_normals.size() * 3, &m_normals[0], GL_STATIC_DRAW); //Send the data to OpenGL
+/**
+Works out how far every vertex of a patch is from the triangles that would
+skip it, so the patch can be simplified to any error bound later on without
+its heights.
+*/
+void Terrain::computePatchErrors(const PatchData& data, vector<float>& errors) const
+{
+    const int vertexCount = (PATCH_SIZE + 1) * (PATCH_SIZE + 1);
+    errors.resize(vertexCount * 2);
+
+    m_rtin.computeErrors(&data.vertices[1], 3, &m_keepQuadrants[0], &errors[0]);
+    m_rtin.computeErrors(&data.vertices[1], 3, &m_keepBorder[0], &errors[vertexCount]);
 }
 
-void Terrain::generateTexCoords(int width)
+/**
+Builds the simplified mesh of a patch for the error bound of its level,
+once split into a section per quadrant and once as a single section for
+nodes that draw the whole patch. The border always keeps every vertex, it
+is what the neighbouring patches and the morph to the next level line up
+with, and the quadrant sections keep the lines between the quadrants so
+that no triangle reaches into a quadrant a child node draws instead.
+*/
+void Terrain::buildPatchIndices(int level, const TerrainPatch& patch, IndexBuilder& builder) const
 {
-    for (int z = 0; z < width; ++z)
+    const int width = PATCH_SIZE + 1;
+    const int half = PATCH_SIZE / 2;
+    const float maxError = m_meshError * float(1 << level);
+
+    builder = IndexBuilder(width * width, FORSYTH_ORDER);
+
+    vector<GLuint> triangles;
+    m_rtin.buildMesh(&patch.errors[0], maxError, triangles);
+
+    vector<GLuint> quadrants[4];
+    for (unsigned int i = 0; i < triangles.size(); i += 3)
     {
-        for (int x = 0; x < width; ++x)
+        //Three times the centroid, every corner is on the quadrant's side of the lines or on them
+        int x = 0;
+        int z = 0;
+        for (int j = 0; j < 3; ++j)
         {
-            float s = (float(x) / float(width)) * 8.0f;
-            float t = (float(z) / float(width)) * 8.0f;
-            m_texCoords.push_back(TexCoord(s, t));
+            x += triangles[i + j] % width;
+            z += triangles[i + j] / width;
         }
+
+        int quadrant = ((x > 3 * half) ? 1 : 0) | ((z > 3 * half) ? 2 : 0);
+        quadrants[quadrant].insert(quadrants[quadrant].end(), triangles.begin() + i, triangles.begin() + i + 3);
     }
 
-    glGenBuffers(1, &m_texCoordBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer); //Bind the vertex buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_texCoords.size() * 2, &m_texCoords[0], GL_STATIC_DRAW); //Send the data to OpenGL
+    for (int i = 0; i < 4; ++i)
+    {
+        builder.addTriangleSection(quadrants[i]);
+    }
+
+    triangles.clear();
+    m_rtin.buildMesh(&patch.errors[width * width], maxError, triangles);
+    builder.addTriangleSection(triangles);
 }
 
-void Terrain::generateWaterTexCoords(int width)
+//Points the vertex array of a patch at its own indices, or at the shared grid when it has none
+void Terrain::bindPatchIndices(TerrainPatch& patch)
 {
-    for (int z = 0; z < width; ++z)
+    glBindVertexArray(patch.vertexArray);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, (patch.indices.buffer != 0) ? patch.indices.buffer : m_patchIndices.buffer);
+    glBindVertexArray(0);
+}
+
+void Terrain::setMeshError(float error)
+{
+    m_meshError = std::max(error, 0.0f);
+
+    vector<int> nodes;
+    vector<TerrainPatch*> patches;
+    for (map<int, TerrainPatch>::iterator i = m_patches.begin(); i != m_patches.end(); ++i)
     {
-        for (int x = 0; x < width; ++x)
+        nodes.push_back((*i).first);
+        patches.push_back(&(*i).second);
+    }
+
+    if (patches.empty())
+    {
+        return;
+    }
+
+    //The meshes are built by jobs from the errors kept with each patch, only the uploads stay here
+    vector<IndexBuilder> builders(patches.size(), IndexBuilder(0, FORSYTH_ORDER));
+    if (m_meshError > 0.0f)
+    {
+        m_jobs->wait(m_jobs->parallelFor(0, patches.size(), 1, [this, &nodes, &patches, &builders](int first, int end)
         {
-            float s = (float(x) / float(width)) * 8.0f;
-            float t = (float(z) / float(width)) * 8.0f;
-            m_waterTexCoords.push_back(TexCoord(s, t));
-        }
+            for (int i = first; i < end; ++i)
+            {
+                buildPatchIndices(m_quadtree.getNode(nodes[i]).level, *patches[i], builders[i]);
+            }
+        }));
     }
 
-    glGenBuffers(1, &m_waterTexCoordsBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_waterTexCoordsBuffer); //Bind the vertex buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_waterTexCoords.size() * 2, &m_waterTexCoords[0], GL_STATIC_DRAW); //Send the data to OpenGL
+    for (unsigned int i = 0; i < patches.size(); ++i)
+    {
+        if (m_meshError > 0.0f)
+        {
+            builders[i].upload(patches[i]->indices);
+        }
+        else
+        {
+            glDeleteBuffers(1, &patches[i]->indices.buffer);
+            patches[i]->indices = IndexBuffer();
+        }
+
+        bindPatchIndices(*patches[i]);
+    }
 }
 
-bool Terrain::loadHeightmap(const string& rawFile, int width) 
+float Terrain::getPatchTriangles() const
 {
-    const float HEIGHT_SCALE = 10.0f; 
-    std::ifstream fileIn(rawFile.c_str(), std::ios::binary);
+    const float gridTriangles = float(PATCH_SIZE * PATCH_SIZE * 2);
+    if (m_patches.empty())
+    {
+        return gridTriangles;
+    }
 
-    if (!fileIn.good()) 
+    float triangles = 0.0f;
+    for (map<int, TerrainPatch>::const_iterator i = m_patches.begin(); i != m_patches.end(); ++i)
     {
-        std::cout << "File does not exist" << std::endl;
-        return false;
+        const IndexBuffer& indices = (*i).second.indices;
+        triangles += (indices.buffer != 0) ? float(indices.sections[5] - indices.sections[4]) / 3.0f : gridTriangles;
     }
 
-    //This line reads in the whole file into a string
-    string stringBuffer(std::istreambuf_iterator<char>(fileIn), (std::istreambuf_iterator<char>()));
+    return triangles / float(m_patches.size());
+}
 
-    fileIn.close();
+bool Terrain::setHeights(int firstX, int firstZ, int width, int depth, const float* heights)
+{
+    SampleRegion region = { std::max(firstX, 0), std::max(firstZ, 0),
+                            std::min(firstX + width, m_width), std::min(firstZ + depth, m_depth) };
 
-    if (stringBuffer.size() != (width * width)) 
+    if (region.firstX >= region.endX || region.firstZ >= region.endZ)
     {
-        std::cout << "Image size does not match passed width" << std::endl;
         return false;
     }
 
-    vector<float> heights;
-    heights.reserve(width * width); //Reserve some space (faster)
+    //The heights are rounded to what the tiles hold, so that every copy agrees
+    const int regionWidth = region.endX - region.firstX;
+    const int regionDepth = region.endZ - region.firstZ;
+    vector<unsigned short> samples(regionWidth * regionDepth);
+    vector<float> rounded(samples.size());
+
+    for (int z = 0; z < regionDepth; ++z)
+    {
+        const float* row = heights + (region.firstZ - firstZ + z) * width + (region.firstX - firstX);
+        for (int x = 0; x < regionWidth; ++x)
+        {
+            samples[z * regionWidth + x] = m_heightmap.encode(row[x]);
+            rounded[z * regionWidth + x] = m_heightmap.decode(samples[z * regionWidth + x]);
+        }
+    }
+
+    m_streamer.beginEdit();
+    m_heightmap.setSamples(region, &samples[0]);
+    m_streamer.endEdit(region);
 
-    //Go through the string converting each character to a float and scale it
-    for (int i = 0; i < (width * width); ++i) 
+    //The baked pinned patches no longer match the heights
+    m_baked.close();
+
+    m_heightField.setHeights(region.firstX, region.firstZ, regionWidth, regionDepth, &rounded[0]);
+    m_quadtree.updateBounds(m_heightmap.getLeafBounds(), m_heightmap.getLeafCount(), region);
+
+    if (m_heightTexture != 0)
+    {
+        glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, region.firstX, region.firstZ, regionWidth, regionDepth,
+                        GL_RED, GL_UNSIGNED_SHORT, &samples[0]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+
+    //The normals of the samples around the region change with it
+    if (m_splatTexture != 0)
     {
-        //Convert to floating value, the unsigned char cast is importantant otherwise the values wrap at 128
-        float value = (float)(unsigned char)stringBuffer[i] / 256.0f; 
-    
-        heights.push_back(value * HEIGHT_SCALE);
-        m_colors.push_back(Color(value, value, value));
+        SampleRegion border = { std::max(region.firstX - 1, 0), std::max(region.firstZ - 1, 0),
+                                std::min(region.endX + 1, m_width), std::min(region.endZ + 1, m_depth) };
+
+        vector<unsigned char> weights;
+        computeSplatWeights(border, weights);
+
+        glBindTexture(GL_TEXTURE_2D, m_splatTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, border.firstX, border.firstZ, border.endX - border.firstX,
+                        border.endZ - border.firstZ, GL_RGBA, GL_UNSIGNED_BYTE, &weights[0]);
     }
 
-    glGenBuffers(1, &m_colorBuffer); //Generate a buffer for the colors
-    glBindBuffer(GL_ARRAY_BUFFER, m_colorBuffer); //Bind the color buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_colors.size() * 3, &m_colors[0], GL_STATIC_DRAW); //Send the data to OpenGL
+    //Every sample within the search radius may have the edit on its horizon
+    if (m_horizonTexture != 0)
+    {
+        const int radius = HorizonMap::SEARCH_RADIUS;
+        SampleRegion reach = { std::max(region.firstX - radius, 0), std::max(region.firstZ - radius, 0),
+                               std::min(region.endX + radius, m_width), std::min(region.endZ + radius, m_depth) };
+
+        vector<unsigned char> horizons;
+        HorizonMap::bake(m_heightField, reach, *m_jobs, horizons);
 
-    generateVertices(heights, width);
-    generateIndices(width);
-    generateTexCoords(width);
-    generateNormals();
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_horizonTexture);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, reach.firstX, reach.firstZ, 0, reach.endX - reach.firstX,
+                        reach.endZ - reach.firstZ, 2, GL_RGBA, GL_UNSIGNED_BYTE, &horizons[0]);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
 
-    generateWaterVertices(width);
-    generateWaterIndices(width);
-    generateWaterTexCoords(width);
+    updatePatches(region);
     return true;
 }
 
-void Terrain::renderWater()
+void Terrain::releasePatch(TerrainPatch& patch)
 {
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-   
+    glDeleteVertexArrays(1, &patch.vertexArray);
+    glDeleteBuffers(4, patch.buffers);
+    glDeleteBuffers(1, &patch.indices.buffer);
+    patch.indices = IndexBuffer();
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_waterVertexBuffer);
-    glVertexAttribPointer((GLint)0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+void Terrain::releasePatches()
+{
+    for (map<int, TerrainPatch>::iterator i = m_patches.begin(); i != m_patches.end(); ++i)
+    {
+        releasePatch((*i).second);
+    }
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_waterTexCoordsBuffer);
-    glVertexAttribPointer((GLint)1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    m_patches.clear();
+    m_selection.clear();
+    m_patchReady.assign(m_patchReady.size(), 0);
+}
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_waterIndexBuffer);
-    
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    
-    glDrawElements(GL_TRIANGLES, m_waterIndices.size(), GL_UNSIGNED_INT, 0);
+/**
+The coarsest level is built up front and never evicted, it is what gets
+drawn while the finer patches are still on their way. In the packed layout
+a baked terrain has the vertices ready. Builds on this thread, so the
+streamer must not be running.
+*/
+void Terrain::buildPinnedPatches()
+{
+    if (m_baked.isOpen() && m_vertexLayout == INTERLEAVED_PACKED_LAYOUT)
+    {
+        for (int i = 0; i < m_baked.getPinnedCount(); ++i)
+        {
+            const int node = m_baked.getPinnedNode(i);
+            const float* errors = m_baked.getPinnedErrors(i);
 
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
-    glDisable(GL_BLEND);
+            TerrainPatch& patch = m_patches[node];
+            patch.pinned = true;
+            patch.errors.assign(errors, errors + m_baked.getPinnedErrorCount());
+            uploadPackedPatch(node, m_baked.getPinnedVertices(i), patch);
+        }
+
+        return;
+    }
+
+    vector<PatchData> data;
+    buildPinnedData(data);
+
+    for (unsigned int i = 0; i < data.size(); ++i)
+    {
+        TerrainPatch& patch = m_patches[data[i].node];
+        patch.pinned = true;
+        uploadPatch(data[i], patch);
+    }
 }
 
-void Terrain::render()
+//Builds the patches of the coarsest level with jobs
+void Terrain::buildPinnedData(vector<PatchData>& data) const
 {
-   
+    const int topLevel = m_quadtree.getLevelCount() - 1;
 
-    //Bind the vertex array and set the vertex pointer to point at it
-    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
-    //glVertexPointer(3, GL_FLOAT, 0, 0);
-    glVertexAttribPointer((GLint)0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    
-    //Bind the color array
-  //  glBindBuffer(GL_ARRAY_BUFFER, m_colorBuffer);
-    //glColorPointer(3, GL_FLOAT, 0, 0);
-  //  glVertexAttribPointer((GLint)1, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    vector<PatchRequest> requests;
+    for (int i = 0; i < m_quadtree.getNodeCount(); ++i)
+    {
+        const QuadtreeNode& node = m_quadtree.getNode(i);
+        if (node.level == topLevel)
+        {
+            PatchRequest request = { i, node.level, node.x, node.z };
+            requests.push_back(request);
+        }
+    }
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
-    glVertexAttribPointer((GLint)1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    data.resize(requests.size());
+    m_jobs->wait(m_jobs->parallelFor(0, requests.size(), 1, [this, &requests, &data](int first, int end)
+    {
+        for (int i = first; i < end; ++i)
+        {
+            TileStreamer::buildPatch(m_heightmap, PATCH_SIZE, requests[i], data[i]);
+        }
+    }));
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
-    glVertexAttribPointer((GLint)2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+/**
+Saves what a cold start generated for the next run: the quadtree, the
+chosen patch indices, the water indices and the pinned patches, packed
+whatever the current layout.
+*/
+bool Terrain::bakeTerrain(const string& bakedFile, unsigned long long key, const IndexBuilder& patchIndices,
+                          const IndexBuilder& waterIndices, const vector<unsigned char>& horizons) const
+{
+    vector<PatchData> data;
+    buildPinnedData(data);
 
-    //Bind the index array
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-    
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
-    
-    //Draw the triangles
-    glDrawElements(GL_TRIANGLES, m_indices.size(), GL_UNSIGNED_INT, 0);
+    vector<int> nodes;
+    vector<PackedTerrainVertex> vertices;
+    vector<float> errors;
+    for (unsigned int i = 0; i < data.size(); ++i)
+    {
+        vector<PackedTerrainVertex> patchVertices;
+        vector<float> patchErrors;
+        packVertices(data[i], 0, int(data[i].morphHeights.size()), patchVertices);
+        computePatchErrors(data[i], patchErrors);
+
+        nodes.push_back(data[i].node);
+        vertices.insert(vertices.end(), patchVertices.begin(), patchVertices.end());
+        errors.insert(errors.end(), patchErrors.begin(), patchErrors.end());
+    }
+
+    return BakedTerrain::write(bakedFile, key, m_quadtree, patchIndices, waterIndices, nodes, vertices, errors, horizons);
+}
+
+Terrain::TerrainPatch* Terrain::getPatch(int nodeIndex)
+{
+    TerrainPatch& patch = m_patches[nodeIndex];
+    patch.lastUsedFrame = m_frame;
+    return &patch;
+}
+
+/**
+Takes the patches the streamer has finished and gives them vertex buffers.
+The uploads per frame are capped so a burst of arrivals doesn't stall a frame.
+*/
+void Terrain::collectPatches()
+{
+    vector<PatchData*> finished;
+    m_streamer.collect(finished, MAX_UPLOADS_PER_FRAME);
+
+    for (unsigned int i = 0; i < finished.size(); ++i)
+    {
+        if (!m_patchReady[finished[i]->node])
+        {
+            TerrainPatch& patch = m_patches[finished[i]->node];
+            patch.pinned = false;
+            uploadPatch(*finished[i], patch);
+        }
+
+        delete finished[i];
+    }
+}
+
+void Terrain::setTileCacheBudget(size_t bytes)
+{
+    m_streamer.setCacheBudget(bytes);
+}
+
+/**
+Drops the least recently used patches once there are more than
+MAX_RESIDENT_PATCHES of them. Patches used this frame and the pinned
+coarsest level are never dropped.
+*/
+void Terrain::evictPatches()
+{
+    if (m_patches.size() <= MAX_RESIDENT_PATCHES)
+    {
+        return;
+    }
+
+    vector<std::pair<unsigned int, int> > candidates;
+    for (map<int, TerrainPatch>::iterator i = m_patches.begin(); i != m_patches.end(); ++i)
+    {
+        if ((*i).second.lastUsedFrame != m_frame && !(*i).second.pinned)
+        {
+            candidates.push_back(std::make_pair((*i).second.lastUsedFrame, (*i).first));
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end());
+
+    unsigned int excess = m_patches.size() - MAX_RESIDENT_PATCHES;
+    for (unsigned int i = 0; i < excess && i < candidates.size(); ++i)
+    {
+        map<int, TerrainPatch>::iterator patch = m_patches.find(candidates[i].second);
+        releasePatch((*patch).second);
+        m_patchReady[(*patch).first] = 0;
+        m_patches.erase(patch);
+    }
+}
+
+void Terrain::generateWaterTexCoords()
+{
+    const float mapSize = float(std::max(m_width, m_depth));
+
+    m_waterTexCoords.clear();
+    for (int z = 0; z < m_depth; ++z)
+    {
+        for (int x = 0; x < m_width; ++x)
+        {
+            float s = (float(x) / mapSize) * TEXCOORD_RANGE;
+            float t = (float(z) / mapSize) * TEXCOORD_RANGE;
+            m_waterTexCoords.push_back(TexCoord(s, t));
+        }
+    }
+
+}
+
+void Terrain::uploadWater()
+{
+    glGenVertexArrays(1, &m_waterVertexArray);
+    glBindVertexArray(m_waterVertexArray);
+
+    //The water stays a mesh in the height texture layout, it uses packed vertices then
+    if (m_vertexLayout != SEPARATE_FLOAT_LAYOUT)
+    {
+        const float offsetX = m_quadtree.sampleToWorldX(0);
+        const float offsetZ = m_quadtree.sampleToWorldZ(0);
+        vector<PackedWaterVertex> vertices(m_waterVertices.size());
+
+        for (unsigned int i = 0; i < vertices.size(); ++i)
+        {
+            PackedWaterVertex& vertex = vertices[i];
+            vertex.x = (unsigned short)(m_waterVertices[i].x - offsetX + 0.5f);
+            vertex.height = 0;
+            vertex.z = (unsigned short)(m_waterVertices[i].z - offsetZ + 0.5f);
+            vertex.padding = 0;
+            vertex.texCoord[0] = quantizeUnorm16(m_waterTexCoords[i].s / TEXCOORD_RANGE);
+            vertex.texCoord[1] = quantizeUnorm16(m_waterTexCoords[i].t / TEXCOORD_RANGE);
+        }
+
+        glGenBuffers(1, &m_waterVertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, m_waterVertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(PackedWaterVertex) * vertices.size(), &vertices[0], GL_STATIC_DRAW);
+
+        const GLsizei stride = sizeof(PackedWaterVertex);
+        glVertexAttribPointer((GLint)0, 3, GL_UNSIGNED_SHORT, GL_FALSE, stride, (const GLvoid*)offsetof(PackedWaterVertex, x));
+        glVertexAttribPointer((GLint)1, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, (const GLvoid*)offsetof(PackedWaterVertex, texCoord));
+    }
+    else
+    {
+        glGenBuffers(1, &m_waterVertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, m_waterVertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_waterVertices.size() * 3, &m_waterVertices[0], GL_STATIC_DRAW);
+        glVertexAttribPointer((GLint)0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+        glGenBuffers(1, &m_waterTexCoordsBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, m_waterTexCoordsBuffer); //Bind the vertex buffer
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * m_waterTexCoords.size() * 2, &m_waterTexCoords[0], GL_STATIC_DRAW); //Send the data to OpenGL
+        glVertexAttribPointer((GLint)1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    }
+
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_waterIndices.buffer);
+    glBindVertexArray(0);
+}
+
+void Terrain::releaseWater()
+{
+    glDeleteVertexArrays(1, &m_waterVertexArray);
+    glDeleteBuffers(1, &m_waterVertexBuffer);
+    glDeleteBuffers(1, &m_waterTexCoordsBuffer);
+
+    m_waterVertexArray = 0;
+    m_waterVertexBuffer = 0;
+    m_waterTexCoordsBuffer = 0;
+}
+
+bool Terrain::setVertexLayout(VertexLayout layout)
+{
+    if (layout == m_vertexLayout)
+    {
+        return true;
+    }
+
+    //Nothing has been uploaded yet
+    if (m_width == 0)
+    {
+        m_vertexLayout = layout;
+        return true;
+    }
+
+    if (layout == HEIGHT_TEXTURE_LAYOUT && !createHeightTexture())
+    {
+        return false;
+    }
+
+    //The pinned patches are rebuilt on this thread, the worker has to be out of the way
+    size_t cacheBudget = m_streamer.getCacheBudget();
+    m_streamer.stop();
+
+    m_vertexLayout = layout;
+    releasePatches();
+    startPatchBuffers(cacheBudget);
+
+    releaseWater();
+    uploadWater();
+    return true;
+}
+
+/**
+Gets the patches going for the current layout. The vertex buffer layouts
+need the pinned patches and the streamer, the height texture layout has
+every node ready straight away.
+*/
+void Terrain::startPatchBuffers(size_t cacheBudget)
+{
+    if (m_vertexLayout == HEIGHT_TEXTURE_LAYOUT)
+    {
+        m_patchReady.assign(m_patchReady.size(), 1);
+        return;
+    }
+
+    buildPinnedPatches();
+    m_streamer.start(&m_heightmap, PATCH_SIZE, cacheBudget);
+}
+
+void Terrain::buildHeightField()
+{
+    vector<unsigned short> samples;
+    readHeights(samples);
+
+    vector<float> heights(samples.size());
+    for (unsigned int i = 0; i < samples.size(); ++i)
+    {
+        heights[i] = m_heightmap.decode(samples[i]);
+    }
+
+    m_heightField.build(&heights[0], m_width, m_depth, m_quadtree.sampleToWorldX(0), m_quadtree.sampleToWorldZ(0));
+}
+
+//Gathers the samples of level 0 of the tiled heightmap into one row by row array
+void Terrain::readHeights(vector<unsigned short>& heights) const
+{
+    const int tileSize = m_heightmap.getTileSize();
+    const int stride = m_heightmap.getTileStride();
+    //The last sample belongs to the tile before it
+    const int lastTileX = std::max(m_width - 2, 0) / tileSize;
+    const int lastTileZ = std::max(m_depth - 2, 0) / tileSize;
+
+    heights.resize(m_width * m_depth);
+    for (int z = 0; z < m_depth; ++z)
+    {
+        int tileZ = std::min(z / tileSize, lastTileZ);
+        for (int x = 0; x < m_width; ++x)
+        {
+            int tileX = std::min(x / tileSize, lastTileX);
+            const unsigned short* tile = m_heightmap.getTile(0, tileX, tileZ);
+            heights[z * m_width + x] = tile[(z - tileZ * tileSize + 1) * stride + (x - tileX * tileSize + 1)];
+        }
+    }
+}
+
+/**
+Copies level 0 of the tiled heightmap into a 16 bit single channel texture.
+The vertex shader reads it with texelFetch, so it has no mipmaps and no
+filtering.
+*/
+bool Terrain::createHeightTexture()
+{
+    if (m_heightTexture != 0)
+    {
+        return true;
+    }
+
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    if (m_width > maxSize || m_depth > maxSize)
+    {
+        std::cerr << "The heightmap is too large for a texture (" << std::max(m_width, m_depth) << " > " << maxSize << ")" << std::endl;
+        return false;
+    }
+
+    vector<unsigned short> heights;
+    readHeights(heights);
+
+    glGenTextures(1, &m_heightTexture);
+    glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    //Rows of an odd width aren't 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, m_width, m_depth, 0, GL_RED, GL_UNSIGNED_SHORT, &heights[0]);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    //The grid vertices come from gl_VertexID, all the vertex array needs is the index buffer
+    glGenVertexArrays(1, &m_gridVertexArray);
+    glBindVertexArray(m_gridVertexArray);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_patchIndices.buffer);
+    glBindVertexArray(0);
+
+    return true;
+}
+
+/**
+Weights of the sand, grass, rock and snow layers for every sample of the
+region, row by row, 4 bytes per sample that add up to 255. Steep slopes
+are rock at any height, the rest goes from sand along the water through
+grass to snow on the peaks.
+*/
+void Terrain::computeSplatWeights(const SampleRegion& region, vector<unsigned char>& weights) const
+{
+    const int regionWidth = region.endX - region.firstX;
+    vector<float> x(regionWidth), z(regionWidth), heights(regionWidth), normals(regionWidth * 3);
+    weights.resize(size_t(regionWidth) * (region.endZ - region.firstZ) * 4);
+
+    for (int row = region.firstZ; row < region.endZ; ++row)
+    {
+        for (int i = 0; i < regionWidth; ++i)
+        {
+            x[i] = m_heightField.getOriginX() + float(region.firstX + i);
+            z[i] = m_heightField.getOriginZ() + float(row);
+        }
+
+        m_heightField.getHeights(&x[0], &z[0], regionWidth, &heights[0]);
+        m_heightField.getNormals(&x[0], &z[0], regionWidth, &normals[0]);
+
+        unsigned char* texels = &weights[size_t(row - region.firstZ) * regionWidth * 4];
+        for (int i = 0; i < regionWidth; ++i)
+        {
+            float rock = 1.0f - glm::smoothstep(ROCK_END_SLOPE, ROCK_START_SLOPE, normals[i * 3 + 1]);
+
+            float sand = (1.0f - rock) * (1.0f - glm::smoothstep(WATER_HEIGHT, SAND_HEIGHT, heights[i]));
+            float snow = (1.0f - rock) * glm::smoothstep(SNOW_START_HEIGHT, SNOW_END_HEIGHT, heights[i]);
+
+            int sandWeight = int(sand * 255.0f + 0.5f);
+            int rockWeight = int(rock * 255.0f + 0.5f);
+            int snowWeight = int(snow * 255.0f + 0.5f);
+
+            texels[i * 4 + 0] = (unsigned char)sandWeight;
+            texels[i * 4 + 1] = (unsigned char)std::max(255 - sandWeight - rockWeight - snowWeight, 0);
+            texels[i * 4 + 2] = (unsigned char)rockWeight;
+            texels[i * 4 + 3] = (unsigned char)snowWeight;
+        }
+    }
+}
+
+/**
+The splat map has one texel per heightmap sample and is filtered linearly,
+so the weights blend across every quad the same way the heights do.
+*/
+bool Terrain::createSplatTexture(const vector<unsigned char>& weights)
+{
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    if (m_width > maxSize || m_depth > maxSize)
+    {
+        std::cerr << "The heightmap is too large for a splat map (" << std::max(m_width, m_depth) << " > " << maxSize << ")" << std::endl;
+        return false;
+    }
+
+    if (m_splatTexture == 0)
+    {
+        glGenTextures(1, &m_splatTexture);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, m_splatTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, m_width, m_depth, 0, GL_RGBA, GL_UNSIGNED_BYTE, &weights[0]);
+
+    return true;
+}
+
+/**
+The horizons cover the texels of the splat map in two layers. They are
+filtered linearly, like the heights they were taken from.
+*/
+bool Terrain::createHorizonTexture(const unsigned char* horizons)
+{
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    if (horizons == NULL || m_width > maxSize || m_depth > maxSize)
+    {
+        return false;
+    }
+
+    if (m_horizonTexture == 0)
+    {
+        glGenTextures(1, &m_horizonTexture);
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, m_horizonTexture);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, m_width, m_depth, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, horizons);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    return true;
+}
+
+unsigned int Terrain::getVertexSize() const
+{
+    if (m_vertexLayout == HEIGHT_TEXTURE_LAYOUT)
+    {
+        return 0;
+    }
+
+    if (m_vertexLayout == INTERLEAVED_PACKED_LAYOUT)
+    {
+        return sizeof(PackedTerrainVertex);
+    }
+
+    return sizeof(GLfloat) * (3 + 2 + 3 + 1);
+}
+
+size_t Terrain::getVertexMemory() const
+{
+    size_t patchVertices = (PATCH_SIZE + 1) * (PATCH_SIZE + 1);
+    size_t waterVertexSize = (m_vertexLayout != SEPARATE_FLOAT_LAYOUT) ? sizeof(PackedWaterVertex) : sizeof(GLfloat) * (3 + 2);
+    size_t terrainSize = m_patches.size() * patchVertices * getVertexSize();
+
+    //The height texture takes the place of the vertex buffers
+    if (m_vertexLayout == HEIGHT_TEXTURE_LAYOUT)
+    {
+        terrainSize = size_t(m_width) * m_depth * sizeof(unsigned short);
+    }
+
+    return terrainSize + m_waterVertices.size() * waterVertexSize;
+}
+
+/**
+Timer queries are read back a frame or more late, reading them straight
+after the draws would stall until the GPU caught up. While a result is
+outstanding the frame simply goes unmeasured.
+*/
+void Terrain::beginTimer(DrawTimer& timer)
+{
+    if (timer.query == 0)
+    {
+        return;
+    }
+
+    if (timer.pending)
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(timer.query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            return;
+        }
+
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(timer.query, GL_QUERY_RESULT, &elapsed);
+        timer.elapsed += elapsed;
+        ++timer.samples;
+        timer.pending = false;
+    }
+
+    glBeginQuery(GL_TIME_ELAPSED, timer.query);
+    timer.running = true;
+}
+
+void Terrain::endTimer(DrawTimer& timer)
+{
+    if (timer.running)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        timer.running = false;
+        timer.pending = true;
+    }
+}
+
+double Terrain::getDrawTime()
+{
+    if (m_terrainTimer.query == 0)
+    {
+        return -1.0;
+    }
+
+    double milliseconds = 0.0;
+    DrawTimer* timers[2] = { &m_terrainTimer, &m_waterTimer };
+    for (int i = 0; i < 2; ++i)
+    {
+        if (timers[i]->samples > 0)
+        {
+            milliseconds += double(timers[i]->elapsed) / double(timers[i]->samples) / 1000000.0;
+        }
+
+        timers[i]->elapsed = 0;
+        timers[i]->samples = 0;
+    }
+
+    return milliseconds;
+}
+
+double Terrain::getSubmitTime()
+{
+    double milliseconds = (m_submitSamples > 0) ? m_submitTime / m_submitSamples : 0.0;
+    m_submitTime = 0.0;
+    m_submitSamples = 0;
+    return milliseconds;
+}
+
+bool Terrain::loadHeightmap(const string& rawFile, const RawHeightmapFormat& format, JobSystem& jobs) 
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    Clock::time_point start = Clock::now();
+
+    //Mapping the source only reads its header, the samples are only touched if it needs converting
+    RawHeightmap source;
+    if (!source.open(rawFile, format))
+    {
+        return false;
+    }
+
+    const int width = source.getWidth();
+    const int depth = source.getDepth();
+    const int levels = TerrainQuadtree::computeLevelCount(std::max(width, depth), PATCH_SIZE);
+
+    m_streamer.stop();
+    m_jobs = &jobs;
+
+    //The raw file is converted once into a tiled pyramid which is then mapped into memory
+    const string baseName = rawFile.substr(0, rawFile.find_last_of('.'));
+    const string tileFile = baseName + ".tiles";
+
+    if (!m_heightmap.open(tileFile) || m_heightmap.getWidth() != width || m_heightmap.getDepth() != depth ||
+        m_heightmap.getTileSize() != TILE_SIZE || m_heightmap.getLevelCount() != levels ||
+        !m_heightmap.isSourceCurrent(source))
+    {
+        m_heightmap.close();
+
+        if (!TiledHeightmap::convert(source, HEIGHT_SCALE, TILE_SIZE, PATCH_SIZE, levels, tileFile, jobs) ||
+            !m_heightmap.open(tileFile))
+        {
+            return false;
+        }
+    }
+
+    //What gets generated from the tiles is baked too, keyed by the source and every setting it depends on
+    vector<unsigned int> bakeParameters;
+    bakeParameters.push_back(PATCH_SIZE);
+    bakeParameters.push_back(TILE_SIZE);
+    bakeParameters.push_back(levels);
+    bakeParameters.push_back(floatBits(HEIGHT_SCALE));
+    bakeParameters.push_back(floatBits(WATER_HEIGHT));
+    bakeParameters.push_back(floatBits(TEXCOORD_RANGE));
+    bakeParameters.push_back(floatBits(LOD_LEAF_RANGE));
+    bakeParameters.push_back(HorizonMap::DIRECTION_COUNT);
+    bakeParameters.push_back(HorizonMap::SEARCH_RADIUS);
+
+    const string bakedFile = baseName + ".baked";
+    const unsigned long long bakeKey = BakedTerrain::computeKey(source, bakeParameters);
+    const bool warm = m_baked.open(bakedFile, bakeKey);
+
+    source.close();
+
+    releasePatches();
+    releaseWater();
+
+    m_width = width;
+    m_depth = depth;
+
+    if (warm)
+    {
+        m_quadtree.build(width, depth, PATCH_SIZE, LOD_LEAF_RANGE, m_baked.getNodes(), m_baked.getNodeCount());
+    }
+    else
+    {
+        m_quadtree.build(width, depth, PATCH_SIZE, LOD_LEAF_RANGE, m_heightmap.getLeafBounds(), m_heightmap.getLeafCount());
+    }
+
+    m_patchReady.assign(m_quadtree.getNodeCount(), 0);
+
+    /*
+        The index orders, the water and the height field are built by jobs
+        while this thread goes on with the GL side. The water indices follow
+        the order picked for the patches, so they wait on it. A warm start
+        only has the water grid and the height field left to build.
+    */
+    vector<IndexBuilder> patchIndices;
+    IndexBuilder waterIndices(width * depth, ROW_MAJOR_ORDER);
+    JobHandle patchOrder;
+    JobHandle water;
+
+    if (warm)
+    {
+        m_indexOrder = m_baked.getPatchIndexOrder();
+        water = jobs.schedule([this]()
+        {
+            generateWaterVertices();
+            generateWaterTexCoords();
+        });
+    }
+    else
+    {
+        patchOrder = generatePatchIndices(patchIndices);
+        water = jobs.schedule([this, &waterIndices]()
+        {
+            generateWaterVertices();
+            generateWaterTexCoords();
+            generateWaterIndices(waterIndices);
+        }, vector<JobHandle>(1, patchOrder));
+    }
+
+    JobHandle heightField = jobs.schedule([this]() { buildHeightField(); });
+
+    //The splat map samples the height field
+    vector<unsigned char> splatWeights;
+    JobHandle splat = jobs.schedule([this, &splatWeights]()
+    {
+        SampleRegion region = { 0, 0, m_width, m_depth };
+        computeSplatWeights(region, splatWeights);
+    }, vector<JobHandle>(1, heightField));
+
+    //A cold start bakes the horizons over every core, a warm one maps them
+    vector<unsigned char> horizons;
+    JobHandle horizonMap;
+    if (!warm)
+    {
+        horizonMap = jobs.schedule([this, &jobs, &horizons]()
+        {
+            SampleRegion region = { 0, 0, m_width, m_depth };
+            HorizonMap::bake(m_heightField, region, jobs, horizons);
+        }, vector<JobHandle>(1, heightField));
+    }
+
+    //The patch vertex arrays refer to the index buffer, so it comes first
+    if (warm)
+    {
+        m_baked.uploadPatchIndices(m_patchIndices);
+    }
+    else
+    {
+        jobs.wait(patchOrder);
+        uploadPatchIndices(patchIndices);
+    }
+
+    if (m_vertexLayout == HEIGHT_TEXTURE_LAYOUT && !createHeightTexture())
+    {
+        m_vertexLayout = INTERLEAVED_PACKED_LAYOUT;
+    }
+
+    startPatchBuffers(DEFAULT_TILE_CACHE_BUDGET);
+
+    jobs.wait(water);
+    if (warm)
+    {
+        m_baked.uploadWaterIndices(m_waterIndices);
+    }
+    else
+    {
+        uploadWaterIndices(waterIndices);
+    }
+    uploadWater();
+
+    jobs.wait(splat);
+    if (!createSplatTexture(splatWeights))
+    {
+        glDeleteTextures(1, &m_splatTexture);
+        m_splatTexture = 0;
+    }
+
+    if (!warm)
+    {
+        jobs.wait(horizonMap);
+    }
+
+    //Without horizons there is no texture, which turns horizon lighting off
+    const unsigned char* horizonData = warm ? m_baked.getHorizons() : (horizons.empty() ? NULL : &horizons[0]);
+    if (!createHorizonTexture(horizonData))
+    {
+        glDeleteTextures(1, &m_horizonTexture);
+        m_horizonTexture = 0;
+    }
+
+    if (GLEW_ARB_timer_query && m_terrainTimer.query == 0)
+    {
+        glGenQueries(1, &m_terrainTimer.query);
+        glGenQueries(1, &m_waterTimer.query);
+    }
+
+    Clock::time_point ready = Clock::now();
+    double loadTime = std::chrono::duration<double, std::milli>(ready - start).count();
+
+    if (warm)
+    {
+        std::cout << "Terrain warm start from " << bakedFile << ": ready in " << loadTime << " ms" << std::endl;
+        return true;
+    }
+
+    //Baking isn't counted in the cold start, it only happens once
+    const IndexBuilder* chosen = &patchIndices[0];
+    for (unsigned int i = 0; i < patchIndices.size(); ++i)
+    {
+        if (patchIndices[i].getOrder() == m_indexOrder)
+        {
+            chosen = &patchIndices[i];
+        }
+    }
+
+    bool baked = bakeTerrain(bakedFile, bakeKey, *chosen, waterIndices, horizons);
+    std::cout << "Terrain cold start: ready in " << loadTime << " ms";
+    if (baked)
+    {
+        std::cout << ", baked into " << bakedFile << " in "
+                  << std::chrono::duration<double, std::milli>(Clock::now() - ready).count() << " ms";
+    }
+    std::cout << std::endl;
+
+    return true;
+}
+
+//The world heights of a whole raw heightmap for the benchmarks, without building a terrain
+static bool loadBenchmarkHeights(const string& rawFile, const RawHeightmapFormat& format,
+                                 vector<float>& heights, int& width, int& depth)
+{
+    RawHeightmap source;
+    if (!source.open(rawFile, format))
+    {
+        return false;
+    }
+
+    width = source.getWidth();
+    depth = source.getDepth();
+
+    vector<unsigned short> samples(size_t(width) * depth);
+    source.readRows(0, depth, &samples[0]);
+
+    heights.resize(samples.size());
+    for (unsigned int i = 0; i < samples.size(); ++i)
+    {
+        heights[i] = float(samples[i]) / 65536.0f * HEIGHT_SCALE;
+    }
+
+    return true;
+}
+
+bool Terrain::benchmarkNormals(const string& rawFile, const RawHeightmapFormat& format)
+{
+    vector<float> heights;
+    int width, depth;
+    if (!loadBenchmarkHeights(rawFile, format, heights, width, depth))
+    {
+        return false;
+    }
+
+    NormalGenerator::benchmark(&heights[0], width, depth, 1.0f);
+    return true;
+}
+
+bool Terrain::benchmarkShading(const string& rawFile, const RawHeightmapFormat& format)
+{
+    vector<float> heights;
+    int width, depth;
+    return loadBenchmarkHeights(rawFile, format, heights, width, depth) &&
+           ShadingReference::benchmark(&heights[0], width, depth, 1.0f);
+}
+
+void Terrain::update(const glm::vec3& cameraPosition, const Frustum& frustum)
+{
+    m_cameraPosition = cameraPosition;
+
+    //Every node can be drawn from the height texture, there is nothing to stream
+    if (m_vertexLayout == HEIGHT_TEXTURE_LAYOUT)
+    {
+        m_quadtree.select(cameraPosition, frustum, m_patchReady, m_selection, m_missing);
+        cullHiddenQuadrants();
+        return;
+    }
+
+    collectPatches();
+
+    m_quadtree.select(cameraPosition, frustum, m_patchReady, m_selection, m_missing);
+    cullHiddenQuadrants();
+
+    //Ask for whatever is missing, this replaces last frame's requests
+    vector<PatchRequest> requests(m_missing.size());
+    for (unsigned int i = 0; i < m_missing.size(); ++i)
+    {
+        const QuadtreeNode& node = m_quadtree.getNode(m_missing[i]);
+        requests[i].node = m_missing[i];
+        requests[i].level = node.level;
+        requests[i].x = node.x;
+        requests[i].z = node.z;
+    }
+
+    m_streamer.request(requests);
+}
+
+/**
+Tests the selected quadrants nearest first against the horizon of the ones
+in front of them and drops the hidden ones, along with nodes that have no
+quadrant left. The bounds of a quadrant hold whatever LOD it is drawn at,
+every drawn height is a blend of heightmap samples inside them. Nodes that
+still need streaming are requested all the same.
+*/
+void Terrain::cullHiddenQuadrants()
+{
+    m_hiddenQuadrants = 0;
+    m_horizon.begin(m_cameraPosition);
+
+    if (!m_horizonCulling)
+    {
+        m_horizon.end();
+        return;
+    }
+
+    vector<std::pair<float, int> > order;
+    vector<glm::vec3> bounds;
+    for (unsigned int i = 0; i < m_selection.size(); ++i)
+    {
+        const QuadtreeNode& node = m_quadtree.getNode(m_selection[i].node);
+        for (int quadrant = 0; quadrant < 4; ++quadrant)
+        {
+            glm::vec3 boxMin, boxMax;
+            if (!(m_selection[i].quadrants & (1 << quadrant)) ||
+                !m_quadtree.getQuadrantBounds(node, quadrant, boxMin, boxMax))
+            {
+                continue;
+            }
+
+            //Selection and quadrant share the key, the bounds are found by the order they were added in
+            order.push_back(std::make_pair(m_horizon.getNearDistance(boxMin, boxMax), int(i * 4 + quadrant)));
+            bounds.push_back(boxMin);
+            bounds.push_back(boxMax);
+        }
+    }
+
+    vector<int> boxes(m_selection.size() * 4, -1);
+    for (unsigned int i = 0; i < order.size(); ++i)
+    {
+        boxes[order[i].second] = i;
+    }
+
+    std::sort(order.begin(), order.end());
+
+    for (unsigned int i = 0; i < order.size(); ++i)
+    {
+        const int key = order[i].second;
+        const int box = boxes[key];
+
+        if (m_horizon.cull(bounds[box * 2], bounds[box * 2 + 1]))
+        {
+            m_selection[key / 4].quadrants &= ~(1u << (key % 4));
+            ++m_hiddenQuadrants;
+        }
+    }
+
+    m_horizon.end();
+
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < m_selection.size(); ++i)
+    {
+        if (m_selection[i].quadrants != 0)
+        {
+            m_selection[kept++] = m_selection[i];
+        }
+    }
+
+    m_selection.resize(kept);
+}
+
+void Terrain::renderWater()
+{
+    beginTimer(m_waterTimer);
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+
+    //The water shares the terrain fragment shader but never splats
+    m_waterProgram->sendUniform(m_waterUniforms[TERRAIN_UNIFORM_SPLATTING], 0);
+    m_waterProgram->sendUniform(m_waterUniforms[TERRAIN_UNIFORM_SPLAT_MAP], 2);
+    m_waterProgram->sendUniform(m_waterUniforms[TERRAIN_UNIFORM_MATERIAL_LAYERS], 3);
+
+    //Packed water vertices hold grid positions, the height is all in the offset
+    if (m_vertexLayout != SEPARATE_FLOAT_LAYOUT)
+    {
+        m_waterProgram->sendUniform(m_waterUniforms[TERRAIN_UNIFORM_POSITION_SCALE], 1.0f, 1.0f, 1.0f);
+        m_waterProgram->sendUniform(m_waterUniforms[TERRAIN_UNIFORM_POSITION_OFFSET], m_quadtree.sampleToWorldX(0), WATER_HEIGHT, m_quadtree.sampleToWorldZ(0));
+        m_waterProgram->sendUniform(m_waterUniforms[TERRAIN_UNIFORM_TEXCOORD_SCALE], TEXCOORD_RANGE);
+    }
+    else
+    {
+        m_waterProgram->sendUniform(m_waterUniforms[TERRAIN_UNIFORM_POSITION_SCALE], 1.0f, 1.0f, 1.0f);
+        m_waterProgram->sendUniform(m_waterUniforms[TERRAIN_UNIFORM_POSITION_OFFSET], 0.0f, 0.0f, 0.0f);
+        m_waterProgram->sendUniform(m_waterUniforms[TERRAIN_UNIFORM_TEXCOORD_SCALE], 1.0f);
+    }
+
+    setPrimitiveRestart(m_waterIndices);
+
+    glBindVertexArray(m_waterVertexArray);
+    drawSections(m_waterIndices, 0, 1);
+    glBindVertexArray(0);
+
+    glDisable(GL_PRIMITIVE_RESTART);
+
+    glDisable(GL_BLEND);
+
+    endTimer(m_waterTimer);
+}
+
+//Strips are joined with restart indices, lists don't need them
+void Terrain::setPrimitiveRestart(const IndexBuffer& indices)
+{
+    if (indices.mode == GL_TRIANGLE_STRIP)
+    {
+        glEnable(GL_PRIMITIVE_RESTART);
+        glPrimitiveRestartIndex(indices.restartIndex);
+    }
+    else
+    {
+        glDisable(GL_PRIMITIVE_RESTART);
+    }
+}
+
+void Terrain::render()
+{
+    ++m_frame;
+
+    beginTimer(m_terrainTimer);
+
+    m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_CAMERA_POSITION], m_cameraPosition.x, m_cameraPosition.y, m_cameraPosition.z);
+
+    //Tell the shader how to turn the stored attributes back into world positions, normals and texture coordinates
+    if (m_vertexLayout == HEIGHT_TEXTURE_LAYOUT)
+    {
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_POSITION_SCALE], 1.0f, HEIGHT_SCALE * 65535.0f / 65536.0f, 1.0f);
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_POSITION_OFFSET], m_quadtree.sampleToWorldX(0), 0.0f, m_quadtree.sampleToWorldZ(0));
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_TEXCOORD_SCALE], TEXCOORD_RANGE / float(std::max(m_width, m_depth)));
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_PATCH_WIDTH], PATCH_SIZE + 1);
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_HEIGHT_MAP], 1);
+
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+    else if (m_vertexLayout == INTERLEAVED_PACKED_LAYOUT)
+    {
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_POSITION_SCALE], 1.0f, HEIGHT_SCALE / 65535.0f, 1.0f);
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_POSITION_OFFSET], m_quadtree.sampleToWorldX(0), 0.0f, m_quadtree.sampleToWorldZ(0));
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_TEXCOORD_SCALE], TEXCOORD_RANGE);
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_OCTAHEDRAL_NORMALS], 1);
+    }
+    else
+    {
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_POSITION_SCALE], 1.0f, 1.0f, 1.0f);
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_POSITION_OFFSET], 0.0f, 0.0f, 0.0f);
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_TEXCOORD_SCALE], 1.0f);
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_OCTAHEDRAL_NORMALS], 0);
+    }
+
+    m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_HEIGHT_TEXTURE], (m_vertexLayout == HEIGHT_TEXTURE_LAYOUT) ? 1 : 0);
+
+    //Samplers of different types may not share a unit even when unused, so the units are set either way
+    bool splatting = (m_splatTexture != 0 && m_materialLayers != 0);
+    m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_SPLATTING], splatting ? 1 : 0);
+    m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_SPLAT_MAP], 2);
+    m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_MATERIAL_LAYERS], 3);
+    m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_HORIZON_LIGHTING], (m_horizonTexture != 0) ? 1 : 0);
+    m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_HORIZON_MAP], 4);
+    m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_SPLAT_TRANSFORM], 1.0f / m_width, 1.0f / m_depth,
+                               (0.5f - m_quadtree.sampleToWorldX(0)) / m_width,
+                               (0.5f - m_quadtree.sampleToWorldZ(0)) / m_depth);
+
+    if (m_horizonTexture != 0)
+    {
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_horizonTexture);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    if (splatting)
+    {
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, m_splatTexture);
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, m_materialLayers);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    typedef std::chrono::high_resolution_clock Clock;
+    Clock::time_point submitStart = Clock::now();
+
+    setPrimitiveRestart(m_patchIndices);
+
+    const bool indirect = (m_indirectDraws && m_vertexLayout == HEIGHT_TEXTURE_LAYOUT);
+    m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_INDIRECT_DRAWS], indirect ? 1 : 0);
+
+    if (indirect)
+    {
+        drawIndirect();
+    }
+
+    for (unsigned int i = 0; i < m_selection.size() && !indirect; ++i)
+    {
+        const NodeSelection& selection = m_selection[i];
+        const QuadtreeNode& node = m_quadtree.getNode(selection.node);
+
+        const IndexBuffer* indices = &m_patchIndices;
+        if (m_vertexLayout == HEIGHT_TEXTURE_LAYOUT)
+        {
+            //Every node draws the same grid, placed by its first sample and the samples between vertices
+            glBindVertexArray(m_gridVertexArray);
+            m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_PATCH_ORIGIN], float(node.x), float(node.z), float(1 << node.level));
+        }
+        else
+        {
+            TerrainPatch* patch = getPatch(selection.node);
+            glBindVertexArray(patch->vertexArray);
+
+            if (patch->indices.buffer != 0)
+            {
+                indices = &patch->indices;
+            }
+        }
+
+        m_GLSLProgram->sendUniform(m_terrainUniforms[TERRAIN_UNIFORM_MORPH_RANGE], m_quadtree.getMorphStart(node.level), m_quadtree.getMorphEnd(node.level));
+
+        //A simplified patch drawn whole doesn't need the lines between its quadrants
+        if (selection.quadrants == 0xF && indices != &m_patchIndices)
+        {
+            drawSections(*indices, 4, 5);
+            continue;
+        }
+
+        //Draw runs of neighbouring quadrants with a single call, quadrants are the first sections of the patch index buffers
+        int first = 0, end = 0;
+        while (nextQuadrantRun(selection.quadrants, first, end))
+        {
+            drawSections(*indices, first, end);
+        }
+    }
+
+    glBindVertexArray(0);
+    glDisable(GL_PRIMITIVE_RESTART);
+
+    m_submitTime += std::chrono::duration<double, std::milli>(Clock::now() - submitStart).count();
+    ++m_submitSamples;
+
+    endTimer(m_terrainTimer);
 
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
-    glDisableVertexAttribArray(2);
+    evictPatches();
 }
@@ -7,11 +7,26 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include <GL/Glew.h>
+#include <glm/glm.hpp>
 #include "glslshader.h"
+#include "quadtree.h"
+#include "tiledheightmap.h"
+#include "tilestreamer.h"
+#include "rawheightmap.h"
+#include "heightfield.h"
+#include "vertexformat.h"
+#include "indexbuilder.h"
+#include "rtinmesh.h"
+#include "bakedterrain.h"
+#include "horizonculler.h"
+#include "horizonmap.h"
+#include "jobsystem.h"
 
 using std::string;
 using std::vector;
+using std::map;
 
 struct Vertex 
 {
@@ -39,55 +54,229 @@ struct TexCoord
     }
 };
 
-struct Color 
-{
-    float r, g, b;
-    Color(float r, float g, float b) 
-    {
-        this->r = r;
-        this->g = g;
-        this->b = b;
-    }
-};
-
 class Terrain 
 {
 public:
     Terrain();
-    bool loadHeightmap(const string& rawFile, int width);
+    ~Terrain();
+    //The CPU work is spread over jobs, only the GL calls stay on the calling thread
+    bool loadHeightmap(const string& rawFile, const RawHeightmapFormat& format, JobSystem& jobs);
+    void update(const glm::vec3& cameraPosition, const Frustum& frustum);
     void render();
     void renderWater();
     void SetTextureHandle(GLuint handle);
-    GLSLProgram* m_GLSLProgram;
+
+    //The programs render and renderWater draw with, linked and with their variants prepared
+    void setPrograms(GLSLProgram* terrainProgram, GLSLProgram* waterProgram);
+
+    /*
+        A GL_TEXTURE_2D_ARRAY of sand, grass, rock and snow, in that order.
+        The terrain blends them with a splat map it builds from the heights
+        and slopes, so every patch is still a single draw. 0 goes back to
+        the single texture bound by the caller.
+    */
+    void setMaterialLayers(GLuint textureArray) { m_materialLayers = textureArray; }
+    void setTileCacheBudget(size_t bytes);
+
+    /*
+        Replaces the heights of the samples [firstX, firstX + width) x
+        [firstZ, firstZ + depth) with width x depth world heights, row by
+        row. Only the patches and texels that read the region are rebuilt.
+        The water keeps the extent it was loaded with.
+    */
+    bool setHeights(int firstX, int firstZ, int width, int depth, const float* heights);
+
+    //Compares the normal generators on a raw heightmap, needs no GL context
+    static bool benchmarkNormals(const string& rawFile, const RawHeightmapFormat& format);
+
+    //Checks and times the CPU version of the vertex lighting and fog on a raw heightmap, needs no GL context
+    static bool benchmarkShading(const string& rawFile, const RawHeightmapFormat& format);
+
+    //Rebuilds every resident vertex buffer in the new layout, false if the GL can't do the layout
+    bool setVertexLayout(VertexLayout layout);
+    VertexLayout getVertexLayout() const { return m_vertexLayout; }
+
+    //Bytes per terrain vertex and bytes of terrain and water vertices held by the GPU
+    unsigned int getVertexSize() const;
+    size_t getVertexMemory() const;
+
+    /*
+        Patches are drawn as the coarsest right triangulated irregular
+        network whose heights stay within error world units of the full
+        grid, doubled on every coarser level. 0 draws the full grid. The
+        height texture layout always draws the full grid.
+    */
+    void setMeshError(float error);
+    float getMeshError() const { return m_meshError; }
+
+    //Average triangles of the resident patches when drawn whole
+    float getPatchTriangles() const;
+
+    /*
+        Horizon culling drops the patch quadrants that the terrain in front
+        of them hides, on the CPU during update. Once update is done,
+        isOccluded tests the bounds of other objects against the same
+        horizon.
+    */
+    void setHorizonCulling(bool enabled) { m_horizonCulling = enabled; }
+    bool isHorizonCulling() const { return m_horizonCulling; }
+    unsigned int getHiddenQuadrants() const { return m_hiddenQuadrants; }
+    bool isOccluded(const glm::vec3& boxMin, const glm::vec3& boxMax) const { return m_horizon.isOccluded(boxMin, boxMax); }
+
+    /*
+        Indirect draws submit every selected patch of the height texture
+        layout with a single glMultiDrawElementsIndirect. The origin and
+        morph range of each draw sit in a per instance vertex attribute
+        that the base instance of its command picks out. The other layouts
+        keep a vertex array per patch and draw them one by one. False if
+        the GL can't draw indirect.
+    */
+    bool setIndirectDraws(bool enabled);
+    bool isIndirectDraws() const { return m_indirectDraws; }
+
+    //Average GPU time of render and renderWater in milliseconds since the last call, -1 without timer queries
+    double getDrawTime();
+
+    //Average CPU time render spent submitting the patches in milliseconds since the last call
+    double getSubmitTime();
+
+    //Height, normal and ray queries against the loaded heightmap in world space
+    const HeightField& getHeightField() const { return m_heightField; }
+
 private:
-    void generateVertices(const vector<float> heights, int width);
-    void generateIndices(int width);
-    void generateTexCoords(int width);
-    void generateNormals();
+    //The vertex array and buffers of one quadtree node
+    struct TerrainPatch
+    {
+        GLuint vertexArray;
+        GLuint buffers[4];      //Only the first one is used by the packed layout
+        unsigned int lastUsedFrame;
+        bool pinned;
+        IndexBuffer indices;    //Sections 0-3 are the quadrants and 4 the whole patch, no buffer while the shared grid is drawn
+        vector<float> errors;   //RTIN vertex errors with the quadrant lines kept, then with only the border kept
+    };
+
+    //The command glMultiDrawElementsIndirect reads
+    struct DrawElementsCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    //Measures the GPU time of the draws between begin and end without waiting for the result
+    struct DrawTimer
+    {
+        GLuint query;
+        bool running;           //Between begin and end
+        bool pending;           //The last measurement hasn't been read back yet
+        GLuint64 elapsed;
+        unsigned int samples;
+    };
+
+    JobHandle generatePatchIndices(vector<IndexBuilder>& builders);
+    void uploadPatchIndices(const vector<IndexBuilder>& builders);
+    TerrainPatch* getPatch(int nodeIndex);
+    void buildPinnedPatches();
+    void buildPinnedData(vector<PatchData>& data) const;
+    bool bakeTerrain(const string& bakedFile, unsigned long long key, const IndexBuilder& patchIndices,
+                     const IndexBuilder& waterIndices, const vector<unsigned char>& horizons) const;
+    void collectPatches();
+    void uploadPatch(const PatchData& data, TerrainPatch& patch);
+    void uploadPackedPatch(int node, const PackedTerrainVertex* vertices, TerrainPatch& patch);
+    void finishPatch(int node, TerrainPatch& patch);
+    void packVertices(const PatchData& data, int first, int end, vector<PackedTerrainVertex>& vertices) const;
+    void updatePatches(const SampleRegion& region);
+    void updatePatchRows(const PatchData& data, TerrainPatch& patch, int firstRow, int endRow);
+    void computePatchErrors(const PatchData& data, vector<float>& errors) const;
+    void buildPatchIndices(int level, const TerrainPatch& patch, IndexBuilder& builder) const;
+    void bindPatchIndices(TerrainPatch& patch);
+    void releasePatch(TerrainPatch& patch);
+    void releasePatches();
+    void evictPatches();
+    void cullHiddenQuadrants();
     
-    void generateWaterVertices(int width);
-    void generateWaterIndices(int width);
-    void generateWaterTexCoords(int width);
-
-    GLuint m_vertexBuffer;
-    GLuint m_indexBuffer;
-    GLuint m_colorBuffer;
-    GLuint m_texCoordBuffer;
-    GLuint m_normalBuffer;
+    void generateWaterVertices();
+    void generateWaterIndices(IndexBuilder& builder);
+    void uploadWaterIndices(const IndexBuilder& builder);
+    void generateWaterTexCoords();
+    void uploadWater();
+    void releaseWater();
+    void readHeights(vector<unsigned short>& heights) const;
+    void buildHeightField();
+    bool createHeightTexture();
+    void computeSplatWeights(const SampleRegion& region, vector<unsigned char>& weights) const;
+    bool createSplatTexture(const vector<unsigned char>& weights);
+    bool createHorizonTexture(const unsigned char* horizons);
+    void startPatchBuffers(size_t cacheBudget);
+
+    void drawSections(const IndexBuffer& indices, int first, int end);
+    void drawIndirect();
+    void createIndirectBuffers();
+    void setPrimitiveRestart(const IndexBuffer& indices);
+
+    void beginTimer(DrawTimer& timer);
+    void endTimer(DrawTimer& timer);
+
+    GLSLProgram* m_GLSLProgram;
+    GLSLProgram* m_waterProgram;
+    vector<GLSLProgram::UniformHandle> m_terrainUniforms;  //By TerrainUniform
+    vector<GLSLProgram::UniformHandle> m_waterUniforms;
+
+    IndexBuffer m_patchIndices;
+    IndexOrder m_indexOrder;
+
+    RtinMesh m_rtin;
+    vector<unsigned char> m_keepQuadrants;  //Per patch vertex, the border and the lines between the quadrants
+    vector<unsigned char> m_keepBorder;
+    float m_meshError;
+
     GLuint m_grassTexID;
+    GLuint m_materialLayers;        //Owned by the caller
+    GLuint m_splatTexture;          //RGBA8 layer weights, one texel per sample
+    GLuint m_horizonTexture;        //HorizonMap layers over the same texels as the splat map
 
+    GLuint m_heightTexture;         //Level 0 of the heightmap for HEIGHT_TEXTURE_LAYOUT
+    GLuint m_gridVertexArray;       //Holds just the patch indices, the grid comes from gl_VertexID
+
+    GLuint m_waterVertexArray;
     GLuint m_waterVertexBuffer;
-    GLuint m_waterIndexBuffer;
+    IndexBuffer m_waterIndices;
     GLuint m_waterTexCoordsBuffer;
 
-    vector<Vertex> m_vertices;
-    vector<Color> m_colors;
-    vector<TexCoord> m_texCoords;
-    vector<GLuint> m_indices;
-    vector<Vertex> m_normals;
+    VertexLayout m_vertexLayout;
+    DrawTimer m_terrainTimer;
+    DrawTimer m_waterTimer;
+    double m_submitTime;            //CPU milliseconds spent submitting patches since getSubmitTime
+    unsigned int m_submitSamples;
+
+    bool m_indirectDraws;
+    GLuint m_drawCommandBuffer;
+    GLuint m_drawDataBuffer;        //Origin, step and morph range of every selected node
+    vector<DrawElementsCommand> m_drawCommands;
+    vector<GLfloat> m_drawData;
+
+    int m_width;                    //Samples along x and z
+    int m_depth;
+    JobSystem* m_jobs;
+    TiledHeightmap m_heightmap;
+    TileStreamer m_streamer;
+    BakedTerrain m_baked;           //Closed once the heights are edited
+
+    TerrainQuadtree m_quadtree;
+    HeightField m_heightField;
+    vector<NodeSelection> m_selection;
+    vector<int> m_missing;
+    HorizonCuller m_horizon;
+    bool m_horizonCulling;
+    unsigned int m_hiddenQuadrants;   //Selected quadrants the horizon culled last update
+    map<int, TerrainPatch> m_patches;
+    vector<unsigned char> m_patchReady;
+    glm::vec3 m_cameraPosition;
+    unsigned int m_frame;
 
     vector<Vertex> m_waterVertices;
-    vector<GLuint> m_waterIndices;
     vector<TexCoord> m_waterTexCoords;
 };
 
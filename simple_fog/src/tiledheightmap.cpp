@@ -0,0 +1,378 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include "tiledheightmap.h"
+#include "jobsystem.h"
+
+const char TILE_FILE_MAGIC[4] = { 'S', 'F', 'H', 'T' };
+const unsigned int TILE_FILE_VERSION = 3;
+
+//Samples are stored as 16 bit fractions of the height scale
+const float TILE_VALUE_RANGE = 65536.0f;
+
+static int levelSample(int level, int index, int width)
+{
+    return std::min(index << level, width - 1);
+}
+
+TiledHeightmap::TiledHeightmap():
+m_header(NULL),
+m_levels(NULL),
+m_leafBounds(NULL),
+m_leafCount(0),
+m_decodeScale(0.0f)
+{
+
+}
+
+TiledHeightmap::~TiledHeightmap()
+{
+    close();
+}
+
+/**
+Builds the tile pyramid for a heightmap. This is a one off step, the
+converted file is what gets mapped at runtime. The source rows a tile row
+needs are converted into a small buffer first, so the source is never
+copied as a whole.
+*/
+bool TiledHeightmap::convert(const RawHeightmap& source, float heightScale,
+                             int tileSize, int leafSize, int levels, const string& tileFile, JobSystem& jobs)
+{
+    const int width = source.getWidth();
+    const int depth = source.getDepth();
+
+    TileFileHeader header;
+    memcpy(header.magic, TILE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TILE_FILE_VERSION;
+    header.width = width;
+    header.depth = depth;
+    header.tileSize = tileSize;
+    header.leafSize = leafSize;
+    header.levels = levels;
+    header.heightScale = heightScale;
+    header.sourceFormat = source.getSampleFormat();
+
+    if (!source.getFileStamp(header.sourceSize, header.sourceTime))
+    {
+        return false;
+    }
+
+    const int stride = tileSize + 3;
+    const unsigned int tileBytes = stride * stride * sizeof(unsigned short);
+
+    vector<TileLevelInfo> levelInfo(levels);
+    unsigned int offset = sizeof(TileFileHeader) + sizeof(TileLevelInfo) * levels;
+
+    for (int level = 0; level < levels; ++level)
+    {
+        int quadsX = ((width - 1) + (1 << level) - 1) >> level;
+        int quadsZ = ((depth - 1) + (1 << level) - 1) >> level;
+        levelInfo[level].samplesX = quadsX + 1;
+        levelInfo[level].samplesZ = quadsZ + 1;
+        levelInfo[level].tilesX = std::max((quadsX + tileSize - 1) / tileSize, 1);
+        levelInfo[level].tilesZ = std::max((quadsZ + tileSize - 1) / tileSize, 1);
+        levelInfo[level].offset = offset;
+
+        offset += levelInfo[level].tilesX * levelInfo[level].tilesZ * tileBytes;
+    }
+
+    header.boundsOffset = (offset + 3) & ~3u; //The bounds are floats
+
+    std::ofstream fileOut(tileFile.c_str(), std::ios::binary);
+    if (!fileOut.good())
+    {
+        std::cerr << "Could not create the tiled heightmap " << tileFile << std::endl;
+        return false;
+    }
+
+    fileOut.write(reinterpret_cast<const char*>(&header), sizeof(TileFileHeader));
+    fileOut.write(reinterpret_cast<const char*>(&levelInfo[0]), sizeof(TileLevelInfo) * levels);
+
+    //Only one row of tiles, and the source rows it is made of, are held in memory at a time
+    vector<unsigned short> sourceRows(size_t(stride) * width);
+    vector<unsigned short> row;
+    for (int level = 0; level < levels; ++level)
+    {
+        const int samplesX = levelInfo[level].samplesX;
+        const int samplesZ = levelInfo[level].samplesZ;
+        const int tilesX = levelInfo[level].tilesX;
+        const int tilesZ = levelInfo[level].tilesZ;
+        row.resize(tilesX * stride * stride);
+
+        for (int tz = 0; tz < tilesZ; ++tz)
+        {
+            jobs.wait(jobs.parallelFor(0, stride, 1, [&](int first, int end)
+            {
+                for (int j = first; j < end; ++j)
+                {
+                    int z = std::max(0, std::min(tz * tileSize + j - 1, samplesZ - 1));
+                    int sourceZ = levelSample(level, z, depth);
+                    source.readRows(sourceZ, sourceZ + 1, &sourceRows[size_t(j) * width]);
+                }
+            }));
+
+            jobs.wait(jobs.parallelFor(0, tilesX, 1, [&](int first, int end)
+            {
+                for (int tx = first; tx < end; ++tx)
+                {
+                    unsigned short* tile = &row[tx * stride * stride];
+
+                    for (int j = 0; j < stride; ++j)
+                    {
+                        const unsigned short* sourceRow = &sourceRows[size_t(j) * width];
+
+                        for (int i = 0; i < stride; ++i)
+                        {
+                            int x = std::max(0, std::min(tx * tileSize + i - 1, samplesX - 1));
+                            tile[j * stride + i] = sourceRow[levelSample(level, x, width)];
+                        }
+                    }
+                }
+            }));
+
+            fileOut.write(reinterpret_cast<const char*>(&row[0]), std::streamsize(tileBytes) * tilesX);
+        }
+    }
+
+    //Pad up to the bounds table
+    const char padding[4] = { 0, 0, 0, 0 };
+    fileOut.write(padding, header.boundsOffset - offset);
+
+    //Height bounds of every leaf sized block, the quadtree is built from these
+    int leavesX = std::max((width - 1 + leafSize - 1) / leafSize, 1);
+    int leavesZ = std::max((depth - 1 + leafSize - 1) / leafSize, 1);
+    vector<glm::vec2> bounds(leavesX * leavesZ);
+
+    jobs.wait(jobs.parallelFor(0, leavesZ, 0, [&](int first, int end)
+    {
+        vector<unsigned short> heights(width);
+
+        for (int lz = first; lz < end; ++lz)
+        {
+            int endZ = std::min((lz + 1) * leafSize, depth - 1);
+            vector<unsigned short> low(leavesX, 0xFFFF), high(leavesX, 0);
+
+            for (int z = lz * leafSize; z <= endZ; ++z)
+            {
+                source.readRows(z, z + 1, &heights[0]);
+
+                for (int lx = 0; lx < leavesX; ++lx)
+                {
+                    int endX = std::min((lx + 1) * leafSize, width - 1);
+                    for (int x = lx * leafSize; x <= endX; ++x)
+                    {
+                        low[lx] = std::min(low[lx], heights[x]);
+                        high[lx] = std::max(high[lx], heights[x]);
+                    }
+                }
+            }
+
+            for (int lx = 0; lx < leavesX; ++lx)
+            {
+                bounds[lz * leavesX + lx] = glm::vec2(float(low[lx]) / TILE_VALUE_RANGE * heightScale,
+                                                      float(high[lx]) / TILE_VALUE_RANGE * heightScale);
+            }
+        }
+    }));
+
+    fileOut.write(reinterpret_cast<const char*>(&bounds[0]), sizeof(glm::vec2) * bounds.size());
+    return fileOut.good();
+}
+
+bool TiledHeightmap::open(const string& tileFile)
+{
+    close();
+
+    if (!m_file.open(tileFile, true) || m_file.getSize() < sizeof(TileFileHeader))
+    {
+        close();
+        return false;
+    }
+
+    const char* data = m_file.getData();
+    m_header = reinterpret_cast<const TileFileHeader*>(data);
+
+    if (memcmp(m_header->magic, TILE_FILE_MAGIC, sizeof(m_header->magic)) != 0 ||
+        m_header->version != TILE_FILE_VERSION ||
+        m_file.getSize() < sizeof(TileFileHeader) + sizeof(TileLevelInfo) * m_header->levels)
+    {
+        std::cerr << "Not a tiled heightmap: " << tileFile << std::endl;
+        close();
+        return false;
+    }
+
+    m_levels = reinterpret_cast<const TileLevelInfo*>(data + sizeof(TileFileHeader));
+    m_leafCount = std::max(int(m_header->width - 1 + m_header->leafSize - 1) / int(m_header->leafSize), 1);
+    m_leafBounds = reinterpret_cast<const glm::vec2*>(data + m_header->boundsOffset);
+    m_decodeScale = m_header->heightScale / TILE_VALUE_RANGE;
+
+    int leavesZ = std::max(int(m_header->depth - 1 + m_header->leafSize - 1) / int(m_header->leafSize), 1);
+    if (m_file.getSize() < m_header->boundsOffset + sizeof(glm::vec2) * m_leafCount * leavesZ)
+    {
+        std::cerr << "Truncated tiled heightmap: " << tileFile << std::endl;
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void TiledHeightmap::close()
+{
+    m_file.close();
+    m_header = NULL;
+    m_levels = NULL;
+    m_leafBounds = NULL;
+    m_leafCount = 0;
+}
+
+bool TiledHeightmap::isSourceCurrent(const RawHeightmap& source) const
+{
+    unsigned int size, time;
+    if (!source.getFileStamp(size, time))
+    {
+        return false;
+    }
+
+    return m_header->sourceSize == size && m_header->sourceTime == time &&
+           m_header->sourceFormat == (unsigned int)source.getSampleFormat();
+}
+
+const unsigned short* TiledHeightmap::getTile(int level, int tileX, int tileZ) const
+{
+    const TileLevelInfo& info = m_levels[level];
+    const int stride = getTileStride();
+
+    size_t offset = info.offset + size_t(tileZ * info.tilesX + tileX) * stride * stride * sizeof(unsigned short);
+    return reinterpret_cast<const unsigned short*>(m_file.getData() + offset);
+}
+
+int TiledHeightmap::levelToSampleX(int level, int index) const
+{
+    return levelSample(level, index, getWidth());
+}
+
+int TiledHeightmap::levelToSampleZ(int level, int index) const
+{
+    return levelSample(level, index, getDepth());
+}
+
+unsigned short TiledHeightmap::encode(float height) const
+{
+    float value = height / m_decodeScale + 0.5f;
+    return (unsigned short)std::max(0.0f, std::min(value, TILE_VALUE_RANGE - 1.0f));
+}
+
+unsigned short TiledHeightmap::getSample(int x, int z) const
+{
+    const int tileSize = getTileSize();
+
+    //The last sample belongs to the tile before it
+    int tileX = std::min(x / tileSize, std::max(getWidth() - 2, 0) / tileSize);
+    int tileZ = std::min(z / tileSize, std::max(getDepth() - 2, 0) / tileSize);
+
+    const unsigned short* tile = getTile(0, tileX, tileZ);
+    return tile[(z - tileZ * tileSize + 1) * getTileStride() + (x - tileX * tileSize + 1)];
+}
+
+/**
+A tile holds the samples of its level from one before its first to one
+after its last, clamped to the map like convert does. Every tile that could
+hold a changed sample is walked and each of its samples that comes from the
+region is replaced, which covers the aprons and the clamped border without
+treating them apart.
+*/
+void TiledHeightmap::setSamples(const SampleRegion& region, const unsigned short* samples)
+{
+    const int tileSize = getTileSize();
+    const int stride = getTileStride();
+    const int regionWidth = region.endX - region.firstX;
+    char* data = m_file.getWritableData();
+
+    for (int level = 0; level < getLevelCount(); ++level)
+    {
+        const TileLevelInfo& info = m_levels[level];
+        const int samplesX = int(info.samplesX);
+        const int samplesZ = int(info.samplesZ);
+
+        //Level samples that may come from the region, the last one of each axis is clamped into the map
+        int firstX = region.firstX >> level, lastX = std::min((region.endX - 1) >> level, samplesX - 1);
+        int firstZ = region.firstZ >> level, lastZ = std::min((region.endZ - 1) >> level, samplesZ - 1);
+        if (region.endX == getWidth())
+        {
+            lastX = samplesX - 1;
+        }
+        if (region.endZ == getDepth())
+        {
+            lastZ = samplesZ - 1;
+        }
+
+        int firstTileX = std::max(firstX - 2, 0) / tileSize, lastTileX = std::min((lastX + 1) / tileSize, int(info.tilesX) - 1);
+        int firstTileZ = std::max(firstZ - 2, 0) / tileSize, lastTileZ = std::min((lastZ + 1) / tileSize, int(info.tilesZ) - 1);
+
+        for (int tz = firstTileZ; tz <= lastTileZ; ++tz)
+        {
+            for (int tx = firstTileX; tx <= lastTileX; ++tx)
+            {
+                size_t offset = info.offset + size_t(tz * info.tilesX + tx) * stride * stride * sizeof(unsigned short);
+                unsigned short* tile = reinterpret_cast<unsigned short*>(data + offset);
+
+                for (int j = 0; j < stride; ++j)
+                {
+                    int z = levelSample(level, std::max(0, std::min(tz * tileSize + j - 1, samplesZ - 1)), getDepth());
+                    if (z < region.firstZ || z >= region.endZ)
+                    {
+                        continue;
+                    }
+
+                    for (int i = 0; i < stride; ++i)
+                    {
+                        int x = levelSample(level, std::max(0, std::min(tx * tileSize + i - 1, samplesX - 1)), getWidth());
+                        if (x >= region.firstX && x < region.endX)
+                        {
+                            tile[j * stride + i] = samples[(z - region.firstZ) * regionWidth + (x - region.firstX)];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    updateLeafBounds(region);
+}
+
+//Leaves share their edge samples with their neighbours, so a changed sample can belong to two of them
+void TiledHeightmap::updateLeafBounds(const SampleRegion& region)
+{
+    const int leafSize = int(m_header->leafSize);
+    const int leavesZ = std::max((getDepth() - 1 + leafSize - 1) / leafSize, 1);
+    glm::vec2* bounds = reinterpret_cast<glm::vec2*>(m_file.getWritableData() + m_header->boundsOffset);
+
+    int firstX = std::max(region.firstX - 1, 0) / leafSize, lastX = std::min((region.endX - 1) / leafSize, m_leafCount - 1);
+    int firstZ = std::max(region.firstZ - 1, 0) / leafSize, lastZ = std::min((region.endZ - 1) / leafSize, leavesZ - 1);
+
+    for (int lz = firstZ; lz <= lastZ; ++lz)
+    {
+        for (int lx = firstX; lx <= lastX; ++lx)
+        {
+            unsigned short low = 0xFFFF, high = 0;
+
+            int endZ = std::min((lz + 1) * leafSize, getDepth() - 1);
+            int endX = std::min((lx + 1) * leafSize, getWidth() - 1);
+            for (int z = lz * leafSize; z <= endZ; ++z)
+            {
+                for (int x = lx * leafSize; x <= endX; ++x)
+                {
+                    unsigned short sample = getSample(x, z);
+                    low = std::min(low, sample);
+                    high = std::max(high, sample);
+                }
+            }
+
+            bounds[lz * m_leafCount + lx] = glm::vec2(decode(low), decode(high));
+        }
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef BOGLGP_TILEDHEIGHTMAP_H
+#define BOGLGP_TILEDHEIGHTMAP_H
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "mappedfile.h"
+#include "rawheightmap.h"
+
+using std::string;
+using std::vector;
+
+class JobSystem;
+
+/*
+    On-disk layout of a tiled heightmap:
+
+    TileFileHeader
+    TileLevelInfo[levels]
+    level 0 tiles, level 1 tiles, ...   (row major, unsigned short heights)
+    leaf bounds                         (row major, min/max float pairs)
+
+    Level L holds every 2^L-th sample of level 0, so a quadtree node at level L
+    reads a single tile of level L no matter how much of the map it covers.
+    Every tile has a one sample apron on each side so that morph targets and
+    normals along the tile edges can be computed without touching neighbours.
+*/
+struct TileFileHeader
+{
+    char magic[4];
+    unsigned int version;
+    unsigned int width;         //Samples along x of level 0
+    unsigned int depth;         //Samples along z of level 0
+    unsigned int tileSize;      //Quads along each side of a tile
+    unsigned int leafSize;      //Quads along each side of a leaf in the bounds table
+    unsigned int levels;
+    float heightScale;          //World height of the largest stored value
+    unsigned int sourceSize;    //Size, modification time and sample format of the heightmap the tiles were built from
+    unsigned int sourceTime;
+    unsigned int sourceFormat;
+    unsigned int boundsOffset;  //Byte offset of the leaf bounds
+};
+
+struct TileLevelInfo
+{
+    unsigned int samplesX;      //Samples along x and z of this level
+    unsigned int samplesZ;
+    unsigned int tilesX;        //Tiles along x and z of this level
+    unsigned int tilesZ;
+    unsigned int offset;        //Byte offset of the first tile in the file
+};
+
+//A rectangle of level 0 samples, [firstX, endX) x [firstZ, endZ)
+struct SampleRegion
+{
+    int firstX, firstZ;
+    int endX, endZ;
+};
+
+class TiledHeightmap
+{
+public:
+    TiledHeightmap();
+    ~TiledHeightmap();
+
+    //The tiles of each row are built by jobs, the file is written in order on the calling thread
+    static bool convert(const RawHeightmap& source, float heightScale,
+                        int tileSize, int leafSize, int levels, const string& tileFile, JobSystem& jobs);
+
+    //The file is mapped copy on write, edits never reach the disk
+    bool open(const string& tileFile);
+    void close();
+
+    bool isSourceCurrent(const RawHeightmap& source) const;
+
+    int getWidth() const { return int(m_header->width); }
+    int getDepth() const { return int(m_header->depth); }
+    int getTileSize() const { return int(m_header->tileSize); }
+    int getLevelCount() const { return int(m_header->levels); }
+    int getLevelSamplesX(int level) const { return int(m_levels[level].samplesX); }
+    int getLevelSamplesZ(int level) const { return int(m_levels[level].samplesZ); }
+
+    //Number of unsigned shorts in a tile, including the apron
+    int getTileStride() const { return getTileSize() + 3; }
+
+    //Returns the stored samples of a tile, they are only read from disk when touched
+    const unsigned short* getTile(int level, int tileX, int tileZ) const;
+    float decode(unsigned short value) const { return float(value) * m_decodeScale; }
+    unsigned short encode(float height) const;
+
+    //A sample of level 0
+    unsigned short getSample(int x, int z) const;
+
+    /*
+        Replaces the level 0 samples of region, given row by row, on every
+        level that holds them, aprons included, and recomputes the bounds of
+        the leaves around it. Nothing may read the tiles meanwhile.
+    */
+    void setSamples(const SampleRegion& region, const unsigned short* samples);
+
+    //Converts a sample index of level into a sample index of level 0
+    int levelToSampleX(int level, int index) const;
+    int levelToSampleZ(int level, int index) const;
+
+    //Leaves along x, which is also the row length of the leaf bounds
+    int getLeafCount() const { return m_leafCount; }
+    const glm::vec2* getLeafBounds() const { return m_leafBounds; }
+
+private:
+    void updateLeafBounds(const SampleRegion& region);
+
+    MappedFile m_file;
+
+    const TileFileHeader* m_header;
+    const TileLevelInfo* m_levels;
+    const glm::vec2* m_leafBounds;
+    int m_leafCount;
+    float m_decodeScale;
+};
+
+#endif
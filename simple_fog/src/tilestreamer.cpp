@@ -0,0 +1,396 @@
+#include <cmath>
+#include <algorithm>
+
+#include "tilestreamer.h"
+#include "normalgenerator.h"
+#include "vertexformat.h"
+
+TileStreamer::TileStreamer():
+m_heightmap(NULL),
+m_patchSize(0),
+m_stopping(false),
+m_isBuilding(false),
+m_buildingStale(false),
+m_cacheSize(0),
+m_cacheBudget(0)
+{
+
+}
+
+TileStreamer::~TileStreamer()
+{
+    stop();
+}
+
+void TileStreamer::start(const TiledHeightmap* heightmap, int patchSize, size_t cacheBudget)
+{
+    stop();
+
+    m_heightmap = heightmap;
+    m_patchSize = patchSize;
+    m_cacheBudget = cacheBudget;
+    m_stopping = false;
+    m_worker = std::thread(&TileStreamer::run, this);
+}
+
+void TileStreamer::stop()
+{
+    if (m_worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+
+        m_wakeUp.notify_one();
+        m_worker.join();
+    }
+
+    for (unsigned int i = 0; i < m_completed.size(); ++i)
+    {
+        delete m_completed[i].data;
+    }
+
+    m_pending.clear();
+    m_inFlight.clear();
+    m_completed.clear();
+    m_isBuilding = false;
+    m_edited.clear();
+    m_tiles.clear();
+    m_tileIndex.clear();
+    m_cacheSize = 0;
+}
+
+void TileStreamer::request(const vector<PatchRequest>& requests)
+{
+    std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        return;
+    }
+
+    m_pending.clear();
+    for (unsigned int i = 0; i < requests.size(); ++i)
+    {
+        if (m_inFlight.find(requests[i].node) == m_inFlight.end())
+        {
+            m_pending.push_back(requests[i]);
+        }
+    }
+
+    lock.unlock();
+    m_wakeUp.notify_one();
+}
+
+void TileStreamer::collect(vector<PatchData*>& patches, unsigned int maxPatches)
+{
+    std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        return;
+    }
+
+    for (unsigned int i = 0; i < maxPatches && !m_completed.empty(); ++i)
+    {
+        PatchData* patch = m_completed.front().data;
+        m_completed.pop_front();
+        m_inFlight.erase(patch->node);
+        patches.push_back(patch);
+    }
+}
+
+void TileStreamer::beginEdit()
+{
+    m_heightmapMutex.lock();
+}
+
+/**
+Unlike request and collect this waits for the lock, an edit has to land.
+The worker only holds it for a moment between two patches.
+*/
+void TileStreamer::endEdit(const SampleRegion& region)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        deque<CompletedPatch> kept;
+        for (unsigned int i = 0; i < m_completed.size(); ++i)
+        {
+            if (readsRegion(m_patchSize, m_completed[i].request, region))
+            {
+                m_inFlight.erase(m_completed[i].request.node);
+                delete m_completed[i].data;
+            }
+            else
+            {
+                kept.push_back(m_completed[i]);
+            }
+        }
+        m_completed.swap(kept);
+
+        if (m_isBuilding && readsRegion(m_patchSize, m_building, region))
+        {
+            m_buildingStale = true;
+        }
+
+        if (m_worker.joinable())
+        {
+            m_edited.push_back(region);
+        }
+    }
+
+    m_heightmapMutex.unlock();
+}
+
+bool TileStreamer::readsRegion(int patchSize, const PatchRequest& request, const SampleRegion& region)
+{
+    //The patch reads one sample of its level past each side
+    const int step = 1 << request.level;
+    const int size = patchSize << request.level;
+
+    return request.x - step < region.endX && request.x + size + step >= region.firstX &&
+           request.z - step < region.endZ && request.z + size + step >= region.firstZ;
+}
+
+//Drops the cached tiles that hold samples of any of regions
+void TileStreamer::evictTiles(const vector<SampleRegion>& regions)
+{
+    const int tileSize = m_heightmap->getTileSize();
+
+    list<CachedTile>::iterator i = m_tiles.begin();
+    while (i != m_tiles.end())
+    {
+        int level = int((*i).key >> 48);
+        int tileZ = int(((*i).key >> 24) & 0xFFFFFF);
+        int tileX = int((*i).key & 0xFFFFFF);
+
+        //The level 0 samples the tile holds, apron included
+        SampleRegion tile = { (tileX * tileSize - 1) << level, (tileZ * tileSize - 1) << level,
+                              ((tileX + 1) * tileSize + 2) << level, ((tileZ + 1) * tileSize + 2) << level };
+
+        bool stale = false;
+        for (unsigned int j = 0; j < regions.size() && !stale; ++j)
+        {
+            stale = tile.firstX < regions[j].endX && tile.endX > regions[j].firstX &&
+                    tile.firstZ < regions[j].endZ && tile.endZ > regions[j].firstZ;
+        }
+
+        if (stale)
+        {
+            m_cacheSize -= (*i).heights.size() * sizeof(float);
+            m_tileIndex.erase((*i).key);
+            i = m_tiles.erase(i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+void TileStreamer::run()
+{
+    while (true)
+    {
+        PatchRequest request;
+        vector<SampleRegion> edited;
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_stopping && m_pending.empty())
+            {
+                m_wakeUp.wait(lock);
+            }
+
+            if (m_stopping)
+            {
+                return;
+            }
+
+            request = m_pending.front();
+            m_pending.pop_front();
+            m_inFlight.insert(request.node);
+
+            m_building = request;
+            m_isBuilding = true;
+            m_buildingStale = false;
+            edited.swap(m_edited);
+        }
+
+        if (!edited.empty())
+        {
+            evictTiles(edited);
+        }
+
+        PatchData* patch = new PatchData;
+        buildPatch(request, *patch);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_isBuilding = false;
+
+        //Built from heights that have changed since, it is requested again once the node is found missing
+        if (m_buildingStale)
+        {
+            m_inFlight.erase(request.node);
+            delete patch;
+            continue;
+        }
+
+        CompletedPatch completed = { request, patch };
+        m_completed.push_back(completed);
+    }
+}
+
+/**
+Returns the decoded heights of a tile, apron included. Tiles that push the
+cache over its budget evict the least recently used ones, the tile that was
+just asked for always stays.
+*/
+const float* TileStreamer::getTile(int level, int tileX, int tileZ)
+{
+    long long key = ((long long)level << 48) | ((long long)tileZ << 24) | (long long)tileX;
+
+    map<long long, list<CachedTile>::iterator>::iterator i = m_tileIndex.find(key);
+    if (i != m_tileIndex.end())
+    {
+        m_tiles.splice(m_tiles.begin(), m_tiles, (*i).second);
+        return &(*i).second->heights[0];
+    }
+
+    m_tiles.push_front(CachedTile());
+    CachedTile& tile = m_tiles.front();
+    tile.key = key;
+    {
+        std::lock_guard<std::mutex> lock(m_heightmapMutex);
+        decodeTile(*m_heightmap, level, tileX, tileZ, tile.heights);
+    }
+
+    m_tileIndex[key] = m_tiles.begin();
+    m_cacheSize += tile.heights.size() * sizeof(float);
+
+    while (m_cacheSize > m_cacheBudget && m_tiles.size() > 1)
+    {
+        CachedTile& oldest = m_tiles.back();
+        m_cacheSize -= oldest.heights.size() * sizeof(float);
+        m_tileIndex.erase(oldest.key);
+        m_tiles.pop_back();
+    }
+
+    return &tile.heights[0];
+}
+
+void TileStreamer::decodeTile(const TiledHeightmap& heightmap, int level, int tileX, int tileZ, vector<float>& heights)
+{
+    const int stride = heightmap.getTileStride();
+    const unsigned short* source = heightmap.getTile(level, tileX, tileZ);
+
+    heights.resize(stride * stride);
+    for (int j = 0; j < stride * stride; ++j)
+    {
+        heights[j] = heightmap.decode(source[j]);
+    }
+}
+
+//The node lies inside a single tile of its own level
+void TileStreamer::buildPatch(const PatchRequest& request, PatchData& patch)
+{
+    const int tileSize = m_heightmap->getTileSize();
+    const float* tile = getTile(request.level, (request.x >> request.level) / tileSize, (request.z >> request.level) / tileSize);
+    buildPatchFromTile(*m_heightmap, m_patchSize, tile, request, patch);
+}
+
+void TileStreamer::buildPatch(const TiledHeightmap& heightmap, int patchSize, const PatchRequest& request, PatchData& patch)
+{
+    const int tileSize = heightmap.getTileSize();
+
+    vector<float> tile;
+    decodeTile(heightmap, request.level, (request.x >> request.level) / tileSize, (request.z >> request.level) / tileSize, tile);
+    buildPatchFromTile(heightmap, patchSize, &tile[0], request, patch);
+}
+
+void TileStreamer::buildPatchFromTile(const TiledHeightmap& heightmap, int patchSize, const float* tile,
+                                      const PatchRequest& request, PatchData& patch)
+{
+    const int width = patchSize + 1;
+    const int level = request.level;
+    const int tileSize = heightmap.getTileSize();
+    const int stride = heightmap.getTileStride();
+    const int samplesX = heightmap.getLevelSamplesX(level);
+    const int samplesZ = heightmap.getLevelSamplesZ(level);
+    const float mapWidth = float(std::max(heightmap.getWidth(), heightmap.getDepth())); //For both texture coordinates, so texels stay square
+    const float offsetX = float(-heightmap.getWidth() / 2);
+    const float offsetZ = float(-heightmap.getDepth() / 2);
+
+    int originX = request.x >> level;
+    int originZ = request.z >> level;
+    int tileX = originX / tileSize;
+    int tileZ = originZ / tileSize;
+
+    const float* heights = tile + (originZ - tileZ * tileSize + 1) * stride + (originX - tileX * tileSize + 1);
+
+    patch.node = request.node;
+    patch.vertices.resize(width * width * 3);
+    patch.morphHeights.resize(width * width);
+    patch.texCoords.resize(width * width * 2);
+    patch.normals.resize(width * width * 3);
+
+    //Distances between the neighbours used for the slopes, they only differ from twice the spacing along the map border
+    vector<float> scaleX(width);
+    for (int i = 0; i < width; ++i)
+    {
+        int sampleX = std::min(originX + i, samplesX - 1);
+        int left = heightmap.levelToSampleX(level, std::max(sampleX - 1, 0));
+        int right = heightmap.levelToSampleX(level, std::min(sampleX + 1, samplesX - 1));
+        scaleX[i] = 1.0f / float(std::max(right - left, 1));
+    }
+
+    for (int j = 0; j < width; ++j)
+    {
+        int sampleZ = std::min(originZ + j, samplesZ - 1);
+        int z = heightmap.levelToSampleZ(level, sampleZ);
+
+        //Central differences, the apron holds the neighbours along the tile edges
+        const float* row = heights + j * stride;
+        int up = heightmap.levelToSampleZ(level, std::max(sampleZ - 1, 0));
+        int down = heightmap.levelToSampleZ(level, std::min(sampleZ + 1, samplesZ - 1));
+
+        NormalGenerator::computeRow(row - 1, row + 1, row - stride, row + stride, &scaleX[0],
+                                    1.0f / float(std::max(down - up, 1)), width, &patch.normals[j * width * 3]);
+
+        for (int i = 0; i < width; ++i)
+        {
+            int sampleX = std::min(originX + i, samplesX - 1);
+            int x = heightmap.levelToSampleX(level, sampleX);
+
+            const float* h = heights + j * stride + i;
+            float height = *h;
+
+            /*
+                The morph target is where this vertex lies on the next
+                coarser level, vertices on the coarse grid don't move and
+                the rest slide onto the edge or diagonal they split
+            */
+            float morphHeight = height;
+            if ((i & 1) && (j & 1))
+            {
+                morphHeight = (h[stride - 1] + h[-stride + 1]) * 0.5f;
+            }
+            else if (i & 1)
+            {
+                morphHeight = (h[-1] + h[1]) * 0.5f;
+            }
+            else if (j & 1)
+            {
+                morphHeight = (h[-stride] + h[stride]) * 0.5f;
+            }
+
+            int vertex = j * width + i;
+            patch.vertices[vertex * 3 + 0] = float(x) + offsetX;
+            patch.vertices[vertex * 3 + 1] = height;
+            patch.vertices[vertex * 3 + 2] = float(z) + offsetZ;
+            patch.morphHeights[vertex] = morphHeight;
+            patch.texCoords[vertex * 2 + 0] = (float(x) / mapWidth) * TEXCOORD_RANGE;
+            patch.texCoords[vertex * 2 + 1] = (float(z) / mapWidth) * TEXCOORD_RANGE;
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef BOGLGP_TILESTREAMER_H
+#define BOGLGP_TILESTREAMER_H
+
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "tiledheightmap.h"
+
+using std::vector;
+using std::deque;
+using std::list;
+using std::map;
+using std::set;
+
+struct PatchRequest
+{
+    int node;           //Quadtree node the patch is for
+    int level;          //LOD level of the node
+    int x, z;           //Origin of the node in level 0 samples
+};
+
+//Vertex streams of a patch, ready to be copied into buffers on the GL thread
+struct PatchData
+{
+    int node;
+    vector<float> vertices;     //x, y, z
+    vector<float> morphHeights;
+    vector<float> texCoords;    //s, t
+    vector<float> normals;      //x, y, z
+};
+
+/*
+    Builds terrain patches on a worker thread. The worker decodes the tiles
+    it needs from the mapped heightmap into an LRU cache that is bounded by
+    a memory budget, builds the patch vertex streams and queues them up for
+    the GL thread. The GL thread never waits on the worker: request and
+    collect give up straight away when the worker holds the lock and are
+    simply tried again on the next frame.
+
+    The heightmap can be edited while the worker runs, between beginEdit and
+    endEdit. Patches that read the edited region and were started or
+    finished before endEdit are thrown away, as are the cached tiles that
+    hold it, so nothing built from the old heights is handed out.
+*/
+class TileStreamer
+{
+public:
+    TileStreamer();
+    ~TileStreamer();
+
+    void start(const TiledHeightmap* heightmap, int patchSize, size_t cacheBudget);
+    void stop();
+
+    void setCacheBudget(size_t bytes) { m_cacheBudget = bytes; }
+    size_t getCacheBudget() const { return m_cacheBudget; }
+    size_t getCacheSize() const { return m_cacheSize; }
+
+    //Replaces the requests that haven't been started yet
+    void request(const vector<PatchRequest>& requests);
+
+    //Hands over up to maxPatches finished patches, the caller deletes them
+    void collect(vector<PatchData*>& patches, unsigned int maxPatches);
+
+    //Waits until the worker isn't reading the heightmap and keeps it from starting to
+    void beginEdit();
+    void endEdit(const SampleRegion& region);
+
+    //Whether the patch of request reads any sample of region, its normals and morph targets included
+    static bool readsRegion(int patchSize, const PatchRequest& request, const SampleRegion& region);
+
+    //Builds a patch on the calling thread without going through the cache, safe from any thread
+    static void buildPatch(const TiledHeightmap& heightmap, int patchSize, const PatchRequest& request, PatchData& patch);
+
+private:
+    struct CachedTile
+    {
+        long long key;
+        vector<float> heights;
+    };
+
+    struct CompletedPatch
+    {
+        PatchRequest request;
+        PatchData* data;
+    };
+
+    void run();
+    void evictTiles(const vector<SampleRegion>& regions);
+    void buildPatch(const PatchRequest& request, PatchData& patch);
+    const float* getTile(int level, int tileX, int tileZ);
+
+    static void decodeTile(const TiledHeightmap& heightmap, int level, int tileX, int tileZ, vector<float>& heights);
+    static void buildPatchFromTile(const TiledHeightmap& heightmap, int patchSize, const float* tile,
+                                   const PatchRequest& request, PatchData& patch);
+
+    const TiledHeightmap* m_heightmap;
+    int m_patchSize;
+
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::mutex m_heightmapMutex;    //Held by the worker while it decodes a tile and by edits
+    std::condition_variable m_wakeUp;
+    bool m_stopping;
+
+    //Everything below is guarded by m_mutex
+    deque<PatchRequest> m_pending;
+    set<int> m_inFlight;            //Nodes being built or waiting to be collected
+    deque<CompletedPatch> m_completed;
+    PatchRequest m_building;        //The request the worker is on, if m_isBuilding
+    bool m_isBuilding;
+    bool m_buildingStale;           //An edit touched m_building after it was started
+    vector<SampleRegion> m_edited;  //Regions whose tiles are still in the cache
+
+    //The tile cache is only touched by the worker
+    list<CachedTile> m_tiles;       //Most recently used first
+    map<long long, list<CachedTile>::iterator> m_tileIndex;
+    std::atomic<size_t> m_cacheSize;
+    std::atomic<size_t> m_cacheBudget;
+};
+
+#endif
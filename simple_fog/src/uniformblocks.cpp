@@ -0,0 +1,178 @@
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+#include "uniformblocks.h"
+
+//In the order of UniformBlockBinding
+const char* UNIFORM_BLOCK_NAMES[] = { "Frame", "Fog", "Light", "Material" };
+
+//How long beginFrame waits on a fence before asking again, in nanoseconds
+const GLuint64 FENCE_TIMEOUT = 1000000000;
+
+const char* getUniformBlockName(UniformBlockBinding binding)
+{
+    return UNIFORM_BLOCK_NAMES[binding];
+}
+
+UniformBlocks::UniformBlocks():
+m_buffer(0),
+m_sectionSize(0),
+m_alignment(1),
+m_persistent(false),
+m_mapped(NULL),
+m_section(0),
+m_offset(0)
+{
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+    {
+        m_fences[i] = 0;
+    }
+}
+
+UniformBlocks::~UniformBlocks()
+{
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+    {
+        if (m_fences[i] != 0)
+        {
+            glDeleteSync(m_fences[i]);
+        }
+    }
+
+    if (m_mapped != NULL)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+        glUnmapBuffer(GL_UNIFORM_BUFFER);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    glDeleteBuffers(1, &m_buffer);
+}
+
+bool UniformBlocks::initialize(size_t frameSize)
+{
+    GLint alignment = 1;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    m_alignment = size_t(std::max(alignment, 1));
+    m_sectionSize = (frameSize + m_alignment - 1) / m_alignment * m_alignment;
+
+    const GLsizeiptr bufferSize = GLsizeiptr(m_sectionSize * FRAMES_IN_FLIGHT);
+
+    //Only the errors of the buffer calls below count, not ones left over from earlier setup
+    while (glGetError() != GL_NO_ERROR)
+    {
+
+    }
+
+    glGenBuffers(1, &m_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+
+    m_persistent = (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage);
+    if (m_persistent)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_UNIFORM_BUFFER, bufferSize, NULL, flags);
+        m_mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, bufferSize, flags);
+    }
+    else
+    {
+        glBufferData(GL_UNIFORM_BUFFER, bufferSize, NULL, GL_STREAM_DRAW);
+    }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    if (glGetError() != GL_NO_ERROR || (m_persistent && m_mapped == NULL))
+    {
+        std::cerr << "Could not create the uniform buffer" << std::endl;
+        return false;
+    }
+
+    std::cout << "Uniform blocks " << (m_persistent ? "in a persistently mapped buffer" : "mapped every frame, no ARB_buffer_storage")
+              << ", " << m_sectionSize << " bytes a frame" << std::endl;
+
+    //Starts on the last section so the first frame gets section 0
+    m_section = FRAMES_IN_FLIGHT - 1;
+    return true;
+}
+
+void UniformBlocks::bindProgram(GLSLProgram& program)
+{
+    for (int i = 0; i < UNIFORM_BLOCK_COUNT; ++i)
+    {
+        program.bindUniformBlock(i, getUniformBlockName(UniformBlockBinding(i)));
+    }
+}
+
+void UniformBlocks::beginFrame()
+{
+    m_section = (m_section + 1) % FRAMES_IN_FLIGHT;
+    m_offset = 0;
+
+    //The GPU may still be reading what was written here FRAMES_IN_FLIGHT frames ago
+    GLsync& fence = m_fences[m_section];
+    if (fence != 0)
+    {
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT) == GL_TIMEOUT_EXPIRED)
+        {
+
+        }
+
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    if (!m_persistent)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+        m_mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, GLintptr(m_section * m_sectionSize), GLsizeiptr(m_sectionSize),
+                                                    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+        if (m_mapped == NULL)
+        {
+            std::cerr << "Could not map the uniform buffer section " << m_section << std::endl;
+        }
+    }
+}
+
+bool UniformBlocks::write(UniformBlockBinding binding, const void* block, size_t size)
+{
+    if (m_mapped == NULL)
+    {
+        std::cerr << "The uniform buffer section isn't mapped, the " << getUniformBlockName(binding)
+                  << " uniform block is written between beginFrame and endWrites" << std::endl;
+        return false;
+    }
+
+    if (m_offset + size > m_sectionSize)
+    {
+        std::cerr << "No room left for the " << getUniformBlockName(binding) << " uniform block" << std::endl;
+        return false;
+    }
+
+    unsigned char* section = m_persistent ? m_mapped + m_section * m_sectionSize : m_mapped;
+    memcpy(section + m_offset, block, size);
+
+    glBindBufferRange(GL_UNIFORM_BUFFER, binding, m_buffer, GLintptr(m_section * m_sectionSize + m_offset), GLsizeiptr(size));
+
+    m_offset = (m_offset + size + m_alignment - 1) / m_alignment * m_alignment;
+    return true;
+}
+
+void UniformBlocks::endWrites()
+{
+    //A buffer can't be drawn from while it is mapped, unless it is mapped persistently
+    if (!m_persistent && m_mapped != NULL)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+        glUnmapBuffer(GL_UNIFORM_BUFFER);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        m_mapped = NULL;
+    }
+}
+
+void UniformBlocks::endFrame()
+{
+    m_fences[m_section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
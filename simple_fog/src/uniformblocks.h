@@ -0,0 +1,115 @@
+#ifndef BOGLGP_UNIFORMBLOCKS_H
+#define BOGLGP_UNIFORMBLOCKS_H
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <cstddef>
+#include <GL/glew.h>
+#include "glslshader.h"
+
+//The binding point of every uniform block, the same in all programs
+enum UniformBlockBinding
+{
+    FRAME_BLOCK,
+    FOG_BLOCK,
+    LIGHT_BLOCK,
+    MATERIAL_BLOCK,
+    UNIFORM_BLOCK_COUNT
+};
+
+//The block name the shaders declare for a binding point
+const char* getUniformBlockName(UniformBlockBinding binding);
+
+//The std140 layouts of the blocks, every vec3 and mat3 column padded out to a vec4
+struct FrameBlock
+{
+    float modelview[16];
+    float projection[16];
+    float normalMatrix[12];
+};
+
+struct FogBlock
+{
+    float color[4];
+    float tableTransform[2];    //Scale and offset from eye distance to the fog table
+    float start;
+    float end;
+    float density;
+    float padding[3];
+};
+
+struct LightBlock
+{
+    float position[4];
+    float diffuse[4];
+    float specular[4];
+    float ambient[4];
+};
+
+struct MaterialBlock
+{
+    float ambient[4];
+    float diffuse[4];
+    float specular[4];
+    float emissive[4];
+    float shininess;
+    float padding[3];
+};
+
+/*
+    One uniform buffer that the blocks of every frame are written into,
+    split in FRAMES_IN_FLIGHT sections used in turn. A frame's blocks are
+    allocated one after another in its section and bound to their binding
+    points, so every program sees them without a glUniform call of its own.
+
+    A section is only written again once the fence of the frame that last
+    used it has passed. Where the GL has ARB_buffer_storage the buffer is
+    mapped persistently once; GL 3.2 has to map the section every frame,
+    unsynchronized since the fence already keeps the GPU out of it.
+*/
+class UniformBlocks
+{
+public:
+    static const int FRAMES_IN_FLIGHT = 3;
+
+    UniformBlocks();
+    ~UniformBlocks();
+
+    //Room for frameSize bytes of blocks a frame, needs a GL context
+    bool initialize(size_t frameSize);
+
+    //Points the blocks the program declares at their binding points
+    static void bindProgram(GLSLProgram& program);
+
+    //Waits for the next section to be free, blocks are written between beginFrame and endWrites
+    void beginFrame();
+
+    //Copies a block into the frame and binds it, false if the frame is out of room
+    bool write(UniformBlockBinding binding, const void* block, size_t size);
+
+    template <typename Block>
+    bool write(UniformBlockBinding binding, const Block& block)
+    {
+        return write(binding, &block, sizeof(Block));
+    }
+
+    //Before the draws that read the blocks
+    void endWrites();
+
+    //After the last draw of the frame
+    void endFrame();
+
+private:
+    GLuint m_buffer;
+    size_t m_sectionSize;
+    size_t m_alignment;         //GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+    bool m_persistent;
+    unsigned char* m_mapped;    //The whole buffer when persistent, else the current section while it is mapped
+    int m_section;
+    size_t m_offset;            //Of the next block in the section
+    GLsync m_fences[FRAMES_IN_FLIGHT];
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef BOGLGP_VERTEXFORMAT_H
+#define BOGLGP_VERTEXFORMAT_H
+
+#include <cmath>
+#include <algorithm>
+
+//Texture coordinates run from 0 to this across the map, the packed layouts store fractions of it
+const float TEXCOORD_RANGE = 8.0f;
+
+enum VertexLayout
+{
+    SEPARATE_FLOAT_LAYOUT,      //One float buffer per attribute
+    INTERLEAVED_PACKED_LAYOUT,  //A single buffer of quantized attributes
+    HEIGHT_TEXTURE_LAYOUT       //No terrain vertex buffers, the vertex shader displaces a shared grid with a height texture
+};
+
+/*
+    A terrain vertex in the packed layout, 16 bytes instead of 36:
+
+    offset  attribute       type                    decoded by the vertex shader
+    0       a_Vertex        3 unsigned shorts       sample x, quantized height, sample z
+    6       a_MorphHeight   unsigned short          quantized height
+    8       a_Normal        2 normalized shorts     octahedral encoding
+    12      a_TexCoord0     2 normalized ushorts    multiplied by texcoord_scale
+
+    The shader turns a_Vertex and a_MorphHeight back into world space with
+    position_scale and position_offset. The float layout sends ones and zeros.
+*/
+struct PackedTerrainVertex
+{
+    unsigned short x, height, z;
+    unsigned short morphHeight;
+    short normal[2];
+    unsigned short texCoord[2];
+};
+
+//A water vertex in the packed layout, 12 bytes instead of 20
+struct PackedWaterVertex
+{
+    unsigned short x, height, z;
+    unsigned short padding;         //Keeps the texture coordinates 4 byte aligned
+    unsigned short texCoord[2];
+};
+
+inline unsigned short quantizeUnorm16(float value)
+{
+    value = std::min(std::max(value, 0.0f), 1.0f);
+    return (unsigned short)(value * 65535.0f + 0.5f);
+}
+
+inline short quantizeSnorm16(float value)
+{
+    value = std::min(std::max(value, -1.0f), 1.0f);
+    return (short)floorf(value * 32767.0f + 0.5f);
+}
+
+/**
+Projects a unit vector onto the octahedron |x| + |y| + |z| = 1 and unfolds
+the lower half over the upper one, which leaves two numbers in [-1, 1]. This
+keeps the precision of the normal even in every direction, unlike storing
+two components and rebuilding the third. decodeOctahedral in the vertex
+shader does the reverse.
+*/
+inline void encodeOctahedral(float x, float y, float z, short* encoded)
+{
+    float sum = fabsf(x) + fabsf(y) + fabsf(z);
+    float u = x / sum;
+    float v = y / sum;
+
+    if (z < 0.0f)
+    {
+        float foldedU = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        float foldedV = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+        u = foldedU;
+        v = foldedV;
+    }
+
+    encoded[0] = quantizeSnorm16(u);
+    encoded[1] = quantizeSnorm16(v);
+}
+
+#endif